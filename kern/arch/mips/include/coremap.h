@@ -6,46 +6,94 @@
  */
 
 #include <machine/vm.h>
+#include <spinlock.h>
 
 #define CME_FREE 0
 #define CME_FIXED 1
 #define CME_CLEAN 2
 #define CME_DIRTY 3
 
+/*
+ * Pageout daemon defaults: the daemon is woken when fewer than
+ * PAGEOUT_LOW_DIV-th of the frames are free or clean and cleans dirty
+ * frames in batches of PAGEOUT_BATCH until PAGEOUT_HIGH_DIV-th are.
+ */
+#define PAGEOUT_LOW_DIV 16
+#define PAGEOUT_HIGH_DIV 8
+#define PAGEOUT_BATCH 8
+
+/*
+ * Swap space is handed to each cpu in runs of up to SWAP_CLUSTER_PAGES
+ * contiguous slots so that pages faulted in together land together on
+ * disk. SWAP_MAX_PAGES bounds the size of the disk map bitmap (one page).
+ */
+#define SWAP_CLUSTER_PAGES 16
+#define SWAP_MAX_PAGES (PAGE_SIZE * 8)
+
+/*
+ * Clustered paging: at most SWAP_IO_CLUSTER pages move in one swap I/O.
+ * On a fault up to SWAP_READAHEAD_DEFAULT following pages that sit in the
+ * next swap slots are read in with the faulting one.
+ */
+#define SWAP_IO_CLUSTER 8
+#define SWAP_READAHEAD_DEFAULT 4
+
 #define INVALID_PADDR ((paddr_t)0)
 #define PADDR_IS_VALID(paddr) ((paddr >= base*PAGE_SIZE) && (paddr % PAGE_SIZE == 0))
 
 uint32_t base; // Number of pages taken up by coremap
 
+/*
+ * Additional address spaces mapping a frame copy-on-write after fork.
+ * Shared frames always live at the same virtual address in every sharer,
+ * so the address space is all we need to find the other page tables.
+ */
+struct cm_sharer{
+    struct addrspace *as;
+    struct cm_sharer *next;
+};
+
 /* Core map structures and functions */
 struct cm_entry{
     struct addrspace *as;
+    struct cm_sharer *sharers; // Address spaces other than as sharing this frame
+    unsigned share_count; // Number of address spaces mapping this frame
     int disk_offset;  // Stores the disk offset when page in memory
+    int next_free; // Next entry on a free list, or -1
+    struct vnode *vn; // Executable whose text cache holds this page, or file of a shared mapping, else NULL
+    int next_cached; // Next entry on a text cache chain, or -1
+    int file_page; // Page of vn held here, for a shared mapping
+    int kpages; // Length of the kernel block starting here, else 0
+    volatile spinlock_data_t busy; // Pin; taken with an atomic test-and-set
     vaddr_t vaddr_base:20;
-    int junk:8;
+    int junk:5;
+    unsigned int filebacked:1; // Clean copy of file data; dropped, not swapped
+    unsigned int mapped:1; // Page of a shared file mapping; written back to vn, never swapped
+    unsigned int onlist:1; // Linked on a global free list
+    unsigned int zeroed:1; // Free page already known to be zero filled
     unsigned int state:2;
-    unsigned int busy_bit:1;
     unsigned int use_bit:1;
 };
 
 struct cv *written_to_disk;
+struct cv *pageout_wanted;
 struct lock *cv_lock;
+struct semaphore *zero_wanted;
 
 struct vnode *swapfile;
 struct bitmap *disk_map;
 struct lock *disk_map_lock;
-struct semaphore *dirty_pages;
 
 /*
  * Page selection APIs
  */
 paddr_t alloc_one_page(struct addrspace *as, vaddr_t va);
+paddr_t alloc_zeroed_page(struct addrspace *as, vaddr_t va);
 vaddr_t alloc_kpages(int npages);
 void free_coremap_page(paddr_t pa, bool iskern);
 void free_kpages(vaddr_t va);
-int find_free_page(void);
+int find_free_page(bool want_zero);
 int choose_evict_page(void);
-void pin_all_pages(struct addrspace *as);
 
 /*
  * Acessor/setter methods
@@ -71,25 +119,89 @@ unsigned cme_try_pin(int ix);
 unsigned cme_get_use(int ix);
 void cme_set_use(int ix, unsigned use);
 
+// Marking a page dirty (or free) clears this
+unsigned cme_get_filebacked(int ix);
+void cme_set_filebacked(int ix, unsigned filebacked);
+
+/*
+ * Copy-on-write sharing. The caller must hold the pin on the entry.
+ *
+ *    cme_add_sharer - map the frame into one more address space
+ *    cme_drop_sharer - remove an address space, returns the remaining count
+ *    cme_is_sharer - whether the address space maps the frame
+ */
+unsigned cme_get_share_count(int ix);
+int cme_add_sharer(int ix, struct addrspace *as);
+unsigned cme_drop_sharer(int ix, struct addrspace *as);
+bool cme_is_sharer(int ix, struct addrspace *as);
+
+/*
+ * Text page cache. Read-only pages of an executable are shared by every
+ * process running it, as copy-on-write sharers of one frame, found by
+ * (vnode, virtual page). A frame leaves the cache when it is evicted or
+ * its last sharer lets go of it.
+ *
+ *    textcache_lookup - returns the cached frame for the page, pinned, or
+ *                       INVALID_PADDR if there is none or it is busy
+ *    textcache_insert - caches the pinned, freshly read frame pa for vn,
+ *                       unless another one got there first
+ *    cme_is_cached - whether a frame is in the text cache; such a frame
+ *                    must be copied before it is written
+ */
+paddr_t textcache_lookup(struct vnode *vn, vaddr_t va);
+void textcache_insert(paddr_t pa, struct vnode *vn);
+bool cme_is_cached(int ix);
+
+/*
+ * Shared file mappings (mmap MAP_SHARED). Such a frame holds page
+ * file_page of vn; it has no swap slot and is never copied on write, so
+ * processes sharing it after fork see each other's writes. Once dirty it
+ * is written back to the file, by the pageout daemon or when its last
+ * sharer unmaps it, and a clean one is dropped rather than swapped.
+ * The caller must hold the pin on the entry.
+ *
+ *    cme_set_mapped - make the freshly filled, clean frame a page of vn
+ *    cme_is_mapped - whether the frame belongs to a shared mapping
+ *    cme_writeback - if the frame is a dirty mapped page, write it to its
+ *                    file and mark it clean. Does file system I/O, so is
+ *                    best called without any pt_lock.
+ */
+void cme_set_mapped(int ix, struct vnode *vn, int file_page);
+bool cme_is_mapped(int ix);
+int cme_writeback(int ix);
+
 /*
  * Bootstrap
+ *
+ *    coremap_bootstrap - set up the coremap; called from vm_bootstrap
+ *    coremap_start_threads - start the pageout daemon and page zeroing
+ *                thread; called at the end of boot after swapfile_init
  */
 void coremap_bootstrap(void);
+void coremap_start_threads(void);
 
 /*
  * Swap space functions
  */
 
 void swapfile_init(void);
-unsigned swapfile_reserve_index(void); // Called in mark_allocated()
+int swapfile_reserve_index(unsigned *index); // Returns ENOSPC when swap is full
 void swapfile_free_index(unsigned index); // Called in free_coremap_page()
+void swapfile_share_index(unsigned index); // Called in as_copy()
+unsigned swapfile_index_refs(unsigned index);
 
 int swapout(paddr_t ppn);
 int swapin(struct addrspace *as, vaddr_t vpn, paddr_t dest);
 void evict_page(paddr_t ppn);
 int write_page(void *page, unsigned offset);
 int read_page(void *page, unsigned offset);
+int write_pages(paddr_t *pages, unsigned npages, unsigned offset);
+int read_pages(paddr_t *pages, unsigned npages, unsigned offset);
+void swapin_set_readahead(int npages);
 void writer_thread(void *junk, unsigned long num);
+void zero_thread(void *junk, unsigned long num);
+void pageout_set_watermarks(int low, int high);
+void pageout_get_watermarks(int *low, int *high);
 
 
 #endif /* _COREMAP_H_ */
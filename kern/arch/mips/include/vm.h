@@ -112,11 +112,10 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
 
 #define TLBSHOOTDOWN_MAX 16
 
-/* PPN is the address to shoot down and done_handling is used for synchronizing 
- * with subsequent instructions */
+/* PPN is the address to shoot down. The sender waits for the target's
+ * c_shootdown_done to catch up rather than for each entry. */
 struct tlbshootdown{
 	uint32_t ppn;
-	struct semaphore *done_handling;
 };
 
 
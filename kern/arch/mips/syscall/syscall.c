@@ -82,6 +82,8 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	uint32_t ar3,retval2;
+	uint32_t pos[2];
+	uint32_t mmargs[4];
 	uint64_t ar2,ret64;
 	int err = 0;
 
@@ -156,6 +158,27 @@ syscall(struct trapframe *tf)
         retval = sys_write(tf->tf_a0,(userptr_t)tf->tf_a1,tf->tf_a2,&err);
         break;
 
+        case SYS_pread:
+        case SYS_pwrite:
+        // The 64-bit offset is aligned past a3, onto the stack
+        err = copyin((const_userptr_t)(tf->tf_sp+16),pos,sizeof(pos));
+        if (err)
+        	break;
+        join32to64(pos[0],pos[1],&ar2);
+        if (callno == SYS_pread)
+        	retval = sys_pread(tf->tf_a0,(userptr_t)tf->tf_a1,tf->tf_a2,(off_t)ar2,&err);
+        else
+        	retval = sys_pwrite(tf->tf_a0,(userptr_t)tf->tf_a1,tf->tf_a2,(off_t)ar2,&err);
+        break;
+
+        case SYS_readv:
+        retval = sys_readv(tf->tf_a0,(userptr_t)tf->tf_a1,tf->tf_a2,&err);
+        break;
+
+        case SYS_writev:
+        retval = sys_writev(tf->tf_a0,(userptr_t)tf->tf_a1,tf->tf_a2,&err);
+        break;
+
         case SYS_dup2:
         retval = sys_dup2(tf->tf_a0,tf->tf_a1,&err);
         break;
@@ -199,6 +222,24 @@ syscall(struct trapframe *tf)
 
         case SYS_sbrk:
         retval = sys_sbrk((int)tf->tf_a0, &err);
+        break;
+
+        case SYS_mmap:
+        // fd, then the 64-bit offset aligned past it, are on the stack
+        err = copyin((const_userptr_t)(tf->tf_sp+16),mmargs,sizeof(mmargs));
+        if (err)
+        	break;
+        join32to64(mmargs[2],mmargs[3],&ar2);
+        retval = sys_mmap((vaddr_t)tf->tf_a0,tf->tf_a1,tf->tf_a2,tf->tf_a3,
+        	(int)mmargs[0],(off_t)ar2,&err);
+        break;
+
+        case SYS_munmap:
+        err = sys_munmap((vaddr_t)tf->tf_a0,tf->tf_a1);
+        break;
+
+        case SYS_mprotect:
+        err = sys_mprotect((vaddr_t)tf->tf_a0,tf->tf_a1,(int)tf->tf_a2);
         break;
 
 	    default:
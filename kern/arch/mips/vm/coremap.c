@@ -17,23 +17,66 @@
 #include <bitmap.h>
 #include <cpu.h>
 #include <uio.h>
+#include <stat.h>
 
 #define MIN_USER_CM_PAGES 10
 
 // Local shared variables
 static struct cm_entry *coremap;
-static struct spinlock busy_lock = SPINLOCK_INITIALIZER;
 static struct spinlock stat_lock = SPINLOCK_INITIALIZER;
 static int clock_hand;
 
+/*
+ * Global free lists, linked through next_free and protected by free_lock.
+ * Freed pages go to the freeing cpu's magazine first and spill over onto
+ * free_dirty, from which zero_thread moves them onto free_zeroed.
+ */
+static struct spinlock free_lock = SPINLOCK_INITIALIZER;
+static int free_zeroed = -1;
+static int free_dirty = -1;
+
 static int num_cm_entries;
 static int num_cm_free;
 static int num_cm_kernel;
 static int num_cm_user;
+static int num_cm_zeroed; // Free pages that are already zero filled
+static bool zero_requested;
+
+// Swap slot allocation state, protected by disk_map_lock
+static unsigned swap_npages;
+static unsigned swap_nclusters;
+static unsigned swap_cursor; // Cluster at which to start looking for a free run
+static uint8_t *cluster_free; // Number of unmarked slots in each cluster
+
+// Number of references (frames and page table entries) to each swap slot
+static uint16_t **disk_refs;
+#define SWAP_REFS_PER_PAGE (PAGE_SIZE / sizeof(uint16_t))
+#define SWAP_REFS(i) disk_refs[(i) / SWAP_REFS_PER_PAGE][(i) % SWAP_REFS_PER_PAGE]
+
+// Number of slots in cluster cl (the last one may be short)
+#define swap_cluster_size(cl) \
+    ((cl) == swap_nclusters - 1 ? swap_npages - (cl) * SWAP_CLUSTER_PAGES : SWAP_CLUSTER_PAGES)
+
+// Pageout daemon state (watermarks count frames that are free or clean)
+static int pageout_low;
+static int pageout_high;
+static bool pageout_requested;
+
+// Number of following pages speculatively read on a swap-in
+static int swap_readahead = SWAP_READAHEAD_DEFAULT;
 
 #define COREMAP_TO_PADDR(i) (paddr_t)PAGE_SIZE * (i + base)
 #define PADDR_TO_COREMAP(paddr)  (paddr / PAGE_SIZE) - base
 
+// Text page cache hash chains, linked through next_cached
+#define TEXTCACHE_BUCKETS 64
+#define TEXTCACHE_HASH(vn, vpn) ((((vaddr_t)(vn) >> 4) ^ (vpn)) % TEXTCACHE_BUCKETS)
+static struct spinlock textcache_lock = SPINLOCK_INITIALIZER;
+static int textcache[TEXTCACHE_BUCKETS];
+
+static void textcache_remove(int ix);
+static void cm_forget_file(int ix);
+
 /*
  * Static page selection helpers
  */
@@ -46,8 +89,8 @@ static int num_cm_user;
  * Synchronization: See alloc_one_page for synchonization note.
  */
 
-static int reached_kpage_limit(void){
-    if (num_cm_kernel + 1 >= num_cm_entries - MIN_USER_CM_PAGES) {
+static int reached_kpage_limit(int npages){
+    if (num_cm_kernel + npages >= num_cm_entries - MIN_USER_CM_PAGES) {
         return 1;
     }
     return 0;
@@ -65,36 +108,600 @@ static int reached_kpage_limit(void){
 static void mark_allocated(int ix, int iskern) {
     // Sanity check
     KASSERT(coremap[ix].state == CME_FREE);
-    KASSERT(coremap[ix].busy_bit == 1);
+    KASSERT(cme_get_busy(ix));
+
+    KASSERT(coremap[ix].sharers == NULL);
+    KASSERT(coremap[ix].next_free == -1);
 
     coremap[ix].as = NULL;
     coremap[ix].disk_offset = -1;
     coremap[ix].vaddr_base = 0;
     coremap[ix].use_bit = 0;
+    coremap[ix].filebacked = 0;
+    KASSERT(coremap[ix].vn == NULL);
+    KASSERT(!coremap[ix].mapped);
 
     spinlock_acquire(&stat_lock);
     num_cm_free -= 1;
+    coremap[ix].zeroed = 0;
     if (iskern) {
         coremap[ix].state = CME_FIXED;
+        coremap[ix].share_count = 0;
+        coremap[ix].kpages = 1;
         num_cm_kernel += 1;
     }
     else {
         coremap[ix].state = CME_DIRTY;
+        coremap[ix].share_count = 1;
         num_cm_user += 1;
     }
     KASSERT(num_cm_free+num_cm_user+num_cm_kernel == num_cm_entries);
     spinlock_release(&stat_lock);
 }
 
+/*
+ * cme_next_sharer
+ *
+ * Returns the address space mapping coremap entry ix with the smallest
+ * pointer value greater than prev (or the smallest one overall if prev
+ * is NULL), or NULL if there are no more. Used to walk the sharers of a
+ * frame in lock order without allocating.
+ *
+ * Synchronization: Caller must hold the pin on the entry.
+ */
+
+static struct addrspace *cme_next_sharer(int ix, struct addrspace *prev) {
+    struct addrspace *best = NULL;
+    struct cm_sharer *s;
+
+    if (coremap[ix].as != NULL && (vaddr_t)coremap[ix].as > (vaddr_t)prev)
+        best = coremap[ix].as;
+    for (s = coremap[ix].sharers; s != NULL; s = s->next) {
+        if ((vaddr_t)s->as > (vaddr_t)prev && (best == NULL || (vaddr_t)s->as < (vaddr_t)best))
+            best = s->as;
+    }
+    return best;
+}
+
+/*
+ * cm_lock_sharers
+ *
+ * Acquires the page table lock of every address space mapping the victim
+ * page ix, in order of raw pointer value to avoid deadlock. A user caller
+ * already holds as->pt_lock; if any sharer sorts before it we drop it and
+ * take everything in order. *held is set to the sharer whose lock the
+ * caller held on entry (if any) so that cm_unlock_sharers leaves it alone.
+ *
+ * Synchronization: Caller must hold the pin on the entry.
+ */
+
+static void cm_lock_sharers(int ix, struct addrspace *as, struct addrspace **held) {
+    struct addrspace *s;
+    bool reorder = false;
+
+    *held = NULL;
+    for (s = cme_next_sharer(ix, NULL); s != NULL; s = cme_next_sharer(ix, s)) {
+        if (lock_do_i_hold(s->pt_lock)) {
+            KASSERT(*held == NULL);
+            *held = s;
+        }
+    }
+    KASSERT(as == NULL || *held == NULL || *held == as);
+
+    // If a user is calling the function, acquire AS locks in pointer order
+    if (as != NULL) {
+        s = cme_next_sharer(ix, NULL);
+        if (s != NULL && (vaddr_t)s < (vaddr_t)as) {
+            lock_release(as->pt_lock);
+            reorder = true;
+        }
+    }
+    for (s = cme_next_sharer(ix, NULL); s != NULL; s = cme_next_sharer(ix, s)) {
+        if (reorder && (vaddr_t)as <= (vaddr_t)s) {
+            lock_acquire(as->pt_lock);
+            reorder = false;
+        }
+        if (s != as && s != *held)
+            lock_acquire(s->pt_lock);
+    }
+    if (reorder)
+        lock_acquire(as->pt_lock);
+}
+
+static void cm_unlock_sharers(int ix, struct addrspace *as, struct addrspace *held) {
+    struct addrspace *s;
+
+    for (s = cme_next_sharer(ix, NULL); s != NULL; s = cme_next_sharer(ix, s)) {
+        // When user is evicting self, do not want to free own lock
+        // Don't want kernel to drop lock in middle of as operation
+        if (s != as && s != held)
+            lock_release(s->pt_lock);
+    }
+}
+
+/*
+ * cme_clear_sharers
+ *
+ * Releases the sharer list of an evicted page.
+ */
+
+static void cme_clear_sharers(int ix) {
+    struct cm_sharer *s;
+
+    while (coremap[ix].sharers != NULL) {
+        s = coremap[ix].sharers;
+        coremap[ix].sharers = s->next;
+        kfree(s);
+    }
+    coremap[ix].as = NULL;
+    coremap[ix].share_count = 0;
+}
+
+/*
+ * pageout_kick
+ *
+ * Wakes the pageout daemon because memory is running low on clean pages.
+ *
+ * Synchronization: cv_lock protects pageout_requested.
+ */
+
+static void pageout_kick(void) {
+    // Daemon not started yet, or we cannot sleep on cv_lock here
+    if (pageout_wanted == NULL || curthread->t_in_interrupt)
+        return;
+    if (pageout_requested)
+        return;
+
+    lock_acquire(cv_lock);
+    pageout_requested = true;
+    cv_signal(pageout_wanted, cv_lock);
+    lock_release(cv_lock);
+}
+
+/*
+ * zero_kick
+ *
+ * Tells zero_thread that there are free pages to zero.
+ */
+
+static void zero_kick(void) {
+    if (zero_wanted == NULL || zero_requested)
+        return;
+    zero_requested = true;
+    V(zero_wanted);
+}
+
+/*
+ * Free list helpers
+ *
+ *    cm_list_take - pop a page off a global free list, or -1
+ *    cm_magazine_take - pop a page off a cpu's magazine, or -1
+ *    cm_steal_free - take a page from any cpu's magazine, or -1
+ *    cm_put_free - return a newly freed page to this cpu's magazine,
+ *                  spilling half of a full magazine onto free_dirty
+ *
+ * Pages on the lists are CME_FREE and unpinned.
+ */
+
+static void cm_list_push(int *head, int ix) {
+    KASSERT(spinlock_do_i_hold(&free_lock));
+    KASSERT(!coremap[ix].onlist);
+
+    coremap[ix].next_free = *head;
+    coremap[ix].onlist = 1;
+    *head = ix;
+    if (head == &free_zeroed)
+        num_cm_zeroed++;
+}
+
+static int cm_list_take(int *head) {
+    int ix;
+
+    spinlock_acquire(&free_lock);
+    ix = *head;
+    if (ix >= 0) {
+        *head = coremap[ix].next_free;
+        coremap[ix].next_free = -1;
+        coremap[ix].onlist = 0;
+        if (head == &free_zeroed)
+            num_cm_zeroed--;
+    }
+    spinlock_release(&free_lock);
+    return ix;
+}
+
+// Unlinks every page in [start, start+npages) from a global free list
+static void cm_list_remove_range(int *head, int start, int npages) {
+    int *link = head;
+    int ix;
+
+    KASSERT(spinlock_do_i_hold(&free_lock));
+
+    while ((ix = *link) >= 0) {
+        if (ix >= start && ix < start + npages) {
+            *link = coremap[ix].next_free;
+            coremap[ix].next_free = -1;
+            coremap[ix].onlist = 0;
+            if (head == &free_zeroed)
+                num_cm_zeroed--;
+        }
+        else {
+            link = &coremap[ix].next_free;
+        }
+    }
+}
+
+static int cm_magazine_take(struct cpu *c) {
+    int ix = -1;
+
+    spinlock_acquire(&c->c_cm_lock);
+    if (c->c_cm_nmag > 0)
+        ix = c->c_cm_magazine[--c->c_cm_nmag];
+    spinlock_release(&c->c_cm_lock);
+    return ix;
+}
+
+static int cm_steal_free(void) {
+    unsigned i;
+    int ix;
+
+    for (i=0; i<cpu_count(); i++) {
+        ix = cm_magazine_take(cpu_get(i));
+        if (ix >= 0)
+            return ix;
+    }
+    return -1;
+}
+
+static void cm_put_free(int ix) {
+    struct cpu *c = curcpu->c_self;
+    int spill[CPU_PAGE_MAGAZINE];
+    unsigned nspill = 0, i;
+
+    spinlock_acquire(&c->c_cm_lock);
+    if (c->c_cm_nmag == CPU_PAGE_MAGAZINE) {
+        while (c->c_cm_nmag > CPU_PAGE_MAGAZINE / 2)
+            spill[nspill++] = c->c_cm_magazine[--c->c_cm_nmag];
+    }
+    c->c_cm_magazine[c->c_cm_nmag++] = ix;
+    spinlock_release(&c->c_cm_lock);
+
+    if (nspill == 0)
+        return;
+    spinlock_acquire(&free_lock);
+    for (i=0; i<nspill; i++)
+        cm_list_push(&free_dirty, spill[i]);
+    spinlock_release(&free_lock);
+    zero_kick();
+}
+
+// Moves every page in a cpu's magazine onto free_dirty
+static void cm_magazine_drain(struct cpu *c) {
+    int ix;
+
+    while ((ix = cm_magazine_take(c)) >= 0) {
+        spinlock_acquire(&free_lock);
+        cm_list_push(&free_dirty, ix);
+        spinlock_release(&free_lock);
+    }
+}
+
+/*
+ * cm_shootdown
+ *
+ * Invalidates every TLB entry for the n frames in ixs, on whichever cpus
+ * have run an address space sharing one of them since it last changed
+ * ID, with one IPI per cpu and a single wait.
+ *
+ * Synchronization: Caller must hold the pins on the entries and the
+ * page table locks of their sharers, so no new entries can be loaded.
+ */
+
+static void cm_shootdown(const int *ixs, int n) {
+    struct tlbshootdown ts[SWAP_IO_CLUSTER];
+    struct addrspace *s;
+    uint32_t cpus = 0;
+    int i;
+
+    KASSERT(n <= SWAP_IO_CLUSTER);
+
+    for (i=0; i<n; i++) {
+        KASSERT(cme_get_busy(ixs[i]));
+        ts[i].ppn = COREMAP_TO_PADDR(ixs[i]);
+        for (s = cme_next_sharer(ixs[i], NULL); s != NULL; s = cme_next_sharer(ixs[i], s))
+            cpus |= s->asid_cpus;
+    }
+    if (cpus != 0)
+        ipi_tlbshootdown_cpus(cpus, ts, n);
+}
+
+/*
+ * cm_evict
+ *
+ * Writes out (if dirty) and unmaps the user page ix, leaving it FREE and
+ * still pinned for the caller to reuse. as is the calling process's own
+ * address space, whose pt_lock it may hold, or NULL for the kernel.
+ *
+ * Synchronization: Caller must hold the pin on ix.
+ */
+
+static void cm_evict(int ix, struct addrspace *as) {
+    struct addrspace *held;
+
+    KASSERT(cme_get_busy(ix));
+    KASSERT(cme_get_state(ix) == CME_CLEAN || cme_get_state(ix) == CME_DIRTY);
+
+    /*
+     * A dirty page of a shared mapping would have to go through the file
+     * system, which may be allocating this very page; choose_evict_page
+     * leaves those to the pageout daemon.
+     */
+    KASSERT(!coremap[ix].mapped || cme_get_state(ix) == CME_CLEAN);
+
+    // Lock every page table mapping the victim (more than one if shared copy-on-write)
+    cm_lock_sharers(ix, as, &held);
+    /*
+     * After acquiring page table locks, we must shoot down the TLB for the address to evict
+     * Once this completes, the address cannot be accessed by its old mapping.
+     */
+
+    cm_shootdown(&ix, 1);
+
+    // The daemon fell behind; clean synchronously and ask for help
+    if (cme_get_state(ix) == CME_DIRTY) {
+        pageout_kick();
+        swapout(COREMAP_TO_PADDR(ix));
+    }
+    evict_page(COREMAP_TO_PADDR(ix));
+
+    cm_unlock_sharers(ix, as, held);
+    cme_clear_sharers(ix);
+
+    coremap[ix].as = NULL;
+    coremap[ix].share_count = 0;
+    coremap[ix].disk_offset = -1;
+    coremap[ix].vaddr_base = 0;
+    coremap[ix].use_bit = 0;
+
+    spinlock_acquire(&stat_lock);
+    num_cm_user--;
+    num_cm_free++;
+    spinlock_release(&stat_lock);
+}
+
+/*
+ * cm_compact_evictable / cm_try_evict
+ *
+ * Evict user page ix for cm_compact_run, if that can be done without
+ * waiting. Its callers come from kmalloc and may already hold a pt_lock,
+ * or be in the middle of swap I/O under the VM locks, so it must not
+ * block on a page table lock, take disk_map_lock, or do I/O. Only clean
+ * anonymous pages with one sharer qualify (freeing anything else drops
+ * a swap or file reference), and only if every page table mapping the
+ * page can be locked at once. Dirty pages are left to the pageout
+ * daemon. cm_try_evict returns true if the page was evicted; it is then
+ * FREE and still pinned.
+ *
+ * Synchronization: cm_compact_evictable is a hint when called unpinned.
+ * Caller of cm_try_evict must hold the pin on ix.
+ */
+
+static bool cm_compact_evictable(int ix) {
+    return cme_get_state(ix) == CME_CLEAN && !coremap[ix].filebacked &&
+        coremap[ix].share_count <= 1;
+}
+
+static bool cm_try_evict(int ix) {
+    struct addrspace *s, *t;
+
+    KASSERT(cme_get_busy(ix));
+
+    if (!cm_compact_evictable(ix))
+        return false;
+    for (s = cme_next_sharer(ix, NULL); s != NULL; s = cme_next_sharer(ix, s)) {
+        if (lock_do_i_hold(s->pt_lock) || !lock_tryacquire(s->pt_lock)) {
+            for (t = cme_next_sharer(ix, NULL); t != s; t = cme_next_sharer(ix, t))
+                lock_release(t->pt_lock);
+            return false;
+        }
+    }
+
+    cm_shootdown(&ix, 1);
+    evict_page(COREMAP_TO_PADDR(ix));
+
+    for (s = cme_next_sharer(ix, NULL); s != NULL; s = cme_next_sharer(ix, s))
+        lock_release(s->pt_lock);
+    cme_clear_sharers(ix);
+
+    coremap[ix].disk_offset = -1;
+    coremap[ix].vaddr_base = 0;
+    coremap[ix].use_bit = 0;
+
+    spinlock_acquire(&stat_lock);
+    num_cm_user--;
+    num_cm_free++;
+    spinlock_release(&stat_lock);
+    return true;
+}
+
+/*
+ * Contiguous kernel allocation helpers
+ *
+ *    cm_find_run - best fit search for npages free pages in a row
+ *    cm_claim_run - take such a run off the free lists
+ *    cm_compact_run - evict user pages to make room for a run
+ *
+ * Only pages linked on the global free lists count as free here, so
+ * callers drain the per-cpu magazines first. All return the index of
+ * the first page of the run, or -1.
+ */
+
+static int cm_find_run(int npages) {
+    int i, len = 0;
+    int best = -1, bestlen = num_cm_entries + 1;
+
+    KASSERT(spinlock_do_i_hold(&free_lock));
+
+    for (i=0; i<=num_cm_entries; i++) {
+        if (i < num_cm_entries && coremap[i].onlist) {
+            len++;
+            continue;
+        }
+        // Prefer the smallest hole that fits to keep large ones intact
+        if (len >= npages && len < bestlen) {
+            best = i - len;
+            bestlen = len;
+            if (len == npages)
+                break;
+        }
+        len = 0;
+    }
+    return best;
+}
+
+static void cm_claim_run(int start, int npages) {
+    KASSERT(spinlock_do_i_hold(&free_lock));
+
+    cm_list_remove_range(&free_zeroed, start, npages);
+    cm_list_remove_range(&free_dirty, start, npages);
+}
+
+static void cm_drain_magazines(void) {
+    unsigned i;
+
+    for (i=0; i<cpu_count(); i++)
+        cm_magazine_drain(cpu_get(i));
+}
+
+static int cm_compact_run(int npages) {
+    int i, start, best, bestcost, cost;
+    int attempt;
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        // Find the window of free and evictable pages needing the fewest evictions
+        best = -1;
+        bestcost = npages + 1;
+        for (start = 0; start + npages <= num_cm_entries; start++) {
+            cost = 0;
+            for (i = start; i < start + npages; i++) {
+                if (cme_get_state(i) == CME_FREE)
+                    continue;
+                if (!cm_compact_evictable(i))
+                    break;
+                cost++;
+            }
+            if (i < start + npages) {
+                start = i; // Skip past the page that has to stay
+                continue;
+            }
+            if (cost < bestcost) {
+                best = start;
+                bestcost = cost;
+            }
+        }
+        if (best < 0) {
+            // Get dirty pages cleaned, so a later try may find a window
+            pageout_kick();
+            return -1;
+        }
+
+        // Pages we cannot pin or evict now are left in place; the window then fails below
+        for (i = best; i < best + npages; i++) {
+            if (cme_get_state(i) == CME_FREE || cme_get_state(i) == CME_FIXED)
+                continue;
+            if (!cme_try_pin(i))
+                continue;
+            if (cm_try_evict(i)) {
+                cme_set_busy(i, 0);
+                spinlock_acquire(&free_lock);
+                cm_list_push(&free_dirty, i);
+                spinlock_release(&free_lock);
+            }
+            else {
+                cme_set_busy(i, 0);
+            }
+        }
+
+        cm_drain_magazines();
+        spinlock_acquire(&free_lock);
+        for (i = best; i < best + npages; i++) {
+            if (!coremap[i].onlist)
+                break;
+        }
+        if (i == best + npages) {
+            cm_claim_run(best, npages);
+            spinlock_release(&free_lock);
+            return best;
+        }
+        spinlock_release(&free_lock);
+    }
+    return -1;
+}
+
+/*
+ * cm_alloc_run
+ *
+ * Allocates npages physically contiguous, zero filled kernel pages and
+ * records the length of the block in its first entry for free_kpages.
+ * Best fit over the free pages first; failing that, clean user pages
+ * are evicted out of the cheapest window holding nothing else (see
+ * cm_try_evict). If there is none the allocation fails rather than wait.
+ *
+ * Synchronization: The run is claimed under free_lock, after which the
+ * pages are unreachable by other allocators; pins are taken only to wait
+ * out threads that looked at a page before it was claimed.
+ */
+
+static int cm_alloc_run(int npages) {
+    int start, i;
+    bool was_zeroed;
+
+    if (reached_kpage_limit(npages)) {
+        kprintf("alloc_kpages: kernel heap full\n");
+        return -1;
+    }
+
+    cm_drain_magazines();
+    spinlock_acquire(&free_lock);
+    start = cm_find_run(npages);
+    if (start >= 0)
+        cm_claim_run(start, npages);
+    spinlock_release(&free_lock);
+
+    if (start < 0)
+        start = cm_compact_run(npages);
+    if (start < 0)
+        return -1;
+
+    for (i = start; i < start + npages; i++) {
+        while (!cme_try_pin(i))
+            ;
+        was_zeroed = coremap[i].zeroed;
+        mark_allocated(i, true);
+        coremap[i].kpages = 0;
+        if (!was_zeroed)
+            bzero((void *)PADDR_TO_KVADDR(COREMAP_TO_PADDR(i)), PAGE_SIZE);
+        cme_set_busy(i, 0);
+    }
+    coremap[start].kpages = npages;
+
+    if (num_cm_free < pageout_low)
+        pageout_kick();
+    return start;
+}
+
 /*
  * Page selection APIs
  */
 
 /*
- * alloc_one_page
+ * cm_alloc_page
  *
  * Allocate one page of kernel memory. Allocates kernel page if thread is
- * not NULL, else allocates user page.
+ * not NULL, else allocates user page. If zero is set the page is zero
+ * filled, taken from the pre-zeroed pool when possible. Returns
+ * INVALID_PADDR if there is nothing to evict but dirty pages of shared
+ * mappings, which the pageout daemon has been asked to write back.
  *
  * Synchronization: TODO Aidan
  *
@@ -107,82 +714,48 @@ static void mark_allocated(int ix, int iskern) {
  * to unpin page.
  */
 
-paddr_t alloc_one_page(struct addrspace *as, vaddr_t va){
+static paddr_t cm_alloc_page(struct addrspace *as, vaddr_t va, bool zero){
     int ix = -1;
     int iskern;
-    bool held_lock;
+    bool was_zeroed = false;
 
     KASSERT(num_cm_entries != 0);
 
     iskern = (as == NULL);
 
     // Check there we leave enough pages for user
-    if (iskern && reached_kpage_limit()) {
+    if (iskern && reached_kpage_limit(1)) {
         kprintf("alloc_one_page: kernel heap full\n");
         return INVALID_PADDR;
     }
 
     if (num_cm_free > 0)
-        ix = find_free_page();
+        ix = find_free_page(zero);
     if (ix < 0) {
         // Find a page to swap
         ix = choose_evict_page();
-        KASSERT(ix != -1);
+        if (ix < 0)
+            return INVALID_PADDR;
 
         /* 
          * choose_evict_page can possibly return a free page, in which case
          * we skip the eviction logic.
          */
-        if (cme_get_state(ix) != CME_FREE){
-            held_lock = lock_do_i_hold(coremap[ix].as->pt_lock);
-
-            // If a user is calling the function:
-            if (as != NULL){
-                // To avoid deadlock, acquire AS locks in order of raw pointer value
-                if ((int)coremap[ix].as < (int)as){
-                    lock_release(as->pt_lock);
-                    lock_acquire(coremap[ix].as->pt_lock);
-                    lock_acquire(as->pt_lock);
-                }
-                if ((int)coremap[ix].as > (int)as)
-                    lock_acquire(coremap[ix].as->pt_lock);
-                // If we are evicting our own page, do nothing extra since we already hold our own lock
-            }
-            else {
-                // Kernel might already hold lock when entering the function (as_copy)
-                if (!held_lock)
-                    lock_acquire(coremap[ix].as->pt_lock);
-            }
-            /*
-             * After acquiring page table locks, we must shoot down the TLB for the address to evict
-             * Once this completes, the address cannot be accessed by its old mapping.
-             */
-
-            // Shoot down other CPUs
-            ipi_tlbshootdown_wait_all(COREMAP_TO_PADDR(ix));
-            struct tlbshootdown ts;
-            ts.ppn = COREMAP_TO_PADDR(ix);
-            ts.done_handling = NULL;
-            // Then shoot down our own CPU
-            vm_tlbshootdown(&ts);
-
-            if (cme_get_state(ix) == CME_DIRTY)
-                swapout(COREMAP_TO_PADDR(ix));
-            evict_page(COREMAP_TO_PADDR(ix));
-
-            // When user is evicting self, do not want to free own lock
-            // Don't want kernel to drop lock in middle of as operation
-            if (!held_lock) {
-                KASSERT(coremap[ix].as != NULL);
-                lock_release(coremap[ix].as->pt_lock);
-            }
-        }
+        if (cme_get_state(ix) != CME_FREE)
+            cm_evict(ix, as);
     }
     // ix should be a valid page index at this point
     KASSERT(coremap[ix].state == CME_FREE);
-    KASSERT(coremap[ix].busy_bit == 1);
+    KASSERT(cme_get_busy(ix));
+    was_zeroed = coremap[ix].zeroed;
     mark_allocated(ix, iskern);
 
+    if (zero && !was_zeroed)
+        bzero((void *)PADDR_TO_KVADDR(COREMAP_TO_PADDR(ix)), PAGE_SIZE);
+
+    if (num_cm_free < pageout_low)
+        pageout_kick();
+
     // If not kernel, update as and vaddr_base
     // Also assign a disk offset for swapping
     if (!iskern) {
@@ -193,25 +766,46 @@ paddr_t alloc_one_page(struct addrspace *as, vaddr_t va){
     return COREMAP_TO_PADDR(ix);
 }
 
+/*
+ * alloc_one_page / alloc_zeroed_page
+ *
+ * Allocate a page whose contents are about to be overwritten (swap-in,
+ * copy-on-write), or one that must read as zeros (first touch, kernel).
+ */
+
+paddr_t alloc_one_page(struct addrspace *as, vaddr_t va){
+    return cm_alloc_page(as, va, false);
+}
+
+paddr_t alloc_zeroed_page(struct addrspace *as, vaddr_t va){
+    return cm_alloc_page(as, va, true);
+}
+
 /*
  * alloc_kpages
  *
- * Only allow for single page allocations. Note that we did not have time
- * to modify execv to reflect this change.
+ * Allocates npages physically contiguous pages of kernel memory. Single
+ * pages come off the free lists like any other; larger blocks go through
+ * cm_alloc_run.
  *
- * Sychronization: Responsible for unpinning the coremap entry that
- * was allocated.
+ * Sychronization: Responsible for unpinning the coremap entries that
+ * were allocated.
  */
 
 vaddr_t alloc_kpages(int npages) {
     paddr_t pa;
+    int ix;
 
     if (npages > 1) {
-        kprintf("alloc_kpages: only support single page allocations\n");
-        return (vaddr_t) NULL;
+        ix = cm_alloc_run(npages);
+        if (ix < 0) {
+            kprintf("alloc_kpages: no run of %d free pages\n", npages);
+            return (vaddr_t) NULL;
+        }
+        return PADDR_TO_KVADDR(COREMAP_TO_PADDR(ix));
     }
 
-    pa = alloc_one_page(NULL, (vaddr_t)0);
+    pa = alloc_zeroed_page(NULL, (vaddr_t)0);
 
     if (pa == INVALID_PADDR) {
         kprintf("alloc_kpages: allocation failed\n");
@@ -250,18 +844,23 @@ void free_coremap_page(paddr_t pa, bool iskern) {
         KASSERT(coremap[ix].vaddr_base == 0);
         KASSERT(coremap[ix].state == CME_FIXED);
         KASSERT(coremap[ix].use_bit == 0);
+        coremap[ix].kpages = 0;
         spinlock_acquire(&stat_lock);
         num_cm_kernel--;
     }
     else {
         KASSERT(coremap[ix].as != NULL);
+        KASSERT(coremap[ix].sharers == NULL);
+        KASSERT(coremap[ix].share_count <= 1);
+        cm_forget_file(ix);
         coremap[ix].as = NULL;
+        coremap[ix].share_count = 0;
 
-        // Free swap space
-        KASSERT(coremap[ix].disk_offset != -1);
+        // Free swap space (a page abandoned part way through a fault may have none)
         KASSERT(coremap[ix].vaddr_base != 0);
 
-        swapfile_free_index(coremap[ix].disk_offset);
+        if (coremap[ix].disk_offset != -1)
+            swapfile_free_index(coremap[ix].disk_offset);
         coremap[ix].disk_offset = -1;
         coremap[ix].vaddr_base = 0;
         coremap[ix].use_bit = 0;
@@ -269,61 +868,105 @@ void free_coremap_page(paddr_t pa, bool iskern) {
         spinlock_acquire(&stat_lock);
         num_cm_user--;
     }
-    // Have to zero this page for some reason
-    bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
-
+    // Zeroing is left to zero_thread or to whoever needs a zero page
     cme_set_state(ix, CME_FREE);
     num_cm_free++;
     spinlock_release(&stat_lock);
 
     cme_set_busy(ix, 0); // Make available
+    cm_put_free(ix);
 }
 
 void free_kpages(vaddr_t va) {
-    free_coremap_page(KVADDR_TO_PADDR(va), true /* iskern */);
+    int ix = PADDR_TO_COREMAP(KVADDR_TO_PADDR(va));
+    int npages, i;
+
+    KASSERT(ix >= 0 && ix < num_cm_entries);
+    npages = coremap[ix].kpages;
+    KASSERT(npages >= 1);
+
+    for (i=0; i<npages; i++)
+        free_coremap_page(COREMAP_TO_PADDR(ix+i), true /* iskern */);
 }
 
 /*
  * find_free_page
  *
- * Finds a non-busy page that is marked CME_FREE and returns its coremap index
- * or -1 on failure.  Returned page is marked as busy.
+ * Takes a page off the free lists and returns its coremap index or -1 on
+ * failure. Returned page is marked as busy. Pre-zeroed pages are preferred
+ * if want_zero is set; otherwise this cpu's magazine of recently freed
+ * pages is used first, saving the zeroed pool for those who need it.
  *
- * Synchronization: Tries to pin page before selecting it.
+ * Synchronization: Lists are protected by spinlocks; the page is then
+ * pinned, which can only be contended briefly by a thread that looked at
+ * it before it was freed.
  */
 
-int find_free_page(void){
-    int i;
-    for (i=0; i<(int)num_cm_entries; i++){
-        if (cme_get_state(i) == CME_FREE) {
-            if (cme_try_pin(i)) {
-                if (cme_get_state(i) == CME_FREE)
-                    return i;
-                cme_set_busy(i, 0);
-            }
-        }
+int find_free_page(bool want_zero){
+    int ix = -1;
+
+    if (want_zero) {
+        ix = cm_list_take(&free_zeroed);
+        if (ix < 0)
+            zero_kick(); // Pool ran dry; ask for more
     }
-    return -1;
+    if (ix < 0)
+        ix = cm_magazine_take(curcpu->c_self);
+    if (ix < 0)
+        ix = cm_list_take(&free_dirty);
+    if (ix < 0 && !want_zero)
+        ix = cm_list_take(&free_zeroed);
+    if (ix < 0)
+        ix = cm_steal_free();
+    if (ix < 0)
+        return -1;
+
+    while (!cme_try_pin(ix))
+        ;
+    KASSERT(cme_get_state(ix) == CME_FREE);
+    return ix;
 }
 
 /*
  * choose_evict_page
  *
  * Finds a non-busy page that is marked NRU and returns it. Intervening
- * pages are marked unused. Guaranteed to return a page index.
+ * pages are marked unused. Dirty pages are passed over for up to one
+ * sweep of the clock in favour of pages the pageout daemon has already
+ * cleaned. Dirty pages of shared mappings are never chosen: writing one
+ * back to its file can need memory, and we may be allocating for the
+ * file system already. If after two sweeps those are all there is, the
+ * pageout daemon is woken to write them back and -1 is returned.
  *
  * Synchronization: Tries to pin a page before selecting it for eviction.
  */
 
 int choose_evict_page(void){
     int ret;
+    int dirty_skips = 0;
     while(1){
         if (cme_get_state(clock_hand) != CME_FIXED){
             if (cme_try_pin(clock_hand)){
-                if (cme_get_use(clock_hand)){
+                if (cme_get_state(clock_hand) == CME_FREE){
+                    // Free pages belong to the free lists; memory was freed
+                    // since our caller looked, so try those again
+                    cme_set_busy(clock_hand,0);
+                    ret = find_free_page(false);
+                    if (ret >= 0)
+                        return ret;
+                }
+                else if (cme_get_use(clock_hand)){
                     cme_set_use(clock_hand,0);
                     cme_set_busy(clock_hand,0);
                 }
+                else if (cme_get_state(clock_hand) == CME_DIRTY &&
+                        (dirty_skips < num_cm_entries || coremap[clock_hand].mapped)){
+                    cme_set_busy(clock_hand,0);
+                    if (++dirty_skips >= 2 * num_cm_entries) {
+                        pageout_kick();
+                        return -1;
+                    }
+                }
                 else {
                     ret = clock_hand;
                     clock_hand = (clock_hand + 1) % num_cm_entries;
@@ -338,21 +981,6 @@ int choose_evict_page(void){
 }
 
 
-/*
- * Busy-waits until all pages for an addrspace are pinned
- */
-
-void pin_all_pages(struct addrspace *as){
-    int i; 
-    for (i=0; i<num_cm_entries; i++){
-        if (coremap[i].as == as){
-            while (!cme_try_pin(i)){
-                ;
-            }
-        }
-    }
-}
-
 /* 
  * Coremap accessor/setter methods 
  */
@@ -380,31 +1008,29 @@ unsigned cme_get_state(int ix){
 }
 void cme_set_state(int ix, unsigned state){
     coremap[ix].state = state;
+    // The file no longer has the page's contents (or there are none)
+    if (state == CME_DIRTY || state == CME_FREE)
+        coremap[ix].filebacked = 0;
 }
 
 /* core map entry pinning */
 unsigned cme_get_busy(int ix){
-    if (coremap[ix].busy_bit == 0)
+    if (spinlock_data_get(&coremap[ix].busy) == 0)
         return 0;
     else
         return 1;
 }
 void cme_set_busy(int ix, unsigned busy){
-    coremap[ix].busy_bit = (busy > 0);
+    spinlock_data_set(&coremap[ix].busy, busy > 0);
 }
 
 // Returns 1 on success (cme[ix] was not busy) and 0 on failure
 unsigned cme_try_pin(int ix){
-    spinlock_acquire(&busy_lock);
-    // If busy
-    if(cme_get_busy(ix)) {
-        spinlock_release(&busy_lock);
+    // Cheap check first so contended pins do not hammer the cache line
+    if (spinlock_data_get(&coremap[ix].busy) != 0)
         return 0;
-    }
     // If not busy, pin it!
-    cme_set_busy(ix,1);
-    spinlock_release(&busy_lock);
-    return 1;
+    return spinlock_data_testandset(&coremap[ix].busy) == 0;
 }
 
 unsigned cme_get_use(int ix){
@@ -414,6 +1040,231 @@ void cme_set_use(int ix, unsigned use){
     coremap[ix].use_bit = (use > 0);
 }
 
+unsigned cme_get_filebacked(int ix){
+    return (unsigned)coremap[ix].filebacked;
+}
+void cme_set_filebacked(int ix, unsigned filebacked){
+    KASSERT(!filebacked || coremap[ix].state == CME_CLEAN);
+    coremap[ix].filebacked = (filebacked > 0);
+}
+
+/* copy-on-write sharing */
+unsigned cme_get_share_count(int ix){
+    return coremap[ix].share_count;
+}
+
+int cme_add_sharer(int ix, struct addrspace *as){
+    struct cm_sharer *s;
+
+    KASSERT(cme_get_busy(ix));
+    KASSERT(coremap[ix].as != NULL);
+
+    s = kmalloc(sizeof(struct cm_sharer));
+    if (s == NULL)
+        return ENOMEM;
+    s->as = as;
+    s->next = coremap[ix].sharers;
+    coremap[ix].sharers = s;
+    coremap[ix].share_count++;
+    return 0;
+}
+
+unsigned cme_drop_sharer(int ix, struct addrspace *as){
+    struct cm_sharer *s, **prev;
+
+    KASSERT(cme_get_busy(ix));
+    KASSERT(coremap[ix].share_count > 0);
+
+    // Promote the first sharer if the owner is leaving
+    if (coremap[ix].as == as) {
+        s = coremap[ix].sharers;
+        if (s == NULL) {
+            coremap[ix].share_count = 0;
+            return 0;
+        }
+        coremap[ix].as = s->as;
+        coremap[ix].sharers = s->next;
+        kfree(s);
+        return --coremap[ix].share_count;
+    }
+    for (prev = &coremap[ix].sharers; *prev != NULL; prev = &(*prev)->next) {
+        if ((*prev)->as == as) {
+            s = *prev;
+            *prev = s->next;
+            kfree(s);
+            return --coremap[ix].share_count;
+        }
+    }
+    panic("cme_drop_sharer: address space does not map page\n");
+    return 0;
+}
+
+bool cme_is_sharer(int ix, struct addrspace *as){
+    struct cm_sharer *s;
+
+    if (coremap[ix].state == CME_FREE || coremap[ix].state == CME_FIXED)
+        return false;
+    if (coremap[ix].as == as)
+        return true;
+    for (s = coremap[ix].sharers; s != NULL; s = s->next) {
+        if (s->as == as)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Text page cache
+ *
+ * A frame is only taken out of the cache by whoever holds its pin, and
+ * lookups pin under textcache_lock, so a frame pinned by a lookup is
+ * still cached and still holds the page. A busy frame is reported as a
+ * miss rather than waited for: the faulting process holds its pt_lock,
+ * and the pin holder may be an evictor that wants it.
+ */
+
+paddr_t textcache_lookup(struct vnode *vn, vaddr_t va){
+    vaddr_t vpn = va >> 12;
+    paddr_t pa = INVALID_PADDR;
+    int ix;
+
+    spinlock_acquire(&textcache_lock);
+    for (ix = textcache[TEXTCACHE_HASH(vn, vpn)]; ix >= 0; ix = coremap[ix].next_cached) {
+        if (coremap[ix].vn == vn && coremap[ix].vaddr_base == vpn) {
+            if (cme_try_pin(ix))
+                pa = COREMAP_TO_PADDR(ix);
+            break;
+        }
+    }
+    spinlock_release(&textcache_lock);
+    return pa;
+}
+
+void textcache_insert(paddr_t pa, struct vnode *vn){
+    int ix = PADDR_TO_COREMAP(pa);
+    vaddr_t vpn = coremap[ix].vaddr_base;
+    int *head = &textcache[TEXTCACHE_HASH(vn, vpn)];
+    int j;
+
+    KASSERT(cme_get_busy(ix));
+    KASSERT(coremap[ix].filebacked);
+    KASSERT(coremap[ix].vn == NULL);
+
+    spinlock_acquire(&textcache_lock);
+    for (j = *head; j >= 0; j = coremap[j].next_cached) {
+        // Lost a race with another process reading the same page
+        if (coremap[j].vn == vn && coremap[j].vaddr_base == vpn)
+            break;
+    }
+    if (j < 0) {
+        coremap[ix].vn = vn;
+        coremap[ix].next_cached = *head;
+        *head = ix;
+    }
+    spinlock_release(&textcache_lock);
+}
+
+static void textcache_remove(int ix){
+    int *prev;
+
+    KASSERT(cme_get_busy(ix));
+
+    if (!cme_is_cached(ix))
+        return;
+
+    spinlock_acquire(&textcache_lock);
+    prev = &textcache[TEXTCACHE_HASH(coremap[ix].vn, coremap[ix].vaddr_base)];
+    while (*prev != ix) {
+        KASSERT(*prev >= 0);
+        prev = &coremap[*prev].next_cached;
+    }
+    *prev = coremap[ix].next_cached;
+    spinlock_release(&textcache_lock);
+
+    coremap[ix].vn = NULL;
+    coremap[ix].next_cached = -1;
+}
+
+bool cme_is_cached(int ix){
+    return coremap[ix].vn != NULL && !coremap[ix].mapped;
+}
+
+/*
+ * Shared file mappings. See coremap.h.
+ *
+ * A dirty mapped page is cleaned the way the pageout daemon cleans swap
+ * backed ones: only the pin is needed. Once the frame's TLB entries are
+ * shot down, a write to it faults and waits for the pin in vm_fault, so
+ * the page cannot change under the I/O. Only the part of the page before
+ * the current end of the file is written; a mapping never grows its file.
+ */
+
+void cme_set_mapped(int ix, struct vnode *vn, int file_page){
+    KASSERT(cme_get_busy(ix));
+    KASSERT(coremap[ix].state == CME_CLEAN);
+    KASSERT(coremap[ix].vn == NULL);
+    KASSERT(coremap[ix].disk_offset == -1);
+
+    coremap[ix].vn = vn;
+    coremap[ix].file_page = file_page;
+    coremap[ix].mapped = 1;
+    coremap[ix].filebacked = 1;
+}
+
+bool cme_is_mapped(int ix){
+    return coremap[ix].mapped;
+}
+
+int cme_writeback(int ix){
+    off_t pos = (off_t)coremap[ix].file_page * PAGE_SIZE;
+    struct iovec iov;
+    struct uio u;
+    struct stat st;
+    size_t len;
+    int result;
+
+    KASSERT(cme_get_busy(ix));
+
+    if (!coremap[ix].mapped || coremap[ix].state != CME_DIRTY)
+        return 0;
+
+    cm_shootdown(&ix, 1);
+
+    result = VOP_STAT(coremap[ix].vn, &st);
+    if (result)
+        return result;
+    if (pos < st.st_size) {
+        len = st.st_size - pos < PAGE_SIZE ? st.st_size - pos : PAGE_SIZE;
+        uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(COREMAP_TO_PADDR(ix)),
+            len, pos, UIO_WRITE);
+        result = VOP_WRITE(coremap[ix].vn, &u);
+        if (result)
+            return result;
+    }
+    cme_set_state(ix, CME_CLEAN);
+    cme_set_filebacked(ix, 1);
+    return 0;
+}
+
+/*
+ * cm_forget_file
+ *
+ * Detaches the frame from the file it holds a page of, if any: takes it
+ * out of the text cache or ends its part in a shared mapping.
+ *
+ * Synchronization: Caller must hold the pin on ix.
+ */
+
+static void cm_forget_file(int ix){
+    if (coremap[ix].mapped) {
+        coremap[ix].vn = NULL;
+        coremap[ix].file_page = 0;
+        coremap[ix].mapped = 0;
+    }
+    else
+        textcache_remove(ix);
+}
+
 /* coremap_bootstrap
  *
  * ram_stealmem() cannot be called after ram_getsize(), so
@@ -457,14 +1308,37 @@ void coremap_bootstrap(void){
     // NRU Clock
     clock_hand = 0;
 
+    // Pageout daemon watermarks
+    pageout_set_watermarks(num_cm_entries / PAGEOUT_LOW_DIV,
+        num_cm_entries / PAGEOUT_HIGH_DIV);
+
     // Initialize coremap entries; basically zero everything
     for (i=0; i<(int)num_cm_entries; i++) {
         coremap[i].as = NULL;
+        coremap[i].sharers = NULL;
+        coremap[i].share_count = 0;
         coremap[i].disk_offset = -1;
         coremap[i].vaddr_base = 0;
         coremap[i].state = CME_FREE;
-        coremap[i].busy_bit = 0;
+        coremap[i].busy = 0;
         coremap[i].use_bit = 0;
+        coremap[i].zeroed = 0;
+        coremap[i].next_free = -1;
+        coremap[i].vn = NULL;
+        coremap[i].next_cached = -1;
+        coremap[i].file_page = 0;
+        coremap[i].mapped = 0;
+        coremap[i].kpages = 0;
+    }
+    for (i=0; i<TEXTCACHE_BUCKETS; i++)
+        textcache[i] = -1;
+    num_cm_zeroed = 0;
+
+    // Everything starts out on the list of pages waiting to be zeroed
+    for (i=num_cm_entries-1; i>=0; i--) {
+        coremap[i].next_free = free_dirty;
+        coremap[i].onlist = 1;
+        free_dirty = i;
     }
 
     /* Initialize synchronization primitives
@@ -487,6 +1361,9 @@ void swapfile_init(void){
     KASSERT(disk_map == NULL);
     KASSERT(disk_map_lock == NULL);
 
+    struct stat st;
+    unsigned i;
+
     char *disk_path = NULL;
     disk_path = kstrdup("lhd0raw:");
     if (disk_path == NULL)
@@ -496,48 +1373,238 @@ void swapfile_init(void){
     if (err)
         panic("swapfile_init: could not open disk");
 
-    // TODO: 1200 is an approximation of 5MB/4KB, which is max number of pages we can have in swap
-    disk_map = bitmap_create(1200);
+    // Size swap from the device, bounded by what a one page bitmap can track
+    err = VOP_STAT(swapfile, &st);
+    if (err)
+        panic("swapfile_init: could not stat disk");
+    swap_npages = st.st_size / PAGE_SIZE;
+    if (swap_npages > SWAP_MAX_PAGES)
+        swap_npages = SWAP_MAX_PAGES;
+    if (swap_npages == 0)
+        panic("swapfile_init: swap disk too small");
+    swap_nclusters = DIVROUNDUP(swap_npages, SWAP_CLUSTER_PAGES);
+
+    disk_map = bitmap_create(swap_npages);
     if (disk_map == NULL)
         panic("swapfile_init: could not create disk map");
 
+    cluster_free = kmalloc(swap_nclusters);
+    if (cluster_free == NULL)
+        panic("swapfile_init: could not create cluster map");
+    for (i=0; i<swap_nclusters; i++)
+        cluster_free[i] = swap_cluster_size(i);
+
+    // Reference counts are kept in page sized chunks
+    disk_refs = kmalloc(DIVROUNDUP(swap_npages, SWAP_REFS_PER_PAGE) * sizeof(uint16_t *));
+    if (disk_refs == NULL)
+        panic("swapfile_init: could not create disk reference counts");
+    for (i=0; i<DIVROUNDUP(swap_npages, SWAP_REFS_PER_PAGE); i++) {
+        disk_refs[i] = kmalloc(PAGE_SIZE);
+        if (disk_refs[i] == NULL)
+            panic("swapfile_init: could not create disk reference counts");
+        bzero(disk_refs[i], PAGE_SIZE);
+    }
+
     disk_map_lock = lock_create("disk map lock");
     if (disk_map_lock == NULL)
         panic("swapfile_init: could not create disk map lock");
+
+    kprintf("swap: %u pages on %s\n", swap_npages, "lhd0raw:");
+}
+
+/*
+ * Called at the end of boot(), after swapfile_init
+ */
+void coremap_start_threads(void){
+    int err;
+
+    // Start the pageout daemon now that there is somewhere to write to
+    pageout_wanted = cv_create("pageout wanted");
+    if (pageout_wanted == NULL)
+        panic("coremap_start_threads: could not create pageout cv");
+    err = thread_fork("pageout", writer_thread, NULL, 0, NULL);
+    if (err)
+        panic("coremap_start_threads: could not start pageout daemon");
+
+    zero_wanted = sem_create("zero wanted", 1);
+    if (zero_wanted == NULL)
+        panic("coremap_start_threads: could not create zero semaphore");
+    zero_requested = true;
+    err = thread_fork("pagezero", zero_thread, NULL, 0, NULL);
+    if (err)
+        panic("coremap_start_threads: could not start page zeroing thread");
 }
 
 /*
- * Uses the bitmap disk_map to find and return an available index, marking
- * it used. Panics in case of swap space being filled
+ * swapfile_take_run
+ *
+ * Marks a run of free slots used in the disk map for a cpu's slot cache,
+ * starting at the rotating cursor. An entirely free cluster is preferred;
+ * otherwise the first free run inside a partially used cluster is taken.
+ * Returns ENOSPC if every slot is in use.
+ *
+ * Synchronization: Caller holds disk_map_lock.
  */
-unsigned swapfile_reserve_index(void){
+static int swapfile_take_run(unsigned *first, unsigned *len){
+    unsigned k, cl, ix, end;
+
+    KASSERT(lock_do_i_hold(disk_map_lock));
+
+    for (k=0; k<swap_nclusters; k++) {
+        cl = (swap_cursor + k) % swap_nclusters;
+        if (cluster_free[cl] == swap_cluster_size(cl))
+            goto found;
+    }
+    for (k=0; k<swap_nclusters; k++) {
+        cl = (swap_cursor + k) % swap_nclusters;
+        if (cluster_free[cl] > 0)
+            goto found;
+    }
+    return ENOSPC;
+
+    found:
+    ix = cl * SWAP_CLUSTER_PAGES;
+    end = ix + swap_cluster_size(cl);
+    while (bitmap_isset(disk_map, ix))
+        ix++;
+    *first = ix;
+    while (ix < end && !bitmap_isset(disk_map, ix)) {
+        bitmap_mark(disk_map, ix);
+        cluster_free[cl]--;
+        ix++;
+    }
+    *len = ix - *first;
+    swap_cursor = (cl + 1) % swap_nclusters;
+    return 0;
+}
+
+/*
+ * swapfile_steal
+ *
+ * Last resort when the disk map is full: take a slot cached by any cpu.
+ */
+static int swapfile_steal(unsigned *index){
+    unsigned i;
+    struct cpu *c;
+
+    for (i=0; i<cpu_count(); i++) {
+        c = cpu_get(i);
+        spinlock_acquire(&c->c_swap_lock);
+        if (c->c_swap_next < c->c_swap_end) {
+            *index = c->c_swap_next++;
+            spinlock_release(&c->c_swap_lock);
+            return 0;
+        }
+        spinlock_release(&c->c_swap_lock);
+    }
+    return ENOSPC;
+}
+
+/*
+ * Finds an available index, marking it used. Slots come from this cpu's
+ * cache of contiguous slots without touching the disk map; the cache is
+ * refilled a run at a time under disk_map_lock. Returns ENOSPC once swap
+ * is full.
+ */
+int swapfile_reserve_index(unsigned *index){
+    struct cpu *c = curcpu->c_self;
+    unsigned first, len;
+    int err;
+
     KASSERT(swapfile != NULL);
     KASSERT(disk_map != NULL);
     KASSERT(disk_map_lock != NULL);
 
+    spinlock_acquire(&c->c_swap_lock);
+    if (c->c_swap_next < c->c_swap_end) {
+        *index = c->c_swap_next++;
+        spinlock_release(&c->c_swap_lock);
+        KASSERT(SWAP_REFS(*index) == 0);
+        SWAP_REFS(*index) = 1;
+        return 0;
+    }
+    spinlock_release(&c->c_swap_lock);
+
     lock_acquire(disk_map_lock);
+    err = swapfile_take_run(&first, &len);
+    if (err) {
+        err = swapfile_steal(index);
+        if (err) {
+            lock_release(disk_map_lock);
+            return err;
+        }
+    }
+    else {
+        *index = first;
+        // Keep the rest of the run, unless someone refilled the cache meanwhile
+        spinlock_acquire(&c->c_swap_lock);
+        if (c->c_swap_next == c->c_swap_end) {
+            c->c_swap_next = first + 1;
+            c->c_swap_end = first + len;
+            len = 1;
+        }
+        spinlock_release(&c->c_swap_lock);
+        for (; len > 1; len--) {
+            bitmap_unmark(disk_map, first + len - 1);
+            cluster_free[(first + len - 1) / SWAP_CLUSTER_PAGES]++;
+        }
+    }
+    KASSERT(SWAP_REFS(*index) == 0);
+    SWAP_REFS(*index) = 1;
+    lock_release(disk_map_lock);
+
+    return 0;
+}
+
+/*
+ * Adds a reference to an index that is already in use, so that a swapped
+ * out page can be shared copy-on-write between a parent and child.
+ */
+void swapfile_share_index(unsigned index){
+    KASSERT(swapfile != NULL);
+    KASSERT(index < swap_npages);
+
+    lock_acquire(disk_map_lock);
+
+    KASSERT(bitmap_isset(disk_map,index));
+    KASSERT(SWAP_REFS(index) > 0 && SWAP_REFS(index) < 0xffff);
+    SWAP_REFS(index)++;
+
+    lock_release(disk_map_lock);
+}
 
-    unsigned index;
-    if (bitmap_alloc(disk_map,&index))
-        panic("swapfile_reserve_index: disk out of space");
+unsigned swapfile_index_refs(unsigned index){
+    unsigned refs;
 
+    KASSERT(index < swap_npages);
+
+    lock_acquire(disk_map_lock);
+    refs = SWAP_REFS(index);
     lock_release(disk_map_lock);
-    return index;
+
+    return refs;
 }
 
 /*
- * Marks the given index of the disk map freed - index must have been
- * previously obtained through the use of swapfile_reserve_index
+ * Drops a reference to the given index of the disk map, marking it freed
+ * once nothing refers to it - index must have been previously obtained
+ * through the use of swapfile_reserve_index
  */
 void swapfile_free_index(unsigned index){
     KASSERT(swapfile != NULL);
     KASSERT(disk_map != NULL);
     KASSERT(disk_map_lock != NULL);
+    KASSERT(index < swap_npages);
 
     lock_acquire(disk_map_lock);
 
     KASSERT(bitmap_isset(disk_map,index));
-    bitmap_unmark(disk_map,index);
+    KASSERT(SWAP_REFS(index) > 0);
+    SWAP_REFS(index)--;
+    if (SWAP_REFS(index) == 0) {
+        bitmap_unmark(disk_map,index);
+        cluster_free[index / SWAP_CLUSTER_PAGES]++;
+    }
 
     lock_release(disk_map_lock);
 }
@@ -559,6 +1626,82 @@ int swapout(paddr_t ppn){
     return ret;
 }
 
+/*
+ * alloc_free_page
+ *
+ * Like alloc_one_page for a user page, but only takes a free frame and
+ * never evicts; used for speculative work that should not cause paging.
+ * Returns the frame pinned, or INVALID_PADDR.
+ */
+static paddr_t alloc_free_page(struct addrspace *as, vaddr_t va){
+    int ix;
+
+    if (num_cm_free <= pageout_low)
+        return INVALID_PADDR;
+    ix = find_free_page(false);
+    if (ix < 0)
+        return INVALID_PADDR;
+    mark_allocated(ix, false);
+    coremap[ix].as = as;
+    coremap[ix].vaddr_base = va >> 12;
+    return COREMAP_TO_PADDR(ix);
+}
+
+/*
+ * swapin_readahead
+ *
+ * Collects the pages following vpn that are swapped out to the slots
+ * following offset (and not shared with another page table), allocating a
+ * free frame for each, up to the read-ahead window. Nothing is read ahead
+ * if the faulting page's own slot is shared. pages[0] and ptes[0] are the
+ * faulting page. Returns the number of pages to read.
+ *
+ * Synchronization: Caller holds as->pt_lock. disk_map_lock is held for
+ * the whole scan rather than taken for each slot; taking a free frame
+ * never sleeps, so that can be done under it.
+ */
+static unsigned swapin_readahead(struct addrspace *as, vaddr_t vpn,
+        unsigned offset, paddr_t *pages, struct pt_ent **ptes){
+    unsigned n;
+    vaddr_t va;
+    struct pt_ent *pte;
+
+    if (swap_readahead == 0)
+        return 1;
+
+    lock_acquire(disk_map_lock);
+    if (SWAP_REFS(offset) != 1) {
+        lock_release(disk_map_lock);
+        return 1;
+    }
+    for (n = 1; n <= (unsigned)swap_readahead && n < SWAP_IO_CLUSTER; n++) {
+        va = vpn + n * PAGE_SIZE;
+        if (va >= USERSPACETOP || offset + n >= swap_npages)
+            break;
+        pte = get_pt_entry(as, va);
+        if (pte == NULL || !pte_get_exists(pte) || pte_get_present(pte))
+            break;
+        if ((unsigned)pte_get_location(pte) != offset + n)
+            break;
+        if (SWAP_REFS(offset + n) != 1)
+            break;
+        pages[n] = alloc_free_page(as, va);
+        if (pages[n] == INVALID_PADDR)
+            break;
+        ptes[n] = pte;
+    }
+    lock_release(disk_map_lock);
+    return n;
+}
+
+void swapin_set_readahead(int npages){
+    if (npages < 0)
+        npages = 0;
+    if (npages > SWAP_IO_CLUSTER - 1)
+        npages = SWAP_IO_CLUSTER - 1;
+    swap_readahead = npages;
+}
+
 /*
  * Reads a page of physical memory from the disk offset specified in the 
  * thread's page table to the given physical address. 
@@ -567,7 +1710,9 @@ int swapout(paddr_t ppn){
  */
 int swapin(struct addrspace *as, vaddr_t vpn, paddr_t dest){
     int idx, ret;
-    unsigned offset;
+    unsigned offset, n, i;
+    paddr_t pages[SWAP_IO_CLUSTER];
+    struct pt_ent *ptes[SWAP_IO_CLUSTER];
 
     KASSERT(as != NULL);
     KASSERT(lock_do_i_hold(as->pt_lock));
@@ -578,17 +1723,57 @@ int swapin(struct addrspace *as, vaddr_t vpn, paddr_t dest){
     KASSERT(!pte_get_present(pte));
 
     offset = pte_get_location(pte);
-    ret = read_page((void *)PADDR_TO_KVADDR(dest),offset);
+    pages[0] = dest;
+    ptes[0] = pte;
+    n = swapin_readahead(as, vpn, offset, pages, ptes);
+
+    ret = read_pages(pages, n, offset);
+    if (ret && n > 1) {
+        // Give up on the speculative pages and just get the one we need
+        for (i=1; i<n; i++)
+            free_coremap_page(pages[i], false /* iskern */);
+        n = 1;
+        ret = read_page((void *)PADDR_TO_KVADDR(dest),offset);
+    }
 
     if (!ret){
         idx = PADDR_TO_COREMAP(dest);
-        coremap[idx].disk_offset = offset;
         coremap[idx].vaddr_base = vpn>>12;
         coremap[idx].as = as;
-        coremap[idx].state = CME_CLEAN;
+
+        /*
+         * If the slot is still referenced by other (copy-on-write) page
+         * tables, this frame must not be written back over it. Give the
+         * frame a slot of its own and let it be written out when evicted.
+         */
+        if (swapfile_index_refs(offset) > 1) {
+            unsigned own;
+            ret = swapfile_reserve_index(&own);
+            if (ret)
+                return ret;
+            coremap[idx].disk_offset = own;
+            coremap[idx].state = CME_DIRTY;
+            swapfile_free_index(offset);
+        }
+        else {
+            coremap[idx].disk_offset = offset;
+            coremap[idx].state = CME_CLEAN;
+        }
 
         pte_set_present(pte,1);
         pte_set_location(pte,dest>>12);
+
+        // Read-ahead pages are clean and unreferenced until touched
+        for (i=1; i<n; i++) {
+            idx = PADDR_TO_COREMAP(pages[i]);
+            coremap[idx].disk_offset = offset + i;
+            coremap[idx].state = CME_CLEAN;
+            coremap[idx].use_bit = 0;
+
+            pte_set_present(ptes[i],1);
+            pte_set_location(ptes[i],pages[i]>>12);
+            cme_set_busy(idx,0);
+        }
     }
 
     return ret;
@@ -596,29 +1781,59 @@ int swapin(struct addrspace *as, vaddr_t vpn, paddr_t dest){
 
 /*
  * Updates page table to have entry marked as absent and its location
- * set to the offset on disk where it can be found.
+ * set to the offset on disk where it can be found. A page shared
+ * copy-on-write is unmapped from every sharer, each of which then holds
+ * a reference to the swap slot.
+ *
+ * A page still holding just what it was read in with from a file is
+ * never written to swap: its entries are removed outright, so the next
+ * fault reads it from the file again, and its swap slot is released.
+ * A clean page of a shared mapping, which has no slot, goes the same way.
  *
- * SHOULD ONLY BE CALLED WHEN THE LOCKS FOR BOTH ADDRSPACES ARE HELD
+ * SHOULD ONLY BE CALLED WHEN THE LOCKS FOR ALL SHARING ADDRSPACES ARE HELD
  */
 void evict_page(paddr_t ppn){
     KASSERT(PADDR_IS_VALID(ppn));
 
     int i = PADDR_TO_COREMAP(ppn);
+    struct addrspace *as;
+    unsigned n;
+
     KASSERT(coremap[i].state == CME_CLEAN);
-    KASSERT(coremap[i].disk_offset != -1);
+    KASSERT(coremap[i].disk_offset != -1 || coremap[i].mapped);
     KASSERT(coremap[i].as != NULL);
 
-    struct pt_ent *pte = get_pt_entry(coremap[i].as,coremap[i].vaddr_base<<12);
-    KASSERT(pte != NULL);
+    if (coremap[i].filebacked) {
+        for (as = cme_next_sharer(i, NULL); as != NULL; as = cme_next_sharer(i, as)) {
+            struct pt_ent *pte = get_pt_entry(as,coremap[i].vaddr_base<<12);
+            KASSERT(pte != NULL);
+
+            pte_set_present(pte,0);
+            pt_remove(as,coremap[i].vaddr_base<<12);
+        }
+        if (!coremap[i].mapped)
+            swapfile_free_index(coremap[i].disk_offset);
+        cm_forget_file(i);
+        cme_set_state(i,CME_FREE);
+        return;
+    }
+
+    for (as = cme_next_sharer(i, NULL); as != NULL; as = cme_next_sharer(i, as)) {
+        struct pt_ent *pte = get_pt_entry(as,coremap[i].vaddr_base<<12);
+        KASSERT(pte != NULL);
 
-    pte_set_present(pte,0);
-    pte_set_location(pte,coremap[i].disk_offset);
+        pte_set_present(pte,0);
+        pte_set_location(pte,coremap[i].disk_offset);
+    }
+    // The frame's own reference is handed to the first page table
+    for (n = 1; n < coremap[i].share_count; n++)
+        swapfile_share_index(coremap[i].disk_offset);
 
     cme_set_state(i,CME_FREE);
 }
 
 int write_page(void *page, unsigned offset){
-    // TODO: Assert offset is not off disk
+    KASSERT(offset < swap_npages);
 
     struct iovec iov;
     struct uio u;
@@ -628,7 +1843,7 @@ int write_page(void *page, unsigned offset){
 }
 
 int read_page(void *page, unsigned offset){
-    // TODO: Assert offset is not off disk
+    KASSERT(offset < swap_npages);
 
     struct iovec iov;
     struct uio u;
@@ -637,21 +1852,263 @@ int read_page(void *page, unsigned offset){
     return VOP_READ(swapfile,&u);
 }
 
-// NOTE: As of now, ignoring cleaner thread
+/*
+ * Moves npages physical pages to or from consecutive swap slots starting
+ * at offset in a single scatter-gather request.
+ */
+static int swap_io_pages(paddr_t *pages, unsigned npages, unsigned offset,
+        enum uio_rw rw){
+    struct iovec iov[SWAP_IO_CLUSTER];
+    struct uio u;
+    unsigned i;
+
+    KASSERT(npages > 0 && npages <= SWAP_IO_CLUSTER);
+    KASSERT(offset + npages <= swap_npages);
+
+    for (i=0; i<npages; i++) {
+        iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(pages[i]);
+        iov[i].iov_len = PAGE_SIZE;
+    }
+    u.uio_iov = iov;
+    u.uio_iovcnt = npages;
+    u.uio_offset = (off_t)offset*PAGE_SIZE;
+    u.uio_resid = npages*PAGE_SIZE;
+    u.uio_segflg = UIO_SYSSPACE;
+    u.uio_rw = rw;
+    u.uio_space = NULL;
+
+    if (rw == UIO_READ)
+        return VOP_READ(swapfile,&u);
+    return VOP_WRITE(swapfile,&u);
+}
+
+int write_pages(paddr_t *pages, unsigned npages, unsigned offset){
+    return swap_io_pages(pages, npages, offset, UIO_WRITE);
+}
+
+int read_pages(paddr_t *pages, unsigned npages, unsigned offset){
+    return swap_io_pages(pages, npages, offset, UIO_READ);
+}
+
+/*
+ * Sets the pageout daemon watermarks, in frames that are free or clean.
+ * The daemon is woken below low and cleans until high is reached.
+ */
+void pageout_set_watermarks(int low, int high){
+    if (low < 1)
+        low = 1;
+    if (high <= low)
+        high = low + 1;
+    pageout_low = low;
+    pageout_high = high;
+}
+
+/*
+ * Gets the watermarks in effect, after any clamping by the above.
+ */
+void pageout_get_watermarks(int *low, int *high){
+    *low = pageout_low;
+    *high = pageout_high;
+}
+
+/*
+ * pageout_count_clean
+ *
+ * Returns the number of frames that could be evicted without a write.
+ * Unsynchronized; only used as a heuristic by the daemon.
+ */
+static int pageout_count_clean(void){
+    int i, n = 0;
+
+    for (i=0; i<num_cm_entries; i++){
+        if (coremap[i].state == CME_FREE || coremap[i].state == CME_CLEAN)
+            n++;
+    }
+    return n;
+}
+
+/*
+ * pageout_neighbor
+ *
+ * Returns the coremap index, pinned, of the page delta pages away from
+ * page ix in the same address space if it is dirty and sits in the swap
+ * slot delta slots away, so the two can be written in one I/O; else -1.
+ *
+ * Synchronization: Caller holds the pin on ix, which keeps its address
+ * space (and page table) alive. The page table is read without its lock,
+ * so everything is checked again once the neighbor is pinned.
+ */
+static int pageout_neighbor(int ix, int delta){
+    struct addrspace *as = coremap[ix].as;
+    vaddr_t va = cme_get_vaddr(ix) + delta * PAGE_SIZE;
+    int slot = coremap[ix].disk_offset + delta;
+    struct pt_ent *pte;
+    int nix;
+
+    if (va == 0 || va >= USERSPACETOP || slot < 0 || slot >= (int)swap_npages)
+        return -1;
+    pte = get_pt_entry(as, va);
+    if (pte == NULL || !pte_get_exists(pte) || !pte_get_present(pte))
+        return -1;
+    nix = PADDR_TO_COREMAP((paddr_t)pte_get_location(pte) << 12);
+    if (nix < 0 || nix >= num_cm_entries || coremap[nix].state != CME_DIRTY)
+        return -1;
+    if (!cme_try_pin(nix))
+        return -1;
+    if (coremap[nix].as != as || coremap[nix].state != CME_DIRTY ||
+            (vaddr_t)cme_get_vaddr(nix) != va || coremap[nix].disk_offset != slot) {
+        cme_set_busy(nix,0);
+        return -1;
+    }
+    return nix;
+}
+
+/*
+ * pageout_gather
+ *
+ * Grows the pinned dirty page ix into a cluster of pinned dirty pages
+ * that are contiguous both in its address space and in swap, ordered by
+ * swap slot. Returns the cluster size.
+ */
+static int pageout_gather(int ix, int *cluster){
+    int back[SWAP_IO_CLUSTER];
+    int nb = 0, n = 0, nix, i;
+
+    while (nb < SWAP_IO_CLUSTER - 1) {
+        nix = pageout_neighbor(ix, -(nb + 1));
+        if (nix < 0)
+            break;
+        back[nb++] = nix;
+    }
+    for (i = nb - 1; i >= 0; i--)
+        cluster[n++] = back[i];
+    cluster[n++] = ix;
+    while (n < SWAP_IO_CLUSTER) {
+        nix = pageout_neighbor(ix, n - nb);
+        if (nix < 0)
+            break;
+        cluster[n++] = nix;
+    }
+    return n;
+}
+
+/*
+ * pageout_clean_batch
+ *
+ * Picks up to PAGEOUT_BATCH dirty, recently unused frames ahead of the
+ * eviction clock, growing each into a cluster of its address space
+ * neighbours. Each cluster has its TLB entries shot down, so that further
+ * writes fault (and block on the pin in vm_fault), and is then written to
+ * its swap slots in one I/O. Dirty pages of shared mappings are written
+ * back to their files instead. Returns the number of pages cleaned.
+ *
+ * Synchronization: Only the pin is needed. A frame changes from dirty to
+ * clean while pinned and with no writable TLB mapping, so no page table
+ * lock is taken and faulting threads are never blocked on the daemon's I/O
+ * unless they write to a page being cleaned.
+ */
+static int pageout_clean_batch(void){
+    int cluster[SWAP_IO_CLUSTER];
+    paddr_t pages[SWAP_IO_CLUSTER];
+    int i, n, cleaned = 0, scanned, ix;
+
+    ix = clock_hand;
+    for (scanned = 0; scanned < num_cm_entries && cleaned < PAGEOUT_BATCH; scanned++){
+        ix = (ix + 1) % num_cm_entries;
+        if (coremap[ix].state != CME_DIRTY || coremap[ix].use_bit)
+            continue;
+        if (!cme_try_pin(ix))
+            continue;
+        if (coremap[ix].state != CME_DIRTY || coremap[ix].as == NULL) {
+            cme_set_busy(ix,0);
+            continue;
+        }
+        // Shared mappings go back to their file, one page at a time
+        if (coremap[ix].mapped) {
+            if (cme_writeback(ix) == 0)
+                cleaned++;
+            else
+                kprintf("pageout: write-back of a mapped page failed\n");
+            cme_set_busy(ix,0);
+            continue;
+        }
+        KASSERT(coremap[ix].disk_offset != -1);
+
+        n = pageout_gather(ix, cluster);
+        for (i=0; i<n; i++)
+            pages[i] = COREMAP_TO_PADDR(cluster[i]);
+        cm_shootdown(cluster, n);
+
+        if (write_pages(pages, n, coremap[cluster[0]].disk_offset) == 0) {
+            for (i=0; i<n; i++)
+                cme_set_state(cluster[i],CME_CLEAN);
+            cleaned += n;
+        }
+        else {
+            kprintf("pageout: write of %d pages at slot %d failed\n",
+                n, coremap[cluster[0]].disk_offset);
+        }
+        for (i=0; i<n; i++)
+            cme_set_busy(cluster[i],0);
+    }
+    return cleaned;
+}
+
+/*
+ * writer_thread
+ *
+ * Pageout daemon. Sleeps until memory runs low on clean pages, then
+ * writes dirty pages back in batches until the high watermark of free or
+ * clean frames is reached, so that evictions usually find a clean victim.
+ */
 void writer_thread(void *junk, unsigned long num){
     (void)junk;
     (void)num;
 
-    int i;
     while(1){
-        P(dirty_pages);
-        for (i=0; i<(int)num_cm_entries; i++){
-            if (cme_get_state(i) == CME_DIRTY){
-                // Write dirty page to memory
-                cme_set_state(i,CME_CLEAN);
-                // Signal CV
+        lock_acquire(cv_lock);
+        while (!pageout_requested)
+            cv_wait(pageout_wanted, cv_lock);
+        pageout_requested = false;
+        lock_release(cv_lock);
+
+        while (pageout_count_clean() < pageout_high){
+            if (pageout_clean_batch() == 0)
                 break;
-            }
+        }
+    }
+}
+
+/*
+ * zero_thread
+ *
+ * Zeroes free pages in the background so that first-touch faults and
+ * kernel allocations can usually take a page that is already zero filled.
+ * Runs as a background thread, at the lowest priority, and yields after
+ * every page, so anything else runnable on its CPU goes first.
+ */
+void zero_thread(void *junk, unsigned long num){
+    (void)junk;
+    (void)num;
+
+    int ix;
+    thread_set_background();
+    while(1){
+        P(zero_wanted);
+        zero_requested = false;
+
+        while ((ix = cm_list_take(&free_dirty)) >= 0){
+            while (!cme_try_pin(ix))
+                ;
+            bzero((void *)PADDR_TO_KVADDR(COREMAP_TO_PADDR(ix)), PAGE_SIZE);
+            coremap[ix].zeroed = 1;
+            cme_set_busy(ix,0);
+
+            spinlock_acquire(&free_lock);
+            cm_list_push(&free_zeroed, ix);
+            spinlock_release(&free_lock);
+
+            thread_yield();
         }
     }
 }
@@ -674,7 +2131,6 @@ void vm_tlbshootdown_all(void){
 }
 
 void vm_tlbshootdown(const struct tlbshootdown *ts){
-    struct semaphore *sem = ts->done_handling;
     uint32_t ppn = ts->ppn;
     int spl;
 
@@ -686,15 +2142,19 @@ void vm_tlbshootdown(const struct tlbshootdown *ts){
         goto done;
 
     uint32_t vpn = (uint32_t)cme_get_vaddr(ix) & TLBHI_VPAGE;
-    int ret = tlb_probe(vpn,0); // ppn is not used by function
+    struct addrspace *as;
+    int ret;
 
-    if (ret >= 0) // tlb_probe returns negative value on failure or index on success
-        tlb_write(TLBHI_INVALID(ret),TLBLO_INVALID(),ret);
+    // Entries are tagged with an address space ID, so look for the page
+    // under the ID of each address space sharing it (the caller holds the
+    // pin, which keeps the sharer list still)
+    for (as = cme_next_sharer(ix, NULL); as != NULL; as = cme_next_sharer(ix, as)) {
+        ret = tlb_probe(vpn | (as->asid << TLBHI_PIDSHIFT),0); // ppn is not used by function
+        if (ret >= 0) // tlb_probe returns negative value on failure or index on success
+            tlb_write(TLBHI_INVALID(ret),TLBLO_INVALID(),ret);
+    }
 
     done:
-    if (sem != NULL)
-        V(sem);
-
     splx(spl);
 }
 
@@ -3,6 +3,7 @@
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <mips/tlb.h>
@@ -29,6 +30,132 @@ vm_bootstrap(void)
 	coremap_bootstrap();
 }
 
+/*
+ * Address space IDs.
+ *
+ * IDs 1..TLBHI_MAXPID are handed out in order under asid_lock. When they
+ * run out a new generation starts: every address space's ID becomes stale
+ * (asid_gen no longer matches) and each cpu flushes its whole TLB the next
+ * time it activates anything. An ID therefore names one address space per
+ * generation, and a cpu never holds translations from an older generation
+ * than the one it is running, so entries left behind by other address
+ * spaces can stay in the TLB across context switches.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = 1;
+static unsigned asid_next = 1;
+
+void
+vm_activate(struct addrspace *as)
+{
+	uint32_t gen;
+	unsigned asid = 0;
+	int i, spl;
+
+	spl = splhigh();
+
+	spinlock_acquire(&asid_lock);
+	if (as != NULL && as->asid_gen != asid_generation) {
+		if (asid_next > TLBHI_MAXPID) {
+			asid_generation++;
+			asid_next = 1;
+		}
+		as->asid = asid_next++;
+		as->asid_gen = asid_generation;
+		as->asid_cpus = 0;
+	}
+	gen = asid_generation;
+	if (as != NULL) {
+		// Shootdowns for this address space need only visit these
+		KASSERT(curcpu->c_number < 32);
+		as->asid_cpus |= (uint32_t)1 << curcpu->c_number;
+		asid = as->asid;
+	}
+	spinlock_release(&asid_lock);
+
+	if (curcpu->c_asid_gen != gen) {
+		for (i=0; i<NUM_TLB; i++) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+		curcpu->c_asid_gen = gen;
+	}
+	tlb_setasid(asid << TLBHI_PIDSHIFT);
+
+	splx(spl);
+}
+
+/*
+ * Rather than hunting down the entries on every cpu the address space has
+ * run on, retire its ID. The old entries can then never match again, and
+ * are flushed when the generation turns over.
+ */
+void
+vm_tlbflush_as(struct addrspace *as)
+{
+	spinlock_acquire(&asid_lock);
+	as->asid_gen = 0;
+	spinlock_release(&asid_lock);
+
+	if (as == curthread->t_addrspace) {
+		vm_activate(as);
+	}
+}
+
+/*
+ * EntryHi for a user page of the current address space. Only valid with
+ * interrupts off: a context switch in between can hand the address space
+ * a new ASID, and the entry would be loaded under the stale one.
+ */
+#define TLB_EHI(as, va) (((va) & TLBHI_VPAGE) | ((as)->asid << TLBHI_PIDSHIFT))
+
+/*
+ * vm_cow_copy
+ *
+ * Breaks copy-on-write sharing of the page mapped at faultaddress: copies
+ * the pinned shared frame *pa into a new frame with its own swap slot,
+ * points the page table entry at it and leaves the old frame to the other
+ * sharers. On success *pa is the new (pinned) frame and the old one has
+ * been unpinned; on failure the old frame is unpinned.
+ *
+ * Synchronization: Caller holds as->pt_lock and the pin on *pa.
+ */
+static
+int
+vm_cow_copy(struct addrspace *as, vaddr_t faultaddress, struct pt_ent *pte,
+	paddr_t *pa)
+{
+	paddr_t new;
+	unsigned offset;
+	int ix = cm_get_index(*pa);
+
+	KASSERT(lock_do_i_hold(as->pt_lock));
+	KASSERT(cme_get_busy(ix));
+
+	if (swapfile_reserve_index(&offset)) {
+		cme_set_busy(ix,0);
+		return ENOMEM;
+	}
+	new = alloc_one_page(as,faultaddress);
+	if (new == INVALID_PADDR) {
+		swapfile_free_index(offset);
+		cme_set_busy(ix,0);
+		return ENOMEM;
+	}
+	memcpy((void *)PADDR_TO_KVADDR(new), (void *)PADDR_TO_KVADDR(*pa), PAGE_SIZE);
+	cme_set_offset(cm_get_index(new),offset);
+
+	// The old frame still backs at least one other address space, unless
+	// it was only shared through the text cache
+	if (cme_drop_sharer(ix,as) == 0)
+		free_coremap_page(*pa, false /* iskern */);
+	else
+		cme_set_busy(ix,0);
+
+	pte_set_location(pte,new>>12);
+	*pa = new;
+	return 0;
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -54,7 +181,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	}
 	else {
 		permissions = as_get_permissions(as,faultaddress);
-		valid = permissions >= 0;
+		valid = permissions > 0; // A PROT_NONE mapping may not be touched
 	}
 	if (!valid) {
 		return EFAULT;
@@ -64,24 +191,47 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-	    // Check permissions - are we allowed to write? 
-	    // (either by permission or if we are in the middle of loading)
+	    // Check permissions - are we allowed to write?
 	    KASSERT(pte != NULL);
-		if (!(pte_get_permissions(pte) & VM_WRITE) && !as->is_loading)
+		if (!(pte_get_permissions(pte) & VM_WRITE))
 			return EFAULT;
 
-		// If so, mark TLB and coremap entries dirty then return
+		lock_acquire(as->pt_lock);
+		// Page may have been evicted since the TLB entry was loaded; just retry
+		if (!pte_get_present(pte)) {
+			lock_release(as->pt_lock);
+			return 0;
+		}
 		paddr_t pa = (pte_get_location(pte)<<12);
 
+		// Never spin on a pin while holding pt_lock (evictors pin first, then lock)
+		if (!cme_try_pin(cm_get_index(pa))) {
+			lock_release(as->pt_lock);
+			return 0;
+		}
+
+		// Page is shared copy-on-write: give this address space its own copy.
+		// Pages of a shared mapping are written in place by every sharer.
+		if (!cme_is_mapped(cm_get_index(pa)) &&
+		    (cme_get_share_count(cm_get_index(pa)) > 1 ||
+		     cme_is_cached(cm_get_index(pa)))) {
+			ret = vm_cow_copy(as, faultaddress, pte, &pa);
+			if (ret) {
+				lock_release(as->pt_lock);
+				return ret;
+			}
+		}
+
+		// If so, mark TLB and coremap entries dirty then return
 		cme_set_state(cm_get_index(pa),CME_DIRTY);
 
 		elo = (pa & TLBLO_PPAGE) | TLBLO_DIRTY | TLBLO_VALID;
-		ehi = faultaddress & TLBHI_VPAGE;
 
 		spl = splhigh();
 
-		tlbindex = tlb_probe(faultaddress,0);
-		if (tlbindex < -1) {
+		ehi = TLB_EHI(as, faultaddress);
+		tlbindex = tlb_probe(ehi,0);
+		if (tlbindex < 0) {
 			tlb_random(ehi, elo);
 		}
 		else {
@@ -90,6 +240,9 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		cme_set_use(cm_get_index(pa), 1);
 		splx(spl);
 
+		cme_set_busy(cm_get_index(pa),0);
+		lock_release(as->pt_lock);
+
 		return 0;
 
 	    case VM_FAULT_READ:
@@ -99,28 +252,120 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EINVAL;
 	}
 
+	/*
+	 * Fast path for a resident page that only lacks its TLB entry. Evictors
+	 * pin the frame before they touch the page table, so once we hold the
+	 * pin and the entry still names that frame it stays put, and the TLB
+	 * can be loaded without pt_lock. Anything else takes the slow path.
+	 */
+	if (pte != NULL) {
+		struct pt_ent snap = *pte;
+		if (pte_get_exists(&snap) && pte_get_present(&snap)) {
+			int ix;
+
+			pa = (uint32_t)(pte_get_location(&snap)<<12);
+			ix = cm_get_index(pa);
+			if (cme_try_pin(ix)) {
+				if (pte_get_present(pte) &&
+				    pte_get_location(pte) == pte_get_location(&snap)) {
+					elo = (pa & TLBLO_PPAGE) | TLBLO_VALID;
+
+					spl = splhigh();
+					ehi = TLB_EHI(as, faultaddress);
+					tlb_random(ehi, elo);
+					cme_set_use(ix, 1);
+					splx(spl);
+
+					cme_set_busy(ix,0);
+					return 0;
+				}
+				cme_set_busy(ix,0);
+			}
+		}
+	}
+
 	lock_acquire(as->pt_lock);
 	if (pte == NULL || !pte_get_exists(pte)) {
-		// First time accessing page
-		paddr_t new = alloc_one_page(curthread->t_addrspace,faultaddress);
+		struct vnode *text = as_page_text(as, faultaddress);
+
+		// Another process running this executable may have the page already
+		if (text != NULL) {
+			pa = textcache_lookup(text, faultaddress);
+			if (pa != INVALID_PADDR) {
+				ret = cme_add_sharer(cm_get_index(pa), as);
+				if (ret == 0) {
+					ret = pt_insert(as,faultaddress,pa>>12,permissions);
+					if (ret)
+						cme_drop_sharer(cm_get_index(pa), as);
+				}
+				cme_set_busy(cm_get_index(pa),0);
+				lock_release(as->pt_lock);
+				return ret;
+			}
+		}
+
+		/*
+		 * First time accessing page; reserve its swap slot up front.
+		 * A page of a shared mapping needs none, as it is written
+		 * back to its file.
+		 */
+		int file_page;
+		struct vnode *mapped = as_page_mapped(as, faultaddress, &file_page);
+		unsigned offset;
+		if (mapped == NULL && swapfile_reserve_index(&offset)) {
+			lock_release(as->pt_lock);
+			return ENOMEM;
+		}
+
+		paddr_t new = alloc_zeroed_page(curthread->t_addrspace,faultaddress);
 
 		if (new == 0) {
+			if (mapped == NULL)
+				swapfile_free_index(offset);
 			lock_release(as->pt_lock);
 			return ENOMEM;
 		}
 
 		KASSERT(PADDR_IS_VALID(new));
 
-		bzero((void *)PADDR_TO_KVADDR(new), PAGE_SIZE);
-		
+		// Give the coremap entry its offset
+		if (mapped == NULL)
+			cme_set_offset(cm_get_index(new),offset);
+
+		/*
+		 * Read in whatever part of the page comes from the executable.
+		 * The file system may need to evict our pages meanwhile, so let
+		 * go of pt_lock; the frame stays pinned and, with no entry for
+		 * it yet, nobody else can get at it.
+		 */
+		if (as_page_is_file(as, faultaddress)) {
+			lock_release(as->pt_lock);
+			ret = as_fill_page(as, faultaddress, new);
+			lock_acquire(as->pt_lock);
+			if (ret) {
+				free_coremap_page(new, false /* iskern */);
+				lock_release(as->pt_lock);
+				return ret;
+			}
+			// Matches the file, so it can be dropped instead of swapped
+			cme_set_state(cm_get_index(new),CME_CLEAN);
+			cme_set_filebacked(cm_get_index(new),1);
+		}
+		if (mapped != NULL) {
+			// Past the end of the file it stays zeros, and is clean too
+			cme_set_state(cm_get_index(new),CME_CLEAN);
+			cme_set_mapped(cm_get_index(new), mapped, file_page);
+		}
+
 		ret = pt_insert(as,faultaddress,new>>12,permissions); // Should permissions be RW?
 		if (ret) {
+			free_coremap_page(new, false /* iskern */);
 			lock_release(as->pt_lock);
 			return ret;
 		}
 
-		// Give the coremap entry a new offset
-		cme_set_offset(cm_get_index(new),swapfile_reserve_index());
+		if (text != NULL && cme_get_filebacked(cm_get_index(new)))
+			textcache_insert(new, text);
 		cme_set_busy(cm_get_index(new),0);
 	}
 	else { // Page exists either in memory or in swap
@@ -130,11 +375,10 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 			if (!ret)
 				KASSERT(0);
 
-			// TODO prob and actually write to random index
-			ehi = faultaddress & TLBHI_VPAGE;
 			elo = (pa & TLBLO_PPAGE) | TLBLO_VALID;
 
 			spl = splhigh();
+			ehi = TLB_EHI(as, faultaddress);
 			tlb_random(ehi, elo);
 			cme_set_use(cm_get_index(pa), 1);
 			splx(spl);
@@ -142,9 +386,16 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		else {
 			// Page is in swap space
 			paddr_t new = alloc_one_page(curthread->t_addrspace,faultaddress);
+			if (new == INVALID_PADDR) {
+				lock_release(as->pt_lock);
+				return ENOMEM;
+			}
 			ret = swapin(as,faultaddress,new);
-
-			KASSERT(!ret);
+			if (ret) {
+				free_coremap_page(new, false /* iskern */);
+				lock_release(as->pt_lock);
+				return ret;
+			}
 			cme_set_busy(cm_get_index(new),0);
 		}
 	}
@@ -51,13 +51,10 @@
 /* Shortcuts for the size macros in kern/sfs.h */
 #define SFS_FS_BITMAPSIZE(sfs)  SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks)
 #define SFS_FS_BITBLOCKS(sfs)   SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks)
-#define JN_SUMMARY_LOCATION(sfs)    SFS_MAP_LOCATION + SFS_FS_BITBLOCKS(sfs) + 1
-
-struct bitmap *b;
 
 /* Journal prototype functions*/
 static
-void recover(struct sfs_fs *sfs);
+void recover(struct sfs_fs *sfs, uint32_t *next_bseq);
 
 static
 void print_transaction(struct record *r);
@@ -125,6 +122,29 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Write the free block bitmap if it has changed since it was last
+ * written. Called by the journal checkpointer before it drops records
+ * that changed it.
+ */
+int
+sfs_writemap(struct sfs_fs *sfs)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_bitlock);
+	if (sfs->sfs_freemapdirty) {
+		result = sfs_mapio(sfs, UIO_WRITE);
+		if (result) {
+			lock_release(sfs->sfs_bitlock);
+			return result;
+		}
+		sfs->sfs_freemapdirty = false;
+	}
+	lock_release(sfs->sfs_bitlock);
+	return 0;
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -248,6 +268,14 @@ sfs_unmount(struct fs *fs)
 		return EBUSY;
 	}
 
+	/*
+	 * Empty the journal and stop its threads. The checkpointer may be
+	 * after the bitmap lock on its way out.
+	 */
+	lock_release(sfs->sfs_bitlock);
+	sfs_jn_stop(fs);
+	lock_acquire(sfs->sfs_bitlock);
+
 	/* We should have just had sfs_sync called. */
 	KASSERT(!sfs->sfs_superdirty);
 	KASSERT(!sfs->sfs_freemapdirty);
@@ -272,6 +300,7 @@ sfs_unmount(struct fs *fs)
 	/* Destory journal objects */
 	lock_destroy(log_buf_lock);
 	lock_destroy(transaction_id_lock);
+	lock_destroy(checkpoint_lock);
 
 	/* nothing else to do */
 	return 0;
@@ -297,6 +326,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
 	struct sfs_fs *sfs;
+	uint32_t next_bseq;
 
 	/* We don't pass any options through mount */
 	(void)options;
@@ -307,6 +337,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	KASSERT(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	KASSERT(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	KASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	KASSERT(sizeof(struct record) == RECORD_SIZE);
+	KASSERT(sizeof(struct jn_block) == SFS_BLOCKSIZE);
 
 	/*
 	 * We can't mount on devices with the wrong sector size.
@@ -466,20 +498,10 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return result;
 	}
 
-	no_active_transactions = cv_create("no active transactions");
-	if (no_active_transactions == NULL)
-		goto err1;
-	checkpoint_cleared = cv_create("checkpoint cleared");
-	if (checkpoint_cleared == NULL)
-		goto err2;
-	transaction_lock = lock_create("transaction lock");
-	if (transaction_lock == NULL)
-		goto err3;
 	checkpoint_lock = lock_create("checkpoint lock");
 	if (checkpoint_lock == NULL)
-		goto err4;
+		goto err1;
 	num_active_transactions = 0;
-	in_checkpoint = 0;
 
 
 	/* the other fields */
@@ -487,7 +509,12 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	sfs->sfs_freemapdirty = false;
 
 	// Recovery
-	recover(sfs);
+	recover(sfs, &next_bseq);
+
+	// Nothing can commit before this
+	result = sfs_jn_start(&sfs->sfs_absfs, next_bseq);
+	if (result)
+		goto err2;
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
@@ -499,12 +526,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	(void)print_transaction;
 	return 0;
 
-	err4:
-	lock_destroy(transaction_lock);
-	err3:
-	cv_destroy(checkpoint_cleared);
 	err2:
-	cv_destroy(no_active_transactions);
+	lock_destroy(checkpoint_lock);
 	err1:
 	lock_release(sfs->sfs_vnlock);
 	lock_release(sfs->sfs_bitlock);
@@ -516,8 +539,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	kfree(sfs);
 	lock_destroy(log_buf_lock);
 	lock_destroy(transaction_id_lock);
-	kfree(log_buf);
-	return ENOMEM;
+	return result ? result : ENOMEM;
 }
 
 /*
@@ -534,44 +556,16 @@ sfs_mount(const char *device)
  * Journal recovery routine
  */
 static
-void first_pass(struct record *r) {
-	unsigned id = r->transaction_id;
-	if (r->transaction_type == REC_COMMIT && !bitmap_isset(b, id)) {
-		bitmap_mark(b, id);
-	}
-}
-
-static
-void recover(struct sfs_fs *sfs) {
-	// Construct bitmap
-	struct sfs_jn_summary *s = kmalloc(SFS_BLOCKSIZE);
-	if (s == NULL)
-		panic("Cannot allocate memory for journal summary");
-	if (sfs_readblock(&sfs->sfs_absfs, JN_SUMMARY_LOCATION(sfs), s, SFS_BLOCKSIZE))
-		panic("Cannot read from journal summary");
-	b = bitmap_create((unsigned)s->max_id+1);
-	if (b == NULL) {
-		panic("Cannot create bitmap");
-	}
+void recover(struct sfs_fs *sfs, uint32_t *next_bseq) {
+	sfs_recover(&sfs->sfs_absfs, next_bseq);
 	// journal_iterator(&sfs->sfs_absfs, print_transaction);
-	// First pass
-	journal_iterator(&sfs->sfs_absfs, first_pass);
-
-	// Second pass
-	fs_journal_iterator(&sfs->sfs_absfs, b, apply_record);
 
 	// Explicitly synch bitmap
-	//lock_acquire(sfs->sfs_bitlock);
-	sfs_mapio(sfs,UIO_WRITE);
-	//lock_release(sfs->sfs_bitlock);
-
-	// Set journal entries to 0
-	s->num_entries = 0;
-	s->max_id = 0;
-	sfs_writeblock(&sfs->sfs_absfs, JN_SUMMARY_LOCATION(sfs), s, SFS_BLOCKSIZE);
-
-	bitmap_destroy(b);
-	kfree(s);
+	if (sfs->sfs_freemapdirty) {
+		sfs_mapio(sfs,UIO_WRITE);
+		sfs->sfs_freemapdirty = false;
+	}
+	// sfs_jn_start empties the journal
 }
 
 static
@@ -612,5 +606,10 @@ void print_transaction(struct record *r) {
 		kprintf("\tidx: %d", r->changed.r_bitmap.index);
 		kprintf("\tsetting: %d", r->changed.r_bitmap.setting);
 	}
+	else if(r->transaction_type == REC_IMAGE){
+		kprintf("\tIMAGE");
+		kprintf("\tblock: %d", r->changed.r_image.block);
+		kprintf("\tpart: %d", r->changed.r_image.part);
+	}
 	kprintf("\n");
 }
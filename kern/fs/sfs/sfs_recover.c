@@ -0,0 +1,540 @@
+/*
+ * Added for PetrelOS
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <array.h>
+#include <bitmap.h>
+#include <vfs.h>
+#include <sfs.h>
+#include <objcache.h>
+
+/*
+ * Journal recovery.
+ *
+ * The log is read once, from the tail to its end, keeping its records
+ * and noting which transactions committed. The records of committed
+ * transactions are then redone in log order, which is the order the
+ * changes were made in: transactions need not commit in the order they
+ * touched a block, least of all the free block bitmap. They are redone
+ * against copies in memory of the blocks they change: each block is read
+ * at most once, however many records touch it, and the changed ones are
+ * written in block order at the end. Mount time goes with the number of
+ * blocks touched rather than the number of records.
+ *
+ * Records and block images (see sfs_jn_mode) are redone alike. Once a
+ * block is freed nothing more is written to it, until it is allocated
+ * again: it may since have been used for file data, which the journal
+ * doesn't cover. That holds for blocks written out early, to bound the
+ * memory used, too: a block that a later record frees is held back.
+ *
+ * There is one disk, so this is all done by the mounting thread.
+ */
+
+/* A transaction found in the log */
+struct rtxn {
+	uint32_t id;
+	bool committed;
+};
+
+/* A block being redone */
+struct rblock {
+	daddr_t block;
+	bool dirty;
+	struct rblock *next;		/* hash chain */
+	char data[SFS_BLOCKSIZE];
+};
+
+#define RB_HASHSIZE 64
+#define RB_MAX 256		/* blocks held before writing them out early */
+#define RB_PER_RECORD 5		/* most blocks one record can touch */
+
+struct recovery {
+	struct fs *fs;
+	struct array *txns;		/* by first record in the log */
+	struct array *recs;		/* records, in log order */
+	struct array *owners;		/* the rtxn of each */
+	struct rblock *hash[RB_HASHSIZE];
+	unsigned nblocks;
+	unsigned limit;			/* nblocks to write out early at */
+	struct bitmap *freed;		/* blocks freed by the log so far */
+	struct bitmap *later;		/* blocks freed further on */
+};
+
+static
+void read_summary(struct fs *fs, struct sfs_jn_summary *s) {
+	struct sfs_jn_summary *tmp = kmalloc(SFS_BLOCKSIZE);
+
+	if (tmp == NULL)
+		panic("Cannot allocate memory for journal summary");
+	if (sfs_readblock(fs, JN_SUMMARY_LOCATION(fs), tmp, SFS_BLOCKSIZE))
+		panic("Cannot from journal summary");
+	*s = *tmp;
+	kfree(tmp);
+}
+
+/*
+ * Read block K of the log, counting from the tail, into JB, and return
+ * how many records at the start of it belong to the log. Past a record
+ * that fails its checksum nothing does: it was torn, never written, or
+ * is left from an earlier time round. *MORE is set if the log goes on
+ * into the next block.
+ */
+static
+unsigned read_log_block(struct fs *fs, const struct sfs_jn_summary *s,
+		unsigned k, struct jn_block *jb, bool *more) {
+	uint32_t bseq = s->jn_seq + k;
+	unsigned j, nrec;
+	bool whole;
+
+	*more = false;
+	if (k >= JN_BLOCKS)
+		return 0;
+	if (sfs_readblock(fs, JN_LOCATION(fs) + bseq % JN_BLOCKS, jb,
+			SFS_BLOCKSIZE))
+		panic("Cannot read journal block");
+
+	whole = jb->jb_seq == bseq && jb->jb_sum == jn_block_checksum(jb) &&
+		jb->jb_nrec <= (unsigned)REC_PER_BLK;
+	nrec = whole ? jb->jb_nrec : (unsigned)REC_PER_BLK;
+	for (j = 0; j < nrec; j++) {
+		if (jb->jb_rec[j].transaction_type > REC_IMAGE ||
+		    jb->jb_rec[j].checksum != record_checksum(&jb->jb_rec[j], bseq))
+			break;
+	}
+	*more = whole && j == (unsigned)REC_PER_BLK;
+	return j;
+}
+
+void journal_iterator(struct fs *fs, void (*f)(struct record *)) {
+	struct sfs_jn_summary s;
+	struct jn_block *jb = kmalloc(SFS_BLOCKSIZE);
+	unsigned j, k, n;
+	bool more;
+
+	if (jb == NULL)
+		panic("Cannot allocate memory for journal block");
+
+	read_summary(fs, &s);
+	for (k = 0, more = true; more; k++) {
+		n = read_log_block(fs, &s, k, jb, &more);
+		for (j = k == 0 ? s.jn_tail : 0; j < n; j++) {
+			(*f)(&jb->jb_rec[j]);
+		}
+	}
+	kfree(jb);
+}
+
+////////////////////////////////////////////////////////////
+// Sorting the log
+
+static
+void add_record(struct recovery *rc, const struct record *r) {
+	struct rtxn *tx = NULL;
+	struct record *copy;
+	unsigned i;
+
+	// The transaction is most likely one of the last few seen
+	for (i = array_num(rc->txns); i > 0; i--) {
+		tx = array_get(rc->txns, i - 1);
+		if (tx->id == r->transaction_id)
+			break;
+	}
+	if (i == 0) {
+		tx = kmalloc(sizeof(struct rtxn));
+		if (tx == NULL)
+			panic("Cannot allocate memory for recovery");
+		tx->id = r->transaction_id;
+		tx->committed = false;
+		if (array_add(rc->txns, tx, NULL))
+			panic("Cannot allocate memory for recovery");
+	}
+
+	if (r->transaction_type == REC_COMMIT) {
+		tx->committed = true;
+		return;
+	}
+	copy = objcache_alloc(&record_cache);
+	if (copy == NULL)
+		panic("Cannot allocate memory for recovery");
+	*copy = *r;
+	if (array_add(rc->recs, copy, NULL) ||
+	    array_add(rc->owners, tx, NULL))
+		panic("Cannot allocate memory for recovery");
+}
+
+static
+void free_txns(struct recovery *rc) {
+	unsigned i;
+
+	for (i = 0; i < array_num(rc->recs); i++) {
+		objcache_free(&record_cache, array_get(rc->recs, i));
+	}
+	array_setsize(rc->recs, 0);
+	array_destroy(rc->recs);
+	array_setsize(rc->owners, 0);
+	array_destroy(rc->owners);
+	for (i = 0; i < array_num(rc->txns); i++) {
+		kfree(array_get(rc->txns, i));
+	}
+	array_setsize(rc->txns, 0);
+	array_destroy(rc->txns);
+}
+
+////////////////////////////////////////////////////////////
+// Blocks being redone
+
+static
+struct rblock *rb_get(struct recovery *rc, daddr_t block) {
+	struct rblock *rb;
+	unsigned h = block % RB_HASHSIZE;
+
+	for (rb = rc->hash[h]; rb != NULL; rb = rb->next) {
+		if (rb->block == block)
+			return rb;
+	}
+
+	rb = kmalloc(sizeof(struct rblock));
+	if (rb == NULL)
+		panic("Cannot allocate memory for recovery");
+	if (sfs_readblock(rc->fs, block, rb->data, SFS_BLOCKSIZE))
+		panic("Cannot read block %u for recovery", block);
+	rb->block = block;
+	rb->dirty = false;
+	rb->next = rc->hash[h];
+	rc->hash[h] = rb;
+	rc->nblocks++;
+	return rb;
+}
+
+/* Forget BLOCK, changed or not */
+static
+void rb_drop(struct recovery *rc, daddr_t block) {
+	struct rblock **rbp, *rb;
+
+	for (rbp = &rc->hash[block % RB_HASHSIZE]; *rbp != NULL;
+	     rbp = &(*rbp)->next) {
+		rb = *rbp;
+		if (rb->block == block) {
+			*rbp = rb->next;
+			kfree(rb);
+			rc->nblocks--;
+			return;
+		}
+	}
+}
+
+/*
+ * Note in rc->later the blocks that committed records from FROM on free.
+ */
+static
+void rb_later(struct recovery *rc, unsigned from) {
+	struct sfs_fs *sfs = rc->fs->fs_data;
+	const struct record *r;
+	struct rtxn *tx;
+	unsigned i;
+
+	bzero(bitmap_getdata(rc->later),
+	      SFS_BITMAPSIZE(sfs->sfs_super.sp_nblocks) / CHAR_BIT);
+	for (i = from; i < array_num(rc->recs); i++) {
+		tx = array_get(rc->owners, i);
+		r = array_get(rc->recs, i);
+		if (tx->committed && r->transaction_type == REC_BITMAP &&
+		    !r->changed.r_bitmap.setting &&
+		    !bitmap_isset(rc->later, r->changed.r_bitmap.index))
+			bitmap_mark(rc->later, r->changed.r_bitmap.index);
+	}
+}
+
+/* Changed, but to be freed further on: must not be written yet */
+static
+bool rb_held(struct recovery *rc, struct rblock *rb) {
+	return rb->dirty && bitmap_isset(rc->later, rb->block);
+}
+
+/*
+ * Write out every changed block, in block order, and drop them all,
+ * except those that records from FROM on free: what a later free undoes
+ * must not reach the disk, as the block may hold file data by now. With
+ * FROM past the last record, everything goes.
+ */
+static
+void rb_flush(struct recovery *rc, unsigned from) {
+	struct rblock **dirty, **rbp, *rb;
+	unsigned h, i, j, n = 0;
+
+	if (rc->nblocks == 0)
+		return;
+	dirty = kmalloc(rc->nblocks * sizeof(struct rblock *));
+	if (dirty == NULL)
+		panic("Cannot allocate memory for recovery");
+	rb_later(rc, from);
+
+	// Insertion sort; there are about RB_MAX of them
+	for (h = 0; h < RB_HASHSIZE; h++) {
+		for (rb = rc->hash[h]; rb != NULL; rb = rb->next) {
+			if (!rb->dirty || rb_held(rc, rb))
+				continue;
+			for (i = n; i > 0 && dirty[i - 1]->block > rb->block; i--) {
+				dirty[i] = dirty[i - 1];
+			}
+			dirty[i] = rb;
+			n++;
+		}
+	}
+	for (j = 0; j < n; j++) {
+		if (sfs_writeblock(rc->fs, dirty[j]->block, dirty[j]->data,
+				SFS_BLOCKSIZE))
+			panic("Cannot write block %u for recovery", dirty[j]->block);
+	}
+	kfree(dirty);
+
+	for (h = 0; h < RB_HASHSIZE; h++) {
+		rbp = &rc->hash[h];
+		while ((rb = *rbp) != NULL) {
+			if (rb_held(rc, rb)) {
+				rbp = &rb->next;
+				continue;
+			}
+			*rbp = rb->next;
+			kfree(rb);
+			rc->nblocks--;
+		}
+	}
+	// Those held back don't count towards the next time
+	rc->limit = rc->nblocks + RB_MAX;
+}
+
+static
+struct sfs_inode *rb_inode(struct recovery *rc, uint32_t ino) {
+	return (struct sfs_inode *)rb_get(rc, ino)->data;
+}
+
+/*
+ * Disk block of block FILEBLOCK of the file with inode INODEPTR, which
+ * must exist, reading indirect blocks through the cache.
+ */
+static
+uint32_t rb_bmap(struct recovery *rc, struct sfs_inode *inodeptr,
+		uint32_t fileblock) {
+	uint32_t *iddata;
+	uint32_t next_block, idoff = 0;
+	int indir, i;
+
+	if (fileblock >= SFS_NDIRECT + SFS_DBPERIDB + SFS_DBPERIDB*SFS_DBPERIDB +
+			SFS_DBPERIDB*SFS_DBPERIDB*SFS_DBPERIDB)
+		panic("Recovery: file block %u out of range", fileblock);
+
+	if (fileblock < SFS_NDIRECT) {
+		return inodeptr->sfi_direct[fileblock];
+	}
+	fileblock -= SFS_NDIRECT;
+
+	if (fileblock >= SFS_DBPERIDB + SFS_DBPERIDB*SFS_DBPERIDB) {
+		indir = 3;
+		fileblock -= SFS_DBPERIDB + SFS_DBPERIDB*SFS_DBPERIDB;
+		next_block = inodeptr->sfi_tindirect;
+	}
+	else if (fileblock >= SFS_DBPERIDB) {
+		indir = 2;
+		fileblock -= SFS_DBPERIDB;
+		next_block = inodeptr->sfi_dindirect;
+	}
+	else {
+		indir = 1;
+		next_block = inodeptr->sfi_indirect;
+	}
+
+	for (i = indir; i > 0; i--) {
+		KASSERT(next_block != 0);
+		iddata = (uint32_t *)rb_get(rc, next_block)->data;
+		if (i == 3) {
+			idoff = fileblock / (SFS_DBPERIDB*SFS_DBPERIDB);
+			fileblock -= idoff * (SFS_DBPERIDB*SFS_DBPERIDB);
+		}
+		if (i == 2) {
+			idoff = fileblock / SFS_DBPERIDB;
+			fileblock -= idoff * SFS_DBPERIDB;
+		}
+		if (i == 1) {
+			idoff = fileblock;
+		}
+		next_block = iddata[idoff];
+	}
+	return next_block;
+}
+
+////////////////////////////////////////////////////////////
+// Redo
+
+/*
+ * The block to change for a record, or NULL if the block is free as of
+ * this point in the log: a block freed and then used for file data is
+ * not logged again, so nothing from before it was freed may be written
+ * to it.
+ */
+static
+struct rblock *rb_modify(struct recovery *rc, daddr_t block) {
+	struct rblock *rb;
+
+	if (bitmap_isset(rc->freed, block))
+		return NULL;
+	rb = rb_get(rc, block);
+	rb->dirty = true;
+	return rb;
+}
+
+// Apply a recorded change
+static
+void redo_record(struct recovery *rc, const struct record *r) {
+	struct sfs_fs *sfs = rc->fs->fs_data;
+	struct sfs_inode *inodeptr;
+	struct sfs_dir sd;
+	struct rblock *rb;
+	uint32_t *indir = NULL;
+	uint32_t index, target, fileblock, fileoff;
+	off_t actual_pos;
+
+	switch (r->transaction_type) {
+	    case REC_INODE:
+		inodeptr = rb_inode(rc, r->changed.r_inode.inode_num);
+		target = r->changed.r_inode.inode_num;
+		// Find level of indirection
+		if (r->changed.r_inode.id_lvl == 0)
+			indir = &inodeptr->sfi_direct[r->changed.r_inode.offset];
+		if (r->changed.r_inode.id_lvl == 1)
+			indir = &inodeptr->sfi_indirect;
+		if (r->changed.r_inode.id_lvl == 2)
+			indir = &inodeptr->sfi_dindirect;
+		if (r->changed.r_inode.id_lvl == 3)
+			indir = &inodeptr->sfi_tindirect;
+		KASSERT(indir != NULL);
+
+		// Changed contents of indirect block, not the inode
+		if (r->changed.r_inode.id_lvl > 0 && !r->changed.r_inode.set) {
+			target = *indir;
+			indir = &((uint32_t *)rb_get(rc, target)->data)
+				[r->changed.r_inode.offset];
+		}
+		if (rb_modify(rc, target) != NULL)
+			*indir = r->changed.r_inode.blockno;
+		break;
+
+	    case REC_ILINK:
+		rb = rb_modify(rc, r->changed.r_ilink.inode_num);
+		if (rb != NULL)
+			((struct sfs_inode *)rb->data)->sfi_linkcount =
+				r->changed.r_ilink.linkcount;
+		break;
+
+	    case REC_ISIZE:
+		rb = rb_modify(rc, r->changed.r_isize.inode_num);
+		if (rb != NULL)
+			((struct sfs_inode *)rb->data)->sfi_size =
+				r->changed.r_isize.size;
+		break;
+
+	    case REC_ITYPE:
+		rb = rb_modify(rc, r->changed.r_itype.inode_num);
+		if (rb != NULL)
+			((struct sfs_inode *)rb->data)->sfi_type =
+				r->changed.r_itype.type;
+		break;
+
+	    case REC_BITMAP:
+		index = r->changed.r_bitmap.index;
+		if (r->changed.r_bitmap.setting) {
+			if (!bitmap_isset(sfs->sfs_freemap, index))
+				bitmap_mark(sfs->sfs_freemap, index);
+			if (bitmap_isset(rc->freed, index))
+				bitmap_unmark(rc->freed, index);
+		}
+		else {
+			if (bitmap_isset(sfs->sfs_freemap, index))
+				bitmap_unmark(sfs->sfs_freemap, index);
+			// What was written to it earlier in the log no longer
+			// matters; a later allocation takes it back
+			if (!bitmap_isset(rc->freed, index))
+				bitmap_mark(rc->freed, index);
+			rb_drop(rc, index);
+		}
+		sfs->sfs_freemapdirty = true;
+		break;
+
+	    case REC_DIR:
+		sd.sfd_ino = r->changed.r_directory.inode;
+		bzero(sd.sfd_name, SFS_NAMELEN);
+		strcpy(sd.sfd_name, r->changed.r_directory.sfd_name);
+
+		inodeptr = rb_inode(rc, r->changed.r_directory.parent_inode);
+		actual_pos = sizeof(struct sfs_dir) * r->changed.r_directory.slot;
+		fileblock = actual_pos / SFS_BLOCKSIZE;
+		fileoff = actual_pos % SFS_BLOCKSIZE;
+
+		rb = rb_modify(rc, rb_bmap(rc, inodeptr, fileblock));
+		if (rb != NULL)
+			memcpy(&rb->data[fileoff], &sd, sizeof(struct sfs_dir));
+		break;
+
+	    case REC_IMAGE:
+		KASSERT(r->changed.r_image.part < IMAGE_PARTS);
+		rb = rb_modify(rc, r->changed.r_image.block);
+		if (rb != NULL)
+			memcpy(&rb->data[r->changed.r_image.part * IMAGE_CHUNK],
+				r->changed.r_image.data, IMAGE_CHUNK);
+		break;
+
+	    default:
+		panic("Invalid record");
+	}
+}
+
+void sfs_recover(struct fs *fs, uint32_t *next_bseq) {
+	struct recovery rc;
+	struct sfs_jn_summary s;
+	struct jn_block *jb;
+	struct sfs_fs *sfs = fs->fs_data;
+	struct rtxn *tx;
+	unsigned i, j, k, n;
+	bool more;
+
+	rc.fs = fs;
+	rc.txns = array_create();
+	rc.recs = array_create();
+	rc.owners = array_create();
+	rc.freed = bitmap_create(SFS_BITMAPSIZE(sfs->sfs_super.sp_nblocks));
+	rc.later = bitmap_create(SFS_BITMAPSIZE(sfs->sfs_super.sp_nblocks));
+	jb = kmalloc(SFS_BLOCKSIZE);
+	if (rc.txns == NULL || rc.recs == NULL || rc.owners == NULL ||
+	    rc.freed == NULL || rc.later == NULL || jb == NULL)
+		panic("Cannot allocate memory for recovery");
+	bzero(rc.hash, sizeof(rc.hash));
+	rc.nblocks = 0;
+	rc.limit = RB_MAX;
+
+	read_summary(fs, &s);
+	for (k = 0, more = true; more; k++) {
+		n = read_log_block(fs, &s, k, jb, &more);
+		for (j = k == 0 ? s.jn_tail : 0; j < n; j++) {
+			add_record(&rc, &jb->jb_rec[j]);
+		}
+	}
+	kfree(jb);
+	// Past every block read, good or not
+	*next_bseq = s.jn_seq + k;
+
+	for (i = 0; i < array_num(rc.recs); i++) {
+		tx = array_get(rc.owners, i);
+		if (!tx->committed)
+			continue;
+		// Never while a record holds blocks
+		if (rc.nblocks + RB_PER_RECORD > rc.limit)
+			rb_flush(&rc, i);
+		redo_record(&rc, array_get(rc.recs, i));
+	}
+	rb_flush(&rc, array_num(rc.recs));
+	free_txns(&rc);
+	bitmap_destroy(rc.freed);
+	bitmap_destroy(rc.later);
+}
@@ -47,7 +47,9 @@
 #include <device.h>
 #include <sfs.h>
 #include <current.h>
+#include <thread.h>
 #include <vm.h>
+#include <objcache.h>
 
 /*
  * Locking protocol for sfs:
@@ -73,6 +75,13 @@
  *
  *    Ordering among directory locks:
  *       Parent first, then child.
+ *
+ *    Starting a transaction (create_transaction) may wait for journal
+ *    space, which only commits make, so operations start theirs before
+ *    reserving buffers or taking any of the above, and never inside
+ *    another. For the same reason the last reference to a file that has
+ *    just lost its last link, which reclaim erases, is dropped with
+ *    nothing held.
  */
 
 /* Slot in a directory that ".." is expected to appear in */
@@ -85,17 +94,87 @@ int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 /* needed by reclaim */
 static
-int sfs_dotruncate(struct vnode *v, off_t len, struct transaction *t);
+int sfs_dotruncate(struct vnode *v, off_t len, struct transaction *t,
+		   bool *more);
 
 /* Journaling functions -- bottom of file */
 int next_transaction_id = 0;
 int log_buf_offset = 0;
+int sfs_jn_mode = SFS_JN_RECORDS;
+
+/*
+ * Group commit state, all under log_buf_lock. Records are appended to
+ * log_buf; the log writer swaps it for the other staging buffer and
+ * writes the full one out while appends carry on. Sequence numbers count
+ * records ever appended, so a commit waits for log_flushed_seq to reach
+ * the number of its commit record.
+ */
+static struct record log_bufs[2][BUF_RECORDS];
+static struct record *log_buf = log_bufs[0];
+static unsigned log_seq;		/* records appended */
+static unsigned log_flushed_seq;	/* records known to be on disk */
+static int log_waiters;			/* commits sleeping on log_flushed */
+static bool log_flushing;		/* writer has a batch in flight */
+static bool log_writer_exit;		/* unmount wants the writer gone */
+static struct cv *log_work;		/* writer sleeps here */
+static struct cv *log_flushed;		/* batch done, or buffer freed */
+static struct fs *log_fs;
+static int jn_mode;			/* sfs_jn_mode at mount */
+static struct sfs_jn_stats jn_stats;	/* writer and checkpoint_lock */
+
+/*
+ * Checkpoint state, under checkpoint_lock. jn_live holds the transactions
+ * whose records may still be needed, in the order of their first records:
+ * open ones, and committed ones whose buffers may not be on disk yet. The
+ * log tail is the first record of the first of them.
+ */
+static struct array *jn_live;
+static unsigned jn_tail_seq;		/* oldest record still needed */
+static int jn_reserved;			/* records reserved by open ones */
+static int jn_space_waiters;		/* create_transaction()s waiting */
+static bool checkpoint_exit;		/* unmount wants the checkpointer gone */
+static struct cv *jn_work;		/* checkpointer sleeps here */
+static struct cv *jn_space;		/* tail moved, or reservation freed */
+
+/*
+ * Only the log writer touches these. The head block is kept in memory
+ * and rewritten whole as records are added, so the log is written
+ * without ever being read; the summary is written from memory too.
+ */
+static unsigned jn_written_seq;		/* records in the on-disk journal */
+static struct jn_block jn_head_block;	/* where the next record goes */
+static unsigned jn_head_bseq;		/* and its block number */
+static unsigned jn_disk_tail_bseq;	/* block of the tail on disk */
+static union {
+	struct sfs_jn_summary s;
+	char block[SFS_BLOCKSIZE];
+} jn_summary;
+
+/* The checkpointer starts when the log is half full, and rests at a quarter */
+#define JN_CHECKPOINT_START (MAX_JN_ENTRIES / 2)
+#define JN_CHECKPOINT_STOP (MAX_JN_ENTRIES / 4)
+
+/*
+ * Records the log can hold at once, wherever in its block the tail is.
+ */
+#define JN_ROOM (MAX_JN_ENTRIES - REC_PER_BLK)
 
-#define REC_PER_BLK (int) (SFS_BLOCKSIZE / (RECORD_SIZE))
-#define BITBLOCKS(fs) SFS_BITBLOCKS(((struct sfs_fs*)fs->fs_data)->sfs_super.sp_nblocks)
-#define JN_SUMMARY_LOCATION(fs) SFS_MAP_LOCATION + BITBLOCKS(fs) + 1
-#define JN_LOCATION(fs) SFS_MAP_LOCATION + BITBLOCKS(fs) + 1 + 1
-#define MAX_JN_ENTRIES (SFS_JN_SIZE-1) * REC_PER_BLK
+/*
+ * Most records one transaction may log, commit record and block images
+ * included. Each reserves this much when it starts, and create_transaction
+ * waits until the log can take it on top of what every open transaction
+ * may still log; so the log writer never waits for the checkpointer, and
+ * whatever pins the tail can always commit.
+ *
+ * Block allocations are refused with ENOSPC once a transaction is within
+ * JN_ALLOC_SLACK of it, which leaves room for the records that go with an
+ * allocation, the blocks it may pin, and the commit; sfs_write then goes
+ * on in a new transaction. A truncate stops at twice that and goes on in
+ * a new one too, so that rmdir and rename have room left after theirs.
+ */
+#define JN_TXN_RESERVE (JN_ROOM / 8)
+#define JN_ALLOC_SLACK (4 * IMAGE_PARTS + 16)
+#define JN_TRUNC_SLACK (2 * JN_ALLOC_SLACK)
 
 static
 struct transaction *
@@ -105,10 +184,10 @@ static
 int hold_buffer_cache(struct transaction *t, struct buf *buf);
 
 static
-int record(struct record *r, struct fs *fs);
+int record(struct record *r, struct fs *fs, struct transaction *t);
 
 static
-int commit(struct transaction *t, struct fs *fs, int do_checkpoint);
+int commit(struct transaction *t, struct fs *fs);
 
 static
 void abort(struct transaction *t);
@@ -117,10 +196,20 @@ static
 int check_and_record(struct record *r, struct transaction *t, struct fs *fs);
 
 static
-int checkpoint(struct fs *fs);
+unsigned txn_size(struct transaction *t);
 
 static
-void flush_log_buf(struct fs *fs);
+int log_used(void);
+
+static
+void log_force(void);
+
+static
+void log_images(struct transaction *t, struct fs *fs);
+
+static
+void write_log(struct fs *fs, struct record *batch, int n);
+
 
 ////////////////////////////////////////////////////////////
 //
@@ -201,6 +290,10 @@ sfs_clearblock(struct sfs_fs *sfs, uint32_t block, struct buf **bufret)
  *
  * Allocates 1 buffer (via sfs_clearblock) if bufret != NULL.
  * Uses 1 regardless.
+ *
+ * The record is made after sfs_bitlock is dropped: record() can wait
+ * for the journal, and the checkpointer takes sfs_bitlock to write the
+ * freemap back before it makes room there.
  */
 static
 int
@@ -209,20 +302,24 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock, struct buf **bufret, struct
 	int result;
 
 	lock_acquire(sfs->sfs_bitlock);
-
 	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_bitlock);
 		return result;
 	}
-	struct record *r = makerec_bitmap((uint32_t)*diskblock,1);
-	int log_ret = check_and_record(r,t,&sfs->sfs_absfs);
-	if (log_ret)
-		panic("log failed");
-
 	sfs->sfs_freemapdirty = true;
-
 	lock_release(sfs->sfs_bitlock);
-	
+
+	struct record *r = makerec_bitmap((uint32_t)*diskblock,1);
+	result = check_and_record(r,t,&sfs->sfs_absfs);
+	if (result) {
+		/* The transaction is as big as it may get (ENOSPC) */
+		lock_acquire(sfs->sfs_bitlock);
+		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		lock_release(sfs->sfs_bitlock);
+		return result;
+	}
+
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
 	}
@@ -234,19 +331,50 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock, struct buf **bufret, struct
 
 /*
  * Free a block.
+ *
+ * The block stays marked in use until T commits (sfs_bfree_commit).
+ * Until then a crash leaves it in use by whatever held it before, so it
+ * may be neither handed out again nor written to disk as free by the
+ * checkpointer. Since nothing else can touch the bit before then, the
+ * record is made without sfs_bitlock, as in sfs_balloc.
  */
 static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock, struct transaction *t)
 {
 	lock_acquire(sfs->sfs_bitlock);
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
+	KASSERT(bitmap_isset(sfs->sfs_freemap, diskblock));
+	lock_release(sfs->sfs_bitlock);
 
 	struct record *r = makerec_bitmap(diskblock,0);
 	check_and_record(r,t,&sfs->sfs_absfs);
 
+	if (array_add(t->freed, (void *)(uintptr_t)diskblock, NULL)) {
+		panic("sfs: bfree: out of memory\n");
+	}
+}
+
+/*
+ * Really free the blocks T freed, now that its commit record is on disk.
+ */
+static
+void
+sfs_bfree_commit(struct sfs_fs *sfs, struct transaction *t)
+{
+	unsigned i, num;
+
+	num = array_num(t->freed);
+	if (num == 0) {
+		return;
+	}
+	lock_acquire(sfs->sfs_bitlock);
+	for (i=0; i<num; i++) {
+		bitmap_unmark(sfs->sfs_freemap,
+			      (uint32_t)(uintptr_t)array_get(t->freed, i));
+	}
 	sfs->sfs_freemapdirty = true;
 	lock_release(sfs->sfs_bitlock);
+	array_setsize(t->freed, 0);
 }
 
 /*
@@ -601,6 +729,10 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
 		buffer_mark_dirty(iobuffer);
+		// Directory blocks are metadata: pinned until commit, like inodes
+		if (sv->sv_type == SFS_TYPE_DIR) {
+			hold_buffer_cache(t, iobuffer);
+		}
 	}
 
 	buffer_release(iobuffer);
@@ -1332,11 +1464,30 @@ sfs_close(struct vnode *v)
 	return 0;
 }
 
+/*
+ * Reclaim a vnode for an inode with no links left, on behalf of code
+ * that was inside another SFS operation when it let go of it.
+ */
+static
+void
+sfs_reclaim_thread(void *vn, unsigned long unused)
+{
+	(void)unused;
+	VOP_DECREF((struct vnode *)vn);
+}
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
  * This function should try to avoid returning errors other than EBUSY.
  *
+ * If the inode has no links left it is erased, in as many transactions
+ * as that takes. Starting one may wait for room in the journal, which
+ * is only safe holding nothing an open transaction may need. So that is
+ * done with our own locks dropped; and if we were reached from inside
+ * another SFS operation, which may hold others, it is handed to a thread
+ * of its own along with the reference.
+ *
  * Locking: gets/releases vnode lock. Gets/releases sfs_vnlock, and 
  *    possibly also sfs_bitlock, while holding the vnode lock
  *    
@@ -1350,10 +1501,12 @@ sfs_reclaim(struct vnode *v)
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_inode *iptr;
+	struct transaction *t = NULL;
 	unsigned ix, i, num;
-	bool buffers_needed;
+	bool buffers_needed, more;
 	int result;
 
+ again:
 	lock_acquire(sv->sv_lock);
 	lock_acquire(sfs->sfs_vnlock);
 
@@ -1372,6 +1525,9 @@ sfs_reclaim(struct vnode *v)
 		lock_release(v->vn_countlock);
 		lock_release(sfs->sfs_vnlock);
 		lock_release(sv->sv_lock);
+		if (t != NULL) {
+			abort(t);
+		}
 		return EBUSY;
 	}
 	lock_release(v->vn_countlock);
@@ -1397,16 +1553,34 @@ sfs_reclaim(struct vnode *v)
 		if (buffers_needed) {
 			unreserve_buffers(4, SFS_BLOCKSIZE);
 		}
+		if (t != NULL) {
+			abort(t);
+		}
 		return result;
 	}
 	iptr = buffer_map(sv->sv_buf);
 
-	// ENTRYPOINT
-	struct transaction *t = create_transaction();
-
 	/* If there are no on-disk references to the file either, erase it. */
+	if (iptr->sfi_linkcount==0 && t == NULL) {
+		sfs_release_inode(sv);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		if (buffers_needed) {
+			unreserve_buffers(4, SFS_BLOCKSIZE);
+		}
+		else if (thread_fork("sfs reclaim", sfs_reclaim_thread, v, 0,
+				       NULL) == 0) {
+			/* It has our reference now */
+			return EBUSY;
+		}
+		/* (or, if there was no thread to be had, here after all) */
+		// ENTRYPOINT
+		t = create_transaction();
+		goto again;
+	}
+
 	if (iptr->sfi_linkcount==0) {
-		result = sfs_dotruncate(&sv->sv_v, 0, t);
+		result = sfs_dotruncate(&sv->sv_v, 0, t, &more);
 		if (result) {
 			sfs_release_inode(sv);
 			lock_release(sfs->sfs_vnlock);
@@ -1417,6 +1591,18 @@ sfs_reclaim(struct vnode *v)
 			abort(t);
 			return result;
 		}
+		if (more) {
+			/* Commit this much and go on in a new one */
+			sfs_release_inode(sv);
+			lock_release(sfs->sfs_vnlock);
+			lock_release(sv->sv_lock);
+			if (buffers_needed) {
+				unreserve_buffers(4, SFS_BLOCKSIZE);
+			}
+			commit(t, v->vn_fs);
+			t = create_transaction();
+			goto again;
+		}
 		sfs_release_inode(sv);
 		/* Discard the inode */
 		buffer_drop(&sfs->sfs_absfs, sv->sv_ino, SFS_BLOCKSIZE);
@@ -1446,7 +1632,9 @@ sfs_reclaim(struct vnode *v)
 	}
 	vnodearray_remove(sfs->sfs_vnodes, ix);
 
-	commit(t, v->vn_fs, 0);
+	if (t != NULL) {
+		commit(t, v->vn_fs);
+	}
 
 	VOP_CLEANUP(&sv->sv_v);
 
@@ -1489,6 +1677,10 @@ sfs_read(struct vnode *v, struct uio *uio)
 /*
  * Called for write(). sfs_io() does the work.
  *
+ * A big write is done in as many transactions as it takes: when one
+ * runs out of room (JN_TXN_RESERVE) sfs_io stops short with ENOSPC,
+ * and what it did is committed before going on in the next.
+ *
  * Locking: gets/releases vnode lock.
  * 
  * Requires up to 3 buffers.
@@ -1498,22 +1690,29 @@ int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct transaction *t;
+	size_t resid;
+	bool more;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	// ENTRYPOINT: Create transaction
-	struct transaction *t = create_transaction();
+	do {
+		// ENTRYPOINT: Create transaction
+		t = create_transaction();
 
-	lock_acquire(sv->sv_lock);
-	reserve_buffers(3, SFS_BLOCKSIZE);
+		lock_acquire(sv->sv_lock);
+		reserve_buffers(3, SFS_BLOCKSIZE);
 
-	result = sfs_io(sv, uio, t);
+		resid = uio->uio_resid;
+		result = sfs_io(sv, uio, t);
+		more = result == ENOSPC && t->full && uio->uio_resid < resid;
 
-	commit(t, v->vn_fs, 1);
+		commit(t, v->vn_fs);
 
-	unreserve_buffers(3, SFS_BLOCKSIZE);
-	lock_release(sv->sv_lock);
+		unreserve_buffers(3, SFS_BLOCKSIZE);
+		lock_release(sv->sv_lock);
+	} while (more);
 
 	return result;
 }
@@ -1730,44 +1929,166 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Mapped pages are read in and written back with
+ * sfs_read and sfs_write, so they go through the buffer cache and the
+ * journal like any other file I/O; there is nothing to set up.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
+}
+
+/*
+ * Where a truncate has got to as it works down from the end of the file.
+ */
+struct sfs_trunc {
+	struct sfs_vnode *st_sv;
+	struct transaction *st_t;
+	uint32_t st_blocklen;		/* first file block to go */
+	uint32_t st_freedto;		/* all from this block on is gone */
+	bool st_stopped;		/* the transaction is out of room */
+	int st_result;			/* error reading an indirect block */
+};
+
+/*
+ * Whether the truncate may free one more block in its transaction. It
+ * stops once that is within JN_TRUNC_SLACK of its reservation.
+ */
+static
+bool
+sfs_trunc_room(struct sfs_trunc *st)
+{
+	if (txn_size(st->st_t) + JN_TRUNC_SLACK > JN_TXN_RESERVE) {
+		st->st_stopped = true;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Free the blocks past the truncate point under indirect block BLOCK,
+ * which is DEPTH levels above the data (1 for an indirect block, 2 for
+ * a double and 3 for a triple indirect block) and maps the file from
+ * block BASE on. TOPLEVEL is DEPTH if the inode points to BLOCK, else
+ * 0: only changes to those can be logged as records. Sets *EMPTY if
+ * BLOCK maps nothing any more, for the caller to free it.
+ *
+ * Requires up to DEPTH buffers.
+ */
+static
+void
+sfs_trunc_indirect(struct sfs_trunc *st, uint32_t block, int depth,
+		   int toplevel, uint32_t base, bool *empty)
+{
+	struct sfs_vnode *sv = st->st_sv;
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t span, childbase;
+	bool childempty, modified = false;
+	struct record *r;
+	int i, result;
+
+	*empty = false;
+
+	result = buffer_read(sv->sv_v.vn_fs, block, SFS_BLOCKSIZE, &idbuf);
+	/* if there's an error, guess we just lose all the blocks it maps */
+	if (result) {
+		kprintf("sfs_dotruncate: error reading indirect block %u: %s\n",
+			block, strerror(result));
+		st->st_result = result;
+		return;
+	}
+	iddata = buffer_map(idbuf);
+
+	/* How many file blocks each entry maps */
+	span = 1;
+	for (i = 1; i < depth; i++) {
+		span *= SFS_DBPERIDB;
+	}
+
+	for (i = SFS_DBPERIDB - 1; i >= 0 && !st->st_stopped; i--) {
+		childbase = base + i * span;
+		if (childbase + span <= st->st_blocklen) {
+			/* This entry and the ones before it are all kept */
+			break;
+		}
+		if (iddata[i] == 0) {
+			continue;
+		}
+		if (depth > 1) {
+			sfs_trunc_indirect(st, iddata[i], depth - 1, 0,
+					   childbase, &childempty);
+			if (!childempty) {
+				continue;
+			}
+		}
+		if (!sfs_trunc_room(st)) {
+			break;
+		}
+
+		sfs_bfree(sfs, iddata[i], st->st_t);
+		iddata[i] = 0;
+		if (!modified) {
+			hold_buffer_cache(st->st_t, idbuf);
+			modified = true;
+		}
+		if (toplevel) {
+			r = makerec_inode(sv->sv_ino, toplevel, 0, i, 0);
+			int log_ret = check_and_record(r, st->st_t,
+						       &sfs->sfs_absfs);
+			if (log_ret)
+				panic("log failed");
+		}
+		st->st_freedto = childbase;
+	}
+
+	if (modified) {
+		buffer_mark_dirty(idbuf);
+	}
+	*empty = true;
+	for (i = 0; i < SFS_DBPERIDB; i++) {
+		if (iddata[i] != 0) {
+			*empty = false;
+			break;
+		}
+	}
+	buffer_release(idbuf);
 }
 
 /*
  * Do the work of truncating a file (or directory)
  *
+ * Works down from the end of the file. If T runs out of room first it
+ * stops, cuts the file back to what is left and sets *MORE; the caller
+ * then goes on in a new transaction.
+ *
  * Locking: must hold vnode lock. Acquires/releases buffer locks.
  * 
  * Requires up to 4 buffers.
  */
 static
 int
-sfs_dotruncate(struct vnode *v, off_t len, struct transaction *t)
+sfs_dotruncate(struct vnode *v, off_t len, struct transaction *t, bool *more)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-
-	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
-
 	struct sfs_inode *inodeptr;
-	struct buf *idbuf, *didbuf, *tidbuf;
-	uint32_t *iddata = NULL, *diddata = NULL, *tiddata = NULL ;
-	uint32_t block, i;
-	uint32_t idblock, baseblock, highblock, didblock, tidblock;
-	int result = 0, final_result = 0;
-	int id_hasnonzero = 0, did_hasnonzero = 0, tid_hasnonzero = 0;
+	struct sfs_trunc st;
+	uint32_t *idptr;
+	uint32_t base, span;
+	bool empty;
+	int indir, i, result;
 	struct record *r;
+	off_t size;
 
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
+	*more = false;
+
 	result = sfs_load_inode(sv);
 	if (result) {
 		return result;
@@ -1776,387 +2097,91 @@ sfs_dotruncate(struct vnode *v, off_t len, struct transaction *t)
 
 	hold_buffer_cache(t,sv->sv_buf);
 
+	st.st_sv = sv;
+	st.st_t = t;
+	/* Length in blocks (divide rounding up) */
+	st.st_blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	st.st_freedto = SFS_NDIRECT + SFS_DBPERIDB + SFS_DBPERIDB*SFS_DBPERIDB +
+		SFS_DBPERIDB*SFS_DBPERIDB*SFS_DBPERIDB;
+	st.st_stopped = false;
+	st.st_result = 0;
+
 	/*
-	 * Go through the direct blocks. Discard any that are
-	 * past the limit we're truncating to.
+	 * The triple, double and single indirect blocks, in that order.
+	 * BASE is the first file block each maps, SPAN how many it maps.
 	 */
-	for (i=0; i<SFS_NDIRECT; i++) {
-		block = inodeptr->sfi_direct[i];
-		if (i >= blocklen && block != 0) {
-			sfs_bfree(sfs, block, t);
-			inodeptr->sfi_direct[i] = 0;
-
-			r = makerec_inode(sv->sv_ino,0,0,i,0);
-			int log_ret = check_and_record(r,t,&sfs->sfs_absfs);
-			if (log_ret)
-				panic("log failed");
+	span = SFS_DBPERIDB*SFS_DBPERIDB*SFS_DBPERIDB;
+	base = st.st_freedto - span;
+	for (indir = 3; indir > 0 && !st.st_stopped; indir--) {
+		if (indir == 3) {
+			idptr = &inodeptr->sfi_tindirect;
+		}
+		else if (indir == 2) {
+			idptr = &inodeptr->sfi_dindirect;
+		}
+		else {
+			idptr = &inodeptr->sfi_indirect;
 		}
-	}
-
-	/* Indirect block number */
-	idblock = inodeptr->sfi_indirect;
-
-	/* Double indirect block number */
-	didblock = inodeptr->sfi_dindirect;
-
-	/* Triple indirect block number */
-	tidblock = inodeptr->sfi_tindirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the file */
-	highblock = baseblock + SFS_DBPERIDB + SFS_DBPERIDB* SFS_DBPERIDB +
-			SFS_DBPERIDB* SFS_DBPERIDB* SFS_DBPERIDB - 1;
-
-
-	/* We are going to cycle through all the blocks, changing levels
-	 * of indirection. And free the ones that are past the new end
-	 * of file.
-	 */
-	if (blocklen < highblock)
-	{
-		int indir = 1, level3 = 0, level2 = 0, level1 = 0;
-		int id_modified = 0, did_modified = 0, tid_modified = 0;
-
-		while(indir <= 3)
-		{
-
-			if(indir == 1)
-			{
-				baseblock = SFS_NDIRECT;
-				if(idblock == 0)
-				{
-					indir++;
-					continue;
-				}
-			}
-			if(indir == 2)
-			{
-				baseblock = SFS_NDIRECT + SFS_DBPERIDB;
-				if(didblock == 0)
-				{
-					indir++;
-					continue;
-				}
-			}
-			if(indir == 3 )
-			{
-				baseblock = SFS_NDIRECT + SFS_DBPERIDB + SFS_DBPERIDB * SFS_DBPERIDB;
-				if(tidblock == 0)
-				{
-					indir++;
-					continue;
-				}
-			}
-
-			if(indir == 1)
-			{
-				/* If the level of indirection is 1, we are
-				 * cycling through the blocks reachable from
-				 * our indirect blocks. Read the indirect block
-				 */
-				KASSERT(idblock != 0);  // otherwise we would not be here
-
-				/* Read the indirect block */
-				result = buffer_read(sv->sv_v.vn_fs, idblock,
-						SFS_BLOCKSIZE, &idbuf);
-				/* if there's an error, guess we just lose
-				 * all the blocks referenced by this indirect
-				 * block!
-				 */
-				if (result) {
-					kprintf("sfs_dotruncate: error reading indirect block %u: %s\n",
-							idblock, strerror(result));
-					final_result = result;
-					indir++;
-					continue;
-				}
-
-				/* We do not need to execute the parts for double and triple
-				 * levels of indirection.
-				 */
-				goto ilevel1;
-			}
-			if(indir == 2)
-			{
-				KASSERT(didblock != 0);  // otherwise we would not be here
-
-				/* Read the double indirect block */
-				result = buffer_read(sv->sv_v.vn_fs, didblock,
-						SFS_BLOCKSIZE, &didbuf);
-				/* if there's an error, guess we just lose
-				 * all the blocks referenced by this double-indirect
-				 * block!
-				 */
-				if (result) {
-					kprintf("sfs_dotruncate: error reading double indirect block %u: %s\n",
-							didblock, strerror(result));
-					final_result = result;
-					indir++;
-					continue;
-				}
-
-				/* We do not need to execute the parts for the triple
-				 * level of indirection.
-				 */
-				goto ilevel2;
-			}
-			if(indir == 3)
-			{
 
-				KASSERT(tidblock != 0);  // otherwise we would not be here
+		if (*idptr != 0 && base + span > st.st_blocklen) {
+			sfs_trunc_indirect(&st, *idptr, indir, indir, base,
+					   &empty);
+			if (empty && sfs_trunc_room(&st)) {
+				/* The whole block is empty now; free it */
+				sfs_bfree(sfs, *idptr, t);
+				*idptr = 0;
 
-				/* Read the triple indirect block */
-				result = buffer_read(sv->sv_v.vn_fs, tidblock,
-						SFS_BLOCKSIZE, &tidbuf);
-				/* if there's an error, guess we just lose
-				 * all the blocks referenced by this triple-indirect
-				 * block!
-				 */
-				if (result) {
-					kprintf("sfs_dotruncate: error reading triple indirect block %u: %s\n",
-							tidblock, strerror(result));
-					final_result = result;
-					indir++;
-					continue;
-				}
+				r = makerec_inode(sv->sv_ino,indir,1,0,0);
+				int log_ret = check_and_record(r,t,&sfs->sfs_absfs);
+				if (log_ret)
+					panic("log failed");
 
-				goto ilevel3;
+				st.st_freedto = base;
 			}
+		}
 
-			/* This is the loop for level of indirection 3
-			 * Go through all double indirect blocks pointed to from this triple
-			 * indirect block, discard the ones that are past the new end of file.
-			 */
-
-			ilevel3:
-			tiddata = buffer_map(tidbuf);
-			hold_buffer_cache(t,tidbuf);
-
-			for(level3 = 0; level3 < SFS_DBPERIDB; level3++)
-			{
-				if(blocklen >= baseblock +
-						SFS_DBPERIDB * SFS_DBPERIDB * (level3)
-						|| tiddata[level3] == 0)
-				{
-					if(tiddata[level3] != 0)
-					{
-						tid_hasnonzero = 1;
-					}
-					continue;
-				}
-
-				/* Read the double indirect block, hand it to the next
-				 * inner loop.
-				 */
-
-				didblock = tiddata[level3];
-				result = buffer_read(sv->sv_v.vn_fs, didblock,
-						SFS_BLOCKSIZE, &didbuf);
+		span /= SFS_DBPERIDB;
+		base -= span;
+	}
 
-				/* if there's an error, guess we just lose
-				 * all the blocks referenced by this double-indirect
-				 * block!
-				 */
-				if (result) {
-					kprintf("sfs_dotruncate: error reading double indirect block %u: %s\n",
-							didblock, strerror(result));
-					final_result = result;
-					continue;
-				}
+	/*
+	 * Then the direct blocks. Discard any that are past the limit
+	 * we're truncating to.
+	 */
+	for (i = SFS_NDIRECT - 1; i >= 0 && !st.st_stopped; i--) {
+		if ((uint32_t)i < st.st_blocklen) {
+			break;
+		}
+		if (inodeptr->sfi_direct[i] == 0) {
+			continue;
+		}
+		if (!sfs_trunc_room(&st)) {
+			break;
+		}
 
-				/* This is the loop for level of indirection 2
-				 * Go through all indirect blocks pointed to from this double
-				 * indirect block, discard the ones that are past the new end of file.
-				 */
-				ilevel2:
-				diddata = buffer_map(didbuf);
-				hold_buffer_cache(t,didbuf);
-
-				for(level2 = 0; level2 < SFS_DBPERIDB; level2++)
-				{
-					/* Discard any blocks that are past the new EOF */
-					if (blocklen >= baseblock +
-							(level3) * SFS_DBPERIDB * SFS_DBPERIDB +
-							(level2) * SFS_DBPERIDB
-							|| diddata[level2] == 0)
-					{
-						if(diddata[level2] != 0)
-						{
-							did_hasnonzero = 1;
-						}
-						continue;
-					}
-
-					/* Read the indirect block, hand it to the next
-					 * inner loop.
-					 */
-
-					idblock = diddata[level2];
-					result = buffer_read(sv->sv_v.vn_fs, idblock,
-							SFS_BLOCKSIZE, &idbuf);
-					/* if there's an error, guess we just lose
-					 * all the blocks referenced by this indirect
-					 * block!
-					 */
-					if (result) {
-						kprintf("sfs_dotruncate: error reading indirect block %u: %s\n",
-								idblock, strerror(result));
-						final_result = result;
-						continue;
-					}
-
-
-					/* This is the loop for level of indirection 1
-					 * Go through all direct blocks pointed to from this indirect
-					 * block, discard the ones that are past the new end of file.
-					 */
-					ilevel1:
-					iddata = buffer_map(idbuf);
-					hold_buffer_cache(t,idbuf);
-
-					for (level1 = 0; level1<SFS_DBPERIDB; level1++)
-					{
-						/* Discard any blocks that are past the new EOF */
-						if (blocklen < baseblock +
-								(level3) * SFS_DBPERIDB * SFS_DBPERIDB +
-								(level2) * SFS_DBPERIDB + level1
-								&& iddata[level1] != 0)
-						{
-
-							int block = iddata[level1];
-							iddata[level1] = 0;
-
-							r = makerec_inode(sv->sv_ino,1,0,level1,0);
-
-							id_modified = 1;
-
-							sfs_bfree(sfs, block, t);
-						}
-
-						/* Remember if we see any nonzero blocks in here */
-						if (iddata[level1]!=0)
-						{
-							id_hasnonzero=1;
-						}
-					}/* end for level 1*/
-
-					if (!id_hasnonzero)
-					{
-						/* The whole indirect block is empty now; free it */
-						sfs_bfree(sfs, idblock, t);
-						if(indir == 1)
-						{
-							inodeptr->sfi_indirect = 0;
-							r = makerec_inode(sv->sv_ino,1,1,0,0);
-							int log_ret = check_and_record(r,t,&sfs->sfs_absfs);
-							if (log_ret)
-								panic("log failed");
-						}
-						if(indir != 1)
-						{
-							did_modified = 1;
-							diddata[level2] = 0;
-						}
-					}
-					else if(id_modified)
-					{
-						/* The indirect block has been modified */
-						buffer_mark_dirty(idbuf);
-						if(indir != 1)
-						{
-							did_hasnonzero = 1;
-						}
-					}
-
-					buffer_release(idbuf);
-
-					/* If we are just doing 1 level of indirection,
-					 * break out of the loop
-					 */
-					if(indir == 1)
-					{
-						break;
-					}
-				} /* end for level2 */
-
-				/* If we are just doing 1 level of indirection,
-				 * break out of the loop
-				 */
-				if(indir == 1)
-				{
-					break;
-				}
+		sfs_bfree(sfs, inodeptr->sfi_direct[i], t);
+		inodeptr->sfi_direct[i] = 0;
 
-				if (!did_hasnonzero)
-				{
-					/* The whole double indirect block is empty now; free it */
-					sfs_bfree(sfs, didblock, t);
-					if(indir == 2)
-					{
-						inodeptr->sfi_dindirect = 0;
-
-						r = makerec_inode(sv->sv_ino,2,1,0,0);
-						int log_ret = check_and_record(r,t,&sfs->sfs_absfs);
-						if (log_ret)
-							panic("log failed");
-
-						buffer_mark_dirty(sv->sv_buf);
-					}
-					if(indir == 3)
-					{
-						tid_modified = 1;
-						tiddata[level3] = 0;
-					}
-				}
-				else if(did_modified)
-				{
-					/* The double indirect block has been modified */
-					buffer_mark_dirty(didbuf);
-					if(indir == 3)
-					{
-						tid_hasnonzero = 1;
-					}
-				}
+		r = makerec_inode(sv->sv_ino,0,0,i,0);
+		int log_ret = check_and_record(r,t,&sfs->sfs_absfs);
+		if (log_ret)
+			panic("log failed");
 
-				buffer_release(didbuf);
-				if(indir < 3)
-				{
-					break;
-				}
-			} /* end for level 3 */
-			if(indir < 3)
-			{
-				indir++;
-				continue;  /* while */
-			}
-			if (!tid_hasnonzero)
-			{
-				/* The whole triple indirect block is empty now; free it */
-				sfs_bfree(sfs, tidblock, t);
-				inodeptr->sfi_tindirect = 0;
+		st.st_freedto = i;
+	}
 
-				r = makerec_inode(sv->sv_ino,3,1,0,0);
-				int log_ret = check_and_record(r,t,&sfs->sfs_absfs);
-				if (log_ret)
-					panic("log failed");
-			}
-			else if(tid_modified)
-			{
-				/* The triple indirect block has been modified */
-				buffer_mark_dirty(tidbuf);
-			}
-			buffer_release(tidbuf);
-			indir++;
+	/* Set the file size: LEN, or as far down as we got */
+	size = len;
+	if (st.st_stopped) {
+		size = (off_t)st.st_freedto * SFS_BLOCKSIZE;
+		if (size > (off_t)inodeptr->sfi_size) {
+			size = inodeptr->sfi_size;
 		}
+		*more = true;
 	}
+	inodeptr->sfi_size = size;
 
-
-	/* Set the file size */
-	inodeptr->sfi_size = len;
-
-	r = makerec_isize(sv->sv_ino,len);
+	r = makerec_isize(sv->sv_ino,size);
 	int log_ret = check_and_record(r,t,&sfs->sfs_absfs);
 	if (log_ret)
 		panic("log failed");
@@ -2167,12 +2192,15 @@ sfs_dotruncate(struct vnode *v, off_t len, struct transaction *t)
 	/* release the inode buffer */
 	sfs_release_inode(sv);
 
-	return final_result;
+	return st.st_result;
 }
 
 /*
  * Truncate a file (or directory)
  *
+ * A big truncate is done in as many transactions as it takes, each
+ * committed before the next starts (see sfs_dotruncate).
+ *
  * Locking: gets/releases vnode lock.
  * 
  * Requires up to 4 buffers.
@@ -2182,20 +2210,24 @@ int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct transaction *t;
+	bool more;
 	int result;
 
-	//ENTRYPOINT
-	struct transaction *t = create_transaction();
+	do {
+		//ENTRYPOINT
+		t = create_transaction();
 
-	lock_acquire(sv->sv_lock);
-	reserve_buffers(4, SFS_BLOCKSIZE);
+		lock_acquire(sv->sv_lock);
+		reserve_buffers(4, SFS_BLOCKSIZE);
 
-	result = sfs_dotruncate(v, len, t);
+		result = sfs_dotruncate(v, len, t, &more);
 
-	commit(t, v->vn_fs, 1);
+		commit(t, v->vn_fs);
 
-	unreserve_buffers(4, SFS_BLOCKSIZE);
-	lock_release(sv->sv_lock);
+		unreserve_buffers(4, SFS_BLOCKSIZE);
+		lock_release(sv->sv_lock);
+	} while (result == 0 && more);
 
 	return result;
 }
@@ -2354,6 +2386,9 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	int result;
 	struct record *r;
 
+	// ENTRYPOINT: Begin transaction
+	struct transaction *t = create_transaction();
+
 	lock_acquire(sv->sv_lock);
 	
 	reserve_buffers(4, SFS_BLOCKSIZE);
@@ -2362,6 +2397,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	if (result) {
 		unreserve_buffers(4, SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
+		abort(t);
 		return result;
 	}
 	sv_inodebuf = buffer_map(sv->sv_buf);
@@ -2370,6 +2406,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		sfs_release_inode(sv);
 		unreserve_buffers(4, SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
+		abort(t);
 		return ENOENT;
 	}
 	
@@ -2380,6 +2417,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	if (result!=0 && result!=ENOENT) {
 		unreserve_buffers(4, SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
+		abort(t);
 		return result;
 	}
 
@@ -2387,6 +2425,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	if (result==0 && excl) {
 		unreserve_buffers(4, SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
+		abort(t);
 		return EEXIST;
 	}
 
@@ -2396,17 +2435,16 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		if (result) {
 			unreserve_buffers(4, SFS_BLOCKSIZE);
 			lock_release(sv->sv_lock);
+			abort(t);
 			return result;
 		}
 		*ret = &newguy->sv_v;
 		unreserve_buffers(4, SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
+		abort(t);
 		return 0;
 	}
 
-	// ENTRYPOINT: Begin transaction
-	struct transaction *t = create_transaction();
-
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy, t);
 	if (result) {
@@ -2426,10 +2464,11 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	if (result) {
 		sfs_release_inode(newguy);
 		lock_release(newguy->sv_lock);
-		VOP_DECREF(&newguy->sv_v);
 		unreserve_buffers(4, SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
 		abort(t);
+		/* With no links, reclaim erases it: not with anything held */
+		VOP_DECREF(&newguy->sv_v);
 		return result;
 	}
 
@@ -2448,7 +2487,7 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 
 	*ret = &newguy->sv_v;
 
-	commit(t, v->vn_fs, 1);
+	commit(t, v->vn_fs);
 
 	unreserve_buffers(4, SFS_BLOCKSIZE);
 	lock_release(newguy->sv_lock);
@@ -2480,14 +2519,14 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
+	// ENTRYPOINT
+	struct transaction *t = create_transaction();
+
 	reserve_buffers(4, SFS_BLOCKSIZE);
 
 	/* directory must be locked first */
 	lock_acquire(sv->sv_lock);
 
-	// ENTRYPOINT
-	struct transaction *t = create_transaction();
-
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, &slot, t);
 	if (result) {
@@ -2525,7 +2564,7 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	buffer_mark_dirty(f->sv_buf);
 
-	commit(t, dir->vn_fs, 1);
+	commit(t, dir->vn_fs);
 
 	sfs_release_inode(f);
 	unreserve_buffers(4, SFS_BLOCKSIZE);
@@ -2556,12 +2595,15 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 	uint32_t ino;
 	struct sfs_inode *dir_inodeptr;
 	struct sfs_inode *new_inodeptr;
-	struct sfs_vnode *newguy;
+	struct sfs_vnode *newguy = NULL;
 	struct record *r;
 	int log_ret;
 
 	(void)mode;
 
+	// ENTRYPOINT
+	struct transaction *t = create_transaction();
+
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(4, SFS_BLOCKSIZE);
 	
@@ -2589,13 +2631,10 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 		goto die_simple;
 	}
 
-	// ENTRYPOINT
-	struct transaction *t = create_transaction();
 	hold_buffer_cache(t,sv->sv_buf);
 
 	result = sfs_makeobj(sfs, SFS_TYPE_DIR, &newguy, t);
 	if (result) {
-		abort(t);
 		goto die_simple;
 	}
 	new_inodeptr = buffer_map(newguy->sv_buf);
@@ -2603,19 +2642,16 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 
 	result = sfs_dir_link(newguy, ".", newguy->sv_ino, NULL, t);
 	if (result) {
-		abort(t);
 		goto die_uncreate;
 	}
 
 	result = sfs_dir_link(newguy, "..", sv->sv_ino, NULL, t);
 	if (result) {
-		abort(t);
 		goto die_uncreate;
 	}
 
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL, t);
 	if (result) {
-		abort(t);
 		goto die_uncreate;
 	}
 
@@ -2643,7 +2679,7 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 	if (log_ret)
 		panic("log failed");
 
-	commit(t, v->vn_fs, 1);
+	commit(t, v->vn_fs);
 
 	buffer_mark_dirty(newguy->sv_buf);
 	sfs_release_inode(newguy);
@@ -2662,7 +2698,6 @@ sfs_mkdir(struct vnode *v, const char *name, mode_t mode)
 die_uncreate:
 	sfs_release_inode(newguy);
 	lock_release(newguy->sv_lock);
-	VOP_DECREF(&newguy->sv_v);
 
 die_simple:
 	sfs_release_inode(sv);
@@ -2670,6 +2705,11 @@ die_simple:
 die_early:
 	unreserve_buffers(4, SFS_BLOCKSIZE);
 	lock_release(sv->sv_lock);
+	abort(t);
+	/* With no links, reclaim erases it: not with anything held */
+	if (newguy != NULL) {
+		VOP_DECREF(&newguy->sv_v);
+	}
 	return result;
 }
 
@@ -2686,19 +2726,23 @@ int
 sfs_rmdir(struct vnode *v, const char *name)
 {
 	struct sfs_vnode *sv = v->vn_data;
-	struct sfs_vnode *victim;
+	struct sfs_vnode *victim = NULL;
 	struct sfs_inode *dir_inodeptr;
 	struct sfs_inode *victim_inodeptr;
 	int result;
 	int slot;
 	int log_ret;
 	struct record *r;
+	bool more;
 
 	/* Cannot remove the . or .. entries from a directory! */
 	if (!strcmp(name, ".") || !strcmp(name, "..")) {
 		return EINVAL;
 	}
 
+	// ENTRYPOINT
+	struct transaction *t = create_transaction();
+
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(4, SFS_BLOCKSIZE);
 
@@ -2716,6 +2760,7 @@ sfs_rmdir(struct vnode *v, const char *name)
 
 	result = sfs_lookonce(sv, name, &victim, true, &slot);
 	if (result) {
+		victim = NULL;
 		goto die_simple;
 	}
 	victim_inodeptr = buffer_map(victim->sv_buf);
@@ -2736,15 +2781,12 @@ sfs_rmdir(struct vnode *v, const char *name)
 		goto die_total;
 	}
 
-	// ENTRYPOINT
-	struct transaction *t = create_transaction();
 	hold_buffer_cache(t,sv->sv_buf);
 	hold_buffer_cache(t,victim->sv_buf);
 
 
 	result = sfs_dir_unlink(sv, slot, t);
 	if (result) {
-		abort(t);
 		goto die_total;
 	}
 
@@ -2770,19 +2812,27 @@ sfs_rmdir(struct vnode *v, const char *name)
 	buffer_mark_dirty(victim->sv_buf);
 	/* buffer released below */
 
-	result = sfs_dotruncate(&victim->sv_v, 0, t);
+	/* If this can't do it all at once, reclaim does the rest */
+	result = sfs_dotruncate(&victim->sv_v, 0, t, &more);
 	
-	commit(t, v->vn_fs, 1);
+	commit(t, v->vn_fs);
+	t = NULL;
 
 die_total:
 	sfs_release_inode(victim);
 	lock_release(victim->sv_lock);
- 	VOP_DECREF(&victim->sv_v);
 die_simple:
 	sfs_release_inode(sv);
 die_early:
  	unreserve_buffers(4, SFS_BLOCKSIZE);
  	lock_release(sv->sv_lock);
+	if (t != NULL) {
+		abort(t);
+	}
+	/* With no links, reclaim erases it: not with anything held */
+	if (victim != NULL) {
+		VOP_DECREF(&victim->sv_v);
+	}
 	return result;
 }
 
@@ -2805,13 +2855,14 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	// ENTRYPOINT: transaction is started after error checks pass
-
 	/* need to check this to avoid deadlock even in error condition */
 	if (!strcmp(name, ".") || !strcmp(name, "..")) {
 		return EISDIR;
 	}
 
+	// ENTRYPOINT
+	struct transaction *t = create_transaction();
+
 	lock_acquire(sv->sv_lock);
 	reserve_buffers(4, SFS_BLOCKSIZE);
 
@@ -2819,6 +2870,7 @@ sfs_remove(struct vnode *dir, const char *name)
 	if (result) {
 		unreserve_buffers(4, SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
+		abort(t);
 		return result;
 	}
 	dir_inodeptr = buffer_map(sv->sv_buf);
@@ -2827,6 +2879,7 @@ sfs_remove(struct vnode *dir, const char *name)
 		sfs_release_inode(sv);
 		unreserve_buffers(4, SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
+		abort(t);
 		return ENOENT;
 	}
 
@@ -2836,6 +2889,7 @@ sfs_remove(struct vnode *dir, const char *name)
 		sfs_release_inode(sv);
 		unreserve_buffers(4, SFS_BLOCKSIZE);
 		lock_release(sv->sv_lock);
+		abort(t);
 		return result;
 	}
 	victim_inodeptr = buffer_map(victim->sv_buf);
@@ -2848,12 +2902,10 @@ sfs_remove(struct vnode *dir, const char *name)
 		lock_release(sv->sv_lock);
 		VOP_DECREF(&victim->sv_v);
 		unreserve_buffers(4, SFS_BLOCKSIZE);
+		abort(t);
 		return EISDIR;
 	}
 
-	// ENTRYPOINT
-	struct transaction *t = create_transaction();
-
 	/* Erase its directory entry. */
 	result = sfs_dir_unlink(sv, slot, t);
 	if (result==0) {
@@ -2873,14 +2925,19 @@ sfs_remove(struct vnode *dir, const char *name)
 	sfs_release_inode(victim);
 	lock_release(victim->sv_lock);
 
-	/* Discard the reference that sfs_lookonce got us */
-	VOP_DECREF(&victim->sv_v);
-
-	commit(t, dir->vn_fs, 1);
+	commit(t, dir->vn_fs);
 
 	unreserve_buffers(4, SFS_BLOCKSIZE);
 
 	lock_release(sv->sv_lock);
+
+	/*
+	 * Discard the reference that sfs_lookonce got us. If it was the
+	 * last, reclaim erases the file, which takes transactions of its
+	 * own: so not until ours is done and nothing is held.
+	 */
+	VOP_DECREF(&victim->sv_v);
+
 	return result;
 }
 
@@ -2970,7 +3027,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	struct sfs_fs *sfs = absdir1->vn_fs->fs_data;
 	struct sfs_vnode *dir1 = absdir1->vn_data;
 	struct sfs_vnode *dir2 = absdir2->vn_data;
-	struct sfs_vnode *obj1=NULL, *obj2=NULL;
+	struct sfs_vnode *obj1=NULL, *obj2=NULL, *victim=NULL;
 	struct sfs_inode *dir1_inodeptr, *dir2_inodeptr;
 	struct sfs_inode *obj1_inodeptr, *obj2_inodeptr;
 	int slot1=-1, slot2=-1;
@@ -2979,6 +3036,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	int found_dir1;
 	int log_ret;
 	struct record *r;
+	bool more;
 
 	/* The VFS layer is supposed to enforce this */
 	KASSERT(absdir1->vn_fs == absdir2->vn_fs);
@@ -3008,6 +3066,9 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	 * need, the rename lock goes outside all the vnode locks.
 	 */
 
+	// ENTRYPOINT
+	struct transaction *t = create_transaction();
+
 	reserve_buffers(7, SFS_BLOCKSIZE);
 
 	lock_acquire(sfs->sfs_renamelock);
@@ -3255,9 +3316,6 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	KASSERT(slot1>=0);
 	KASSERT(slot2>=0);
 
-	// ENTRYPOINT
-	struct transaction *t = create_transaction();
-
 	if (obj2 != NULL) {
 		/*
 		 * Target already exists.
@@ -3268,19 +3326,16 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 		if (obj1_inodeptr->sfi_type == SFS_TYPE_DIR) {
 			if (obj2_inodeptr->sfi_type != SFS_TYPE_DIR) {
 				result = ENOTDIR;
-				abort(t);
 				goto out4;
 			}
 			result = sfs_dir_checkempty(obj2);
 			if (result) {
-				abort(t);
 				goto out4;
 			}
 
 			/* Remove the name */
 			result = sfs_dir_unlink(dir2, slot2, t);
 			if (result) {
-				abort(t);
 				goto out4;
 			}
 
@@ -3306,21 +3361,22 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 			hold_buffer_cache(t,obj2->sv_buf);
 			buffer_mark_dirty(obj2->sv_buf);
 
-			/* ignore errors on this */
-			sfs_dotruncate(&obj2->sv_v, 0, t);
+			/*
+			 * ignore errors on this; if it can't do it all
+			 * at once, reclaim does the rest
+			 */
+			sfs_dotruncate(&obj2->sv_v, 0, t, &more);
 		}
 		else {
 			KASSERT(obj1->sv_type == SFS_TYPE_FILE);
 			if (obj2->sv_type != SFS_TYPE_FILE) {
 				result = EISDIR;
-				abort(t);
 				goto out4;
 			}
 
 			/* Remove the name */
 			result = sfs_dir_unlink(dir2, slot2, t);
 			if (result) {
-				abort(t);
 				goto out4;
 			}
 
@@ -3340,7 +3396,8 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 		sfs_release_inode(obj2);
 
 		lock_release(obj2->sv_lock);
-		VOP_DECREF(&obj2->sv_v);
+		/* Let go of it at the end, once nothing is held */
+		victim = obj2;
 		obj2 = NULL;
 	}
 
@@ -3359,7 +3416,6 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 
 	result = sfs_writedir(dir2, &sd, slot2, t);
 	if (result) {
-		abort(t);
 		goto out4;
 	}
 
@@ -3377,7 +3433,6 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 		/* Directory: reparent it */
 		result = sfs_readdir(obj1, &sd, DOTDOTSLOT);
 		if (result) {
-			abort(t);
 			goto recover1;
 		}
 		if (strcmp(sd.sfd_name, "..")) {
@@ -3391,7 +3446,6 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 		sd.sfd_ino = dir2->sv_ino;
 		result = sfs_writedir(obj1, &sd, DOTDOTSLOT, t);
 		if (result) {
-			abort(t);
 			goto recover1;
 		}
 		dir1_inodeptr->sfi_linkcount--;
@@ -3416,7 +3470,6 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 
 	result = sfs_dir_unlink(dir1, slot1, t);
 	if (result) {
-		abort(t);
 		goto recover2;
 	}
 	obj1_inodeptr->sfi_linkcount--;
@@ -3477,7 +3530,8 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	}
 
 	// Commit
-	commit(t, absdir1->vn_fs, 1);
+	commit(t, absdir1->vn_fs);
+	t = NULL;
 
  out4:
  	sfs_release_inode(dir1);
@@ -3496,16 +3550,27 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 		lock_release(dir2->sv_lock);
 	}
  out0:
+	unreserve_buffers(7, SFS_BLOCKSIZE);
+
+	lock_release(sfs->sfs_renamelock);
+
+	if (t != NULL) {
+		abort(t);
+	}
+
+	/*
+	 * A file whose last name we took may be erased by reclaim, which
+	 * takes transactions of its own; so these come last.
+	 */
 	if (obj2 != NULL) {
 		VOP_DECREF(&obj2->sv_v);
 	}
 	if (obj1 != NULL) {
 		VOP_DECREF(&obj1->sv_v);
 	}
-
-	unreserve_buffers(7, SFS_BLOCKSIZE);
-
-	lock_release(sfs->sfs_renamelock);
+	if (victim != NULL) {
+		VOP_DECREF(&victim->sv_v);
+	}
 
 	return result;
 }
@@ -3950,63 +4015,100 @@ create_transaction(void) {
 		kfree(t);
 		return NULL;
 	}
+	t->blocks = array_create();
+	if (t->blocks == NULL) {
+		array_destroy(t->bufs);
+		kfree(t);
+		return NULL;
+	}
+	t->freed = array_create();
+	if (t->freed == NULL) {
+		array_destroy(t->blocks);
+		array_destroy(t->bufs);
+		kfree(t);
+		return NULL;
+	}
+	t->nrecs = 0;
+	t->logged = false;
+	t->committed = false;
+	t->bitmap = false;
+	t->images = false;
+	t->full = false;
 
 	lock_acquire(transaction_id_lock);
 	t->id = next_transaction_id;
 	next_transaction_id++;
 	lock_release(transaction_id_lock);
 
-	// Synchronization for checkpointing
+	/*
+	 * Wait until the log has room for all this one may log, past what
+	 * is in it and what the open ones may still add (JN_TXN_RESERVE).
+	 * Only commits and the checkpointer make room, so the caller must
+	 * hold no vnode locks or buffers an open transaction may need.
+	 */
 	lock_acquire(checkpoint_lock);
-	while (in_checkpoint) {
-		cv_wait(checkpoint_cleared,checkpoint_lock);
+	while (log_used() + jn_reserved + JN_TXN_RESERVE > JN_ROOM) {
+		jn_space_waiters++;
+		cv_signal(jn_work, checkpoint_lock);
+		cv_wait(jn_space, checkpoint_lock);
+		jn_space_waiters--;
 	}
+	jn_reserved += JN_TXN_RESERVE;
 	num_active_transactions++;
 	lock_release(checkpoint_lock);
 
 	return t;
 }
 
-static 
-int checkpoint(struct fs *fs){
-	int result = 0;
+/*
+ * Drop a transaction that is out of jn_live, or was never in it.
+ */
+static
+void free_transaction(struct transaction *t) {
+	unsigned ix;
 
-	lock_acquire(checkpoint_lock);
-	if (in_checkpoint == 0)
-		in_checkpoint = 1;
-	else {
-		lock_release(checkpoint_lock);
-		return 0;
+	if (t->bufs != NULL) {
+		for (ix = array_num((const struct array*)t->bufs); ix>0; ix--) {
+			buf_decref((struct buf *)array_get(t->bufs, ix-1));
+			array_remove(t->bufs, ix-1);
+		}
+		array_destroy(t->bufs);
 	}
-	in_checkpoint = 1;
-	while (num_active_transactions > 0)
-		cv_wait(no_active_transactions,checkpoint_lock);
-	lock_release(checkpoint_lock);
+	array_setsize(t->blocks, 0);
+	array_destroy(t->blocks);
+	array_setsize(t->freed, 0);
+	array_destroy(t->freed);
+	kfree(t);
+}
 
-	// Checkpoint - write buffers to disk...
-	sync_fs_buffers(fs);
+/*
+ * Move the tail up to the first record anyone still needs.
+ */
+static
+void update_tail(void) {
+	struct transaction *t;
 
-	// ...then update journal summary block
-	struct sfs_jn_summary *s = kmalloc(SFS_BLOCKSIZE);
-	if (s == NULL) {
-		panic("Checkpoint out of memory\n");
+	KASSERT(lock_do_i_hold(checkpoint_lock));
+	if (array_num(jn_live) > 0) {
+		t = array_get(jn_live, 0);
+		jn_tail_seq = t->first_seq;
 	}
-	sfs_readblock(fs, JN_SUMMARY_LOCATION(fs), s, SFS_BLOCKSIZE);
-	s->num_entries = 0;
-	s->max_id = 0;
-	sfs_writeblock(fs, JN_SUMMARY_LOCATION(fs), s, SFS_BLOCKSIZE);
-	kfree(s);
-
-	// Reset counters
-	journal_offset = 0;
-	next_transaction_id = 0;
+	else {
+		// Unlocked read; record() puts t in jn_live before moving log_seq
+		jn_tail_seq = log_seq;
+	}
+	cv_broadcast(jn_space, checkpoint_lock);
+}
 
-	lock_acquire(checkpoint_lock);
-	KASSERT(num_active_transactions == 0);
-	in_checkpoint = 0;
-	cv_broadcast(checkpoint_cleared,checkpoint_lock);
-	lock_release(checkpoint_lock);
-	return result;
+/*
+ * Records appended but not yet behind the tail. Unlocked read of
+ * log_seq, so it may miss records that open transactions are adding;
+ * those are covered by their reservations.
+ */
+static
+int log_used(void) {
+	KASSERT(lock_do_i_hold(checkpoint_lock));
+	return (int)(log_seq - jn_tail_seq);
 }
 
 static
@@ -4023,11 +4125,16 @@ int hold_buffer_cache(struct transaction *t, struct buf *buf) {
 				return 0;
 			}
 		}
-		// Add buf to transaction
+		// Add buf to transaction, with its block for the checkpointer
 		result = array_add(t->bufs, buf, NULL);
 		if (result) {
 			panic("Couldn't hold buffer");
 		}
+		result = array_add(t->blocks,
+			(void *)(uintptr_t)buf_getblock(buf), NULL);
+		if (result) {
+			panic("Couldn't hold buffer");
+		}
 		// Increase reference count
 		buf_incref(buf);
 	}
@@ -4035,79 +4142,145 @@ int hold_buffer_cache(struct transaction *t, struct buf *buf) {
 }
 
 static
-int record(struct record *r, struct fs *fs) {
+int record(struct record *r, struct fs *fs, struct transaction *t) {
+	int result;
+
 	KASSERT(sizeof(struct record) == RECORD_SIZE);
+	(void)fs;
+
+	// Past its reservation the log could fill up under it
+	KASSERT(t->nrecs < JN_TXN_RESERVE);
+	t->nrecs++;
 
-	if (log_buf_offset == BUF_RECORDS) {
-		flush_log_buf(fs);
-		KASSERT(log_buf_offset == 0);
-	}
 	lock_acquire(log_buf_lock);
+	while (log_buf_offset == BUF_RECORDS) {
+		// Wait for the writer to take the full buffer
+		cv_signal(log_work, log_buf_lock);
+		cv_wait(log_flushed, log_buf_lock);
+	}
+	if (!t->logged) {
+		// Holds the tail from here on; jn_live stays in log order
+		t->logged = true;
+		t->first_seq = log_seq;
+		lock_acquire(checkpoint_lock);
+		result = array_add(jn_live, t, NULL);
+		if (result) {
+			panic("Couldn't log transaction");
+		}
+		lock_release(checkpoint_lock);
+	}
 	memcpy(&log_buf[log_buf_offset], (const void *)r, sizeof(struct record));
 	log_buf_offset++;
+	log_seq++;
+	if (log_buf_offset == BUF_RECORDS) {
+		// Get it going before the next record has to wait
+		cv_signal(log_work, log_buf_lock);
+	}
 	lock_release(log_buf_lock);
 	return 0;
 }
 
 /*
- * Synch note: log_buf_lock doubles as mutex lock for on disk journal
+ * The transaction's buffers stay pinned until its commit record is on
+ * disk, so none of its changes can reach the disk ahead of the journal.
+ * It then waits in jn_live for the checkpointer.
  */
 static
-int commit(struct transaction *t, struct fs *fs, int do_checkpoint) {
+int commit(struct transaction *t, struct fs *fs) {
 	unsigned ix;
+	bool logged;
+
+	if (t->images) {
+		log_images(t, fs);
+	}
 
 	// Create commit record
-	struct record *r = kmalloc(sizeof(struct record));
+	struct record *r = objcache_alloc(&record_cache);
 	r->transaction_type = REC_COMMIT;
 	check_and_record(r, t, fs);
 
-	flush_log_buf(fs);
+	log_force();
+	sfs_bfree_commit(fs->fs_data, t);
 
 	for (ix = array_num((const struct array*)t->bufs); ix>0; ix--) {
 		buf_decref((struct buf *)array_get(t->bufs, ix-1));
 		array_remove(t->bufs, ix-1);
 	}
 	array_destroy(t->bufs);
-	kfree(t);
+	t->bufs = NULL;
+
+	// Once committed, the checkpointer may free it
+	logged = t->logged;
 
-	// Checkpoint signaling
 	lock_acquire(checkpoint_lock);
 	KASSERT(num_active_transactions > 0);
 	num_active_transactions--;
-	if (num_active_transactions == 0)
-		cv_signal(no_active_transactions,checkpoint_lock);
+	t->committed = true;
+	jn_stats.js_commits++;
+	jn_reserved -= JN_TXN_RESERVE;
+	if (jn_space_waiters > 0) {
+		// What it didn't use is free, and it may be all that held the tail
+		cv_broadcast(jn_space, checkpoint_lock);
+		cv_signal(jn_work, checkpoint_lock);
+	}
+	else if (log_used() > JN_CHECKPOINT_START) {
+		cv_signal(jn_work, checkpoint_lock);
+	}
 	lock_release(checkpoint_lock);
 
-	if (journal_offset + log_buf_offset > (int)(0.5 * MAX_JN_ENTRIES)){
-		if (do_checkpoint)
-			checkpoint(fs);
+	// Nothing logged (not even the commit record): nothing to wait for
+	if (!logged) {
+		free_transaction(t);
 	}
 
 	return 0;
 }
 
 // To be called in case of error so system doesnt think transaction exists
+// Blocks it freed stay allocated: leaking them is safe whatever of its
+// changes reach the disk
 static
 void abort(struct transaction *t){
-	int ix;
+	unsigned ix, num;
 
-	for (ix = array_num((const struct array*)t->bufs); ix>0; ix--) {
-		buf_decref((struct buf *)array_get(t->bufs, ix-1));
-		array_remove(t->bufs, ix-1);
-	}
-	array_destroy(t->bufs);
-	kfree(t);
-
-	// Synchro for checkpointing
 	lock_acquire(checkpoint_lock);
 	KASSERT(num_active_transactions > 0);
 	num_active_transactions--;
-	if (num_active_transactions == 0)
-		cv_signal(no_active_transactions,checkpoint_lock);
+	jn_reserved -= JN_TXN_RESERVE;
+	cv_broadcast(jn_space, checkpoint_lock);
+	if (t->logged) {
+		// Its records are dead; it no longer holds the tail
+		num = array_num(jn_live);
+		for (ix = 0; ix < num; ix++) {
+			if (array_get(jn_live, ix) == t) {
+				array_remove(jn_live, ix);
+				break;
+			}
+		}
+		KASSERT(ix < num);
+		if (ix == 0) {
+			update_tail();
+		}
+	}
 	lock_release(checkpoint_lock);
+
+	free_transaction(t);
 }
 
 
+/*
+ * Records T has logged, plus the images it has yet to log at commit.
+ */
+static
+unsigned txn_size(struct transaction *t) {
+	unsigned n = t->nrecs;
+
+	if (jn_mode == SFS_JN_BLOCKS) {
+		n += IMAGE_PARTS * array_num(t->bufs);
+	}
+	return n;
+}
+
 static
 int check_and_record(struct record *r, struct transaction *t,
 		struct fs *fs) {
@@ -4115,149 +4288,507 @@ int check_and_record(struct record *r, struct transaction *t,
 	if (r == NULL)
 		return ENOMEM;
 	r->transaction_id = t->id;
-	ret = record(r, fs);
-	kfree(r);
+	if (r->transaction_type == REC_BITMAP)
+		t->bitmap = true;
+	else if (jn_mode == SFS_JN_BLOCKS &&
+		 r->transaction_type != REC_COMMIT &&
+		 r->transaction_type != REC_IMAGE) {
+		// Goes in with the rest of its block at commit
+		t->images = true;
+		objcache_free(&record_cache, r);
+		return 0;
+	}
+	if (r->transaction_type == REC_BITMAP && r->changed.r_bitmap.setting &&
+	    txn_size(t) + JN_ALLOC_SLACK > JN_TXN_RESERVE) {
+		objcache_free(&record_cache, r);
+		t->full = true;
+		return ENOSPC;
+	}
+	ret = record(r, fs, t);
+	objcache_free(&record_cache, r);
 	if (ret)
 		return ret;
 	return 0;
 }
 
+/*
+ * Block mode: log an image of each block T holds, which is each block
+ * it changed, plus maybe a few it only looked at, each once. They are
+ * pinned, and the vnode locks held until commit keep other
+ * transactions off them, so the image is just what T left there. A
+ * block T freed and dropped (a reclaimed inode) needs no image.
+ */
 static
-void flush_log_buf(struct fs *fs) {
-	int i, result, part;
-	unsigned max;
-	daddr_t block = JN_LOCATION(fs);
-	struct record *tmp = kmalloc(SFS_BLOCKSIZE);
-	if (tmp == NULL) {
-		panic("ENOMEM commit failed");
+void log_images(struct transaction *t, struct fs *fs) {
+	char *image;
+	daddr_t block;
+	unsigned i, part, num, logged = 0;
+
+	image = kmalloc(SFS_BLOCKSIZE);
+	if (image == NULL) {
+		panic("Couldn't log block image");
+	}
+	num = array_num(t->bufs);
+	for (i = 0; i < num; i++) {
+		block = (daddr_t)(uintptr_t)array_get(t->blocks, i);
+		if (buf_copyout(array_get(t->bufs, i), block, 0, image,
+				SFS_BLOCKSIZE)) {
+			continue;
+		}
+		for (part = 0; part < IMAGE_PARTS; part++) {
+			if (check_and_record(makerec_image(block, part, image),
+					t, fs)) {
+				panic("Couldn't log block image");
+			}
+		}
+		logged++;
 	}
-	max = 0;
+	kfree(image);
+
+	lock_acquire(checkpoint_lock);
+	jn_stats.js_images += logged;
+	lock_release(checkpoint_lock);
+}
+
+/*
+ * Wait until every record appended so far is in the on-disk journal.
+ * Commits that arrive while the writer is busy with a batch all go out
+ * together in the next one.
+ */
+static
+void log_force(void) {
+	unsigned seq;
 
 	lock_acquire(log_buf_lock);
-	if (log_buf_offset > 0) {
-		// Partial write
-		i = 0;
-		if (journal_offset % REC_PER_BLK != 0) {
-			part = journal_offset % REC_PER_BLK;
-			// Read
-			result = sfs_readblock(fs, block + journal_offset / REC_PER_BLK,
-				tmp, SFS_BLOCKSIZE);
-			if (result) {
-				lock_release(log_buf_lock);
-				panic("flush_log_buf");
-			}
-			// Construct
-			memcpy(&tmp[part], (const void *)log_buf,
-				sizeof(struct record) * (REC_PER_BLK - part));
-			// Write
-			result = sfs_writeblock(fs, block + journal_offset / REC_PER_BLK,
-				tmp, SFS_BLOCKSIZE);
-
-			if (log_buf_offset > REC_PER_BLK - part) {
-				i += REC_PER_BLK - part;
-				journal_offset += REC_PER_BLK - part;
-			}
-			else {
-				i += log_buf_offset;
-				journal_offset += log_buf_offset;
+	seq = log_seq;
+	log_waiters++;
+	while ((int)(seq - log_flushed_seq) > 0) {
+		cv_signal(log_work, log_buf_lock);
+		cv_wait(log_flushed, log_buf_lock);
+	}
+	log_waiters--;
+	lock_release(log_buf_lock);
+}
+
+/*
+ * The log writer sleeps until a commit is waiting or a staging buffer
+ * fills, then writes out the whole buffer as one batch: one pass over
+ * the journal blocks and one summary update for every commit in it.
+ * If more transactions are open than are waiting it first yields once,
+ * so that those about to commit can make the same batch.
+ */
+static
+void
+log_writer_thread(void *x1, unsigned long x2)
+{
+	struct record *batch;
+	unsigned seq;
+	bool yielded = false;
+	int n;
+
+	(void)x1;
+	(void)x2;
+
+	lock_acquire(log_buf_lock);
+	while (!log_writer_exit) {
+		if (log_buf_offset == 0 ||
+		    (log_waiters == 0 && log_buf_offset < BUF_RECORDS)) {
+			cv_wait(log_work, log_buf_lock);
+			continue;
+		}
+		// Unlocked read of the count; it is only a hint
+		if (!yielded && log_buf_offset < BUF_RECORDS &&
+		    log_waiters < num_active_transactions) {
+			yielded = true;
+			lock_release(log_buf_lock);
+			thread_yield();
+			lock_acquire(log_buf_lock);
+			continue;
+		}
+		yielded = false;
+
+		batch = log_buf;
+		n = log_buf_offset;
+		seq = log_seq;
+		log_buf = (batch == log_bufs[0]) ? log_bufs[1] : log_bufs[0];
+		log_buf_offset = 0;
+		log_flushing = true;
+		// Anyone waiting for room can have the other buffer now
+		cv_broadcast(log_flushed, log_buf_lock);
+		lock_release(log_buf_lock);
+
+		write_log(log_fs, batch, n);
+
+		lock_acquire(log_buf_lock);
+		log_flushing = false;
+		log_flushed_seq = seq;
+		cv_broadcast(log_flushed, log_buf_lock);
+	}
+	log_writer_exit = false;
+	cv_broadcast(log_flushed, log_buf_lock);
+	lock_release(log_buf_lock);
+}
+
+/*
+ * Where record SEQ was written: block number and index within it. SEQ
+ * must not be past the head, nor more than a journal behind it.
+ */
+static
+void jn_position(unsigned seq, unsigned *bseq, unsigned *ix) {
+	unsigned back = jn_written_seq - seq;
+
+	KASSERT(back <= MAX_JN_ENTRIES);
+	*bseq = jn_head_bseq;
+	if (back <= jn_head_block.jb_nrec) {
+		*ix = jn_head_block.jb_nrec - back;
+		return;
+	}
+	back -= jn_head_block.jb_nrec;
+	*bseq -= (back + REC_PER_BLK - 1) / REC_PER_BLK;
+	*ix = (REC_PER_BLK - back % REC_PER_BLK) % REC_PER_BLK;
+}
+
+static
+void write_head_block(struct fs *fs) {
+	int result;
+
+	jn_head_block.jb_seq = jn_head_bseq;
+	jn_head_block.jb_sum = jn_block_checksum(&jn_head_block);
+	result = sfs_writeblock(fs, JN_LOCATION(fs) + jn_head_bseq % JN_BLOCKS,
+		&jn_head_block, SFS_BLOCKSIZE);
+	if (result) {
+		panic("write_log");
+	}
+	jn_stats.js_writes++;
+}
 
+/*
+ * Write the summary block, with the tail at record IX of block BSEQ.
+ * The head isn't in it; recovery finds the end of the log by reading
+ * on until a block doesn't belong.
+ */
+static
+void write_summary(struct fs *fs, unsigned bseq, unsigned ix) {
+	int result;
+
+	jn_summary.s.jn_seq = bseq;
+	jn_summary.s.jn_tail = ix;
+	result = sfs_writeblock(fs, JN_SUMMARY_LOCATION(fs), &jn_summary,
+		SFS_BLOCKSIZE);
+	if (result) {
+		panic("write_summary");
+	}
+	jn_disk_tail_bseq = bseq;
+}
+
+/*
+ * Append the N records of BATCH to the on-disk journal. Each block is
+ * filled in the head block and written out whole, once per batch at
+ * most, so a small batch costs one write.
+ *
+ * The summary is only written when the head is about to reuse a slot
+ * the summary on disk still calls live, or has fallen a quarter of the
+ * journal behind the real tail. An old tail costs recovery some extra
+ * replaying, which is harmless.
+ *
+ * Only the log writer writes the journal, so this runs without
+ * log_buf_lock. It never has to wait for room: the records between the
+ * tail and the head are covered by the reservations create_transaction
+ * made, which never add up to more than JN_ROOM.
+ */
+static
+void write_log(struct fs *fs, struct record *batch, int n) {
+	unsigned last, tail, tail_bseq, tail_ix;
+	struct record *r;
+	int i, j, take;
+
+	// The last block this batch puts records in
+	last = jn_head_bseq + (jn_head_block.jb_nrec + n - 1) / REC_PER_BLK;
+
+	lock_acquire(checkpoint_lock);
+	// Past the last record written, the tail is just the head
+	tail = jn_tail_seq;
+	if ((int)(tail - jn_written_seq) > 0) {
+		tail = jn_written_seq;
+	}
+	jn_position(tail, &tail_bseq, &tail_ix);
+	KASSERT(last - tail_bseq < JN_BLOCKS);
+	lock_release(checkpoint_lock);
+
+	if (last - jn_disk_tail_bseq >= JN_BLOCKS ||
+	    tail_bseq - jn_disk_tail_bseq >= JN_BLOCKS / 4) {
+		write_summary(fs, tail_bseq, tail_ix);
+	}
+
+	for (i = 0; i < n; i += take) {
+		take = REC_PER_BLK - jn_head_block.jb_nrec;
+		if (take > n - i) {
+			take = n - i;
+		}
+		for (j = 0; j < take; j++) {
+			r = &jn_head_block.jb_rec[jn_head_block.jb_nrec++];
+			*r = batch[i + j];
+			r->checksum = record_checksum(r, jn_head_bseq);
+		}
+		write_head_block(fs);
+		if (jn_head_block.jb_nrec == (unsigned)REC_PER_BLK) {
+			jn_head_bseq++;
+			jn_head_block.jb_nrec = 0;
+		}
+	}
+	jn_written_seq += n;
+	jn_stats.js_records += n;
+}
+
+/*
+ * Write back every block of T. Returns EAGAIN if one of them can't be
+ * written yet.
+ */
+static
+int checkpoint_transaction(struct fs *fs, struct transaction *t) {
+	unsigned i, num;
+	int result;
+
+	num = array_num(t->blocks);
+	for (i = 0; i < num; i++) {
+		result = sync_fs_block(fs,
+			(daddr_t)(uintptr_t)array_get(t->blocks, i));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The checkpointer. Once the log passes JN_CHECKPOINT_START it takes the
+ * committed transactions at the front of jn_live, writes back their
+ * buffers (and the free block bitmap if they changed it) and retires
+ * them, moving the tail up, until the log is down to JN_CHECKPOINT_STOP.
+ *
+ * An open transaction at the front holds the tail until it commits. So
+ * does a committed one with a buffer that is busy or that a newer open
+ * transaction has pinned; that is tried again at the next commit, or
+ * straight away if a new transaction is waiting for room. Either way the
+ * open ones go on: their room in the log was reserved when they started.
+ */
+static
+void
+checkpoint_thread(void *x1, unsigned long x2)
+{
+	struct fs *fs = x1;
+	struct transaction *t;
+	unsigned i, num, done;
+	bool bitmap;
+	int result;
+
+	(void)x2;
+
+	lock_acquire(checkpoint_lock);
+	while (!checkpoint_exit) {
+		if ((log_used() <= JN_CHECKPOINT_STOP && jn_space_waiters == 0) ||
+		    array_num(jn_live) == 0 ||
+		    !((struct transaction *)array_get(jn_live, 0))->committed) {
+			cv_wait(jn_work, checkpoint_lock);
+			continue;
+		}
+
+		/*
+		 * Only we take committed transactions out, and only open
+		 * ones are added or aborted, so the first NUM stay put.
+		 */
+		num = array_num(jn_live);
+		for (i = 0; i < num; i++) {
+			t = array_get(jn_live, i);
+			if (!t->committed) {
+				break;
 			}
 		}
-		kfree(tmp);
-		// Write full blocks
-		while (log_buf_offset-i >= REC_PER_BLK) {
-			result = sfs_writeblock(fs, block + journal_offset / REC_PER_BLK,
-				&log_buf[i], SFS_BLOCKSIZE);
+		num = i;
+		lock_release(checkpoint_lock);
+
+		result = 0;
+		bitmap = false;
+		for (done = 0; done < num; done++) {
+			// The array itself may be reallocated by record()
+			lock_acquire(checkpoint_lock);
+			t = array_get(jn_live, done);
+			lock_release(checkpoint_lock);
+			result = checkpoint_transaction(fs, t);
 			if (result) {
-				lock_release(log_buf_lock);
-				panic("flush_log_buf");
+				break;
 			}
-			i += REC_PER_BLK;
-			journal_offset += REC_PER_BLK;
+			bitmap = bitmap || t->bitmap;
 		}
-		KASSERT(i<=log_buf_offset);
-		if (log_buf_offset != i) {
-			result = sfs_writeblock(fs, block + journal_offset / REC_PER_BLK,
-				&log_buf[i], SFS_BLOCKSIZE);
+		if (bitmap) {
+			result = sfs_writemap(fs->fs_data);
 			if (result) {
-				lock_release(log_buf_lock);
-				panic("flush_log_buf");
+				panic("sfs: checkpoint: %s\n", strerror(result));
 			}
-			journal_offset += log_buf_offset - i;
-			i += log_buf_offset - i;
 		}
-		KASSERT(i == log_buf_offset);
-		// Record max
-		for (i=0; i< log_buf_offset; i++) {
-			if (log_buf[i].transaction_id > max) {
-				max = log_buf[i].transaction_id;
+
+		lock_acquire(checkpoint_lock);
+		for (i = 0; i < done; i++) {
+			t = array_get(jn_live, 0);
+			array_remove(jn_live, 0);
+			free_transaction(t);
+		}
+		if (done > 0) {
+			update_tail();
+		}
+		if (result == EAGAIN) {
+			if (jn_space_waiters > 0) {
+				lock_release(checkpoint_lock);
+				thread_yield();
+				lock_acquire(checkpoint_lock);
+			}
+			else {
+				cv_wait(jn_work, checkpoint_lock);
 			}
 		}
-		// Clear log buf
-		log_buf_offset = 0;
+		else if (result) {
+			panic("sfs: checkpoint: %s\n", strerror(result));
+		}
 	}
-	KASSERT(journal_offset <= MAX_JN_ENTRIES);
+	checkpoint_exit = false;
+	cv_broadcast(jn_space, checkpoint_lock);
+	lock_release(checkpoint_lock);
+}
 
-	// Update journal summary block
-	struct sfs_jn_summary *s = kmalloc(SFS_BLOCKSIZE);
-	if (s == NULL) {
-		lock_release(log_buf_lock);
+int sfs_jn_start(struct fs *fs, uint32_t next_bseq) {
+	int result;
+
+	log_work = cv_create("log work");
+	if (log_work == NULL) {
+		return ENOMEM;
+	}
+	log_flushed = cv_create("log flushed");
+	if (log_flushed == NULL) {
+		result = ENOMEM;
+		goto fail1;
+	}
+	jn_work = cv_create("checkpoint work");
+	if (jn_work == NULL) {
 		result = ENOMEM;
-		panic("flush_log_buf");
+		goto fail2;
 	}
-	sfs_readblock(fs, JN_SUMMARY_LOCATION(fs), s, SFS_BLOCKSIZE);
-	s->num_entries = journal_offset;
-	if (max > s->max_id)
-		s->max_id = max;
-	sfs_writeblock(fs, JN_SUMMARY_LOCATION(fs), s, SFS_BLOCKSIZE);
-	kfree(s);
+	jn_space = cv_create("journal space");
+	if (jn_space == NULL) {
+		result = ENOMEM;
+		goto fail3;
+	}
+	jn_live = array_create();
+	if (jn_live == NULL) {
+		result = ENOMEM;
+		goto fail4;
+	}
+
+	log_fs = fs;
+	jn_mode = sfs_jn_mode;
+	bzero(&jn_stats, sizeof(jn_stats));
+	log_buf = log_bufs[0];
+	log_buf_offset = 0;
+	log_seq = 0;
+	log_flushed_seq = 0;
+	log_waiters = 0;
+	log_flushing = false;
+	log_writer_exit = false;
+	jn_tail_seq = 0;
+	jn_written_seq = 0;
+	jn_reserved = 0;
+	jn_space_waiters = 0;
+	checkpoint_exit = false;
 
-	lock_release(log_buf_lock); // This also act as on disk journal log here
-}
+	/*
+	 * Recovery is done with the log; start a new one past the last
+	 * block of it, so nothing left on disk can pass for part of the new
+	 * one, and write the summary so the old one is gone.
+	 */
+	jn_head_bseq = next_bseq;
+	bzero(&jn_head_block, sizeof(jn_head_block));
+	bzero(&jn_summary, sizeof(jn_summary));
+	write_summary(fs, jn_head_bseq, 0);
 
-void journal_iterator(struct fs *fs, void (*f)(struct record *)) {
-	int i, j, entries;
-	struct record *r = kmalloc(SFS_BLOCKSIZE);
-	daddr_t block = JN_LOCATION(fs);
-
-	// Get number of entries in journal
-	struct sfs_jn_summary *s = kmalloc(SFS_BLOCKSIZE);
-	if (s == NULL)
-		panic("Cannot allocate memory for journal summary");
-	if (sfs_readblock(fs, JN_SUMMARY_LOCATION(fs), s, SFS_BLOCKSIZE))
-		panic("Cannot from journal summary");
-	entries = s->num_entries;
-	kfree(s);
-	// Pass it to function
-	for(i=0; i<(ROUNDUP(entries, REC_PER_BLK)/REC_PER_BLK); i++) {
-		if (sfs_readblock(fs, block + i, r, SFS_BLOCKSIZE))
-			panic("Just panic");
-		for (j=0; j<REC_PER_BLK; j++) {
-			(*f)(&r[j]);
+	result = thread_fork("sfs log writer", log_writer_thread, NULL, 0, NULL);
+	if (result) {
+		goto fail5;
+	}
+	result = thread_fork("sfs checkpoint", checkpoint_thread, fs, 0, NULL);
+	if (result) {
+		lock_acquire(log_buf_lock);
+		log_writer_exit = true;
+		cv_signal(log_work, log_buf_lock);
+		while (log_writer_exit) {
+			cv_wait(log_flushed, log_buf_lock);
 		}
+		lock_release(log_buf_lock);
+		goto fail5;
 	}
+	return 0;
+
+ fail5:
+	array_destroy(jn_live);
+ fail4:
+	cv_destroy(jn_space);
+ fail3:
+	cv_destroy(jn_work);
+ fail2:
+	cv_destroy(log_flushed);
+ fail1:
+	cv_destroy(log_work);
+	return result;
 }
 
-void fs_journal_iterator(struct fs *fs, struct bitmap *b, void (*f)(struct fs *,struct record *)) {
-	int i, j, entries;
-	struct record *r = kmalloc(SFS_BLOCKSIZE);
-	daddr_t block = JN_LOCATION(fs);
-
-	// Get number of entries in journal
-	struct sfs_jn_summary *s = kmalloc(SFS_BLOCKSIZE);
-	if (s == NULL)
-		panic("Cannot allocate memory for journal summary");
-	if (sfs_readblock(fs, JN_SUMMARY_LOCATION(fs), s, SFS_BLOCKSIZE))
-		panic("Cannot from journal summary");
-	entries = s->num_entries;
-	kfree(s);
-	// Pass it to function
-	for(i=0; i<(ROUNDUP(entries, REC_PER_BLK)/REC_PER_BLK); i++) {
-		if (sfs_readblock(fs, block + i, r, SFS_BLOCKSIZE))
-			panic("Just panic");
-		for (j=0; j<REC_PER_BLK; j++) {
-			if (bitmap_isset(b,r[j].transaction_id))
-				(*f)(fs,&r[j]);
-		}
+/*
+ * Called at unmount, after the final sync: nothing is open, and every
+ * committed transaction is on disk, so the journal can be left empty.
+ */
+void sfs_jn_stop(struct fs *fs) {
+	struct transaction *t;
+
+	lock_acquire(checkpoint_lock);
+	KASSERT(num_active_transactions == 0);
+	KASSERT(jn_reserved == 0);
+	checkpoint_exit = true;
+	cv_signal(jn_work, checkpoint_lock);
+	while (checkpoint_exit) {
+		cv_wait(jn_space, checkpoint_lock);
+	}
+	lock_release(checkpoint_lock);
+
+	lock_acquire(log_buf_lock);
+	KASSERT(log_waiters == 0);
+	log_writer_exit = true;
+	cv_signal(log_work, log_buf_lock);
+	while (log_writer_exit) {
+		cv_wait(log_flushed, log_buf_lock);
+	}
+	lock_release(log_buf_lock);
+
+	while (array_num(jn_live) > 0) {
+		t = array_get(jn_live, 0);
+		KASSERT(t->committed);
+		array_remove(jn_live, 0);
+		free_transaction(t);
 	}
+	write_summary(fs, jn_head_bseq, jn_head_block.jb_nrec);
+
+	array_destroy(jn_live);
+	cv_destroy(jn_space);
+	cv_destroy(jn_work);
+	cv_destroy(log_flushed);
+	cv_destroy(log_work);
+	log_fs = NULL;
+}
+
+/*
+ * The writer's counts are only ever updated before the records they
+ * cover are flushed, so a caller whose commits are done sees them all.
+ */
+void sfs_jn_getstats(struct sfs_jn_stats *js) {
+	lock_acquire(log_buf_lock);
+	lock_acquire(checkpoint_lock);
+	*js = jn_stats;
+	lock_release(checkpoint_lock);
+	lock_release(log_buf_lock);
 }
@@ -48,6 +48,11 @@
 
 #define MAX_REGIONS 10
 
+// Region flags
+#define REGION_MMAP 1   // Made by mmap, and may be taken away by munmap
+#define REGION_SHARED 2 // Writes go back to the file (MAP_SHARED)
+#define REGION_MAYWRITE 4 // mprotect may make it writable
+
 struct vnode;
 
 
@@ -73,22 +78,33 @@ void pte_set_exists(struct pt_ent *pte, unsigned exists);
  * Page table helper methods
  *
  *    pt_create - allocates a first-level page table and returns it
- *    pt_destroy - frees primary page table and all non-NULL secondary ones
+ *    pt_destroy - frees primary page table and all non-NULL secondary ones, unsharing
+ *                 (rather than freeing) pages still mapped copy-on-write elsewhere
  *    get_pt_entry - returns the page table entry for the given VA/AS combo or NULL if doesn't exist
  *    va_to_pa - returns the PPN + offset corresponding to the given VA, if a mapping exists, or NOMAP otherwise
  *    pt_insert - creates a pte for the given mapping, allocating secondary page table if necessary.  If the
  *                mapping already exists, does nothing.  Returns 0 on success.
  *    pt_update - updates location of an existing entry and AND old permissions with new.  Returns 0 on success.
+ *    pt_next - returns the first existing entry at or above *va and below end, updating *va to its address,
+ *              or NULL if there is none.  Only looks at second-level tables and chunks marked populated,
+ *              so walking a whole address space costs about as much as the pages it has.
+ *    pt_protect_range - sets the permissions of every existing entry in [start, end)
+ *    pt_unmap_range - removes every existing entry in [start, end), freeing (or unsharing) its frame or
+ *                     swap slot, and frees second-level tables left empty.  Caller must hold pt_lock and
+ *                     pins on the resident pages in the range.
  */
 
 struct pt_ent **pt_create(void);
-void pt_destroy(struct pt_ent **pt);
+void pt_destroy(struct addrspace *as, struct pt_ent **pt);
 struct pt_ent *get_pt_entry(struct addrspace *as, vaddr_t va);
 paddr_t va_to_pa(struct addrspace *as, vaddr_t va);
 int pt_insert(struct addrspace *as, vaddr_t va, int ppn, int permissions);
 int pt_remove(struct addrspace *as, vaddr_t va);
 int pt_update(struct addrspace *as, vaddr_t va, 
 	int ppn, int permissions, unsigned is_present);
+struct pt_ent *pt_next(struct addrspace *as, vaddr_t *va, vaddr_t end);
+void pt_protect_range(struct addrspace *as, vaddr_t start, vaddr_t end, int permissions);
+void pt_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end);
 
 
 /*
@@ -104,16 +120,32 @@ struct region {
 	int readable;
 	int writeable;
 	int executable;
+	int flags;
+	// File backing, for pages faulted in from an executable or a mapped
+	// file: file_sz bytes at file_vaddr come from vn at file_offset,
+	// everything else is zero
+	struct vnode *vn;	// NULL for anonymous memory
+	vaddr_t file_vaddr;	// Need not be page aligned
+	off_t file_offset;
+	size_t file_sz;
 };
 
 struct addrspace {
 	struct lock *pt_lock;
 	struct pt_ent **page_table;
+	// Summary of the page table: which second-level tables exist, and for
+	// each one which 32-entry chunks hold existing entries
+	uint32_t pt_populated[PAGE_ENTRIES / 32];
+	uint32_t *pt_chunks;
 	// Heap pointers
 	vaddr_t heap_start;
 	vaddr_t heap_end;
 	struct array *regions;
-	bool is_loading;
+	// TLB address space ID, valid while asid_gen is the current generation
+	unsigned asid;
+	uint32_t asid_gen;
+	// Bitmask of cpus that may hold TLB entries under that ID
+	uint32_t asid_cpus;
 };
 
 /*
@@ -139,6 +171,10 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_file_region - set up a region whose first pages are read
+ *                from a file the first time they are touched, rather
+ *                than filled with zeros. Takes a reference to the vnode.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -148,6 +184,43 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_protect_range - change the permissions of the pages mapped in
+ *                [start, end).
+ *
+ *    as_unmap_range - throw away the pages mapped in [start, end),
+ *                first writing back those of shared mappings.
+ *
+ *    as_define_mapping - set up a region for mmap at an address of its
+ *                own choosing below the stack, handed back in *ret.
+ *                Like as_define_file_region, but the region does not
+ *                move the heap, and with SHARED set its pages are
+ *                written back to VN instead of going to swap. OFFSET
+ *                must be page aligned. Returns ENOMEM if there is no
+ *                room. Unless MAYWRITE is set, mprotect may not make
+ *                it writable.
+ *
+ *    as_unmap_regions - munmap [start, end): throw away the pages and
+ *                cut the range out of the mmap regions it touches.
+ *                Other regions are left alone.
+ *
+ *    as_protect_regions - mprotect [start, end): change the permissions
+ *                of the mmap regions in the range, splitting those it
+ *                covers only in part, and of their pages.
+ *
+ *    as_overlaps - whether any region overlaps [start, end).
+ *
+ *    as_page_is_file - whether any of the page at va is file backed.
+ *
+ *    as_page_text - the executable the page at va can be shared through
+ *                (see textcache_lookup), or NULL.
+ *
+ *    as_page_mapped - the file of the shared mapping the page at va is in,
+ *                or NULL; *file_page is set to the page of the file.
+ *
+ *    as_fill_page - read the file backed parts of the page at va into
+ *                the frame at pa, which must already be zeroed. Does
+ *                file system I/O, so must be called without pt_lock.
  */
 
 struct addrspace *as_create(void);
@@ -160,18 +233,45 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_define_file_region(struct addrspace *as,
+                                   vaddr_t vaddr, size_t sz,
+                                   int readable,
+                                   int writeable,
+                                   int executable,
+                                   struct vnode *vn, off_t offset,
+                                   size_t filesz);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+void              as_protect_range(struct addrspace *as, vaddr_t start,
+                                   vaddr_t end, int permissions);
+void              as_unmap_range(struct addrspace *as, vaddr_t start,
+                                 vaddr_t end);
+int               as_define_mapping(struct addrspace *as, size_t sz,
+                                    int permissions, bool shared,
+                                    bool maywrite, struct vnode *vn,
+                                    off_t offset, size_t filesz,
+                                    vaddr_t *ret);
+int               as_unmap_regions(struct addrspace *as, vaddr_t start,
+                                   vaddr_t end);
+int               as_protect_regions(struct addrspace *as, vaddr_t start,
+                                     vaddr_t end, int permissions);
+bool              as_overlaps(struct addrspace *as, vaddr_t start,
+                              vaddr_t end);
 
 int as_get_permissions(struct addrspace *as, vaddr_t va);
+bool as_page_is_file(struct addrspace *as, vaddr_t va);
+struct vnode *as_page_text(struct addrspace *as, vaddr_t va);
+struct vnode *as_page_mapped(struct addrspace *as, vaddr_t va, int *file_page);
+int as_fill_page(struct addrspace *as, vaddr_t va, paddr_t pa);
 
 
 /*
  * Functions in loadelf.c
- *    load_elf - load an ELF user program executable into the current
- *               address space. Returns the entry point (initial PC)
- *               in the space pointed to by ENTRYPOINT.
+ *    load_elf - map an ELF user program executable into the current
+ *               address space; its pages are read in as they are
+ *               touched. Returns the entry point (initial PC) in the
+ *               space pointed to by ENTRYPOINT.
  */
 
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
@@ -107,8 +107,13 @@ int buffer_writeout(struct buf *buf);
 
 /*
  * Sync.
+ *
+ * sync_fs_block writes out one block's buffer if it is dirty, for the
+ * journal checkpointer; it returns EAGAIN, writing nothing, if the
+ * buffer is busy or held by a transaction.
  */
 int sync_fs_buffers(struct fs *fs);
+int sync_fs_block(struct fs *fs, daddr_t block);
 
 /*
  * Starvation/deadlock avoidance logic.
@@ -135,6 +140,9 @@ void set_doom(int);
 
 
 unsigned buf_getref(struct buf *b);
+daddr_t buf_getblock(struct buf *b);
+int buf_copyout(struct buf *b, daddr_t block, size_t off, void *data,
+		size_t len);
 void buf_incref(struct buf *b);
 void buf_decref(struct buf *b);
 
@@ -34,7 +34,7 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
-#define NUM_PRIORITIES 3
+#define NUM_PRIORITIES 4
 
 
 /*
@@ -47,7 +47,10 @@
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
  */
 
-// Multi-level feedback queue per CPU for scheduling
+// Multi-level feedback queue per CPU for scheduling. A thread at level i
+// runs for up to 1<<i hardclocks before being demoted a level; blocking
+// moves it up a level, and schedule() periodically lifts everything back
+// to level 0 so that nothing starves.
 struct mlf_queue {
 	struct threadlist runqueue[NUM_PRIORITIES];
 };
@@ -57,6 +60,9 @@ struct thread *mlf_rem_tail(struct mlf_queue *m);
 bool mlf_isempty(struct mlf_queue *m);
 unsigned mlf_count(struct mlf_queue *m);
 
+/* Number of free pages each cpu caches for itself */
+#define CPU_PAGE_MAGAZINE 8
+
 struct cpu {
 	/*
 	 * Fixed after allocation.
@@ -94,11 +100,41 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * Each batch of shootdowns queued takes a ticket from
+	 * c_shootdown_ticket; c_shootdown_done is the last ticket whose
+	 * mappings have been invalidated, and senders spin on it.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	uint32_t c_shootdown_ticket;
+	volatile uint32_t c_shootdown_done;
 	struct spinlock c_ipi_lock;
+
+	/*
+	 * Free swap slot cache: a contiguous run of slots [c_swap_next,
+	 * c_swap_end) reserved for this cpu. Protected by c_swap_lock
+	 * (other cpus only take from it when swap is otherwise full).
+	 */
+	unsigned c_swap_next;
+	unsigned c_swap_end;
+	struct spinlock c_swap_lock;
+
+	/*
+	 * Magazine of recently freed physical pages (coremap indices),
+	 * used before the global free lists. Protected by c_cm_lock
+	 * (other cpus only take from it when memory is otherwise full).
+	 */
+	int c_cm_magazine[CPU_PAGE_MAGAZINE];
+	unsigned c_cm_nmag;
+	struct spinlock c_cm_lock;
+
+	/*
+	 * ASID generation whose translations this cpu's TLB may hold.
+	 * Only touched by this cpu, at splhigh.
+	 */
+	uint32_t c_asid_gen;
 };
 
 #define TLBSHOOTDOWN_ALL  (-1)
@@ -126,6 +162,12 @@ void cpu_hatch(unsigned software_number);
  */
 const char *cpu_identify(void);
 
+/*
+ * Iterate over all cpus, for subsystems that keep per-cpu state.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned index);
+
 /*
  * Hardware-level interrupt on/off, for the current CPU.
  *
@@ -164,6 +206,10 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_cpus invalidates several mappings on every cpu in
+ * a bitmask of cpu numbers (including the current one), sending one IPI
+ * per target and then waiting for all of them at once. It must be
+ * called from thread context with no spinlocks held.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -178,8 +224,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
-void ipi_tlbshootdown_wait(struct cpu *target, uint32_t ppn);
-void ipi_tlbshootdown_wait_all(uint32_t ppn);
+void ipi_tlbshootdown_cpus(uint32_t cpus, const struct tlbshootdown *mappings,
+			   unsigned n);
 
 void interprocessor_interrupt(void);
 
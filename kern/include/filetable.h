@@ -0,0 +1,99 @@
+/*
+ * Added for PetrelOS
+ */
+
+#ifndef _FILETABLE_H_
+#define _FILETABLE_H_
+
+/*
+ * Open files and per-process file descriptor tables.
+ *
+ * A struct file_table is one open file: a vnode, the mode it was opened
+ * with, and a seek position. Any number of descriptors, in any number of
+ * processes (through fork and dup2), may refer to one; the vnode is
+ * closed when the last reference is dropped. The reference count has its
+ * own spinlock, so passing files around never sleeps.
+ *
+ * The sleeping mutex is only needed to keep the seek position consistent
+ * across a read or write that moves it. I/O at an explicit position, and
+ * I/O on objects without a position (the console), goes straight to the
+ * vnode.
+ *
+ * Functions:
+ *     file_open   - vfs_open PATH and wrap it in a new open file.
+ *     file_incref - add a reference.
+ *     file_decref - drop a reference, closing the file on the last one.
+ *     file_rw     - read or write through UIO. With AT set, uio_offset
+ *                   is used as is and the seek position is untouched;
+ *                   otherwise the I/O happens at, and advances, the seek
+ *                   position.
+ *
+ * A struct fdtable maps a process's descriptors to open files. A bitmap
+ * of the descriptors in use gives the lowest free one without scanning
+ * the entries. Only the owning process changes its table, so looking a
+ * descriptor up takes no lock; fdt_lock orders changes against anyone
+ * copying the table.
+ *
+ *     fdtable_create  - an empty table, or NULL if out of memory.
+ *     fdtable_copy    - a table sharing every open file of SRC (for fork).
+ *     fdtable_destroy - drop every descriptor, then free the table.
+ *     fdtable_stdio   - open the console as descriptors 0, 1 and 2.
+ *     fdtable_add     - install FILE at the lowest free descriptor.
+ *                       Returns EMFILE if there is none.
+ *     fdtable_get     - look a descriptor up. Returns EBADF if not open.
+ *     fdtable_set     - install FILE at descriptor FD, handing back what
+ *                       was there (or NULL) in *OLD for the caller to drop.
+ *     fdtable_remove  - clear descriptor FD, handing back its file.
+ *
+ * fdtable_add and fdtable_set take over the caller's reference to FILE;
+ * fdtable_get does not add one.
+ */
+
+#include <limits.h>
+#include <spinlock.h>
+
+struct uio;
+struct vnode;
+
+#define MAX_FILE_DESCRIPTOR		__FD_MAX
+
+/* Open file */
+struct file_table{
+    int status;
+    off_t offset;
+    int update_pos; // 0 for console, 1 for files
+
+    struct lock *mutex; // Held across I/O that moves offset
+    struct vnode *file;
+
+    struct spinlock reflock;
+    int refcnt;
+};
+
+struct fdtable {
+	struct spinlock fdt_lock;
+	uint32_t fdt_inuse[(MAX_FILE_DESCRIPTOR + 31) / 32];
+	struct file_table *fdt_files[MAX_FILE_DESCRIPTOR];
+};
+
+/* Cache for open files, which are allocated on every open */
+struct objcache;
+extern struct objcache file_table_cache;
+
+int file_open(char *path, int flags, mode_t mode, struct file_table **ret);
+void file_incref(struct file_table *file);
+void file_decref(struct file_table *file);
+int file_rw(struct file_table *file, struct uio *uio, bool at);
+
+struct fdtable *fdtable_create(void);
+int fdtable_copy(struct fdtable *src, struct fdtable **ret);
+void fdtable_destroy(struct fdtable *fdt);
+int fdtable_stdio(struct fdtable *fdt);
+int fdtable_add(struct fdtable *fdt, struct file_table *file, int *fd);
+int fdtable_get(struct fdtable *fdt, int fd, struct file_table **ret);
+int fdtable_set(struct fdtable *fdt, int fd, struct file_table *file,
+		struct file_table **old);
+int fdtable_remove(struct fdtable *fdt, int fd, struct file_table **ret);
+
+
+#endif /* _FILETABLE_H_ */
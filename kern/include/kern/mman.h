@@ -0,0 +1,25 @@
+/*
+ * Added for PetrelOS
+ */
+
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Codes for mmap(), shared between the kernel and <sys/mman.h>.
+ */
+
+/* Protection: any combination, or PROT_NONE */
+#define PROT_NONE     0
+#define PROT_READ     1      /* Pages may be read */
+#define PROT_WRITE    2      /* Pages may be written */
+#define PROT_EXEC     4      /* Pages may be executed */
+
+/* Flags: exactly one of MAP_SHARED and MAP_PRIVATE */
+#define MAP_SHARED    0x0001 /* Writes go to the file */
+#define MAP_PRIVATE   0x0002 /* Writes are private copy-on-write */
+#define MAP_ANON      0x1000 /* Zero filled memory, no file */
+#define MAP_ANONYMOUS MAP_ANON
+
+
+#endif /* _KERN_MMAN_H_ */
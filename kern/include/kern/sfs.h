@@ -73,13 +73,14 @@
 #define REC_DIR 4
 #define REC_BITMAP 5
 #define REC_COMMIT 6
+#define REC_IMAGE 7	/* part of a whole metadata block */
 
 /*
  * On-disk journal superblock
  */
 struct sfs_jn_summary {
-	int32_t num_entries; // If zero, no recovery necessary
-	uint32_t max_id;
+	uint32_t jn_seq;  // Number of the journal block the tail is in
+	uint32_t jn_tail; // Oldest record needed, within that block
 };
 
 /*
@@ -0,0 +1,78 @@
+/*
+ * Added for PetrelOS
+ */
+
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object caches for small kernel objects that are created and destroyed
+ * all the time (locks, semaphores, open file entries, journal records).
+ *
+ * Objects of one size are carved out of whole pages ("slabs"), so an
+ * object's slab is found from its address without kmalloc's search of
+ * every subpage page. Each cpu keeps a small magazine of recently freed
+ * objects; allocation and free normally touch only that.
+ *
+ * An optional constructor runs once on each object when its slab is
+ * filled, not on every allocation, so objects must be handed back to
+ * objcache_free in their constructed state. There is no destructor, so
+ * a constructor should only set up plain fields.
+ *
+ * Caches are usually defined statically with OBJCACHE_INITIALIZER, so
+ * they can be used at any point during boot without being created.
+ *
+ * Functions:
+ *     objcache_create  - allocate a new cache for objects of SIZE bytes.
+ *                        Returns NULL on error.
+ *     objcache_alloc   - get an object. Returns NULL if out of memory.
+ *     objcache_free    - return an object to the cache it came from.
+ *     objcache_destroy - destroy a cache from objcache_create; every
+ *                        object must have been freed.
+ *     objcache_printstats - print slab usage of a cache.
+ *
+ * Objects from a cache must not be passed to kfree, nor kmalloc'd memory
+ * to objcache_free.
+ */
+
+#include <spinlock.h>
+
+/* Cpus beyond this many share the slab lists directly. */
+#define OBJCACHE_CPUS 32
+
+/* Objects held in each cpu's magazine. */
+#define OBJCACHE_MAGSIZE 8
+
+struct objcache_slab; /* Opaque. */
+
+struct objcache_mag {
+	struct spinlock om_lock;
+	unsigned om_count;
+	void *om_objs[OBJCACHE_MAGSIZE];
+};
+
+struct objcache {
+	const char *oc_name;
+	size_t oc_size;
+	void (*oc_ctor)(void *obj);
+
+	struct spinlock oc_lock;		/* Protects the fields below */
+	struct objcache_slab *oc_partial;	/* Slabs with free objects */
+	struct objcache_slab *oc_empty;		/* One wholly free slab kept back */
+	unsigned oc_nslabs;
+
+	struct objcache_mag oc_mags[OBJCACHE_CPUS];
+};
+
+#define OBJCACHE_INITIALIZER(name, size, ctor) \
+	{ name, size, ctor, SPINLOCK_INITIALIZER, NULL, NULL, 0, {} }
+
+struct objcache *objcache_create(const char *name, size_t size,
+				 void (*ctor)(void *obj));
+void *objcache_alloc(struct objcache *oc);
+void objcache_free(struct objcache *oc, void *obj);
+void objcache_destroy(struct objcache *oc);
+void objcache_printstats(struct objcache *oc);
+
+
+#endif /* _OBJCACHE_H_ */
@@ -52,6 +52,8 @@
 
 #define BUF_RECORDS 128
 #define RECORD_SIZE 80 /* bytes */
+#define IMAGE_CHUNK 64 /* bytes of a block image per record */
+#define IMAGE_PARTS (SFS_BLOCKSIZE / IMAGE_CHUNK)
 /* 4 records live in a 512-byte block
  * 32 records live in page size journal buffer
  * 512 records (16 filled buffers) live in 128 block journal
@@ -62,15 +64,24 @@
  */
 struct lock *transaction_id_lock;
 struct lock *log_buf_lock;
-int journal_offset;
 
 struct transaction {
 	unsigned id;
     struct array *bufs; /* buffer caches that the transaction has used */
+    struct array *blocks; /* their block numbers, for the checkpointer */
+    struct array *freed; /* blocks it freed, to free in memory at commit */
+    unsigned first_seq; /* log sequence number of its first record */
+    unsigned nrecs;     /* records it has logged */
+    bool logged;        /* has records in the log */
+    bool committed;
+    bool bitmap;        /* has changed the free block bitmap */
+    bool images;        /* has changes to log as block images */
+    bool full;          /* refused a block allocation for lack of room */
 };
 
 struct record {
-	uint32_t transaction_type;
+	uint16_t transaction_type;
+	uint16_t checksum;	/* record_checksum(), set as it is written */
 	uint32_t transaction_id;
 	union changed {
 		struct r_inode{
@@ -102,10 +113,17 @@ struct record {
 			uint32_t index;
 			uint32_t setting;
 		} r_bitmap;
+		struct r_image {
+			uint32_t block;
+			uint32_t part;	/* which IMAGE_CHUNK of it */
+			char data[IMAGE_CHUNK];
+		} r_image;
 	} changed;
 };
 
-struct record log_buf[BUF_RECORDS];
+/* Cache that makerec_* allocate records from; check_and_record frees them */
+struct objcache;
+extern struct objcache record_cache;
 
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
@@ -144,20 +162,89 @@ struct record *makerec_isize(uint32_t inode_num, uint32_t size);
 struct record *makerec_ilink(uint32_t inode_num, uint32_t linkcount);
 struct record *makerec_dir(uint32_t parent_inode, uint32_t slot, uint32_t inode, const char *sfd_name);
 struct record *makerec_bitmap(uint32_t index, uint32_t setting);
+struct record *makerec_image(uint32_t block, uint32_t part, const char *image);
 
+/*
+ * On-disk journal. After the summary block come JN_BLOCKS journal
+ * blocks, used as a ring. Blocks are numbered in the order they are
+ * written, and block number N lives in slot N % JN_BLOCKS, so a slot left
+ * over from an earlier time round the ring has the wrong number.
+ * JN_BLOCKS divides 2^32, so the numbers can wrap.
+ *
+ * The block trailer is checksummed as a whole, and each record on its
+ * own, salted with the number of the block it was written to: a block
+ * torn by a crash still gives up the records that made it, and no stale
+ * ones.
+ */
+#define REC_PER_BLK ((int) (SFS_BLOCKSIZE / (RECORD_SIZE)))
+#define BITBLOCKS(fs) SFS_BITBLOCKS(((struct sfs_fs*)(fs)->fs_data)->sfs_super.sp_nblocks)
+#define JN_SUMMARY_LOCATION(fs) (SFS_MAP_LOCATION + BITBLOCKS(fs) + 1)
+#define JN_LOCATION(fs) (JN_SUMMARY_LOCATION(fs) + 1)
+#define JN_BLOCKS (SFS_JN_SIZE-1)
+#define MAX_JN_ENTRIES (JN_BLOCKS * REC_PER_BLK)
+
+struct jn_block {
+	struct record jb_rec[REC_PER_BLK];
+	uint32_t jb_seq;			/* block number */
+	uint32_t jb_nrec;			/* records in use */
+	uint32_t jb_sum;			/* of everything above */
+	char jb_pad[SFS_BLOCKSIZE - REC_PER_BLK * RECORD_SIZE - 12];
+};
+
+uint16_t record_checksum(const struct record *r, uint32_t bseq);
+uint32_t jn_block_checksum(const struct jn_block *jb);
+
+/*
+ * Recovery, at mount. sfs_recover redoes every committed transaction in
+ * the journal, leaving the freemap changed in memory, and hands back the
+ * number of the first block past the log. journal_iterator passes each
+ * record in the log to F, for debugging.
+ */
+void sfs_recover(struct fs *fs, uint32_t *next_bseq);
 void journal_iterator(struct fs *fs, void (*f)(struct record *));
-void fs_journal_iterator(struct fs *fs, struct bitmap *b, void (*f)(struct fs *,struct record *));
-void apply_record(struct fs *fs, struct record *r);
+
+/*
+ * Group commit. Records are staged in memory and written to the journal
+ * by a log writer thread, one batch for however many transactions are
+ * committing at the time; commit() sleeps until its records are on disk.
+ *
+ * The journal is circular. A checkpointer thread keeps it from filling
+ * by writing back the buffers of the oldest committed transactions and
+ * then moving the tail past them; nothing else waits for it unless the
+ * log does fill.
+ *
+ * Both threads are started at mount, once recovery is done, with the log
+ * starting at block NEXT_BSEQ, and stopped at unmount, after the final
+ * sync, when the journal is left empty.
+ */
+int sfs_jn_start(struct fs *fs, uint32_t next_bseq);
+void sfs_jn_stop(struct fs *fs);
+
+/*
+ * Journal modes. SFS_JN_RECORDS logs each change to the metadata as a
+ * record of its own. SFS_JN_BLOCKS logs an image of each metadata block
+ * a transaction changed, once, when it commits, however many changes it
+ * made to it. Changes to the free block bitmap are logged as records in
+ * both. sfs_jn_mode is read at mount; recovery takes either.
+ */
+#define SFS_JN_RECORDS 0
+#define SFS_JN_BLOCKS 1
+extern int sfs_jn_mode;
+
+/* Journal activity since mount */
+struct sfs_jn_stats {
+	unsigned js_commits;		/* transactions committed */
+	unsigned js_records;		/* records written to the journal */
+	unsigned js_images;		/* block images, IMAGE_PARTS records each */
+	unsigned js_writes;		/* journal block writes */
+};
+void sfs_jn_getstats(struct sfs_jn_stats *js);
 
 ////////////////////////////////////////////////////////////
 // Checkpoint synchronization
 
-struct cv *no_active_transactions;
-struct cv *checkpoint_cleared;
-struct lock *transaction_lock;
 struct lock *checkpoint_lock;
 int num_active_transactions;
-int in_checkpoint;
 
 /*
  * Function for mounting a sfs (calls vfs_mount)
@@ -180,6 +267,9 @@ int sfs_writeblock(struct fs *fs, daddr_t block, void *data, size_t len);
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Write the free block bitmap if it has changed */
+int sfs_writemap(struct sfs_fs *sfs);
+
 /* Convenience functions */
 int sfs_load_inode(struct sfs_vnode *sv);
 void sfs_release_inode(struct sfs_vnode *sv);
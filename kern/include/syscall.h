@@ -70,6 +70,12 @@ int sys_close(int fd);
 int sys_read(int fd, userptr_t buf, size_t buf_len, int *err);
 int sys_write(int fd, userptr_t buf, size_t nbytes, int *err);
 int sys_rw(int fd, userptr_t buf, size_t nbytes, int *err, int rw);
+int sys_prw(int fd, userptr_t buf, size_t nbytes, off_t pos, int *err, int rw);
+int sys_rwv(int fd, userptr_t iov, int iovcnt, int *err, int rw);
+int sys_pread(int fd, userptr_t buf, size_t nbytes, off_t pos, int *err);
+int sys_pwrite(int fd, userptr_t buf, size_t nbytes, off_t pos, int *err);
+int sys_readv(int fd, userptr_t iov, int iovcnt, int *err);
+int sys_writev(int fd, userptr_t iov, int iovcnt, int *err);
 int sys_dup2(int oldfd, int newfd, int *err);
 off_t sys_lseek(int fd,off_t pos, int whence, int *err);
 void sys__exit(int exitcode);
@@ -80,6 +86,10 @@ pid_t sys_waitpid(pid_t pid, int *status, int options, int *err);
 pid_t sys_fork(struct trapframe *tf, int *err);
 int sys_execv(userptr_t progname, userptr_t args);
 int sys_sbrk(int amount, int *err);
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fd,
+	off_t offset, int *err);
+int sys_munmap(vaddr_t addr, size_t len);
+int sys_mprotect(vaddr_t addr, size_t len, int prot);
 
 #endif /* _SYSCALL_H_ */
 
@@ -67,6 +67,8 @@ int readstress(int, char **);
 int writestress(int, char **);
 int writestress2(int, char **);
 int createstress(int, char **);
+int journalbench(int, char **);
+int journaltest(int, char **);
 int printfile(int, char **);
 
 /* other tests */
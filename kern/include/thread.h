@@ -58,7 +58,6 @@ struct vnode;
 /* Macro to test if two addresses are on the same kernel stack */
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
-#define MAX_FILE_DESCRIPTOR		__FD_MAX
 #define MAX_PROCESSES			__PID_MAX
 
 /* States a thread can be in. */
@@ -69,23 +68,6 @@ typedef enum {
 	S_ZOMBIE,	/* zombie; exited but not yet deleted */
 } threadstate_t;
 
-/* Linked list of pids */
-struct pid_list{
-    pid_t pid;
-    struct pid_list *next;
-};
-
-/* File table */
-struct file_table{
-    int status;
-    off_t offset;
-    int refcnt;
-    int update_pos; // 0 for console, 1 for files
-
-    struct lock *mutex;
-    struct vnode *file;
-};
-
 /* Thread structure. */
 struct thread {
 	/*
@@ -136,16 +118,26 @@ struct thread {
 
 	/* add more here as needed */
 	pid_t pid;
-	pid_t parent_pid;
+	pid_t parent_pid;  // > 0 while someone will collect our exit status
 	int exit_status;
 
-	struct pid_list *children;
-	struct file_table **fd;
+	// Process tree, protected by pid_lock. children heads a doubly
+	// linked list of the processes we forked, through t_sibling_*.
+	struct thread *t_parent;
+	struct thread *children;
+	struct thread *t_sibling_next;
+	struct thread *t_sibling_prev;
+	bool t_parked;  // Exited and switched out, awaiting thread_disown
+
+	struct fdtable *t_fdtable;  // Open file descriptors (see filetable.h)
 
 	struct semaphore *waiting_on;
 
 	// Scheduling variables
-	int priority;  // 0 is highest priority, MAX_PRIORITY is lowest
+	int priority;  // 0 is highest priority, NUM_PRIORITIES-1 is lowest
+	unsigned t_ticks;  // Hardclocks used of the quantum at this priority
+	unsigned t_lastrun;  // t_cpu's c_hardclocks when it last stopped running
+	bool t_background;  // Kept at the lowest priority; see thread_set_background
 };
 
 
@@ -153,8 +145,30 @@ struct thread {
  * Process table global declarations
  */
 extern struct thread **process_table;
-extern struct lock *getpid_lock;
-extern struct lock *global_exec_lock;
+
+/*
+ * Process IDs and the process tree.
+ *
+ *     pid_alloc     - reserve a free pid, or return -1 if there are none.
+ *                     Pids are handed out round robin, so one just freed
+ *                     is not reused straight away. PID_MIN is never given
+ *                     out; it belongs to the process started by the menu.
+ *     pid_claim     - reserve a particular pid. Returns EBUSY if taken.
+ *     pid_free      - release a pid reserved but never used.
+ *     proc_link_child - enter CHILD in the process table under its pid
+ *                     and make it a child of PARENT.
+ *     proc_get_child - look up PID, which must be a child of the current
+ *                     thread. Returns NULL and sets *err if not.
+ *     thread_disown - give up interest in T's exit status. T is destroyed
+ *                     (and its pid freed) now if it has finished exiting,
+ *                     or as soon as it does.
+ */
+pid_t pid_alloc(void);
+int pid_claim(pid_t pid);
+void pid_free(pid_t pid);
+void proc_link_child(struct thread *parent, struct thread *child);
+struct thread *proc_get_child(pid_t pid, int *err);
+void thread_disown(struct thread *t);
 
 /* Call once during system startup to allocate data structures. */
 void thread_bootstrap(void);
@@ -206,10 +220,24 @@ void thread_yield(void);
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Charge the current thread for one hardclock. Returns true if it should
+ * be preempted, either because it has used up its quantum (and has been
+ * demoted) or because a higher priority thread is waiting. Called from
+ * the timer interrupt.
+ */
+bool thread_quantum_tick(void);
+
+/*
+ * Move the current thread to the lowest priority for good: it is not
+ * promoted when it wakes up or when schedule() boosts everything, so it
+ * only runs when nothing else on its CPU is runnable.
+ */
+void thread_set_background(void);
+
+/*
+ * Print the run queues of every cpu.
  */
-void thread_consider_migration(void);
+void thread_printqueues(void);
 
 
 #endif /* _THREAD_H_ */
@@ -61,4 +61,16 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/*
+ * TLB address space IDs.
+ *
+ *     vm_activate     - load AS's ID (giving it one if needed) on this cpu.
+ *                       NULL switches to the ID no user mapping uses.
+ *     vm_tlbflush_as  - make every TLB entry AS has on any cpu unreachable,
+ *                       by moving it to a fresh ID.
+ */
+struct addrspace;
+void vm_activate(struct addrspace *as);
+void vm_tlbflush_as(struct addrspace *as);
+
 #endif /* _VM_H_ */
@@ -134,6 +134,7 @@ boot(void)
 	vfs_setbootfs("emu0");
 
 	swapfile_init();
+	coremap_start_threads();
 
 	/*
 	 * Make sure various things aren't screwed up.
@@ -42,6 +42,8 @@
 #include <test.h>
 #include <synch.h>
 #include <buf.h>
+#include <vm.h>
+#include <machine/coremap.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
@@ -146,8 +148,7 @@ common_prog(int nargs, char **args)
 		return result;
 	}
 	P(thread->waiting_on);
-	sem_destroy(thread->waiting_on);
-	thread->parent_pid = -1;
+	thread_disown(thread);
 
 	return 0;
 }
@@ -364,6 +365,65 @@ cmd_doom(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_SFS
+static
+int
+cmd_jnmode(int nargs, char **args)
+{
+	if (nargs != 2 ||
+	    (strcmp(args[1], "records") && strcmp(args[1], "blocks"))) {
+		kprintf("Usage: jmode records|blocks\n");
+		return EINVAL;
+	}
+
+	sfs_jn_mode = strcmp(args[1], "blocks") ? SFS_JN_RECORDS :
+		SFS_JN_BLOCKS;
+
+	kprintf("SFS journal mode set to %s, from the next mount.\n",
+		args[1]);
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_pageout(int nargs, char **args)
+{
+	int low, high;
+	if (nargs != 3) {
+		kprintf("Usage: pgwm <low watermark> <high watermark>\n");
+		return EINVAL;
+	}
+
+	low = atoi(args[1]);
+	high = atoi(args[2]);
+	pageout_set_watermarks(low, high);
+	pageout_get_watermarks(&low, &high);
+
+	kprintf("Pageout watermarks set to %d/%d pages.\n", low, high);
+
+	return 0;
+}
+
+static
+int
+cmd_readahead(int nargs, char **args)
+{
+	int val;
+	if (nargs != 2) {
+		kprintf("Usage: ra <pages>\n");
+		return EINVAL;
+	}
+
+	val = atoi(args[1]);
+	swapin_set_readahead(val);
+
+	kprintf("Swap read-ahead window set to %d pages.\n", val);
+
+	return 0;
+}
+
 /*
  * Command to set the "boot fs".
  *
@@ -405,6 +465,18 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_runqueues(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printqueues();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -440,6 +512,11 @@ static const char *opsmenu[] = {
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
 	"[doom]    Set the SFS Doom Counter  ",
+#if OPT_SFS
+	"[jmode]   Set the SFS journal mode  ",
+#endif
+	"[pgwm]    Set pageout watermarks    ",
+	"[ra]      Set swap read-ahead window",
 	"[bootfs]  Set \"boot\" filesystem     ",
 	"[pf]      Print a file              ",
 	"[cd]      Change directory          ",
@@ -483,6 +560,10 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+#if OPT_SFS
+	"[fs6] SFS journal benchmark         ",
+	"[fs7] SFS journal recovery test     ",
+#endif
 	NULL
 };
 
@@ -512,6 +593,7 @@ static const char *mainmenu[] = {
 	"[pz] Piazza                         ",
 #endif
 	"[kh] Kernel heap stats              ",
+	"[rq] Scheduler run queues           ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -548,6 +630,11 @@ static struct {
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
 	{ "doom",   cmd_doom },
+#if OPT_SFS
+	{ "jmode",	cmd_jnmode },
+#endif
+	{ "pgwm",	cmd_pageout },
+	{ "ra",		cmd_readahead },
 	{ "bootfs",	cmd_bootfs },
 	{ "pf",		printfile },
 	{ "cd",		cmd_chdir },
@@ -567,6 +654,7 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "rq",         cmd_runqueues },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -594,6 +682,10 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+#if OPT_SFS
+	{ "fs6",	journalbench },
+	{ "fs7",	journaltest },
+#endif
 
 	/* unittests */
 	{ "ut1", 	lock_unittest },
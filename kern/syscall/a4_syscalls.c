@@ -46,6 +46,7 @@
 #include <vfs.h>
 #include <vnode.h>
 #include <syscall.h>
+#include <filetable.h>
 
 /*
  * sync - call vfs_sync
@@ -163,14 +164,7 @@ sys_rename(userptr_t oldpath, userptr_t newpath)
 
 static int
 filetable_findfile(int fd, struct file_table **file) {
-	if (fd >= MAX_FILE_DESCRIPTOR) {
-		return EBADF;
-	}
-	*file = curthread->fd[fd];
-	if (*file == NULL) {
-		return EBADF;
-	}
-	return 0;
+	return fdtable_get(curthread->t_fdtable, fd, file);
 }
 
 
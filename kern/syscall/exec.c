@@ -2,6 +2,7 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <lib.h>
+#include <limits.h>
 #include <thread.h>
 #include <current.h>
 #include <addrspace.h>
@@ -13,108 +14,196 @@
 #include <kern/unistd.h>
 #include <copyinout.h>
 
-//TODO: Use global lock instead
+/*
+ * Argument staging
+ *
+ * Arguments are held in the kernel between leaving the old address space
+ * and entering the new one. They are packed back to back, NULs included,
+ * into page sized chunks allocated as they fill, so a short argument list
+ * costs one page and a full ARG_MAX never needs a large contiguous block.
+ * A string may run across a chunk boundary.
+ *
+ * Everything here belongs to the one exec, so execs need no lock between
+ * them and run in parallel.
+ */
 
-int sys_execv(userptr_t progname, userptr_t args){
-    int i, pad, argc, result, part;
-    char *kbuf;
-    size_t get, offset;
-    struct vnode *v;
-    vaddr_t entrypoint, stackptr;
-    userptr_t userdest;
+#define ARG_CHUNKS   (ARG_MAX / PAGE_SIZE)
+#define ARG_PTRBATCH 32  // argv entries copied out at a time
 
-    struct addrspace *old_addr = curthread->t_addrspace;
-    char **usr_args = (char**)args;
+struct argstage {
+    char *chunks[ARG_CHUNKS];
+    size_t len;  // Bytes of strings staged
+    int argc;
+};
 
-    kbuf = (void *) kmalloc(sizeof(void *));
+static
+void
+argstage_init(struct argstage *st)
+{
+    int i;
 
-    // Check user pointer (reusing kbuf)
-    /*
-     * This only checks four bytes of the user-supplied argv array.  You can
-     * thus safely access argv[0], but further accesses to argv[i] are still
-     * unsafe and unchecked.
-     */
-    result = copyin((const_userptr_t)args,kbuf,4);
-    if (result){
-        kfree(kbuf);
-        return result;
+    for (i=0; i<ARG_CHUNKS; i++)
+        st->chunks[i] = NULL;
+    st->len = 0;
+    st->argc = 0;
+}
+
+static
+void
+argstage_cleanup(struct argstage *st)
+{
+    int i;
+
+    for (i=0; i<ARG_CHUNKS && st->chunks[i] != NULL; i++)
+        kfree(st->chunks[i]);
+}
+
+/*
+ * Copy in the NULL terminated argv array ARGS and its strings. The
+ * strings and the argv array the new process gets must fit in ARG_MAX
+ * together, or E2BIG.
+ */
+static
+int
+argstage_copyin(struct argstage *st, userptr_t args)
+{
+    userptr_t arg;
+    size_t off, room, limit, got;
+    char **chunk;
+    int result;
+
+    while (1) {
+        result = copyin((const_userptr_t)((vaddr_t)args + st->argc * sizeof(userptr_t)),
+                        &arg, sizeof(userptr_t));
+        if (result)
+            return result;
+        if (arg == NULL)
+            return 0;
+        st->argc++;
+
+        // Copy the string a chunk's worth at a time
+        while (1) {
+            // Leave room for argv itself, including its NULL
+            limit = sizeof(userptr_t) * (st->argc + 1);
+            if (st->len + limit >= ARG_MAX)
+                return E2BIG;
+            limit = ARG_MAX - limit - st->len;
+
+            chunk = &st->chunks[st->len / PAGE_SIZE];
+            if (*chunk == NULL) {
+                *chunk = kmalloc(PAGE_SIZE);
+                if (*chunk == NULL)
+                    return ENOMEM;
+            }
+            off = st->len % PAGE_SIZE;
+            room = PAGE_SIZE - off;
+            if (room > limit)
+                room = limit;
+
+            result = copyinstr((const_userptr_t)arg, *chunk + off, room, &got);
+            if (result == 0) {
+                st->len += got;
+                break;
+            }
+            if (result != ENAMETOOLONG)
+                return result;
+            // Filled the chunk without finding the end; carry on in the next
+            st->len += room;
+            arg = (userptr_t)((vaddr_t)arg + room);
+        }
     }
-    kfree(kbuf);
+}
 
-    // Ensure only 1 exec at a time
-    lock_acquire(global_exec_lock);
+/*
+ * Copy the staged arguments onto the new user stack below *STACKPTR:
+ * the strings, then the argv array pointing at them. Hands back the new
+ * stack pointer, which is also where argv starts.
+ */
+static
+int
+argstage_copyout(struct argstage *st, vaddr_t *stackptr)
+{
+    userptr_t ptrs[ARG_PTRBATCH];
+    vaddr_t strbase, argv, dest;
+    size_t pos, n;
+    int i, k, result;
 
-    // Count args
-    argc = 0;
-    /*
-     * These accesses are unsafe.
-     */
-    while(usr_args[argc] != NULL){
-        argc++;
+    strbase = *stackptr - st->len;
+    argv = (strbase - sizeof(userptr_t) * (st->argc + 1)) & ~(vaddr_t)7;
+
+    for (i=0; (size_t)i * PAGE_SIZE < st->len; i++) {
+        n = st->len - i * PAGE_SIZE;
+        if (n > PAGE_SIZE)
+            n = PAGE_SIZE;
+        result = copyout(st->chunks[i], (userptr_t)(strbase + i * PAGE_SIZE), n);
+        if (result)
+            return result;
     }
 
-    /*
-     * With an ARG_MAX of 65536, it is definitely unsafe to be allocating these
-     * arrays on the stack; they could easily overflow the 4k kernel stack
-     * page.
-     */
-    size_t got[argc];
-    userptr_t user_argv[argc];
-
-    /*
-     * Allocating such a large amount of contiguous memory may become very
-     * difficult or impossible due to external fragmentation in the kernel heap
-     * or in physical memory.  You may want to consider allocating smaller
-     * buffers on demand, as you need them.
-     */
-    char *args_buf = kmalloc(PAGE_SIZE*sizeof(char));
-    if (args_buf == NULL)
-        goto err_;
-
-    // Check user pointer
-    kbuf = (char *)kmalloc(PATH_MAX*sizeof(char));
-    if (kbuf == NULL){
-        result = ENOMEM;
-        goto err0;
+    // Walk the strings for where each starts, writing argv out in batches
+    pos = 0;
+    dest = argv;
+    k = 0;
+    for (i=0; i<=st->argc; i++) {
+        if (i < st->argc) {
+            ptrs[k++] = (userptr_t)(strbase + pos);
+            while (st->chunks[pos / PAGE_SIZE][pos % PAGE_SIZE] != 0)
+                pos++;
+            pos++;
+        }
+        else {
+            ptrs[k++] = NULL;
+        }
+        if (k == ARG_PTRBATCH || i == st->argc) {
+            result = copyout(ptrs, (userptr_t)dest, k * sizeof(userptr_t));
+            if (result)
+                return result;
+            dest += k * sizeof(userptr_t);
+            k = 0;
+        }
     }
+    KASSERT(pos == st->len);
+
+    *stackptr = argv;
+    return 0;
+}
+
+int sys_execv(userptr_t progname, userptr_t args){
+    int result;
+    char *kbuf;
+    size_t get;
+    struct vnode *v;
+    vaddr_t entrypoint, stackptr;
+    struct argstage st;
+
+    struct addrspace *old_addr = curthread->t_addrspace;
+
+    kbuf = (char *)kmalloc(PATH_MAX*sizeof(char));
+    if (kbuf == NULL)
+        return ENOMEM;
     result = copyinstr((const_userptr_t)progname,kbuf,PATH_MAX,&get);
     if (result){
         goto err1;
     }
 
+    // Copy args to kernel; the array is terminated by a NULL
+    argstage_init(&st);
+    result = argstage_copyin(&st, args);
+    if (result){
+        goto err2;
+    }
+
     /* Open the file. */
-    result = vfs_open((char *)progname, O_RDONLY, 0, &v);
+    result = vfs_open(kbuf, O_RDONLY, 0, &v);
     if (result) {
-        goto err1;
+        goto err2;
     }
 
     // Keep old addrspace in case of failure
     struct addrspace *new_addr = as_create();
     if (new_addr == NULL){
         result = ENOMEM;
-        goto err2;
-    }
-
-    // Copy args to kernel with copyinstr; The array is terminated by a NULL
-    // The args argument is an array of 0-terminated strings.
-    i = 0;
-    part = 0;
-    /*
-     * These accesses are (still) unsafe.
-     */
-    while (usr_args[i] != NULL){
-      /*
-       * If the user has two arguments of size ARG_MAX - 1, this will easily
-       * overflow args_buf.  In particular, you never actually enforce that the
-       * user's arguments are bound by ARG_MAX; you just assume the user will
-       * oblige.
-       */
-        result = copyinstr((const_userptr_t)usr_args[i], &args_buf[part], PAGE_SIZE, &got[i]);
-        if (result){
-            goto err3;
-        }
-        part += got[i];
-        i++;
+        goto err3;
     }
 
     // Swap addrspace
@@ -134,62 +223,34 @@ int sys_execv(userptr_t progname, userptr_t args){
     }
 
     // Copy args to new addrspace
-    offset = 0;
-    for (i=argc-1; i>-1; i--){
-        part -= got[i]; // readjust inherited part index
-        /*
-         * Assuming that pointers are 4-byte aligned breaks the machine
-         * dependency abstraction barrier.
-         */
-        pad = (4 - (got[i]%4) ) % 4; // Word align
-        offset += pad;
-        offset += got[i];
-
-        user_argv[i] = (userptr_t)(stackptr - offset);
-
-        result = copyoutstr((const char*)&args_buf[part], user_argv[i], got[i], &get);
-        if (result){
-            goto err4;
-        }
-    }
-
-    // Copy pointers to argv
-    userdest = user_argv[0] - 4 * (argc+1);
-    stackptr = (vaddr_t)userdest; // Set stack pointer
-    for (i=0; i<argc; i++){
-        result = copyout((const void *)&user_argv[i], userdest, 4);
-        if (result)
-            goto err4;
-        userdest += 4;
+    result = argstage_copyout(&st, &stackptr);
+    if (result){
+        goto err4;
     }
 
     // Wrap up
-    kfree(args_buf);
+    argstage_cleanup(&st);
+    kfree(kbuf);
     vfs_close(v);
-    lock_release(global_exec_lock);
+    if (old_addr != NULL)
+        as_destroy(old_addr);
 
     /* Warp to user mode. */
-    enter_new_process(argc, (userptr_t)stackptr, stackptr, entrypoint);
+    enter_new_process(st.argc, (userptr_t)stackptr, stackptr, entrypoint);
 
     /* enter_new_process does not return. */
-    /*
-     * You should panic if this happens; in no correct execution of the kernel
-     * should this ever occur.
-     */
+    panic("enter_new_process returned\n");
     return EINVAL;
 
     err4:
         curthread->t_addrspace = old_addr;
         as_activate(curthread->t_addrspace);
-    err3:
         as_destroy(new_addr);
-    err2:
+    err3:
         vfs_close(v);
+    err2:
+        argstage_cleanup(&st);
     err1:
         kfree(kbuf);
-    err0:
-        kfree(args_buf);
-    err_:
-        lock_release(global_exec_lock);
         return result;
 }
@@ -0,0 +1,284 @@
+/*
+ * Added for PetrelOS
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/unistd.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <objcache.h>
+#include <filetable.h>
+
+/*
+ * Open files and descriptor tables. See filetable.h.
+ */
+
+struct objcache file_table_cache =
+	OBJCACHE_INITIALIZER("file_table", sizeof(struct file_table), NULL);
+
+#define FD_ISSET(fdt, fd) \
+	((fdt)->fdt_inuse[(fd) / 32] & ((uint32_t)1 << ((fd) % 32)))
+#define FD_SET(fdt, fd) \
+	((fdt)->fdt_inuse[(fd) / 32] |= (uint32_t)1 << ((fd) % 32))
+#define FD_CLEAR(fdt, fd) \
+	((fdt)->fdt_inuse[(fd) / 32] &= ~((uint32_t)1 << ((fd) % 32)))
+
+////////////////////////////////////////
+// Open files
+
+int
+file_open(char *path, int flags, mode_t mode, struct file_table **ret)
+{
+	struct file_table *file;
+	struct vnode *vn;
+	int result;
+
+	file = objcache_alloc(&file_table_cache);
+	if (file == NULL) {
+		return ENOMEM;
+	}
+	file->mutex = lock_create("file offset");
+	if (file->mutex == NULL) {
+		objcache_free(&file_table_cache, file);
+		return ENOMEM;
+	}
+
+	result = vfs_open(path, flags, mode, &vn);
+	if (result) {
+		lock_destroy(file->mutex);
+		objcache_free(&file_table_cache, file);
+		return result;
+	}
+
+	file->status = flags & O_ACCMODE;
+	file->offset = 0;
+	/* Character devices (the console) have no position */
+	file->update_pos = VOP_TRYSEEK(vn, 0) == 0;
+	file->file = vn;
+	spinlock_init(&file->reflock);
+	file->refcnt = 1;
+
+	*ret = file;
+	return 0;
+}
+
+void
+file_incref(struct file_table *file)
+{
+	spinlock_acquire(&file->reflock);
+	KASSERT(file->refcnt > 0);
+	file->refcnt++;
+	spinlock_release(&file->reflock);
+}
+
+void
+file_decref(struct file_table *file)
+{
+	int refs;
+
+	spinlock_acquire(&file->reflock);
+	KASSERT(file->refcnt > 0);
+	refs = --file->refcnt;
+	spinlock_release(&file->reflock);
+
+	if (refs > 0) {
+		return;
+	}
+
+	// Returns void; prints for hard I/O errors so no way to return them
+	vfs_close(file->file);
+	lock_destroy(file->mutex);
+	spinlock_cleanup(&file->reflock);
+	objcache_free(&file_table_cache, file);
+}
+
+int
+file_rw(struct file_table *file, struct uio *uio, bool at)
+{
+	bool seek = !at && file->update_pos;
+	int result;
+
+	if (seek) {
+		lock_acquire(file->mutex);
+		uio->uio_offset = file->offset;
+	}
+
+	if (uio->uio_rw == UIO_READ) {
+		result = VOP_READ(file->file, uio);
+	}
+	else {
+		result = VOP_WRITE(file->file, uio);
+	}
+
+	if (seek) {
+		file->offset = uio->uio_offset;
+		lock_release(file->mutex);
+	}
+	return result;
+}
+
+////////////////////////////////////////
+// Descriptor tables
+
+struct fdtable *
+fdtable_create(void)
+{
+	struct fdtable *fdt;
+
+	fdt = kmalloc(sizeof(struct fdtable));
+	if (fdt == NULL) {
+		return NULL;
+	}
+	spinlock_init(&fdt->fdt_lock);
+	bzero(fdt->fdt_inuse, sizeof(fdt->fdt_inuse));
+	bzero(fdt->fdt_files, sizeof(fdt->fdt_files));
+	return fdt;
+}
+
+int
+fdtable_copy(struct fdtable *src, struct fdtable **ret)
+{
+	struct fdtable *fdt;
+	int fd;
+
+	fdt = fdtable_create();
+	if (fdt == NULL) {
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&src->fdt_lock);
+	for (fd = 0; fd < MAX_FILE_DESCRIPTOR; fd++) {
+		if (FD_ISSET(src, fd)) {
+			file_incref(src->fdt_files[fd]);
+			fdt->fdt_files[fd] = src->fdt_files[fd];
+		}
+	}
+	memcpy(fdt->fdt_inuse, src->fdt_inuse, sizeof(fdt->fdt_inuse));
+	spinlock_release(&src->fdt_lock);
+
+	*ret = fdt;
+	return 0;
+}
+
+void
+fdtable_destroy(struct fdtable *fdt)
+{
+	struct file_table *file;
+	int fd;
+
+	for (fd = 0; fd < MAX_FILE_DESCRIPTOR; fd++) {
+		if (fdtable_remove(fdt, fd, &file) == 0) {
+			file_decref(file);
+		}
+	}
+	spinlock_cleanup(&fdt->fdt_lock);
+	kfree(fdt);
+}
+
+int
+fdtable_stdio(struct fdtable *fdt)
+{
+	static const int modes[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
+	struct file_table *file, *old;
+	char path[5];
+	int fd, result;
+
+	KASSERT(STDIN_FILENO == 0 && STDOUT_FILENO == 1 && STDERR_FILENO == 2);
+
+	for (fd = 0; fd < 3; fd++) {
+		/* vfs_open may scribble on the path */
+		strcpy(path, "con:");
+		result = file_open(path, modes[fd], 0664, &file);
+		if (result) {
+			return result;
+		}
+		result = fdtable_set(fdt, fd, file, &old);
+		KASSERT(result == 0);
+		if (old != NULL) {
+			file_decref(old);
+		}
+	}
+	return 0;
+}
+
+int
+fdtable_add(struct fdtable *fdt, struct file_table *file, int *fd)
+{
+	uint32_t free;
+	int i, bit;
+
+	spinlock_acquire(&fdt->fdt_lock);
+	for (i = 0; i * 32 < MAX_FILE_DESCRIPTOR; i++) {
+		free = ~fdt->fdt_inuse[i];
+		if (free == 0) {
+			continue;
+		}
+		for (bit = 0; (free & ((uint32_t)1 << bit)) == 0; bit++) {
+			/* find lowest clear bit */
+		}
+		if (i * 32 + bit >= MAX_FILE_DESCRIPTOR) {
+			break;
+		}
+		*fd = i * 32 + bit;
+		FD_SET(fdt, *fd);
+		fdt->fdt_files[*fd] = file;
+		spinlock_release(&fdt->fdt_lock);
+		return 0;
+	}
+	spinlock_release(&fdt->fdt_lock);
+	return EMFILE;
+}
+
+int
+fdtable_get(struct fdtable *fdt, int fd, struct file_table **ret)
+{
+	if (fd < 0 || fd >= MAX_FILE_DESCRIPTOR || fdt == NULL) {
+		return EBADF;
+	}
+	*ret = fdt->fdt_files[fd];
+	if (*ret == NULL) {
+		return EBADF;
+	}
+	return 0;
+}
+
+int
+fdtable_set(struct fdtable *fdt, int fd, struct file_table *file,
+	    struct file_table **old)
+{
+	if (fd < 0 || fd >= MAX_FILE_DESCRIPTOR) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&fdt->fdt_lock);
+	*old = fdt->fdt_files[fd];
+	fdt->fdt_files[fd] = file;
+	FD_SET(fdt, fd);
+	spinlock_release(&fdt->fdt_lock);
+	return 0;
+}
+
+int
+fdtable_remove(struct fdtable *fdt, int fd, struct file_table **ret)
+{
+	if (fd < 0 || fd >= MAX_FILE_DESCRIPTOR) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&fdt->fdt_lock);
+	*ret = fdt->fdt_files[fd];
+	if (*ret == NULL) {
+		spinlock_release(&fdt->fdt_lock);
+		return EBADF;
+	}
+	fdt->fdt_files[fd] = NULL;
+	FD_CLEAR(fdt, fd);
+	spinlock_release(&fdt->fdt_lock);
+	return 0;
+}
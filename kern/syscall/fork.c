@@ -14,6 +14,7 @@
 #include <addrspace.h>
 #include <mips/trapframe.h>
 #include <limits.h>
+#include <filetable.h>
 
 struct init_data{
   struct semaphore *wait_on_child;
@@ -21,18 +22,6 @@ struct init_data{
   struct trapframe *child_tf;
 };
 
-static 
-pid_t
-getpid(){
-  KASSERT(process_table != NULL);
-  int i;
-  for (i=PID_MIN; i<MAX_PROCESSES; i++){
-    if (process_table[i] == NULL)
-      return (pid_t)i;
-  }
-  return -1; // No pids available
-}
-
 static
 void
 child_init(void *p, unsigned long n){
@@ -54,18 +43,12 @@ child_init(void *p, unsigned long n){
 
 
 pid_t sys_fork(struct trapframe *tf, int *err){
-  int i;
-
-  // Acquire and reserve child pid
-  lock_acquire(getpid_lock);
-  pid_t childpid = getpid();
+  // Reserve child pid; it is entered in the process table once the child exists
+  pid_t childpid = pid_alloc();
   if (childpid == -1) {
-    lock_release(getpid_lock);
     *err = ENPROC;
     goto err1;
   }
-  process_table[childpid] = curthread; // NOTE: This reserves the pid until child process is initiated
-  lock_release(getpid_lock);
 
   // Synchronization primitives to be passed to childe intialization routine
   struct init_data *s = kmalloc(sizeof(struct init_data));
@@ -103,10 +86,10 @@ pid_t sys_fork(struct trapframe *tf, int *err){
     goto err8;
   }
 
-  // Create a pid_list entry for the parent
-  struct pid_list *new_child_pidlist = kmalloc(sizeof(struct pid_list));
-  if (new_child_pidlist == NULL){
-    *err = ENOMEM;
+  // Share the parent's open files
+  struct fdtable *child_fdtable;
+  *err = fdtable_copy(curthread->t_fdtable, &child_fdtable);
+  if (*err){
     goto err9;
   }
 
@@ -119,28 +102,18 @@ pid_t sys_fork(struct trapframe *tf, int *err){
 
   // Populate child thread with allocated fields and those copied from parent
   child_thread->parent_pid = curthread->pid;
-  for (i=0; i<MAX_FILE_DESCRIPTOR; i++){
-    if (curthread->fd[i] != NULL){
-      child_thread->fd[i] = curthread->fd[i];
-      child_thread->fd[i]->refcnt++;
-    }
-  }
+  child_thread->t_fdtable = child_fdtable;
   child_thread->waiting_on = child_waiting_on;
   child_thread->t_addrspace = child_as;
   child_thread->t_cwd = curthread->t_cwd;
   VOP_INCREF(child_thread->t_cwd); 
   child_thread->pid = childpid;
   child_thread->parent_pid = curthread->pid;
+  proc_link_child(curthread, child_thread);
   
   V(s->wait_on_parent);
   P(s->wait_on_child);
 
-  // Insert child's PID into head of parents list
-  new_child_pidlist->next = curthread->children;
-  new_child_pidlist->pid = childpid;
-  curthread->children = new_child_pidlist;
-  process_table[childpid] = child_thread;
-
   // Free init_data (child is done)
   sem_destroy(s->wait_on_parent);
   sem_destroy(s->wait_on_child);
@@ -150,7 +123,7 @@ pid_t sys_fork(struct trapframe *tf, int *err){
 
   // Error cleanup
   err10:
-    kfree(new_child_pidlist);
+    fdtable_destroy(child_fdtable);
   err9:
     sem_destroy(child_waiting_on);
   err8:
@@ -162,9 +135,7 @@ pid_t sys_fork(struct trapframe *tf, int *err){
   err3:
     kfree(s);
   err2:
-    lock_acquire(getpid_lock);
-    process_table[childpid] = NULL;
-    lock_release(getpid_lock);
+    pid_free(childpid);
   err1:
     return -1;
 }
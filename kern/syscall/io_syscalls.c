@@ -6,6 +6,7 @@
 #include <vfs.h>
 #include <vnode.h>
 #include <synch.h>
+#include <filetable.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <current.h>
@@ -13,12 +14,14 @@
 #include <uio.h>
 #include <kern/seek.h>
 #include <kern/stat.h>
+#include <limits.h>
 
 int
 sys_open(userptr_t filename, int flags, int *err) {
-  int i,result;
+  int fd, result;
   char *kbuf;
   size_t got;
+  struct file_table *file;
 
   int f = flags & O_ACCMODE;
   if (f != O_RDONLY && f != O_WRONLY && f != O_RDWR){
@@ -29,149 +32,169 @@ sys_open(userptr_t filename, int flags, int *err) {
     *err = EFAULT;
     return -1;
   }
-  // Look for an available file descriptor
-  for (i=0; i<MAX_FILE_DESCRIPTOR; i++) {
-    if (curthread->fd[i] == NULL) {
-      // Initialize the file table struct and populate it
-      // Note: it seems that vfs_open() will malloc and initialize the vnode
-      curthread->fd[i] = kmalloc(sizeof(struct file_table));
-      if (curthread->fd[i] == NULL){
-        *err = ENOMEM;
-        goto err1;
-      }
-
-      curthread->fd[i]->mutex = lock_create("mutex");
-      if (curthread->fd[i]->mutex == NULL){
-        *err = ENOMEM;
-        goto err2;
-      }
-
-      curthread->fd[i]->refcnt = 1;
-      curthread->fd[i]->status = flags & O_ACCMODE;
-      curthread->fd[i]->offset = 0;
-      curthread->fd[i]->update_pos = 1;
-
-      kbuf = (char *)kmalloc(PATH_MAX*sizeof(char));
-      if (kbuf == NULL){
-        *err = ENOMEM;
-        goto err3;
-      }
-      result = copyinstr((const_userptr_t)filename,kbuf,PATH_MAX,&got);
-      if (result){
-        *err = EFAULT;
-        goto err4;
-      }
-      // Return value is 0 for success
-      *err = vfs_open((char *)filename,flags,0664,&(curthread->fd[i]->file));
-      if (*err){
-        goto err4;
-      }
-
-      // Success
-      kfree(kbuf);
-      return i;
-
-      err4:
-        kfree(kbuf);
-      err3:
-        lock_destroy(curthread->fd[i]->mutex);
-      err2:
-        kfree(curthread->fd[i]);
-        curthread->fd[i] = NULL;
-      err1:
-        return -1;
-    }
+
+  kbuf = (char *)kmalloc(PATH_MAX*sizeof(char));
+  if (kbuf == NULL){
+    *err = ENOMEM;
+    return -1;
   }
-  
-  // If control reaches here, no FDs were available and we return an error
-  *err = EMFILE;
-  return -1;
+  result = copyinstr((const_userptr_t)filename,kbuf,PATH_MAX,&got);
+  if (result){
+    *err = result;
+    goto err1;
+  }
+
+  *err = file_open(kbuf,flags,0664,&file);
+  if (*err){
+    goto err1;
+  }
+  *err = fdtable_add(curthread->t_fdtable,file,&fd);
+  if (*err){
+    goto err2;
+  }
+
+  // Success
+  kfree(kbuf);
+  return fd;
+
+  err2:
+    file_decref(file);
+  err1:
+    kfree(kbuf);
+    return -1;
 }
 
 int 
 sys_close(int fd) {
-  int i;
-  struct file_table *tmp;
-  if (fd < 0 || fd >= MAX_FILE_DESCRIPTOR)
-    return EBADF;
-  if (curthread->fd[fd] == NULL)
-    return EBADF;
-  lock_acquire(curthread->fd[fd]->mutex);
-  
-  curthread->fd[fd]->refcnt--;
-  // Returns void; prints for hard I/O errors so no way to return them
-  if (curthread->fd[fd]->refcnt == 0)
-    vfs_close(curthread->fd[fd]->file);
-  
-  // Free contents of struct (vnode should be freed by vfs_close)
-  if (curthread->fd[fd]->refcnt == 0){
-    lock_release(curthread->fd[fd]->mutex);
-    lock_destroy(curthread->fd[fd]->mutex);
-    kfree(curthread->fd[fd]);
-
-    // Clear all references to this table
-    tmp = curthread->fd[fd];
-    for (i=0; i<MAX_FILE_DESCRIPTOR; i++){
-      if (curthread->fd[i] == tmp)
-        curthread->fd[fd] = NULL;
-    }
-  }
-  else
-    lock_release(curthread->fd[fd]->mutex);
-    curthread->fd[fd] = NULL;
+  struct file_table *file;
+  int result;
+
+  result = fdtable_remove(curthread->t_fdtable,fd,&file);
+  if (result)
+    return result;
+  file_decref(file);
   return 0;
 }
 
-int
-sys_rw(int fd, userptr_t buf, size_t buf_len, int *err, int rw) {
-  if (fd < 0 || fd >= MAX_FILE_DESCRIPTOR){
-    *err = EBADF;
+/*
+ * Read or write through UIO on descriptor FD. The I/O happens at
+ * uio_offset if AT is set (pread and friends), and at the seek position
+ * otherwise. Returns the number of bytes moved.
+ */
+static int
+fd_rw(int fd, struct uio *uio, bool at, int rw, int *err) {
+  struct file_table *file;
+  size_t resid = uio->uio_resid;
+
+  *err = fdtable_get(curthread->t_fdtable,fd,&file);
+  if (*err){
     return -1;
   }
-  if (curthread->fd[fd] == NULL){
+  if ((file->status != rw) && (file->status != O_RDWR)) { 
     *err = EBADF;
     return -1;
   }
-  if (buf == NULL){
-    *err = EFAULT;
+  if (at && !file->update_pos){
+    *err = ESPIPE;
     return -1;
   }
-
-  lock_acquire(curthread->fd[fd]->mutex);
-  
-  if ((curthread->fd[fd]->status != rw) && (curthread->fd[fd]->status != O_RDWR)) { 
-    *err = EBADF;
-    lock_release(curthread->fd[fd]->mutex);
+  if (at && uio->uio_offset < 0){
+    *err = EINVAL;
     return -1;
   }
+
+  uio->uio_rw = (rw == O_RDONLY) ? UIO_READ : UIO_WRITE;
+  *err = file_rw(file,uio,at);
+  return resid - uio->uio_resid;
+}
+
+/*
+ * Single buffer read, write, pread and pwrite.
+ */
+static int
+sys_rw_at(int fd, userptr_t buf, size_t buf_len, off_t pos, bool at,
+          int *err, int rw) {
   struct iovec iov;
   struct uio uio;
 
+  if (buf == NULL){
+    *err = EFAULT;
+    return -1;
+  }
+
   iov.iov_ubase = buf;
   iov.iov_len = buf_len;
   uio.uio_iov = &iov;
   uio.uio_iovcnt = 1;
-  uio.uio_offset = curthread->fd[fd]->offset;
+  uio.uio_offset = pos;
   uio.uio_resid = buf_len;
   uio.uio_segflg = UIO_USERSPACE;
   uio.uio_space = curthread->t_addrspace;
 
-  if (rw == O_RDONLY) {
-    //uio_kinit(&iov, &uio, buf, buf_len, curthread->fd[fd]->offset, UIO_READ);
-    uio.uio_rw = UIO_READ;
-    *err = VOP_READ(curthread->fd[fd]->file,&uio);
+  return fd_rw(fd,&uio,at,rw,err);
+}
+
+int
+sys_rw(int fd, userptr_t buf, size_t buf_len, int *err, int rw) {
+  return sys_rw_at(fd,buf,buf_len,0,false,err,rw);
+}
+
+int
+sys_prw(int fd, userptr_t buf, size_t buf_len, off_t pos, int *err, int rw) {
+  return sys_rw_at(fd,buf,buf_len,pos,true,err,rw);
+}
+
+/*
+ * readv and writev. A few iovecs are copied in on the stack; more
+ * than that are kmalloc'd.
+ */
+#define RWV_STACKIOV  8
+#define RWV_MAXRESID  0x7fffffff  // Must fit the int return value
+
+int
+sys_rwv(int fd, userptr_t iov, int iovcnt, int *err, int rw) {
+  struct iovec stackiov[RWV_STACKIOV];
+  struct iovec *kiov = stackiov;
+  struct uio uio;
+  size_t total = 0;
+  int i, ret = -1;
+
+  if (iovcnt <= 0 || iovcnt > IOV_MAX){
+    *err = EINVAL;
+    return -1;
   }
-  else {
-    uio.uio_rw = UIO_WRITE;
-    *err = VOP_WRITE(curthread->fd[fd]->file,&uio);
+  if (iovcnt > RWV_STACKIOV){
+    kiov = kmalloc(iovcnt*sizeof(struct iovec));
+    if (kiov == NULL){
+      *err = ENOMEM;
+      return -1;
+    }
   }
-  int diff = uio.uio_offset - curthread->fd[fd]->offset;
+  *err = copyin((const_userptr_t)iov,kiov,iovcnt*sizeof(struct iovec));
+  if (*err){
+    goto out;
+  }
+  for (i=0; i<iovcnt; i++){
+    if (kiov[i].iov_len > RWV_MAXRESID - total){
+      *err = EINVAL;
+      goto out;
+    }
+    total += kiov[i].iov_len;
+  }
+
+  uio.uio_iov = kiov;
+  uio.uio_iovcnt = iovcnt;
+  uio.uio_offset = 0;
+  uio.uio_resid = total;
+  uio.uio_segflg = UIO_USERSPACE;
+  uio.uio_space = curthread->t_addrspace;
 
-  if (curthread->fd[fd]->update_pos)
-    curthread->fd[fd]->offset = uio.uio_offset;  
+  ret = fd_rw(fd,&uio,false,rw,err);
 
-  lock_release(curthread->fd[fd]->mutex);
-  return diff;
+ out:
+  if (kiov != stackiov)
+    kfree(kiov);
+  return ret;
 }
 
 int 
@@ -184,34 +207,47 @@ sys_write(int fd, userptr_t buf, size_t buf_len, int *err){
   return sys_rw(fd,buf,buf_len,err,O_WRONLY);
 }
 
+int
+sys_pread(int fd, userptr_t buf, size_t buf_len, off_t pos, int *err){
+  return sys_prw(fd,buf,buf_len,pos,err,O_RDONLY);
+}
+
+int
+sys_pwrite(int fd, userptr_t buf, size_t buf_len, off_t pos, int *err){
+  return sys_prw(fd,buf,buf_len,pos,err,O_WRONLY);
+}
+
+int
+sys_readv(int fd, userptr_t iov, int iovcnt, int *err){
+  return sys_rwv(fd,iov,iovcnt,err,O_RDONLY);
+}
+
+int
+sys_writev(int fd, userptr_t iov, int iovcnt, int *err){
+  return sys_rwv(fd,iov,iovcnt,err,O_WRONLY);
+}
+
 int 
 sys_dup2(int oldfd, int newfd, int *err){
-  if (newfd < 0 || oldfd < 0 || newfd >= MAX_FILE_DESCRIPTOR || oldfd >= MAX_FILE_DESCRIPTOR) {
-    *err = EBADF;
+  struct file_table *file, *old;
+
+  *err = fdtable_get(curthread->t_fdtable,oldfd,&file);
+  if (*err){
     return -1;
   }
-  if (curthread->fd[oldfd] == NULL) {
+  if (newfd < 0 || newfd >= MAX_FILE_DESCRIPTOR) {
     *err = EBADF;
     return -1;
   }
-  if (oldfd == newfd || curthread->fd[oldfd] == curthread->fd[newfd]){
-    return oldfd;
-  }
-  int i;
-  int j=0;
-  for (i=0; i<MAX_FILE_DESCRIPTOR; i++) {
-    if (curthread->fd[i] != NULL)
-      j++;
+  if (oldfd == newfd){
+    return newfd;
   }
-  if (curthread->fd[newfd] != NULL){
-    *err = sys_close(newfd);
-    if (*err)
-      return -1;
-  }
-  curthread->fd[newfd] = curthread->fd[oldfd];
-  lock_acquire(curthread->fd[newfd]->mutex);
-  curthread->fd[newfd]->refcnt++;
-  lock_release(curthread->fd[newfd]->mutex);
+
+  file_incref(file);
+  *err = fdtable_set(curthread->t_fdtable,newfd,file,&old);
+  KASSERT(*err == 0);
+  if (old != NULL)
+    file_decref(old);
   return newfd;
 }
 
@@ -221,42 +257,39 @@ sys_lseek(int fd,off_t pos, int whence, int *err){
     *err = EINVAL;
     return -1;
   }
-  if (fd < 0 || fd >= MAX_FILE_DESCRIPTOR){
-    *err = EBADF;
-    return -1;
-  }
-  if (curthread->fd[fd] == NULL){
-    *err = EBADF;
+  struct file_table *file;
+  *err = fdtable_get(curthread->t_fdtable,fd,&file);
+  if (*err){
     return -1;
   }
-  lock_acquire(curthread->fd[fd]->mutex);
-  if (curthread->fd[fd]->update_pos == 0){
+  lock_acquire(file->mutex);
+  if (file->update_pos == 0){
     *err = ESPIPE;
-    lock_release(curthread->fd[fd]->mutex);
+    lock_release(file->mutex);
     return -1;
   }
 
   off_t newpos;
   struct stat stat;
-  VOP_STAT(curthread->fd[fd]->file,&stat);
+  VOP_STAT(file->file,&stat);
   if (whence == SEEK_SET)
     newpos = pos;
   if (whence == SEEK_CUR)
-    newpos = curthread->fd[fd]->offset+pos;
+    newpos = file->offset+pos;
   if (whence == SEEK_END)
     newpos = stat.st_size+pos;
 
   if (newpos < 0){
     *err = EINVAL;
-    lock_release(curthread->fd[fd]->mutex);
+    lock_release(file->mutex);
     return -1;
   }
-  *err = VOP_TRYSEEK(curthread->fd[fd]->file,newpos);
+  *err = VOP_TRYSEEK(file->file,newpos);
   if (*err){
-    lock_release(curthread->fd[fd]->mutex);
+    lock_release(file->mutex);
     return -1;
   }
-  curthread->fd[fd]->offset = newpos;
-  lock_release(curthread->fd[fd]->mutex);
-  return curthread->fd[fd]->offset;
+  file->offset = newpos;
+  lock_release(file->mutex);
+  return newpos;
 }
@@ -32,18 +32,15 @@
  * Code to load an ELF-format executable into the current address space.
  *
  * It makes the following address space calls:
- *    - first, as_define_region once for each segment of the program;
+ *    - first, as_define_file_region once for each segment of the
+ *      program, naming the part of the executable that backs it;
  *    - then, as_prepare_load;
- *    - then it loads each chunk of the program;
  *    - finally, as_complete_load.
  *
- * This gives the VM code enough flexibility to deal with even grossly
- * mis-linked executables if that proves desirable. Under normal
- * circumstances, as_prepare_load and as_complete_load probably don't
- * need to do anything.
- *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Nothing is read here: vm_fault reads each page in from the executable
+ * the first time it is touched, so starting a big program costs only
+ * the pages it uses. Pages that have not been written since are dropped
+ * rather than swapped when memory runs short.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -59,89 +56,51 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include <vm.h>
+#include <kern/stat.h>
 
 /*
- * Load a segment at virtual address VADDR. The segment in memory
+ * Map a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
  * segment on disk is located at file offset OFFSET and has length
- * FILESIZE.
+ * FILESIZE; FILELEN is the length of the whole file.
  *
  * FILESIZE may be less than MEMSIZE; if so the remaining portion of
- * the in-memory segment should be zero-filled.
+ * the in-memory segment is zero-filled.
  *
- * Note that uiomove will catch it if someone tries to load an
- * executable whose load address is in kernel space. If you should
- * change this code to not use uiomove, be sure to check for this case
- * explicitly.
+ * This used to be read in with uiomove, which caught executables whose
+ * load address is in kernel space; now that pages are read in behind
+ * the user's back, check for that explicitly. Likewise a segment that
+ * runs off the end of the file is caught now rather than at fault time.
  */
 static
 int
-load_segment(struct vnode *v, off_t offset, vaddr_t vaddr,
-	     size_t memsize, size_t filesize,
-	     int is_executable)
+map_segment(struct vnode *v, off_t offset, vaddr_t vaddr,
+	    size_t memsize, size_t filesize, off_t filelen,
+	    int readable, int writeable, int executable)
 {
-	struct iovec iov;
-	struct uio u;
-	int result;
-
 	if (filesize > memsize) {
 		kprintf("ELF: warning: segment filesize > segment memsize\n");
 		filesize = memsize;
 	}
 
-	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
-	      (unsigned long) filesize, (unsigned long) vaddr);
-
-	iov.iov_ubase = (userptr_t)vaddr;
-	iov.iov_len = memsize;		 // length of the memory space
-	u.uio_iov = &iov;
-	u.uio_iovcnt = 1;
-	u.uio_resid = filesize;          // amount to read from the file
-	u.uio_offset = offset;
-	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
-	u.uio_rw = UIO_READ;
-	u.uio_space = curthread->t_addrspace;
-
-	result = VOP_READ(v, &u);
-	if (result) {
-		return result;
+	if (vaddr + memsize < vaddr || vaddr + memsize > USERSPACETOP) {
+		kprintf("ELF: segment outside user space\n");
+		return ENOEXEC;
 	}
 
-	if (u.uio_resid != 0) {
-		/* short read; problem with executable? */
-		kprintf("ELF: short read on segment - file truncated?\n");
+	if (offset < 0 || offset + (off_t)filesize > filelen) {
+		/* problem with executable? */
+		kprintf("ELF: segment past end of file - file truncated?\n");
 		return ENOEXEC;
 	}
 
-	/*
-	 * If memsize > filesize, the remaining space should be
-	 * zero-filled. There is no need to do this explicitly,
-	 * because the VM system should provide pages that do not
-	 * contain other processes' data, i.e., are already zeroed.
-	 *
-	 * During development of your VM system, it may have bugs that
-	 * cause it to (maybe only sometimes) not provide zero-filled
-	 * pages, which can cause user programs to fail in strange
-	 * ways. Explicitly zeroing program BSS may help identify such
-	 * bugs, so the following disabled code is provided as a
-	 * diagnostic tool. Note that it must be disabled again before
-	 * you submit your code for grading.
-	 */
-#if 0
-	{
-		size_t fillamt;
-
-		fillamt = memsize - filesize;
-		if (fillamt > 0) {
-			DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n",
-			      (unsigned long) fillamt);
-			u.uio_resid += fillamt;
-			result = uiomovezeros(fillamt, &u);
-		}
-	}
-#endif
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
 
-	return result;
+	return as_define_file_region(curthread->t_addrspace, vaddr, memsize,
+				     readable, writeable, executable,
+				     v, offset, filesize);
 }
 
 /*
@@ -154,6 +113,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 {
 	Elf_Ehdr eh;   /* Executable header */
 	Elf_Phdr ph;   /* "Program header" = segment header */
+	struct stat st;
 	int result, i;
 	struct iovec iov;
 	struct uio ku;
@@ -198,6 +158,11 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return ENOEXEC;
 	}
 
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+
 	/*
 	 * Go through the list of segments and set up the address space.
 	 *
@@ -239,11 +204,11 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
-		result = as_define_region(curthread->t_addrspace,
-					  ph.p_vaddr, ph.p_memsz,
-					  ph.p_flags & PF_R,
-					  ph.p_flags & PF_W,
-					  ph.p_flags & PF_X);
+		result = map_segment(v, ph.p_offset, ph.p_vaddr,
+				     ph.p_memsz, ph.p_filesz, st.st_size,
+				     ph.p_flags & PF_R,
+				     ph.p_flags & PF_W,
+				     ph.p_flags & PF_X);
 		if (result) {
 			return result;
 		}
@@ -254,44 +219,6 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
-	/*
-	 * Now actually load each segment.
-	 */
-
-	for (i=0; i<eh.e_phnum; i++) {
-		off_t offset = eh.e_phoff + i*eh.e_phentsize;
-		uio_kinit(&iov, &ku, &ph, sizeof(ph), offset, UIO_READ);
-
-		result = VOP_READ(v, &ku);
-		if (result) {
-			return result;
-		}
-
-		if (ku.uio_resid != 0) {
-			/* short read; problem with executable? */
-			kprintf("ELF: short read on phdr - file truncated?\n");
-			return ENOEXEC;
-		}
-
-		switch (ph.p_type) {
-		    case PT_NULL: /* skip */ continue;
-		    case PT_PHDR: /* skip */ continue;
-		    case PT_MIPS_REGINFO: /* skip */ continue;
-		    case PT_LOAD: break;
-		    default:
-			kprintf("loadelf: unknown segment type %d\n",
-				ph.p_type);
-			return ENOEXEC;
-		}
-
-		result = load_segment(v, ph.p_offset, ph.p_vaddr,
-				      ph.p_memsz, ph.p_filesz,
-				      ph.p_flags & PF_X);
-		if (result) {
-			return result;
-		}
-	}
-
 	result = as_complete_load(curthread->t_addrspace);
 	if (result) {
 		return result;
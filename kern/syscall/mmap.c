@@ -0,0 +1,136 @@
+/*
+ * Added for PetrelOS
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <syscall.h>
+#include <current.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+#include <thread.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <filetable.h>
+
+// Page table permissions for PROT, or -1 if it isn't a valid one
+static int prot_permissions(int prot) {
+    int permissions = 0;
+
+    if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0)
+        return -1;
+    if (prot & PROT_READ)
+        permissions |= VM_READ;
+    if (prot & PROT_WRITE)
+        permissions |= VM_WRITE;
+    if (prot & PROT_EXEC)
+        permissions |= VM_EXEC;
+    return permissions;
+}
+
+/*
+ * A mapping is just a region of the address space (see as_define_mapping):
+ * its pages are faulted in like any other, read from the file where the
+ * file covers them and zero filled past its end. MAP_PRIVATE pages are
+ * copied on write like those of an executable, so nothing reaches the
+ * file; MAP_SHARED pages are written back to it instead of going to swap.
+ */
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fd,
+        off_t offset, int *err) {
+    struct addrspace *as = curthread->t_addrspace;
+    int sharing = flags & (MAP_SHARED | MAP_PRIVATE);
+    int permissions = prot_permissions(prot);
+    bool maywrite = true;
+    struct file_table *file;
+    struct vnode *vn = NULL;
+    struct stat st;
+    size_t filesz = 0;
+    vaddr_t va;
+
+    (void)addr; // Only a hint, which we do not take
+
+    if (len == 0 || len > USERSPACETOP || permissions < 0 ||
+        (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_ANON)) != 0 ||
+        (sharing != MAP_SHARED && sharing != MAP_PRIVATE)) {
+        *err = EINVAL;
+        return -1;
+    }
+
+    if (flags & MAP_ANON) {
+        // Shared anonymous memory would need frames shared with no file behind them
+        if (sharing == MAP_SHARED) {
+            *err = EINVAL;
+            return -1;
+        }
+    }
+    else {
+        if (offset < 0 || offset % PAGE_SIZE != 0) {
+            *err = EINVAL;
+            return -1;
+        }
+        *err = fdtable_get(curthread->t_fdtable, fd, &file);
+        if (*err)
+            return -1;
+        if ((file->status & O_ACCMODE) == O_WRONLY ||
+            (sharing == MAP_SHARED && (prot & PROT_WRITE) &&
+             (file->status & O_ACCMODE) != O_RDWR)) {
+            *err = EACCES;
+            return -1;
+        }
+        // Nor may mprotect make it so later
+        maywrite = sharing == MAP_PRIVATE ||
+            (file->status & O_ACCMODE) == O_RDWR;
+        vn = file->file;
+
+        // Only file systems that say so can be mapped; not devices
+        *err = VOP_MMAP(vn);
+        if (*err) {
+            if (*err == EUNIMP)
+                *err = ENODEV;
+            return -1;
+        }
+        *err = VOP_STAT(vn, &st);
+        if (*err)
+            return -1;
+        if (offset < st.st_size)
+            filesz = st.st_size - offset < (off_t)len ? st.st_size - offset : len;
+    }
+
+    *err = as_define_mapping(as, len, permissions, sharing == MAP_SHARED,
+        maywrite, vn, offset, filesz, &va);
+    if (*err)
+        return -1;
+    return (int)va;
+}
+
+/*
+ * Only mappings are taken away; any other part of the range, mapped or
+ * not, is left alone.
+ */
+int sys_munmap(vaddr_t addr, size_t len) {
+    vaddr_t end;
+
+    if (addr % PAGE_SIZE != 0 || len == 0 || addr >= USERSPACETOP ||
+        len > USERSPACETOP - addr)
+        return EINVAL;
+    end = ROUNDUP(addr + len, PAGE_SIZE);
+
+    return as_unmap_regions(curthread->t_addrspace, addr, end);
+}
+
+/*
+ * Likewise only mappings can be changed, but every page of the range
+ * must be in one.
+ */
+int sys_mprotect(vaddr_t addr, size_t len, int prot) {
+    int permissions = prot_permissions(prot);
+
+    if (addr % PAGE_SIZE != 0 || len == 0 || addr >= USERSPACETOP ||
+        len > USERSPACETOP - addr || permissions < 0)
+        return EINVAL;
+
+    return as_protect_regions(curthread->t_addrspace, addr,
+        ROUNDUP(addr + len, PAGE_SIZE), permissions);
+}
@@ -16,14 +16,21 @@ int sys_sbrk(int amount, int *err) {
         return as->heap_end;
     if (amount < 0) {
         if ((long)as->heap_end + (long)amount >= (long)as->heap_start) {
+            old = as->heap_end;
             as->heap_end += amount;
+            // Give back the pages wholly above the new break
+            as_unmap_range(as, (as->heap_end & PAGE_FRAME) + PAGE_SIZE,
+                (old & PAGE_FRAME) + PAGE_SIZE);
             return as->heap_end;
         }
         *err = EINVAL;
         return -1;
     }
+    // The heap may not grow into a mapping (the page of heap_end is heap)
     if (as->heap_end + amount < USERSTACK - STACK_PAGES * PAGE_SIZE &&
-        as->heap_end + amount < as->heap_start + HEAP_MAX) {
+        as->heap_end + amount < as->heap_start + HEAP_MAX &&
+        !as_overlaps(as, (as->heap_end & PAGE_FRAME) + PAGE_SIZE,
+            ((as->heap_end + amount) & PAGE_FRAME) + PAGE_SIZE)) {
         old = as->heap_end;
         as->heap_end += amount;
         return old;
@@ -0,0 +1,231 @@
+/*
+ * Added for PetrelOS
+ */
+
+/*
+ * jnbench - SFS journal benchmark
+ *
+ * Runs the same metadata-heavy workload on an SFS volume once in each
+ * journal mode (see sfs_jn_mode), remounting it in between, and prints
+ * what each phase cost in the journal: transactions, records and bytes
+ * logged, block images among them, journal block writes, and time.
+ *
+ * The volume must be mounted, and nothing may be using it.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <sfs.h>
+#include <test.h>
+
+#define DIRNAME  "jnbench.d"
+#define NFILES   32
+#define BIGSIZE  (256*1024)
+#define CHUNK    4096
+
+static char chunk[CHUNK];	/* what goes in the big file */
+
+struct phase {
+	struct sfs_jn_stats before;
+	time_t secs;
+	uint32_t nsecs;
+};
+
+static
+void
+phase_start(struct phase *ph)
+{
+	sfs_jn_getstats(&ph->before);
+	gettime(&ph->secs, &ph->nsecs);
+}
+
+static
+void
+phase_end(struct phase *ph, const char *name)
+{
+	struct sfs_jn_stats after;
+	time_t secs;
+	uint32_t nsecs;
+	unsigned records;
+
+	gettime(&secs, &nsecs);
+	getinterval(ph->secs, ph->nsecs, secs, nsecs, &secs, &nsecs);
+	sfs_jn_getstats(&after);
+
+	records = after.js_records - ph->before.js_records;
+	kprintf("  %-9s %5u txns %6u records %8u bytes %5u images "
+		"%5u writes %lu.%09lu s\n", name,
+		after.js_commits - ph->before.js_commits,
+		records, records * RECORD_SIZE,
+		after.js_images - ph->before.js_images,
+		after.js_writes - ph->before.js_writes,
+		(unsigned long) secs, (unsigned long) nsecs);
+}
+
+static
+void
+makepath(char *buf, size_t len, const char *fs, const char *name, int n)
+{
+	if (n < 0) {
+		snprintf(buf, len, "%s:%s/%s", fs, DIRNAME, name);
+	}
+	else {
+		snprintf(buf, len, "%s:%s/%s%d", fs, DIRNAME, name, n);
+	}
+}
+
+/* Print and pass on any error */
+static
+int
+check(int result, const char *what)
+{
+	if (result) {
+		kprintf("jnbench: %s: %s\n", what, strerror(result));
+	}
+	return result;
+}
+
+static
+int
+workload(const char *fs)
+{
+	struct phase ph;
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	char path[64], path2[64];
+	off_t pos;
+	int i, result;
+
+	/* Directory operations */
+	phase_start(&ph);
+	snprintf(path, sizeof(path), "%s:%s", fs, DIRNAME);
+	result = check(vfs_mkdir(path, 0775), "mkdir");
+	if (result) {
+		return result;
+	}
+	for (i=0; i<NFILES; i++) {
+		makepath(path, sizeof(path), fs, "file", i);
+		result = check(vfs_open(path, O_WRONLY|O_CREAT|O_EXCL, 0664,
+					&vn), "create");
+		if (result) {
+			return result;
+		}
+		vfs_close(vn);
+	}
+	phase_end(&ph, "create");
+
+	phase_start(&ph);
+	for (i=0; i<NFILES; i++) {
+		makepath(path, sizeof(path), fs, "file", i);
+		makepath(path2, sizeof(path2), fs, "renamed", i);
+		result = check(vfs_rename(path, path2), "rename");
+		if (result) {
+			return result;
+		}
+	}
+	phase_end(&ph, "rename");
+
+	/* A file big enough to need double indirect blocks */
+	phase_start(&ph);
+	makepath(path, sizeof(path), fs, "big", -1);
+	result = check(vfs_open(path, O_WRONLY|O_CREAT|O_EXCL, 0664, &vn),
+		       "create");
+	if (result) {
+		return result;
+	}
+	for (pos=0; pos<BIGSIZE; pos+=CHUNK) {
+		uio_kinit(&iov, &ku, chunk, CHUNK, pos, UIO_WRITE);
+		result = check(VOP_WRITE(vn, &ku), "write");
+		if (result) {
+			vfs_close(vn);
+			return result;
+		}
+	}
+	phase_end(&ph, "write");
+
+	phase_start(&ph);
+	result = check(VOP_TRUNCATE(vn, 0), "truncate");
+	vfs_close(vn);
+	if (result) {
+		return result;
+	}
+	phase_end(&ph, "truncate");
+
+	phase_start(&ph);
+	makepath(path, sizeof(path), fs, "big", -1);
+	result = check(vfs_remove(path), "remove");
+	for (i=0; i<NFILES && !result; i++) {
+		makepath(path, sizeof(path), fs, "renamed", i);
+		result = check(vfs_remove(path), "remove");
+	}
+	if (result) {
+		return result;
+	}
+	snprintf(path, sizeof(path), "%s:%s", fs, DIRNAME);
+	result = check(vfs_rmdir(path), "rmdir");
+	if (result) {
+		return result;
+	}
+	phase_end(&ph, "remove");
+
+	return 0;
+}
+
+int
+journalbench(int nargs, char **args)
+{
+	static const struct {
+		int mode;
+		const char *name;
+	} modes[] = {
+		{ SFS_JN_RECORDS, "records" },
+		{ SFS_JN_BLOCKS, "blocks" },
+	};
+	int oldmode = sfs_jn_mode;
+	char *fs;
+	unsigned i;
+	int result = 0;
+
+	if (nargs != 2) {
+		kprintf("Usage: fs6 filesystem:\n");
+		return EINVAL;
+	}
+	fs = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (fs[strlen(fs)-1]==':') {
+		fs[strlen(fs)-1] = 0;
+	}
+
+	for (i=0; i<sizeof(modes)/sizeof(modes[0]) && !result; i++) {
+		result = check(vfs_unmount(fs), "unmount");
+		if (result) {
+			break;
+		}
+		sfs_jn_mode = modes[i].mode;
+		result = check(sfs_mount(fs), "mount");
+		if (result) {
+			break;
+		}
+		kprintf("SFS journal benchmark on %s, %s mode:\n", fs,
+			modes[i].name);
+		result = workload(fs);
+	}
+
+	/* Leave it mounted as it was */
+	sfs_jn_mode = oldmode;
+	if (!result) {
+		result = check(vfs_unmount(fs), "unmount");
+	}
+	if (!result) {
+		result = check(sfs_mount(fs), "mount");
+	}
+	return result;
+}
@@ -0,0 +1,321 @@
+/*
+ * Added for PetrelOS
+ */
+
+/*
+ * jntest - SFS journal recovery test, for block images
+ *
+ * In two steps, with a crash in between:
+ *
+ *    fs7 lhd1: crash    remounts the volume in block mode (see
+ *                       sfs_jn_mode), makes a set of changes, and
+ *                       panics once they have all committed, before
+ *                       the checkpointer writes their blocks back.
+ *
+ *    fs7 lhd1: check    after rebooting and mounting the volume again,
+ *                       which recovers it, checks that every change is
+ *                       there and cleans up.
+ *
+ * Only metadata is journaled, so the check looks at names and sizes, and
+ * reads the big files through to make sure their block pointers came
+ * back, but not at what the files hold.
+ *
+ * One of the files is far too big to be truncated in one transaction, so
+ * the truncate is split over several; recovery has to replay all of them.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <sfs.h>
+#include <test.h>
+
+#define DIRNAME  "jntest.d"
+#define SLOGAN   "HODIE MIHI - CRAS TIBI\n"
+#define NFILES   8		/* file0..file7 */
+#define NMOVED   4		/* file0..file3 become moved0..moved3 */
+#define SHORTLEN 10		/* file7 is truncated to this */
+#define BIGSIZE  (64*1024)	/* enough for an indirect block */
+#define HUGESIZE (1024*1024)	/* more than one transaction can free */
+#define HUGELEN  (300*1024 + 100)	/* huge is truncated to this */
+#define CHUNK    4096
+
+static char chunk[CHUNK];
+
+static
+void
+makepath(char *buf, size_t len, const char *fs, const char *name, int n)
+{
+	if (n < 0) {
+		snprintf(buf, len, "%s:%s/%s", fs, DIRNAME, name);
+	}
+	else {
+		snprintf(buf, len, "%s:%s/%s%d", fs, DIRNAME, name, n);
+	}
+}
+
+/* Print and pass on any error */
+static
+int
+check(int result, const char *what)
+{
+	if (result) {
+		kprintf("jntest: %s: %s\n", what, strerror(result));
+	}
+	return result;
+}
+
+static
+int
+writefile(const char *path, off_t size)
+{
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	char name[64];
+	off_t pos;
+	size_t len;
+	int result;
+
+	strcpy(name, path);
+	result = check(vfs_open(name, O_WRONLY|O_CREAT|O_EXCL, 0664, &vn),
+		       "create");
+	if (result) {
+		return result;
+	}
+	for (pos=0; pos<size; pos+=len) {
+		len = size - pos < CHUNK ? size - pos : CHUNK;
+		uio_kinit(&iov, &ku, chunk, len, pos, UIO_WRITE);
+		result = check(VOP_WRITE(vn, &ku), "write");
+		if (result) {
+			break;
+		}
+	}
+	vfs_close(vn);
+	return result;
+}
+
+/*
+ * Make the changes, all in block mode, and crash.
+ */
+static
+int
+crash(const char *fs)
+{
+	struct vnode *vn;
+	char path[64], path2[64];
+	int i, result;
+
+	result = check(vfs_unmount(fs), "unmount");
+	if (result) {
+		return result;
+	}
+	sfs_jn_mode = SFS_JN_BLOCKS;
+	result = check(sfs_mount(fs), "mount");
+	if (result) {
+		return result;
+	}
+
+	strcpy(chunk, SLOGAN);
+	snprintf(path, sizeof(path), "%s:%s", fs, DIRNAME);
+	result = check(vfs_mkdir(path, 0775), "mkdir");
+	if (result) {
+		return result;
+	}
+	for (i=0; i<NFILES; i++) {
+		makepath(path, sizeof(path), fs, "file", i);
+		result = writefile(path, strlen(SLOGAN));
+		if (result) {
+			return result;
+		}
+	}
+	for (i=0; i<NMOVED; i++) {
+		makepath(path, sizeof(path), fs, "file", i);
+		makepath(path2, sizeof(path2), fs, "moved", i);
+		result = check(vfs_rename(path, path2), "rename");
+		if (result) {
+			return result;
+		}
+	}
+	for (i=NMOVED; i<NMOVED+2; i++) {
+		makepath(path, sizeof(path), fs, "file", i);
+		result = check(vfs_remove(path), "remove");
+		if (result) {
+			return result;
+		}
+	}
+	makepath(path, sizeof(path), fs, "file", NFILES-1);
+	result = check(vfs_open(path, O_WRONLY, 0, &vn), "open");
+	if (result) {
+		return result;
+	}
+	result = check(VOP_TRUNCATE(vn, SHORTLEN), "truncate");
+	vfs_close(vn);
+	if (result) {
+		return result;
+	}
+	makepath(path, sizeof(path), fs, "big", -1);
+	result = writefile(path, BIGSIZE);
+	if (result) {
+		return result;
+	}
+	makepath(path, sizeof(path), fs, "huge", -1);
+	result = writefile(path, HUGESIZE);
+	if (result) {
+		return result;
+	}
+	result = check(vfs_open(path, O_WRONLY, 0, &vn), "open");
+	if (result) {
+		return result;
+	}
+	result = check(VOP_TRUNCATE(vn, HUGELEN), "truncate");
+	vfs_close(vn);
+	if (result) {
+		return result;
+	}
+
+	/* Every commit above waited for its records to reach the journal */
+	panic("jntest: crashing after commit, as asked\n");
+}
+
+/*
+ * Check that the file named by PATH has size SIZE, or doesn't exist if
+ * SIZE is -1, and if READ is set that it reads to the end. Returns the
+ * number of problems found.
+ */
+static
+int
+checkfile(const char *path, off_t size, bool read)
+{
+	struct vnode *vn;
+	struct stat st;
+	struct iovec iov;
+	struct uio ku;
+	char name[64];
+	off_t pos;
+	int result;
+
+	strcpy(name, path);
+	result = vfs_open(name, O_RDONLY, 0, &vn);
+	if (size < 0) {
+		if (result == ENOENT) {
+			return 0;
+		}
+		if (result == 0) {
+			vfs_close(vn);
+		}
+		kprintf("jntest: %s: should be gone\n", path);
+		return 1;
+	}
+	if (check(result, path)) {
+		return 1;
+	}
+
+	result = check(VOP_STAT(vn, &st), path);
+	if (result == 0 && st.st_size != size) {
+		kprintf("jntest: %s: size %lld, expected %lld\n", path,
+			(long long) st.st_size, (long long) size);
+		result = EINVAL;
+	}
+	for (pos=0; read && result==0 && pos<size; pos+=CHUNK) {
+		uio_kinit(&iov, &ku, chunk, CHUNK, pos, UIO_READ);
+		result = check(VOP_READ(vn, &ku), path);
+	}
+	vfs_close(vn);
+	return result ? 1 : 0;
+}
+
+/*
+ * After recovery: check everything, then remove it.
+ */
+static
+int
+verify(const char *fs)
+{
+	char path[64];
+	int i, bad = 0;
+	off_t size;
+
+	for (i=0; i<NFILES; i++) {
+		makepath(path, sizeof(path), fs, "file", i);
+		if (i < NMOVED + 2) {
+			size = -1;
+		}
+		else if (i == NFILES-1) {
+			size = SHORTLEN;
+		}
+		else {
+			size = strlen(SLOGAN);
+		}
+		bad += checkfile(path, size, false);
+	}
+	for (i=0; i<NMOVED; i++) {
+		makepath(path, sizeof(path), fs, "moved", i);
+		bad += checkfile(path, strlen(SLOGAN), false);
+	}
+	makepath(path, sizeof(path), fs, "big", -1);
+	bad += checkfile(path, BIGSIZE, true);
+	makepath(path, sizeof(path), fs, "huge", -1);
+	bad += checkfile(path, HUGELEN, true);
+
+	if (bad) {
+		kprintf("jntest: %d problems; leaving %s in place\n", bad,
+			DIRNAME);
+		return EINVAL;
+	}
+
+	for (i=0; i<NMOVED; i++) {
+		makepath(path, sizeof(path), fs, "moved", i);
+		if (check(vfs_remove(path), "remove")) {
+			return EIO;
+		}
+	}
+	for (i=NMOVED+2; i<NFILES; i++) {
+		makepath(path, sizeof(path), fs, "file", i);
+		if (check(vfs_remove(path), "remove")) {
+			return EIO;
+		}
+	}
+	makepath(path, sizeof(path), fs, "big", -1);
+	if (check(vfs_remove(path), "remove")) {
+		return EIO;
+	}
+	makepath(path, sizeof(path), fs, "huge", -1);
+	if (check(vfs_remove(path), "remove")) {
+		return EIO;
+	}
+	snprintf(path, sizeof(path), "%s:%s", fs, DIRNAME);
+	if (check(vfs_rmdir(path), "rmdir")) {
+		return EIO;
+	}
+	kprintf("jntest: recovery of block images passed\n");
+	return 0;
+}
+
+int
+journaltest(int nargs, char **args)
+{
+	char *fs;
+
+	if (nargs != 3 ||
+	    (strcmp(args[2], "crash") && strcmp(args[2], "check"))) {
+		kprintf("Usage: fs7 filesystem: crash|check\n");
+		return EINVAL;
+	}
+	fs = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (fs[strlen(fs)-1]==':') {
+		fs[strlen(fs)-1] = 0;
+	}
+
+	if (!strcmp(args[2], "crash")) {
+		return crash(fs);
+	}
+	return verify(fs);
+}
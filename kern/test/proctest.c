@@ -6,6 +6,7 @@
 #include <thread.h>
 #include <test.h>
 #include <current.h>
+#include <filetable.h>
 
 static
 void
@@ -17,7 +18,8 @@ proc_init_test(void)
     KASSERT(curthread->pid == 0);
     KASSERT(curthread->parent_pid == -1);
     KASSERT(curthread->children == NULL);
-    KASSERT(curthread->fd[0] == NULL);
+    KASSERT(curthread->t_fdtable == NULL ||
+            curthread->t_fdtable->fdt_files[0] == NULL);
 
     KASSERT(process_table[0] == curthread);
 
@@ -39,6 +39,15 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <objcache.h>
+
+/* Synchronization objects come and go with every open file and fork. */
+static struct objcache sem_cache =
+	OBJCACHE_INITIALIZER("semaphore", sizeof(struct semaphore), NULL);
+static struct objcache lock_cache =
+	OBJCACHE_INITIALIZER("lock", sizeof(struct lock), NULL);
+static struct objcache cv_cache =
+	OBJCACHE_INITIALIZER("cv", sizeof(struct cv), NULL);
 
 ////////////////////////////////////////////////////////////
 //
@@ -51,21 +60,21 @@ sem_create(const char *name, int initial_count)
 
 	KASSERT(initial_count >= 0);
 
-	sem = kmalloc(sizeof(struct semaphore));
+	sem = objcache_alloc(&sem_cache);
 	if (sem == NULL) {
 		return NULL;
 	}
 
 	sem->sem_name = kstrdup(name);
 	if (sem->sem_name == NULL) {
-		kfree(sem);
+		objcache_free(&sem_cache, sem);
 		return NULL;
 	}
 
 	sem->sem_wchan = wchan_create(sem->sem_name);
 	if (sem->sem_wchan == NULL) {
 		kfree(sem->sem_name);
-		kfree(sem);
+		objcache_free(&sem_cache, sem);
 		return NULL;
 	}
 
@@ -84,7 +93,7 @@ sem_destroy(struct semaphore *sem)
 	spinlock_cleanup(&sem->sem_lock);
 	wchan_destroy(sem->sem_wchan);
 	kfree(sem->sem_name);
-	kfree(sem);
+	objcache_free(&sem_cache, sem);
 }
 
 void
@@ -152,14 +161,14 @@ lock_create(const char *name)
 {
 	struct lock *lock;
 
-	lock = kmalloc(sizeof(struct lock));
+	lock = objcache_alloc(&lock_cache);
 	if (lock == NULL) {
 		return NULL;
 	}
 
 	lock->lk_name = kstrdup(name);
 	if (lock->lk_name == NULL) {
-		kfree(lock);
+		objcache_free(&lock_cache, lock);
 		return NULL;
 	}
 
@@ -168,7 +177,7 @@ lock_create(const char *name)
 	lock->lock_wchan = wchan_create(lock->lk_name);
 	if (lock->lock_wchan == NULL) {
 		kfree(lock->lk_name);
-		kfree(lock);
+		objcache_free(&lock_cache, lock);
 		return NULL;
 	}
 
@@ -190,7 +199,7 @@ lock_destroy(struct lock *lock)
 	spinlock_cleanup(&lock->lock_lock);
 	wchan_destroy(lock->lock_wchan);
 	kfree(lock->lk_name);
-	kfree(lock);
+	objcache_free(&lock_cache, lock);
 }
 
 void
@@ -229,6 +238,30 @@ lock_acquire(struct lock *lock)
 	spinlock_release(&lock->lock_lock);
 }
 
+bool
+lock_tryacquire(struct lock *lock)
+{
+	KASSERT(lock != NULL);
+
+	spinlock_acquire(&lock->lock_lock);
+	if (lock->lock == 0) {
+		spinlock_release(&lock->lock_lock);
+		return false;
+	}
+	lock->lock = 0;
+
+	/* this must work before CPU initialization */
+	if (CURCPU_EXISTS()) {
+	  lock->holder = curthread;
+	}
+	else {
+	  lock->holder = NULL;
+	}
+
+	spinlock_release(&lock->lock_lock);
+	return true;
+}
+
 void
 lock_release(struct lock *lock)
 {
@@ -270,21 +303,21 @@ cv_create(const char *name)
 {
 	struct cv *cv;
 
-	cv = kmalloc(sizeof(struct cv));
+	cv = objcache_alloc(&cv_cache);
 	if (cv == NULL) {
 		return NULL;
 	}
 
 	cv->cv_name = kstrdup(name);
 	if (cv->cv_name==NULL) {
-		kfree(cv);
+		objcache_free(&cv_cache, cv);
 		return NULL;
 	}
 
 	cv->cv_wchan = wchan_create(cv->cv_name);
 	if (cv->cv_wchan == NULL) {
 		kfree(cv->cv_name);
-		kfree(cv);
+		objcache_free(&cv_cache, cv);
 		return NULL;
 	}
 
@@ -299,7 +332,7 @@ cv_destroy(struct cv *cv)
 	wchan_destroy(cv->cv_wchan);
 	
 	kfree(cv->cv_name);
-	kfree(cv);
+	objcache_free(&cv_cache, cv);
 }
 
 void
@@ -48,6 +48,7 @@
 #include <mainbus.h>
 #include <vnode.h>
 #include <vfs.h>
+#include <filetable.h>
 #include <kern/unistd.h>
 #include <kern/fcntl.h>
 
@@ -74,18 +75,14 @@ static struct semaphore *cpu_startup_sem;
 
 /* Process table global definitions */
 struct thread **process_table;
-struct lock *getpid_lock;
-struct lock *global_exec_lock;
 
 ////////////////////////////////////////////////////////////
 /*
  * MLF Queue Helper Routines
  */
 void mlf_add_thread(struct mlf_queue *m, struct thread *t){
-	//kprintf("adding thread of priority %d\n",t->priority);
-	if (t->priority >= 0 && t->priority < NUM_PRIORITIES){
-		threadlist_addtail(&m->runqueue[t->priority],t);
-	}
+	KASSERT(t->priority >= 0 && t->priority < NUM_PRIORITIES);
+	threadlist_addtail(&m->runqueue[t->priority],t);
 }
 struct thread *mlf_rem_head(struct mlf_queue *m){
 	int i;
@@ -104,10 +101,10 @@ struct thread *mlf_rem_tail(struct mlf_queue *m){
 	return NULL;
 }
 bool mlf_isempty(struct mlf_queue *m){
-	int ret = 0;
 	for (int i=0; i<NUM_PRIORITIES; i++)
-		ret = ret & threadlist_isempty(&m->runqueue[i]);
-	return ret;
+		if (!threadlist_isempty(&m->runqueue[i]))
+			return false;
+	return true;
 }
 unsigned mlf_count(struct mlf_queue *m){
 	unsigned count=0;
@@ -203,18 +200,23 @@ thread_create(const char *name)
 
 	/* If you add to struct thread, be sure to initialize here */
 
-	/* Process fields (everything except pid) */
+	/* Process fields */
+	thread->pid = 0;
+	thread->parent_pid = 0;
+	thread->exit_status = 0;
+	thread->t_parent = NULL;
 	thread->children = NULL;
+	thread->t_sibling_next = NULL;
+	thread->t_sibling_prev = NULL;
+	thread->t_parked = false;
+	thread->waiting_on = NULL;
 
-	thread->fd = kmalloc(MAX_FILE_DESCRIPTOR*sizeof(struct file_table *));
-	if (thread->fd == NULL)
-		panic("thread_bootstrap: Out of memory\n");
-
-	int i;
-	for (i=0; i<MAX_FILE_DESCRIPTOR; i++)
-		thread->fd[i] = NULL;
+	thread->t_fdtable = NULL;
 
 	thread->priority = 0;
+	thread->t_ticks = 0;
+	thread->t_lastrun = 0;
+	thread->t_background = false;
 
 	return thread;
 }
@@ -253,8 +255,19 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_ticket = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
+	c->c_swap_next = 0;
+	c->c_swap_end = 0;
+	spinlock_init(&c->c_swap_lock);
+
+	c->c_cm_nmag = 0;
+	spinlock_init(&c->c_cm_lock);
+
+	c->c_asid_gen = 0;
+
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
@@ -318,6 +331,13 @@ thread_destroy(struct thread *thread)
 	/* VM fields, cleaned up in thread_exit */
 	KASSERT(thread->t_addrspace == NULL);
 
+	/* Process fields */
+	KASSERT(thread->t_parent == NULL);
+	KASSERT(thread->children == NULL);
+	if (thread->waiting_on != NULL) {
+		sem_destroy(thread->waiting_on);
+	}
+
 	/* Thread subsystem fields */
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
@@ -332,6 +352,168 @@ thread_destroy(struct thread *thread)
 	kfree(thread);
 }
 
+/*
+ * Process IDs.
+ *
+ * pid_map has a bit set for each pid in use, from the moment pid_alloc
+ * hands it out until the thread holding it is destroyed, so a pid is
+ * never reused while anyone might still look it up. pid_next is where
+ * the next search starts. pid_lock also protects process_table and the
+ * process tree fields of struct thread.
+ */
+#define PID_ALLOC_MIN (PID_MIN + 1)
+
+static struct spinlock pid_lock = SPINLOCK_INITIALIZER;
+static uint32_t pid_map[(PID_MAX + 32) / 32];
+static pid_t pid_next = PID_ALLOC_MIN;
+
+#define PID_ISSET(pid) (pid_map[(pid) / 32] & ((uint32_t)1 << ((pid) % 32)))
+#define PID_SET(pid)   (pid_map[(pid) / 32] |= (uint32_t)1 << ((pid) % 32))
+#define PID_CLEAR(pid) (pid_map[(pid) / 32] &= ~((uint32_t)1 << ((pid) % 32)))
+
+pid_t
+pid_alloc(void)
+{
+	pid_t pid, ret = -1;
+	int n;
+
+	spinlock_acquire(&pid_lock);
+	pid = pid_next;
+	for (n = 0; n <= PID_MAX - PID_ALLOC_MIN; ) {
+		/* Skip whole words of taken pids */
+		if (pid % 32 == 0 && pid_map[pid / 32] == 0xffffffff &&
+		    pid + 32 <= PID_MAX) {
+			pid += 32;
+			n += 32;
+			continue;
+		}
+		if (!PID_ISSET(pid)) {
+			PID_SET(pid);
+			ret = pid;
+			pid_next = (pid == PID_MAX) ? PID_ALLOC_MIN : pid + 1;
+			break;
+		}
+		pid = (pid == PID_MAX) ? PID_ALLOC_MIN : pid + 1;
+		n++;
+	}
+	spinlock_release(&pid_lock);
+
+	return ret;
+}
+
+int
+pid_claim(pid_t pid)
+{
+	int result = 0;
+
+	KASSERT(pid >= PID_MIN && pid <= PID_MAX);
+
+	spinlock_acquire(&pid_lock);
+	if (PID_ISSET(pid)) {
+		result = EBUSY;
+	}
+	else {
+		PID_SET(pid);
+	}
+	spinlock_release(&pid_lock);
+
+	return result;
+}
+
+void
+pid_free(pid_t pid)
+{
+	KASSERT(pid >= PID_MIN && pid <= PID_MAX);
+
+	spinlock_acquire(&pid_lock);
+	KASSERT(PID_ISSET(pid));
+	PID_CLEAR(pid);
+	process_table[pid] = NULL;
+	spinlock_release(&pid_lock);
+}
+
+void
+proc_link_child(struct thread *parent, struct thread *child)
+{
+	spinlock_acquire(&pid_lock);
+	KASSERT(PID_ISSET(child->pid));
+	process_table[child->pid] = child;
+	child->t_parent = parent;
+	child->t_sibling_prev = NULL;
+	child->t_sibling_next = parent->children;
+	if (parent->children != NULL) {
+		parent->children->t_sibling_prev = child;
+	}
+	parent->children = child;
+	spinlock_release(&pid_lock);
+}
+
+struct thread *
+proc_get_child(pid_t pid, int *err)
+{
+	struct thread *t;
+
+	if (pid < PID_MIN || pid > PID_MAX) {
+		*err = ESRCH;
+		return NULL;
+	}
+
+	spinlock_acquire(&pid_lock);
+	t = process_table[pid];
+	if (t == NULL) {
+		*err = ESRCH;
+	}
+	else if (t->t_parent != curthread) {
+		*err = ECHILD;
+		t = NULL;
+	}
+	spinlock_release(&pid_lock);
+
+	return t;
+}
+
+/*
+ * Final destruction of an exited thread nobody is waiting for.
+ */
+static
+void
+thread_reap(struct thread *z)
+{
+	if (z->pid >= PID_MIN) {
+		pid_free(z->pid);
+	}
+	thread_destroy(z);
+}
+
+void
+thread_disown(struct thread *t)
+{
+	bool parked;
+
+	spinlock_acquire(&pid_lock);
+	if (t->t_parent != NULL) {
+		if (t->t_sibling_prev != NULL) {
+			t->t_sibling_prev->t_sibling_next = t->t_sibling_next;
+		}
+		else {
+			KASSERT(t->t_parent->children == t);
+			t->t_parent->children = t->t_sibling_next;
+		}
+		if (t->t_sibling_next != NULL) {
+			t->t_sibling_next->t_sibling_prev = t->t_sibling_prev;
+		}
+		t->t_sibling_next = t->t_sibling_prev = NULL;
+		t->t_parent = NULL;
+	}
+	t->parent_pid = -1;
+	parked = t->t_parked;
+	spinlock_release(&pid_lock);
+
+	if (parked) {
+		thread_reap(t);
+	}
+}
+
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
  * need to have thread_destroy called on them.)
@@ -347,9 +529,15 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		if (!z->parent_pid > 0){  // ONLY REAP ZOMBIES WITHOUT PARENTS
-			process_table[z->pid] = NULL;
-			thread_destroy(z);
+		spinlock_acquire(&pid_lock);
+		if (z->parent_pid > 0) {
+			/* Still to be waited for; thread_disown reaps it */
+			z->t_parked = true;
+			z = NULL;
+		}
+		spinlock_release(&pid_lock);
+		if (z != NULL) {
+			thread_reap(z);
 		}
 	}
 }
@@ -432,15 +620,7 @@ thread_bootstrap(void)
 	process_table = kmalloc((MAX_PROCESSES+1)*sizeof(struct thread *));
 	if (process_table == NULL)
 		panic("thread_bootstrap: Out of memory\n");
-
-	// pid table lock
-	getpid_lock = lock_create("getpid_lock");
-	if (getpid_lock == NULL)
-		panic("thread_bootstrap: Out of memory\n");
-
-	global_exec_lock = lock_create("global_exec_lock");
-	if (global_exec_lock == NULL)
-		panic("thread_bootstrap: Out of memory creating global_exec_lock\n");
+	bzero(process_table, (MAX_PROCESSES+1)*sizeof(struct thread *));
 
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
@@ -475,62 +655,11 @@ void stdio_bootstrap(void){
 	/*
 	 * Open standard in/out/err file descriptors
 	 */
-	char *consoleR = NULL;
-	char *consoleW = NULL;
-	char *consoleE = NULL;
-	consoleR = kstrdup("con:");
-	consoleW = kstrdup("con:");
-	consoleE = kstrdup("con:");
-
-	if (consoleR == NULL || consoleW == NULL || consoleE == NULL)
-		panic("thread_bootstrap: could not connect to console\n");
-
-	struct vnode *out;
-	struct vnode *in;
-	struct vnode *err;
-	int r0 = vfs_open(consoleR,O_RDONLY,0664,&in);
-	int r1 = vfs_open(consoleW,O_WRONLY,0664,&out);
-	int r2 = vfs_open(consoleE,O_WRONLY,0664,&err);
-	if (r0 | r1 | r2)
-	 	panic("thread_bootstrap: could not connect to console\n");
-
-	struct file_table *stdin = kmalloc(sizeof(struct file_table));
-	struct file_table *stdout = kmalloc(sizeof(struct file_table));
-	struct file_table *stderr = kmalloc(sizeof(struct file_table));
-	if (stdin == NULL || stdout == NULL || stderr == NULL)
+	curthread->t_fdtable = fdtable_create();
+	if (curthread->t_fdtable == NULL)
 		panic("thread_bootstrap: out of memory\n");
-
-	stdin->status = O_RDONLY;
-	stdin->refcnt = 1;
-	stdin->offset = 0;
-	stdin->file = in;
-	stdin->update_pos = 0;
-	stdin->mutex = lock_create("stdin");
-
-	stdout->status = O_WRONLY;
-	stdout->refcnt = 1;
-	stdout->offset = 0;
-	stdout->file = out;
-	stdout->update_pos = 0;
-	stdout->mutex = lock_create("stdout");
-
-	stderr->status = O_WRONLY;
-	stderr->refcnt = 1;
-	stderr->offset = 0;
-	stderr->file = err;
-	stderr->update_pos = 0;
-	stderr->mutex = lock_create("stderr");
-
-	if (stdin->mutex == NULL || stdout->mutex == NULL || stderr->mutex == NULL)
-		panic("thread_bootstrap: stdin, stdout, or stderr lock couldn't be initialized\n");
-
-	curthread->fd[STDIN_FILENO] = stdin;
-	curthread->fd[STDOUT_FILENO] = stdout;
-	curthread->fd[STDERR_FILENO] = stderr;
-
-	kfree(consoleR);
-	kfree(consoleW);
-	kfree(consoleE);
+	if (fdtable_stdio(curthread->t_fdtable))
+		panic("thread_bootstrap: could not connect to console\n");
 
 	/*
 	 * Set current working directory to root
@@ -570,6 +699,21 @@ cpu_hatch(unsigned software_number)
 	thread_exit();
 }
 
+/*
+ * Accessors for the cpu array.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned index)
+{
+	return cpuarray_get(&allcpus, index);
+}
+
 /*
  * Start up secondary cpus. Called from boot().
  */
@@ -590,6 +734,104 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Thread migration.
+ *
+ * Work moves between CPUs by stealing: a CPU that runs out of threads
+ * pulls one from the peer with the most waiting, rather than busy CPUs
+ * periodically pushing work away. Threads are otherwise woken on the
+ * CPU they last ran on, and the thief passes over threads that left
+ * their CPU less than CACHE_HOT_HARDCLOCKS ago when it has a choice,
+ * since their working set is likely still in that CPU's cache.
+ */
+#define CACHE_HOT_HARDCLOCKS 2
+
+/*
+ * Take a thread from the busiest other CPU, of the highest priority it
+ * has waiting. Returns NULL if there is nothing to take. The thread is
+ * on no run queue on return and already belongs to this CPU.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim = NULL;
+	struct thread *t, *pick = NULL;
+	unsigned i, n, most = 0;
+	int level;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		/* Unlocked peek; only used to choose where to look */
+		n = mlf_count(&c->c_mlf_runqueue);
+		if (n > most) {
+			most = n;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	for (level=0; level<NUM_PRIORITIES; level++) {
+		THREADLIST_FORALL(t, victim->c_mlf_runqueue.runqueue[level]) {
+			/*
+			 * The victim's curthread can be on its run queue
+			 * if it slept and was woken while the victim was
+			 * idle; it must not be moved.
+			 */
+			if (t == victim->c_curthread) {
+				continue;
+			}
+			if (pick == NULL) {
+				pick = t;
+			}
+			if (victim->c_hardclocks - t->t_lastrun >=
+			    CACHE_HOT_HARDCLOCKS) {
+				pick = t;
+				break;
+			}
+		}
+		if (pick != NULL) {
+			break;
+		}
+	}
+	if (pick != NULL) {
+		threadlist_remove(&victim->c_mlf_runqueue.runqueue[level], pick);
+		pick->t_cpu = curcpu->c_self;
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      pick->t_name, victim->c_number, curcpu->c_number);
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	return pick;
+}
+
+/*
+ * Wake some idle CPU, if there is one, so that it comes and steals the
+ * thread just queued on busy CPU BUSY.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		/* Unlocked peek; a stale answer costs a spurious wakeup */
+		if (c != busy && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -626,6 +868,11 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
 	}
+
+	if (!isidle && target != curthread) {
+		/* It will have to wait there; let an idle cpu take it */
+		thread_kick_idle(targetcpu);
+	}
 }
 
 /*
@@ -764,7 +1011,7 @@ static
 void
 thread_switch(threadstate_t newstate, struct wchan *wc)
 {
-	struct thread *cur, *next;
+	struct thread *cur, *next, *stolen;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -805,8 +1052,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
-	    if (cur->priority > 0) // When a thread blocks, increase its priority upon waking
-	    	cur->priority--;
+		// When a thread blocks, increase its priority upon waking
+		if (cur->priority > 0 && !cur->t_background) {
+			cur->priority--;
+		}
+		cur->t_ticks = 0;
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -830,6 +1080,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		break;
 	}
 	cur->t_state = newstate;
+	cur->t_lastrun = curcpu->c_hardclocks;
 
 	/*
 	 * Get the next thread. While there isn't one, call md_idle().
@@ -854,8 +1105,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = mlf_rem_head(&curcpu->c_mlf_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			stolen = thread_steal();
+			if (stolen == NULL) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
+			if (stolen != NULL) {
+				mlf_add_thread(&curcpu->c_mlf_runqueue, stolen);
+			}
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
@@ -1008,7 +1265,15 @@ thread_exit(void)
 	cur = curthread;
 
 	// File descriptors
-	kfree(cur->fd);
+	if (cur->t_fdtable != NULL) {
+		fdtable_destroy(cur->t_fdtable);
+		cur->t_fdtable = NULL;
+	}
+
+	// Nobody will wait for our children now
+	while (cur->children != NULL) {
+		thread_disown(cur->children);
+	}
 
 	/* VFS fields */
 	if (cur->t_cwd) {
@@ -1052,9 +1317,6 @@ thread_exit(void)
 void
 thread_yield(void)
 {
-	//TODO: return with probability inversely proportional to priority
-	if (curthread->priority < NUM_PRIORITIES-1)
-		curthread->priority++; // Decrease priority when a process uses whole time slice
 	thread_switch(S_READY, NULL);
 }
 
@@ -1063,140 +1325,118 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * Threads start at priority 0. One that runs for the whole quantum of
+ * its level (mlf_quantum, in hardclocks) drops a level, so CPU hogs sink
+ * to long quanta at the bottom while threads that block often, like an
+ * interactive shell, stay near the top and preempt them.
  */
+static const unsigned mlf_quantum[NUM_PRIORITIES] = { 1, 2, 4, 8 };
 
-void
-schedule(void)
+bool
+thread_quantum_tick(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *cur = curthread;
+	bool preempt = false;
+	int i;
+
+	/* Nothing to charge while idling; cur is whoever went to sleep. */
+	if (curcpu->c_isidle) {
+		return false;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (++cur->t_ticks >= mlf_quantum[cur->priority]) {
+		if (cur->priority < NUM_PRIORITIES-1) {
+			cur->priority++;
+		}
+		cur->t_ticks = 0;
+		preempt = true;
+	}
+	else {
+		for (i=0; i<cur->priority; i++) {
+			if (!threadlist_isempty(&curcpu->c_mlf_runqueue.runqueue[i])) {
+				preempt = true;
+				break;
+			}
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return preempt;
 }
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * This is called periodically from hardclock(). Demotion alone would let
+ * a steady stream of interactive threads starve the lower levels forever,
+ * so every time round everything on this CPU goes back to the top level,
+ * except background threads, which stay at the bottom.
  */
 void
-thread_consider_migration(void)
+schedule(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
+	struct mlf_queue *m = &curcpu->c_mlf_runqueue;
+	struct threadlist *bottom = &m->runqueue[NUM_PRIORITIES-1];
 	struct thread *t;
+	unsigned n;
+	int i;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += mlf_count(&c->c_mlf_runqueue);
-		if (c == curcpu->c_self) {
-			my_count = mlf_count(&c->c_mlf_runqueue);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<NUM_PRIORITIES; i++) {
+		/* Go round the list once, putting background threads back */
+		for (n = m->runqueue[i].tl_count; n > 0; n--) {
+			t = threadlist_remhead(&m->runqueue[i]);
+			if (t->t_background) {
+				threadlist_addtail(bottom, t);
+				continue;
+			}
+			t->priority = 0;
+			t->t_ticks = 0;
+			threadlist_addtail(&m->runqueue[0], t);
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
-
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	if (!curthread->t_background) {
+		curthread->priority = 0;
+		curthread->t_ticks = 0;
 	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
+void
+thread_set_background(void)
+{
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = mlf_rem_tail(&curcpu->c_mlf_runqueue); // TODO: enter new CPU with same priority?
-		threadlist_addhead(&victims, t);
-	}
+	curthread->t_background = true;
+	curthread->priority = NUM_PRIORITIES-1;
+	curthread->t_ticks = 0;
 	spinlock_release(&curcpu->c_runqueue_lock);
+}
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
+void
+thread_printqueues(void)
+{
+	struct cpu *c;
+	struct thread *t;
+	unsigned i;
+	int j;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
 		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (mlf_count(&c->c_mlf_runqueue) < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			
-			 /* Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			 
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			mlf_add_thread(&c->c_mlf_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
+		kprintf("cpu%u: %s, running %s (priority %d, %u/%u ticks)\n",
+			c->c_number, c->c_isidle ? "idle" : "busy",
+			c->c_curthread->t_name, c->c_curthread->priority,
+			c->c_curthread->t_ticks,
+			mlf_quantum[c->c_curthread->priority]);
+		for (j=0; j<NUM_PRIORITIES; j++) {
+			kprintf("    level %d (quantum %u): %u ready",
+				j, mlf_quantum[j], c->c_mlf_runqueue.runqueue[j].tl_count);
+			THREADLIST_FORALL(t, c->c_mlf_runqueue.runqueue[j]) {
+				kprintf(" %s", t->t_name);
 			}
+			kprintf("\n");
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
-
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			mlf_add_thread(&curcpu->c_mlf_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
-	}
-
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1382,53 +1622,94 @@ ipi_broadcast(int code)
 	}
 }
 
-void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+/*
+ * Queue MAPPINGS on TARGET and poke it. Returns the ticket that
+ * target->c_shootdown_done reaches once they have been invalidated.
+ */
+static
+uint32_t
+ipi_tlbshootdown_queue(struct cpu *target, const struct tlbshootdown *mappings,
+		       unsigned n)
 {
-	int n;
+	unsigned i;
+	uint32_t ticket;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	for (i=0; i<n; i++) {
+		if (target->c_numshootdown == TLBSHOOTDOWN_ALL) {
+			break;
+		}
+		if (target->c_numshootdown == TLBSHOOTDOWN_MAX) {
+			target->c_numshootdown = TLBSHOOTDOWN_ALL;
+			break;
+		}
+		target->c_shootdown[target->c_numshootdown++] = mappings[i];
 	}
+	ticket = ++target->c_shootdown_ticket;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+
+	return ticket;
 }
 
-/*
- * Sets up tlbshootdown struct and permforms a shootdown synchronized by the semaphore
- * Handles allocation and destruction of the semaphore
- */
-void ipi_tlbshootdown_wait(struct cpu *target, uint32_t ppn){
-    struct tlbshootdown ts;
-    struct semaphore *s = sem_create("wait on",0);
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	ipi_tlbshootdown_queue(target, mapping, 1);
+}
 
-    ts.done_handling = s;
-    ts.ppn = ppn;
+void
+ipi_tlbshootdown_cpus(uint32_t cpus, const struct tlbshootdown *mappings,
+		      unsigned n)
+{
+	uint32_t tickets[32];
+	struct cpu *c;
+	unsigned i, j, num;
+	int spl;
 
-    ipi_tlbshootdown(target,&ts);
-    P(s); // Only V-ed upon completion of shootdown
+	KASSERT(curthread->t_iplhigh_count == 0);
+	KASSERT(!curthread->t_in_interrupt);
 
-    sem_destroy(s);
-}
+	num = cpuarray_num(&allcpus);
+	if (num > 32) {
+		num = 32;
+	}
 
-void ipi_tlbshootdown_wait_all(uint32_t ppn){
-	unsigned i;
-	struct cpu *c;
+	/*
+	 * Stay on this cpu while deciding which one is local, then send
+	 * everything before waiting on anything, so the targets all work
+	 * at once.
+	 */
+	spl = splhigh();
+	for (i=0; i<num; i++) {
+		if ((cpus & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			for (j=0; j<n; j++) {
+				vm_tlbshootdown(&mappings[j]);
+			}
+			cpus &= ~((uint32_t)1 << i);
+		}
+		else {
+			tickets[i] = ipi_tlbshootdown_queue(c, mappings, n);
+		}
+	}
+	splx(spl);
 
-	for (i=0; i < cpuarray_num(&allcpus); i++) {
+	/* Round trips are short; spin with interrupts on rather than sleep */
+	for (i=0; i<num; i++) {
+		if ((cpus & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
 		c = cpuarray_get(&allcpus, i);
-		if (c != curcpu->c_self) {
-			ipi_tlbshootdown_wait(c,ppn);
+		while ((int32_t)(c->c_shootdown_done - tickets[i]) < 0) {
+			/* spin */
 		}
 	}
 }
@@ -1473,6 +1754,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_ticket;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -892,7 +892,8 @@ buffer_evict(struct buf **ret)
 		if (b == NULL) {
 			continue;
 		}
-		if (b->b_busy == 1) {
+		/* held by a journal transaction: must stay, unwritten */
+		if (b->b_busy == 1 || b->refcnt > 0) {
 			b = NULL;
 			continue;
 		}
@@ -910,8 +911,10 @@ buffer_evict(struct buf **ret)
 		b = db;
 	}
 	if (b == NULL) {
-		/* No buffers at all...? */
-		kprintf("buffer_evict: no targets!?\n");
+		/*
+		 * Every buffer is busy or held by a journal transaction.
+		 * The caller waits for one to be released or committed.
+		 */
 		return EAGAIN;
 	}
 
@@ -976,6 +979,7 @@ buffer_get_internal(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 
 	num_total_gets++;
 
+ again:
 	b = buffer_find(fs, block);
 	if (b != NULL) {
 		num_valid_gets++;
@@ -990,6 +994,15 @@ buffer_get_internal(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 		}
 		if (b == NULL) {
 			result = buffer_evict(&b);
+			if (result == EAGAIN) {
+				/*
+				 * Nothing can go: wait for a buffer to be
+				 * released or unpinned, then start over, as
+				 * someone else may have loaded the block.
+				 */
+				cv_wait(buffer_busy_cv, buffer_lock);
+				goto again;
+			}
 			if (result) {
 				return result;
 			}
@@ -1178,15 +1191,42 @@ sync_fs_buffers(struct fs *fs)
 				i = j;
 			}
 		}
-		else if(b->b_dirty && in_checkpoint) {
-			KASSERT(b->refcnt == 0);
-		}
 	}
 
 	lock_release(buffer_lock);
 	return 0;
 }
 
+/*
+ * Write out the buffer for one block, if it is cached and dirty. Returns
+ * EAGAIN if it is in use or still held by a journal transaction.
+ */
+int
+sync_fs_block(struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buffer_lock);
+	bufcheck();
+
+	b = buffer_find(fs, block);
+	if (b == NULL || !b->b_dirty) {
+		lock_release(buffer_lock);
+		return 0;
+	}
+	if (b->b_busy || b->refcnt > 0) {
+		lock_release(buffer_lock);
+		return EAGAIN;
+	}
+
+	/* lock may be released (and then re-acquired) here */
+	result = buffer_sync(b);
+
+	lock_release(buffer_lock);
+	return result;
+}
+
 ////////////////////////////////////////////////////////////
 // syncer
 
@@ -1363,9 +1403,43 @@ buffer_bootstrap(void)
 unsigned buf_getref(struct buf *b){
 	return b->refcnt;
 }
+daddr_t buf_getblock(struct buf *b){
+	return b->b_physblock;
+}
+/*
+ * Copy LEN bytes at OFF out of a buffer a journal transaction holds for
+ * BLOCK. Holding it keeps it from being evicted, and it need not be
+ * busy. Returns ENOENT if it was dropped, its block having been freed.
+ */
+int buf_copyout(struct buf *b, daddr_t block, size_t off, void *data,
+		size_t len){
+	lock_acquire(buffer_lock);
+	if (!b->b_attached || !b->b_valid || b->b_physblock != block) {
+		lock_release(buffer_lock);
+		return ENOENT;
+	}
+	KASSERT(b->refcnt > 0);
+	KASSERT(off + len <= b->b_size);
+	memcpy(data, (char *)b->b_data + off, len);
+	lock_release(buffer_lock);
+	return 0;
+}
+/*
+ * A journal transaction holds a buffer from its first change until it
+ * commits. A held buffer is neither written back nor evicted; buffer_get
+ * may be waiting for the last hold on one to go.
+ */
 void buf_incref(struct buf *b){
+	lock_acquire(buffer_lock);
 	b->refcnt++;
+	lock_release(buffer_lock);
 }
 void buf_decref(struct buf *b){
+	lock_acquire(buffer_lock);
+	KASSERT(b->refcnt > 0);
 	b->refcnt--;
+	if (b->refcnt == 0) {
+		cv_broadcast(buffer_busy_cv, buffer_lock);
+	}
+	lock_release(buffer_lock);
 }
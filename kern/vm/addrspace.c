@@ -39,6 +39,8 @@
 #include <vm.h>
 #include <machine/coremap.h>
 #include <synch.h>
+#include <uio.h>
+#include <vnode.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -49,6 +51,12 @@
 #define PT_PRIMARY_INDEX(va) (int)(va >> 22)
 #define PT_SECONDARY_INDEX(va) (int)((va >> 12) & 0x3FF)
 #define ADDRESS_OFFSET(addr) (int)(addr & 0xFFF)
+#define PT_CHUNK(j) ((j) / 32)
+
+static void as_pin_range(struct addrspace *as, vaddr_t start, vaddr_t end);
+static void as_writeback_range(struct addrspace *as, vaddr_t start, vaddr_t end);
+static int pt_table_alloc(struct addrspace *as, int i);
+static void pt_mark_live(struct addrspace *as, int i, int j);
 
 
 /* AS FUNCTIONS */
@@ -78,17 +86,26 @@ as_create(void)
 	as->page_table = pt_create();
 	if (as->page_table == NULL)
 		goto err2;
+	as->pt_chunks = kmalloc(PAGE_ENTRIES * sizeof(uint32_t));
+	if (as->pt_chunks == NULL)
+		goto err3;
+	bzero(as->pt_chunks, PAGE_ENTRIES * sizeof(uint32_t));
+	bzero(as->pt_populated, sizeof(as->pt_populated));
 	as->regions = array_create();
 	if (as->regions == NULL)
-		goto err3;
+		goto err4;
 	as->heap_start = (vaddr_t)0;
 	as->heap_end = (vaddr_t)0;
-	as->is_loading = false;
+	as->asid = 0;
+	as->asid_gen = 0;
+	as->asid_cpus = 0;
 
 	return as;
 
+	err4:
+	kfree(as->pt_chunks);
 	err3:
-	pt_destroy(as->page_table);
+	kfree(as->page_table);
 	err2:
 	lock_destroy(as->pt_lock);
 	err1:
@@ -98,8 +115,10 @@ as_create(void)
 
 /* as_copy
  *
- * Duplicates addrspace and copies each physical page
- * to guarantee unique physical page access.
+ * Duplicates addrspace and shares each page copy-on-write with the
+ * new address space. Resident pages get another sharer in the coremap
+ * and swapped out pages another reference on their swap slot; the
+ * actual copy happens in vm_fault when either side first writes.
  *
  * Sychrnonization: Will be performed by helper functions
  */
@@ -117,10 +136,9 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	int i,j, errno;
 	unsigned n, c;
 	struct region *old_region, *new_region;
-	void *src, *dest;
-	struct pt_ent *curr_old, *curr_new;
-	int retval, perm, offset;
-	paddr_t base_old;
+	struct pt_ent *curr_old;
+	vaddr_t va;
+	int ix;
 
 	new->heap_start = old->heap_start;
 	new->heap_end = old->heap_end;
@@ -139,9 +157,17 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		new_region->readable = old_region->readable;
 		new_region->writeable = old_region->writeable;
 		new_region->executable = old_region->executable;
+		new_region->flags = old_region->flags;
+		new_region->vn = old_region->vn;
+		new_region->file_vaddr = old_region->file_vaddr;
+		new_region->file_offset = old_region->file_offset;
+		new_region->file_sz = old_region->file_sz;
+		if (new_region->vn != NULL)
+			VOP_INCREF(new_region->vn);
 
 		errno = array_add(new->regions, new_region, NULL);
 		if (errno) {
+			kfree(new_region);
 			goto err1;
 		}
 	}
@@ -150,63 +176,56 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 
 	// PIN ALL PAGES - ensure that no eviction happen during copy
 	// MUST HAPPEN BEFORE LOCKING ADDRESS SPACE TO AVOID DEADLOCK!
-	pin_all_pages(old);
+	as_pin_range(old, 0, MIPS_KSEG0);
 
+	errno = 0;
 	lock_acquire(old->pt_lock);
-	for (i=0; i<PAGE_ENTRIES; i++){
-		if (old->page_table[i] != NULL){
-			new->page_table[i] = kmalloc(PAGE_SIZE);
-			// For each page table entry
-			for (j=0; j<PAGE_ENTRIES; j++){
-				curr_old = &old->page_table[i][j];
-				curr_new = &new->page_table[i][j];
-				// If the entry exists (ie, page is in memory or swap space)
-				if (pte_get_exists(curr_old)){
-					offset = swapfile_reserve_index();  // Location where we will copy the page to
-					// Page is in memory
-					if (pte_get_present(curr_old)){
-						// Write from pinned memory page to new disk offset
-						base_old = (pte_get_location(curr_old) << 12);
-						src = (void *)PADDR_TO_KVADDR(base_old);
-
-						retval = write_page(src,offset);
-						KASSERT(retval == 0);
-
-						// If page was in memory, we pinned it at the start with pin_all_pages
-						// so we must unpin it upon completion of copying
-						cme_set_busy(cm_get_index(base_old),0);						
-					}
-					// Page is in swap space
-					else{
-						// Make a temporary buffer and read the page from disk
-						dest = kmalloc(PAGE_SIZE);
-						retval = read_page(dest,pte_get_location(curr_old));
-						KASSERT(retval == 0);
-
-						// Copy the page from the buffer to the new disk offset
-						retval = write_page(dest,offset);
-						KASSERT(retval == 0);
-						kfree(dest);
-					}
-					// Update the page table for the new process
-					perm = pte_get_permissions(&old->page_table[i][j]);
-					pt_update(new,PT_TO_VADDR(i,j),offset,perm,0);
-				}
+	// Only visit entries that exist
+	va = 0;
+	while ((curr_old = pt_next(old, &va, MIPS_KSEG0)) != NULL) {
+		i = PT_PRIMARY_INDEX(va);
+		j = PT_SECONDARY_INDEX(va);
+		va += PAGE_SIZE;
+
+		if (errno == 0 && new->page_table[i] == NULL)
+			errno = pt_table_alloc(new, i);
+
+		// Page is in memory: share the frame
+		if (pte_get_present(curr_old)){
+			ix = cm_get_index(pte_get_location(curr_old) << 12);
+			if (errno == 0)
+				errno = cme_add_sharer(ix, new);
+			if (errno == 0) {
+				new->page_table[i][j] = *curr_old;
+				pt_mark_live(new, i, j);
 			}
+
+			// If page was in memory, we pinned it at the start with as_pin_range
+			// so we must unpin it upon completion of copying
+			cme_set_busy(ix,0);
+		}
+		// Page is in swap space: share the slot
+		else if (errno == 0){
+			swapfile_share_index(pte_get_location(curr_old));
+			new->page_table[i][j] = *curr_old;
+			pt_mark_live(new, i, j);
 		}
 	}
 
-	*ret = new;
+	// The TLB may hold writable entries for pages that are now shared
+	vm_tlbflush_as(old);
 	lock_release(old->pt_lock);
 
+	if (errno) {
+		as_destroy(new);
+		return errno;
+	}
+
+	*ret = new;
 	return 0;
 	
 	err1:
-	for (i=0; i<(int)n; i++){
-		new_region = (struct region *)array_get(new->regions,i);
-		if (new_region != NULL)
-			kfree(new_region);
-	}
+	as_destroy(new);
 	return ENOMEM;
 }
 
@@ -221,11 +240,12 @@ as_destroy(struct addrspace *as)
 
 	// PIN ALL PAGES - makes sure no evictions during destruction
 	// MUST HAPPEN BEFORE LOCKING ADDRESS SPACE TO AVOID DEADLOCK!
-	pin_all_pages(as);
+	as_pin_range(as, 0, MIPS_KSEG0);
+	as_writeback_range(as, 0, MIPS_KSEG0);
 
 	// Free page table entries and associated core map entries
 	lock_acquire(as->pt_lock);
-	pt_destroy(as->page_table);
+	pt_destroy(as, as->page_table);
 	lock_release(as->pt_lock);
 	lock_destroy(as->pt_lock);
 
@@ -234,6 +254,8 @@ as_destroy(struct addrspace *as)
 	i = num_regions - 1;
 	while (num_regions > 0){
 		ptr = array_get(as->regions, i);
+		if (ptr->vn != NULL)
+			VOP_DECREF(ptr->vn);
 		kfree(ptr);
 		array_remove(as->regions, i);
 
@@ -249,10 +271,9 @@ as_destroy(struct addrspace *as)
 void
 as_activate(struct addrspace *as)
 {
-	(void)as;
-
-	// Writes over entire TLB with invalid entries
-	vm_tlbshootdown_all();
+	// Entries of other address spaces are tagged with their own IDs, so
+	// nothing needs flushing here
+	vm_activate(as);
 }
 
 /*
@@ -268,8 +289,24 @@ as_activate(struct addrspace *as)
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
+{
+	return as_define_file_region(as, vaddr, sz, readable, writeable,
+				     executable, NULL, 0, 0);
+}
+
+/*
+ * Records a region, widened to whole pages, for vm_fault to find. A
+ * shared mapping keeps its file even with no part of the file in it, as
+ * its pages are still written back there.
+ */
+static
+int
+as_add_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+	      int readable, int writeable, int executable, int flags,
+	      struct vnode *vn, off_t offset, size_t filesz)
 {
 	int errno;
+	vaddr_t file_vaddr = vaddr;
 	struct region *region;
 	/* Align the region. First, the base... */
 	sz += vaddr & ~(vaddr_t)PAGE_FRAME; //TODO WHAT IS THIS??
@@ -278,12 +315,6 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	/* ...and now the length. */
 	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
 
-	// Update heap_start
-	if (as->heap_start < (vaddr + sz)) {
-		as->heap_start = vaddr + sz;
-		as->heap_end = as->heap_start;
-	}
-
 	// Record region (to be used in vm_fault)
 	region = kmalloc(sizeof(struct region));
 	if (region == NULL)
@@ -293,27 +324,269 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	region->readable = readable;
 	region->writeable = writeable;
 	region->executable = executable;
+	region->flags = flags;
+	region->vn = (filesz > 0 || (flags & REGION_SHARED)) ? vn : NULL;
+	region->file_vaddr = file_vaddr;
+	region->file_offset = offset;
+	region->file_sz = filesz;
 	errno = array_add(as->regions, region, NULL);
+	if (errno) {
+		kfree(region);
+		return errno;
+	}
+	if (region->vn != NULL)
+		VOP_INCREF(region->vn);
+
+	return 0;
+}
+
+/*
+ * As as_define_region, but the first FILESZ bytes at VADDR are backed by
+ * VN at OFFSET. vm_fault reads them in page by page as they are touched,
+ * and a page that has not been written since can be dropped and read in
+ * again instead of going to swap.
+ */
+int
+as_define_file_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		      int readable, int writeable, int executable,
+		      struct vnode *vn, off_t offset, size_t filesz)
+{
+	vaddr_t end = ROUNDUP(vaddr + sz, PAGE_SIZE);
+	int errno;
+
+	errno = as_add_region(as, vaddr, sz, readable, writeable, executable,
+			      0, vn, offset, filesz);
 	if (errno)
 		return errno;
 
+	// Update heap_start
+	if (as->heap_start < end) {
+		as->heap_start = end;
+		as->heap_end = as->heap_start;
+	}
 	return 0;
 }
 
+/*
+ * Returns the first region overlapping [start, end), or NULL.
+ */
+static
+struct region *
+as_find_overlap(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	unsigned i, len = array_num(as->regions);
+	struct region *r;
+
+	for (i=0; i<len; i++) {
+		r = array_get(as->regions, i);
+		if (r->base < end && start < r->base + r->sz)
+			return r;
+	}
+	return NULL;
+}
+
+bool
+as_overlaps(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	return as_find_overlap(as, start, end) != NULL;
+}
+
+/*
+ * Mappings are placed top down, first fit, from just below the stack, so
+ * they stay clear of the heap growing up from the other end. The page
+ * holding heap_end belongs to the heap (see vm_fault).
+ */
 int
-as_prepare_load(struct addrspace *as)
+as_define_mapping(struct addrspace *as, size_t sz, int permissions,
+		  bool shared, bool maywrite, struct vnode *vn, off_t offset,
+		  size_t filesz, vaddr_t *ret)
+{
+	vaddr_t top = USERSTACK - STACK_PAGES * PAGE_SIZE;
+	vaddr_t floor = (as->heap_end & PAGE_FRAME) + PAGE_SIZE;
+	vaddr_t vaddr;
+	struct region *r;
+	int errno;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+	sz = ROUNDUP(sz, PAGE_SIZE);
+
+	while (top >= floor && top - floor >= sz) {
+		vaddr = top - sz;
+		r = as_find_overlap(as, vaddr, top);
+		if (r == NULL) {
+			errno = as_add_region(as, vaddr, sz,
+				permissions & VM_READ, permissions & VM_WRITE,
+				permissions & VM_EXEC,
+				REGION_MMAP | (shared ? REGION_SHARED : 0) |
+				(maywrite ? REGION_MAYWRITE : 0),
+				vn, offset, filesz);
+			if (errno)
+				return errno;
+			*ret = vaddr;
+			return 0;
+		}
+		// Try again below whatever is in the way
+		top = r->base;
+	}
+	return ENOMEM;
+}
+
+/*
+ * A range in the middle of a mapping splits it in two, which needs a new
+ * region; that is allocated before anything is thrown away, so on ENOMEM
+ * the mapping is intact (though mappings earlier in the range may already
+ * be gone).
+ */
+int
+as_unmap_regions(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	unsigned i = 0;
+	struct region *r, *tail;
+	vaddr_t lo, hi, rend;
+	int errno;
+
+	while (i < array_num(as->regions)) {
+		r = array_get(as->regions, i);
+		rend = r->base + r->sz;
+		if (!(r->flags & REGION_MMAP) || r->base >= end || rend <= start) {
+			i++;
+			continue;
+		}
+		lo = start > r->base ? start : r->base;
+		hi = end < rend ? end : rend;
+
+		if (lo > r->base && hi < rend) {
+			tail = kmalloc(sizeof(struct region));
+			if (tail == NULL)
+				return ENOMEM;
+			*tail = *r;
+			tail->base = hi;
+			tail->sz = rend - hi;
+			errno = array_add(as->regions, tail, NULL);
+			if (errno) {
+				kfree(tail);
+				return errno;
+			}
+			if (tail->vn != NULL)
+				VOP_INCREF(tail->vn);
+		}
+
+		as_unmap_range(as, lo, hi);
+
+		// The file fields stay as they are; as_file_span clips to the region
+		if (lo > r->base) {
+			r->sz = lo - r->base;
+		}
+		else if (hi < rend) {
+			r->base = hi;
+			r->sz = rend - hi;
+		}
+		else {
+			if (r->vn != NULL)
+				VOP_DECREF(r->vn);
+			kfree(r);
+			array_remove(as->regions, i);
+			continue;
+		}
+		i++;
+	}
+	return 0;
+}
+
+/*
+ * Cuts region R in two at AT, which must be inside it: R keeps the part
+ * below, and the part above goes in a new region at the end of the list.
+ */
+static
+int
+as_split_region(struct addrspace *as, struct region *r, vaddr_t at)
 {
-	// VM_READONLY fault handling has special case allowing dirtying of page
-	// if the is_loading variable of the address space is set
-	as->is_loading = true;
+	struct region *tail;
+	int errno;
 
+	KASSERT(at > r->base && at < r->base + r->sz);
+
+	tail = kmalloc(sizeof(struct region));
+	if (tail == NULL)
+		return ENOMEM;
+	*tail = *r;
+	tail->base = at;
+	tail->sz = r->base + r->sz - at;
+	errno = array_add(as->regions, tail, NULL);
+	if (errno) {
+		kfree(tail);
+		return errno;
+	}
+	if (tail->vn != NULL)
+		VOP_INCREF(tail->vn);
+
+	// As in as_unmap_regions, as_file_span clips the file fields
+	r->sz = at - r->base;
+	return 0;
+}
+
+/*
+ * Every page of the range must be in a mapping (else ENOMEM), and none
+ * may be made writable that was mapped shared from a file opened read
+ * only (EACCES); nothing is changed unless both hold. Mappings the range
+ * covers only in part are split first, and the part split off comes
+ * round again later in the list. On ENOMEM from a split, mappings earlier
+ * in the range may already have been changed.
+ */
+int
+as_protect_regions(struct addrspace *as, vaddr_t start, vaddr_t end,
+		   int permissions)
+{
+	unsigned i;
+	struct region *r;
+	vaddr_t va, rend;
+	int errno;
+
+	for (va = start; va < end; va = r->base + r->sz) {
+		r = as_find_overlap(as, va, va + PAGE_SIZE);
+		if (r == NULL || !(r->flags & REGION_MMAP))
+			return ENOMEM;
+		if ((permissions & VM_WRITE) && !(r->flags & REGION_MAYWRITE))
+			return EACCES;
+	}
+
+	for (i=0; i<array_num(as->regions); i++) {
+		r = array_get(as->regions, i);
+		rend = r->base + r->sz;
+		if (r->base >= end || rend <= start)
+			continue;
+		if (r->base < start) {
+			errno = as_split_region(as, r, start);
+			if (errno)
+				return errno;
+			continue;
+		}
+		if (rend > end) {
+			errno = as_split_region(as, r, end);
+			if (errno)
+				return errno;
+		}
+
+		r->readable = permissions & VM_READ;
+		r->writeable = permissions & VM_WRITE;
+		r->executable = permissions & VM_EXEC;
+		as_protect_range(as, r->base, r->base + r->sz, permissions);
+	}
+	return 0;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	// Nothing is loaded up front; vm_fault reads pages in from the file
+	(void)as;
 	return 0;
 }
 
 int
 as_complete_load(struct addrspace *as)
 {
-	as->is_loading = false;
+	(void)as;
 	return 0;
 }
 
@@ -325,6 +598,103 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * Pins every resident page mapped in [start, end) of the address space.
+ * Walks the page table rather than the coremap, so the cost follows the
+ * size of the process.
+ *
+ * Synchronization: Must be called without pt_lock (pins come first). The
+ * entries are read unlocked, so a page evicted while we waited for its pin
+ * is let go again.
+ */
+static
+void
+as_pin_range(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct pt_ent *pte;
+	vaddr_t va = start;
+	int ix;
+
+	while ((pte = pt_next(as, &va, end)) != NULL) {
+		if (pte_get_present(pte)) {
+			ix = cm_get_index(pte_get_location(pte) << 12);
+			while (!cme_try_pin(ix))
+				;
+			// Page may have been evicted while we were waiting
+			if (!pte_get_present(pte) ||
+			    cm_get_index(pte_get_location(pte) << 12) != ix)
+				cme_set_busy(ix, 0);
+		}
+		va += PAGE_SIZE;
+	}
+}
+
+/*
+ * Changes the permissions of every page mapped in [start, end), then
+ * flushes the address space's TLB entries so that none loaded under the
+ * old permissions survives. The region list is left alone.
+ */
+void
+as_protect_range(struct addrspace *as, vaddr_t start, vaddr_t end,
+		 int permissions)
+{
+	lock_acquire(as->pt_lock);
+	pt_protect_range(as, start, end, permissions);
+	vm_tlbflush_as(as);
+	lock_release(as->pt_lock);
+}
+
+/*
+ * Writes back the dirty pages of shared mappings in [start, end) before
+ * they are thrown away. A page another process still maps (after fork)
+ * is left for whichever lets go of it last.
+ *
+ * Synchronization: Caller holds the pins on the resident pages in the
+ * range (see as_pin_range), which keep the entries still, but not
+ * pt_lock, as this does file system I/O.
+ */
+static
+void
+as_writeback_range(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	unsigned i, len = array_num(as->regions);
+	struct pt_ent *pte;
+	vaddr_t va = start;
+	int ix;
+
+	for (i=0; i<len; i++) {
+		if (((struct region *)array_get(as->regions, i))->flags & REGION_SHARED)
+			break;
+	}
+	if (i == len)
+		return;
+
+	while ((pte = pt_next(as, &va, end)) != NULL) {
+		if (pte_get_present(pte)) {
+			ix = cm_get_index(pte_get_location(pte) << 12);
+			if (cme_is_mapped(ix) && cme_get_share_count(ix) == 1 &&
+			    cme_writeback(ix))
+				kprintf("as_writeback_range: lost a page of a mapped file\n");
+		}
+		va += PAGE_SIZE;
+	}
+}
+
+/*
+ * Throws away every page mapped in [start, end), along with its swap
+ * slot, e.g. when the heap shrinks.
+ */
+void
+as_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	as_pin_range(as, start, end);
+	as_writeback_range(as, start, end);
+	lock_acquire(as->pt_lock);
+	pt_unmap_range(as, start, end);
+	vm_tlbflush_as(as);
+	lock_release(as->pt_lock);
+}
+
 /*
  * Searches the regions of an address space to find the one the given
  * virtual address falls in, then returns the permissions of the region.
@@ -352,6 +722,119 @@ int as_get_permissions(struct addrspace *as, vaddr_t va){
 	return -1;
 }
 
+/*
+ * Clips the page at va to the file backed part of region r. Returns false
+ * if none of the page is backed, else sets *start and *end. munmap may
+ * have trimmed the region since, so the region's own bounds count too.
+ */
+static
+bool
+as_file_span(struct region *r, vaddr_t va, vaddr_t *start, vaddr_t *end)
+{
+	if (r->vn == NULL || va < r->base || va >= r->base + r->sz)
+		return false;
+	*start = va > r->file_vaddr ? va : r->file_vaddr;
+	*end = va + PAGE_SIZE;
+	if (*end > r->file_vaddr + r->file_sz)
+		*end = r->file_vaddr + r->file_sz;
+	return *start < *end;
+}
+
+bool
+as_page_is_file(struct addrspace *as, vaddr_t va)
+{
+	unsigned i, len = array_num(as->regions);
+	vaddr_t start, end;
+
+	for (i=0; i<len; i++) {
+		if (as_file_span(array_get(as->regions, i), va, &start, &end))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * A page can be shared with other processes running the same executable
+ * when all of it comes from one read-only, executable, file backed
+ * region: it then reads the same in all of them. Mappings are left out,
+ * as the same file may be mapped at any offset.
+ */
+struct vnode *
+as_page_text(struct addrspace *as, vaddr_t va)
+{
+	unsigned i, len = array_num(as->regions);
+	struct region *r, *found = NULL;
+
+	for (i=0; i<len; i++) {
+		r = array_get(as->regions, i);
+		if (va >= r->base && va < r->base + r->sz) {
+			if (found != NULL)
+				return NULL;
+			found = r;
+		}
+	}
+	if (found == NULL || found->vn == NULL || found->writeable ||
+	    !found->executable || (found->flags & REGION_MMAP))
+		return NULL;
+	return found->vn;
+}
+
+struct vnode *
+as_page_mapped(struct addrspace *as, vaddr_t va, int *file_page)
+{
+	unsigned i, len = array_num(as->regions);
+	struct region *r;
+
+	for (i=0; i<len; i++) {
+		r = array_get(as->regions, i);
+		if (va >= r->base && va < r->base + r->sz &&
+		    (r->flags & REGION_SHARED)) {
+			*file_page = (r->file_offset + (va - r->file_vaddr)) / PAGE_SIZE;
+			return r->vn;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Segments need not start or end on a page boundary, so a page may hold
+ * the tail of one and the head of another; every region is consulted.
+ *
+ * Synchronization: only the owning (single threaded) process changes its
+ * regions, so they are read without pt_lock. The caller holds the pin on
+ * pa, which nobody maps yet.
+ */
+int
+as_fill_page(struct addrspace *as, vaddr_t va, paddr_t pa)
+{
+	unsigned i, len = array_num(as->regions);
+	struct region *r;
+	vaddr_t start, end;
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	KASSERT(!lock_do_i_hold(as->pt_lock));
+
+	for (i=0; i<len; i++) {
+		r = array_get(as->regions, i);
+		if (!as_file_span(r, va, &start, &end))
+			continue;
+
+		uio_kinit(&iov, &u, (void *)(PADDR_TO_KVADDR(pa) + (start - va)),
+			  end - start, r->file_offset + (start - r->file_vaddr),
+			  UIO_READ);
+		result = VOP_READ(r->vn, &u);
+		if (result)
+			return result;
+		if (u.uio_resid != 0) {
+			// load_elf checked the size; someone truncated the file
+			return EIO;
+		}
+	}
+	return 0;
+}
+
 
 /*
  * Page table helper methods
@@ -371,36 +854,199 @@ struct pt_ent **pt_create(void){
 	return ret;
 }
 
+/*
+ * Page table summary upkeep
+ *
+ *    pt_table_alloc - allocates zeroed second-level table i
+ *    pt_table_free - frees second-level table i
+ *    pt_mark_live - notes that entry j of table i exists
+ *    pt_mark_dead - notes that entry j of table i no longer exists
+ *    pt_find_bit - index of the first set bit at or after from, or -1
+ */
+
+static
+int
+pt_table_alloc(struct addrspace *as, int i)
+{
+	KASSERT(as->page_table[i] == NULL);
+
+	as->page_table[i] = kmalloc(PAGE_SIZE);
+	if (as->page_table[i] == NULL)
+		return ENOMEM;
+	bzero(as->page_table[i], PAGE_SIZE);
+	as->pt_chunks[i] = 0;
+	as->pt_populated[i / 32] |= (uint32_t)1 << (i % 32);
+	return 0;
+}
+
+static
+void
+pt_table_free(struct addrspace *as, int i)
+{
+	kfree(as->page_table[i]);
+	as->page_table[i] = NULL;
+	as->pt_chunks[i] = 0;
+	as->pt_populated[i / 32] &= ~((uint32_t)1 << (i % 32));
+}
+
+static
+void
+pt_mark_live(struct addrspace *as, int i, int j)
+{
+	as->pt_chunks[i] |= (uint32_t)1 << PT_CHUNK(j);
+}
+
+static
+void
+pt_mark_dead(struct addrspace *as, int i, int j)
+{
+	int k, first = PT_CHUNK(j) * 32;
+
+	for (k = first; k < first + 32; k++) {
+		if (pte_get_exists(&as->page_table[i][k]))
+			return;
+	}
+	as->pt_chunks[i] &= ~((uint32_t)1 << PT_CHUNK(j));
+}
+
+static
+int
+pt_find_bit(const uint32_t *words, int nbits, int from)
+{
+	int i = from;
+
+	while (i < nbits) {
+		if (words[i / 32] >> (i % 32) == 0) {
+			// Nothing left in this word
+			i = (i / 32 + 1) * 32;
+			continue;
+		}
+		if (words[i / 32] & ((uint32_t)1 << (i % 32)))
+			return i;
+		i++;
+	}
+	return -1;
+}
+
+/*
+ * Drops the address space's claim on what an existing entry maps: the frame
+ * is freed (or just unshared if mapped copy-on-write elsewhere), or the swap
+ * slot released.
+ *
+ * Should only be called with the address space lock and a pin on the frame.
+ */
+static
+void
+pt_release_entry(struct addrspace *as, struct pt_ent *pte)
+{
+	paddr_t pa;
+
+	// If the page exists, we should free the coremap entry
+	if (pte_get_present(pte)){
+		pa = pte_get_location(pte) << 12;
+		if (cme_drop_sharer(cm_get_index(pa), as) == 0) {
+			free_coremap_page(pa, false /* iskern */);
+		}
+		else {
+			cme_set_busy(cm_get_index(pa), 0);
+		}
+	}
+	// Swapped out - just have to free disk index
+	else {
+		swapfile_free_index(pte_get_location(pte));
+	}
+}
+
 /*
  * Frees the page table after freeing any coremap entries and disk offsets that
- * were mapped to virtual addresses within it.
+ * were mapped to virtual addresses within it. Pages still shared copy-on-write
+ * with another address space are only unshared.
  *
  * Should only be called with the address space lock and a pin on all coremap entries
  * that the process owns.
  */
-void pt_destroy(struct pt_ent **pt){
-	int i, j;
-	paddr_t pa;
+void pt_destroy(struct addrspace *as, struct pt_ent **pt){
+	struct pt_ent *pte;
+	vaddr_t va = 0;
+	int i;
 
-	for (i=0; i<PAGE_ENTRIES; i++){
-		if (pt[i] != NULL) {
-			for (j=0; j<PAGE_ENTRIES; j++) {
-				if (pte_get_exists(&pt[i][j])) {
-					// If the page exists, we should free the coremap entry
-					if (pte_get_present(&pt[i][j])){
-						pa = pte_get_location(&pt[i][j]) << 12;
-						free_coremap_page(pa, false /* iskern */);
-					}
-					// Swapped out - just have to free disk index
-					else {
-						swapfile_free_index(pte_get_location(&pt[i][j]));
-					}
-				}
+	KASSERT(pt == as->page_table);
+
+	while ((pte = pt_next(as, &va, MIPS_KSEG0)) != NULL) {
+		pt_release_entry(as, pte);
+		va += PAGE_SIZE;
+	}
+	i = 0;
+	while ((i = pt_find_bit(as->pt_populated, PAGE_ENTRIES, i)) >= 0) {
+		pt_table_free(as, i);
+		i++;
+	}
+	kfree(as->pt_chunks);
+	kfree(pt);
+}
+
+struct pt_ent *pt_next(struct addrspace *as, vaddr_t *va, vaddr_t end){
+	int i, j, k;
+	vaddr_t found;
+
+	i = PT_PRIMARY_INDEX(*va);
+	j = PT_SECONDARY_INDEX(*va);
+	while ((i = pt_find_bit(as->pt_populated, PAGE_ENTRIES, i)) >= 0) {
+		if (PT_TO_VADDR(i,0) >= end)
+			return NULL;
+		if (i != PT_PRIMARY_INDEX(*va))
+			j = 0;
+		// Skip to chunks that hold existing entries
+		while ((k = pt_find_bit(&as->pt_chunks[i], 32, PT_CHUNK(j))) >= 0) {
+			if (j < k * 32)
+				j = k * 32;
+			for (; j < (k + 1) * 32; j++) {
+				if (!pte_get_exists(&as->page_table[i][j]))
+					continue;
+				found = PT_TO_VADDR(i,j);
+				if (found >= end)
+					return NULL;
+				*va = found;
+				return &as->page_table[i][j];
 			}
-			kfree(pt[i]);
 		}
+		i++;
+		j = 0;
+	}
+	return NULL;
+}
+
+void pt_protect_range(struct addrspace *as, vaddr_t start, vaddr_t end, int permissions){
+	struct pt_ent *pte;
+	vaddr_t va = start;
+
+	KASSERT(lock_do_i_hold(as->pt_lock));
+	KASSERT(permissions >= 0 && permissions <= 7);
+
+	while ((pte = pt_next(as, &va, end)) != NULL) {
+		pte_set_permissions(pte, permissions);
+		va += PAGE_SIZE;
+	}
+}
+
+void pt_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end){
+	struct pt_ent *pte;
+	vaddr_t va = start;
+	int i;
+
+	KASSERT(lock_do_i_hold(as->pt_lock));
+
+	while ((pte = pt_next(as, &va, end)) != NULL) {
+		pt_release_entry(as, pte);
+		pte_set_exists(pte, 0);
+		pte_set_present(pte, 0);
+
+		i = PT_PRIMARY_INDEX(va);
+		pt_mark_dead(as, i, PT_SECONDARY_INDEX(va));
+		if (as->pt_chunks[i] == 0)
+			pt_table_free(as, i);
+		va += PAGE_SIZE;
 	}
-	kfree(pt);
 }
 
 /*
@@ -434,26 +1080,14 @@ paddr_t va_to_pa(struct addrspace *as, vaddr_t va){
  * Fails if the entry already exists
  */
 int pt_insert(struct addrspace *as, vaddr_t va, int ppn, int permissions){
-	int i;
-
 	KASSERT(as != NULL);
 	KASSERT((ppn & 0xfff00000) == 0);
 	KASSERT(permissions >= 0 && permissions <= 7);
 
 	// If a secondary page table does not exist, allocate one
 	if (as->page_table[PT_PRIMARY_INDEX(va)] == NULL) {
-		as->page_table[PT_PRIMARY_INDEX(va)] = kmalloc(PAGE_SIZE);
-
-		if (as->page_table[PT_PRIMARY_INDEX(va)] == NULL)
+		if (pt_table_alloc(as, PT_PRIMARY_INDEX(va)))
 			return ENOMEM;
-
-		// Initalizes all entries in the allocated page table to zero
-		for (i=0; i<PAGE_ENTRIES; i++){
-			as->page_table[PT_PRIMARY_INDEX(va)][i].page_paddr_base = 0;
-			as->page_table[PT_PRIMARY_INDEX(va)][i].permissions = 0;
-			as->page_table[PT_PRIMARY_INDEX(va)][i].present = 0;
-			as->page_table[PT_PRIMARY_INDEX(va)][i].exists = 0;
-		}
 	}
 
 	struct pt_ent *pte = get_pt_entry(as,va);
@@ -464,6 +1098,7 @@ int pt_insert(struct addrspace *as, vaddr_t va, int ppn, int permissions){
 	pte_set_permissions(pte,permissions);
 	pte_set_present(pte,1);
 	pte_set_exists(pte,1);
+	pt_mark_live(as, PT_PRIMARY_INDEX(va), PT_SECONDARY_INDEX(va));
 
 	return 0;
 }
@@ -474,6 +1109,7 @@ int pt_remove(struct addrspace *as, vaddr_t va){
 	if (pte == NULL)
 		return -1;
 	pte_set_exists(pte,0);
+	pt_mark_dead(as, PT_PRIMARY_INDEX(va), PT_SECONDARY_INDEX(va));
 	return 0;
 }
 
@@ -491,6 +1127,7 @@ int pt_update(struct addrspace *as, vaddr_t va, int ppn, int permissions, unsign
 	pte_set_present(pte,is_present);
 	pte_set_exists(pte,1);
 	pte_set_permissions(pte,permissions);
+	pt_mark_live(as, PT_PRIMARY_INDEX(va), PT_SECONDARY_INDEX(va));
 
 	return 0;
 }
@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <vm.h>
@@ -119,45 +120,50 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy.
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Pagerefs live in pages of their own, chained together. The first
+ * page is in the kernel BSS so the allocator can start up before
+ * anything else; further pages are added with alloc_kpages as the
+ * subpage heap grows, so its size is bounded only by memory. Pageref
+ * pages are never given back.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define NPAGEREFS ((PAGE_SIZE - 64) / sizeof(struct pageref))
+#define INUSE_WORDS DIVROUNDUP(NPAGEREFS, 32)
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+struct pagerefpage {
+	struct pagerefpage *next;
+	unsigned nused;
+	uint32_t inuse[INUSE_WORDS];
+	struct pageref refs[NPAGEREFS];
+};
+
+static struct pagerefpage firstpagerefs;
+static struct pagerefpage *pagerefpages = &firstpagerefs;
+static unsigned npagerefs = NPAGEREFS;	/* total across all pages */
 
 static
 struct pageref *
 allocpageref(void)
 {
+	struct pagerefpage *prp;
 	unsigned i,j;
 	uint32_t k;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
+	for (prp = pagerefpages; prp != NULL; prp = prp->next) {
+		if (prp->nused == NPAGEREFS) {
 			/* full */
 			continue;
 		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
+		for (i=0; i<INUSE_WORDS; i++) {
+			if (prp->inuse[i]==0xffffffff) {
+				continue;
+			}
+			for (k=1,j=0; k!=0 && i*32+j < NPAGEREFS; k<<=1,j++) {
+				if ((prp->inuse[i] & k)==0) {
+					prp->inuse[i] |= k;
+					prp->nused++;
+					return &prp->refs[i*32 + j];
+				}
 			}
 		}
 		KASSERT(0);
@@ -171,15 +177,24 @@ static
 void
 freepageref(struct pageref *p)
 {
+	struct pagerefpage *prp;
 	size_t i, j;
 	uint32_t k;
 
-	j = p-pagerefs;
+	/* Pages after the first are page aligned, so p leads back to them */
+	if (p >= firstpagerefs.refs && p < firstpagerefs.refs + NPAGEREFS) {
+		prp = &firstpagerefs;
+	}
+	else {
+		prp = (struct pagerefpage *)((vaddr_t)p & PAGE_FRAME);
+	}
+	j = p-prp->refs;
 	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
 	i = j/32;
 	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT((prp->inuse[i] & k) != 0);
+	prp->inuse[i] &= ~k;
+	prp->nused--;
 }
 
 ////////////////////////////////////////
@@ -198,6 +213,35 @@ static struct pageref *allbase;
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Add a page of pagerefs. Called with kmalloc_spinlock held; drops it
+ * around alloc_kpages like subpage_kmalloc does, so callers must recheck
+ * whatever they looked at before.
+ */
+static
+int
+growpagerefs(void)
+{
+	struct pagerefpage *prp;
+	vaddr_t page;
+
+	KASSERT(sizeof(struct pagerefpage) <= PAGE_SIZE);
+
+	spinlock_release(&kmalloc_spinlock);
+	page = alloc_kpages(1);
+	spinlock_acquire(&kmalloc_spinlock);
+	if (page == 0) {
+		return ENOMEM;
+	}
+
+	prp = (struct pagerefpage *)page;
+	bzero(prp, sizeof(*prp));
+	prp->next = pagerefpages;
+	pagerefpages = prp;
+	npagerefs += NPAGEREFS;
+	return 0;
+}
+
 ////////////////////////////////////////
 
 /* SLOWER implies SLOW */
@@ -261,14 +305,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < npagerefs);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < npagerefs);
 		ac++;
 	}
 
@@ -470,6 +514,9 @@ subpage_kmalloc(size_t sz)
 	spinlock_acquire(&kmalloc_spinlock);
 
 	pr = allocpageref();
+	while (pr==NULL && growpagerefs()==0) {
+		pr = allocpageref();
+	}
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
@@ -0,0 +1,376 @@
+/*
+ * Added for PetrelOS
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <machine/coremap.h>
+#include <objcache.h>
+
+/*
+ * Object caches. See objcache.h for the interface.
+ *
+ * A slab is one page: a struct objcache_slab header followed by as many
+ * objects as fit. Each object is followed by a link word, used to chain
+ * free objects in the slab without disturbing their constructed state.
+ * Slabs with free objects are on the cache's partial list; full slabs are
+ * on no list, since objcache_free finds an object's slab by rounding its
+ * address down to the page.
+ *
+ * Lock order is oc_lock, then a magazine's om_lock.
+ */
+
+struct objcache_slab {
+	struct objcache *os_cache;
+	struct objcache_slab *os_next;	/* On oc_partial */
+	struct objcache_slab *os_prev;
+	void *os_free;			/* First free object */
+	unsigned os_nfree;
+	unsigned os_nobjs;
+};
+
+#define OBJ_ALIGN 8
+#define SLAB_FIRST_OBJ ROUNDUP(sizeof(struct objcache_slab), OBJ_ALIGN)
+
+/* Bytes between objects, and where the free chain link sits in each. */
+#define OBJ_LINKOFF(oc) ROUNDUP((oc)->oc_size, sizeof(void *))
+#define OBJ_STRIDE(oc)  ROUNDUP(OBJ_LINKOFF(oc) + sizeof(void *), OBJ_ALIGN)
+#define OBJ_LINK(oc, obj) (*(void **)((vaddr_t)(obj) + OBJ_LINKOFF(oc)))
+
+#define SLAB_OF(obj) ((struct objcache_slab *)((vaddr_t)(obj) & PAGE_FRAME))
+
+////////////////////////////////////////
+
+static
+void
+slab_link(struct objcache *oc, struct objcache_slab *s)
+{
+	KASSERT(spinlock_do_i_hold(&oc->oc_lock));
+
+	s->os_prev = NULL;
+	s->os_next = oc->oc_partial;
+	if (oc->oc_partial != NULL) {
+		oc->oc_partial->os_prev = s;
+	}
+	oc->oc_partial = s;
+}
+
+static
+void
+slab_unlink(struct objcache *oc, struct objcache_slab *s)
+{
+	KASSERT(spinlock_do_i_hold(&oc->oc_lock));
+
+	if (s->os_prev != NULL) {
+		s->os_prev->os_next = s->os_next;
+	}
+	else {
+		KASSERT(oc->oc_partial == s);
+		oc->oc_partial = s->os_next;
+	}
+	if (s->os_next != NULL) {
+		s->os_next->os_prev = s->os_prev;
+	}
+	s->os_next = s->os_prev = NULL;
+}
+
+/*
+ * Get a fresh page and fill it with constructed objects. Called without
+ * oc_lock, as alloc_kpages may need to evict pages.
+ */
+static
+struct objcache_slab *
+slab_create(struct objcache *oc)
+{
+	struct objcache_slab *s;
+	vaddr_t page, obj;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+
+	s = (struct objcache_slab *)page;
+	s->os_cache = oc;
+	s->os_next = s->os_prev = NULL;
+	s->os_free = NULL;
+	s->os_nobjs = (PAGE_SIZE - SLAB_FIRST_OBJ) / OBJ_STRIDE(oc);
+	s->os_nfree = s->os_nobjs;
+	KASSERT(s->os_nobjs > 0);
+
+	/* Chain in address order, lowest first */
+	for (i = s->os_nobjs; i > 0; i--) {
+		obj = page + SLAB_FIRST_OBJ + (i-1) * OBJ_STRIDE(oc);
+		if (oc->oc_ctor != NULL) {
+			oc->oc_ctor((void *)obj);
+		}
+		OBJ_LINK(oc, obj) = s->os_free;
+		s->os_free = (void *)obj;
+	}
+	return s;
+}
+
+/*
+ * Take an object from the first partial slab, which must exist.
+ */
+static
+void *
+slab_take(struct objcache *oc)
+{
+	struct objcache_slab *s = oc->oc_partial;
+	void *obj;
+
+	KASSERT(spinlock_do_i_hold(&oc->oc_lock));
+	KASSERT(s != NULL && s->os_nfree > 0);
+
+	obj = s->os_free;
+	s->os_free = OBJ_LINK(oc, obj);
+	s->os_nfree--;
+	if (s->os_nfree == 0) {
+		slab_unlink(oc, s);
+	}
+	return obj;
+}
+
+/*
+ * Return an object to its slab. If that leaves the slab wholly free and
+ * the cache already has a spare, returns the slab for the caller to
+ * release once oc_lock is dropped; otherwise NULL.
+ */
+static
+struct objcache_slab *
+slab_put(struct objcache *oc, void *obj)
+{
+	struct objcache_slab *s = SLAB_OF(obj);
+
+	KASSERT(spinlock_do_i_hold(&oc->oc_lock));
+	KASSERT(s->os_cache == oc);
+	KASSERT(s->os_nfree < s->os_nobjs);
+
+	OBJ_LINK(oc, obj) = s->os_free;
+	s->os_free = obj;
+	if (s->os_nfree++ == 0) {
+		slab_link(oc, s);
+	}
+	if (s->os_nfree < s->os_nobjs) {
+		return NULL;
+	}
+
+	slab_unlink(oc, s);
+	if (oc->oc_empty == NULL) {
+		oc->oc_empty = s;
+		return NULL;
+	}
+	oc->oc_nslabs--;
+	return s;
+}
+
+/*
+ * The current cpu's magazine, or NULL if it has none (early in boot,
+ * or too many cpus).
+ */
+static
+struct objcache_mag *
+oc_mag(struct objcache *oc)
+{
+	unsigned n;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	n = curcpu->c_number;
+	if (n >= OBJCACHE_CPUS) {
+		return NULL;
+	}
+	return &oc->oc_mags[n];
+}
+
+/*
+ * Hand back several objects at once, releasing any slabs that empty.
+ */
+static
+void
+oc_put_many(struct objcache *oc, void **objs, unsigned n)
+{
+	struct objcache_slab *dead[OBJCACHE_MAGSIZE + 1];
+	unsigned i, ndead = 0;
+
+	KASSERT(n <= OBJCACHE_MAGSIZE + 1);
+
+	spinlock_acquire(&oc->oc_lock);
+	for (i=0; i<n; i++) {
+		dead[ndead] = slab_put(oc, objs[i]);
+		if (dead[ndead] != NULL) {
+			ndead++;
+		}
+	}
+	spinlock_release(&oc->oc_lock);
+
+	for (i=0; i<ndead; i++) {
+		free_kpages((vaddr_t)dead[i]);
+	}
+}
+
+////////////////////////////////////////
+
+struct objcache *
+objcache_create(const char *name, size_t size, void (*ctor)(void *obj))
+{
+	struct objcache *oc;
+	unsigned i;
+
+	oc = kmalloc(sizeof(struct objcache));
+	if (oc == NULL) {
+		return NULL;
+	}
+	oc->oc_name = name;
+	oc->oc_size = size;
+	oc->oc_ctor = ctor;
+	spinlock_init(&oc->oc_lock);
+	oc->oc_partial = NULL;
+	oc->oc_empty = NULL;
+	oc->oc_nslabs = 0;
+	for (i=0; i<OBJCACHE_CPUS; i++) {
+		spinlock_init(&oc->oc_mags[i].om_lock);
+		oc->oc_mags[i].om_count = 0;
+	}
+	return oc;
+}
+
+void *
+objcache_alloc(struct objcache *oc)
+{
+	struct objcache_mag *mag;
+	struct objcache_slab *s;
+	void *obj;
+
+	mag = oc_mag(oc);
+	if (mag != NULL) {
+		spinlock_acquire(&mag->om_lock);
+		if (mag->om_count > 0) {
+			obj = mag->om_objs[--mag->om_count];
+			spinlock_release(&mag->om_lock);
+			return obj;
+		}
+		spinlock_release(&mag->om_lock);
+	}
+
+	spinlock_acquire(&oc->oc_lock);
+	while (oc->oc_partial == NULL) {
+		if (oc->oc_empty != NULL) {
+			slab_link(oc, oc->oc_empty);
+			oc->oc_empty = NULL;
+			break;
+		}
+		spinlock_release(&oc->oc_lock);
+		s = slab_create(oc);
+		if (s == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&oc->oc_lock);
+		oc->oc_nslabs++;
+		slab_link(oc, s);
+	}
+	obj = slab_take(oc);
+
+	/* Half fill the magazine so the next few allocations stay local */
+	if (mag != NULL) {
+		spinlock_acquire(&mag->om_lock);
+		while (mag->om_count < OBJCACHE_MAGSIZE / 2 &&
+		       oc->oc_partial != NULL) {
+			mag->om_objs[mag->om_count++] = slab_take(oc);
+		}
+		spinlock_release(&mag->om_lock);
+	}
+	spinlock_release(&oc->oc_lock);
+
+	return obj;
+}
+
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+	struct objcache_mag *mag;
+	void *spill[OBJCACHE_MAGSIZE + 1];
+	unsigned n = 0;
+
+	if (obj == NULL) {
+		return;
+	}
+	KASSERT(SLAB_OF(obj)->os_cache == oc);
+
+	mag = oc_mag(oc);
+	if (mag != NULL) {
+		spinlock_acquire(&mag->om_lock);
+		if (mag->om_count < OBJCACHE_MAGSIZE) {
+			mag->om_objs[mag->om_count++] = obj;
+			spinlock_release(&mag->om_lock);
+			return;
+		}
+		/* Full; send half of it back to the slabs with this one */
+		while (mag->om_count > OBJCACHE_MAGSIZE / 2) {
+			spill[n++] = mag->om_objs[--mag->om_count];
+		}
+		spinlock_release(&mag->om_lock);
+	}
+	spill[n++] = obj;
+	oc_put_many(oc, spill, n);
+}
+
+void
+objcache_destroy(struct objcache *oc)
+{
+	struct objcache_mag *mag;
+	void *objs[OBJCACHE_MAGSIZE];
+	unsigned i, n;
+
+	for (i=0; i<OBJCACHE_CPUS; i++) {
+		mag = &oc->oc_mags[i];
+		spinlock_acquire(&mag->om_lock);
+		for (n=0; mag->om_count > 0; n++) {
+			objs[n] = mag->om_objs[--mag->om_count];
+		}
+		spinlock_release(&mag->om_lock);
+		oc_put_many(oc, objs, n);
+		spinlock_cleanup(&mag->om_lock);
+	}
+
+	KASSERT(oc->oc_partial == NULL);
+	if (oc->oc_empty != NULL) {
+		free_kpages((vaddr_t)oc->oc_empty);
+		oc->oc_nslabs--;
+	}
+	KASSERT(oc->oc_nslabs == 0);
+
+	spinlock_cleanup(&oc->oc_lock);
+	kfree(oc);
+}
+
+void
+objcache_printstats(struct objcache *oc)
+{
+	struct objcache_slab *s;
+	unsigned i, nfree = 0, nmag = 0, perslab;
+
+	perslab = (PAGE_SIZE - SLAB_FIRST_OBJ) / OBJ_STRIDE(oc);
+
+	spinlock_acquire(&oc->oc_lock);
+	for (s = oc->oc_partial; s != NULL; s = s->os_next) {
+		nfree += s->os_nfree;
+	}
+	if (oc->oc_empty != NULL) {
+		nfree += oc->oc_empty->os_nfree;
+	}
+	for (i=0; i<OBJCACHE_CPUS; i++) {
+		nmag += oc->oc_mags[i].om_count;
+	}
+	kprintf("%-12s %4lu bytes  %3u slabs  %4u in use  %4u free  %3u in magazines\n",
+		oc->oc_name, (unsigned long)oc->oc_size, oc->oc_nslabs,
+		oc->oc_nslabs * perslab - nfree - nmag, nfree, nmag);
+	spinlock_release(&oc->oc_lock);
+}
@@ -0,0 +1,32 @@
+/*
+ * Added for PetrelOS
+ */
+
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/types.h>
+
+/*
+ * Get the PROT_* and MAP_* codes from the kernel.
+ */
+#include <kern/mman.h>
+
+/* Returned by mmap on error */
+#define MAP_FAILED ((void *)-1)
+
+/*
+ * mmap ignores the address hint and picks the address itself. The offset
+ * must be a multiple of the page size, and is ignored for MAP_ANON.
+ * Anonymous mappings must be MAP_PRIVATE.
+ *
+ * mprotect only works on mappings, and every page of the range must be in
+ * one. A shared mapping of a file opened read-only can't be made
+ * writable.
+ */
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+int mprotect(void *addr, size_t len, int prot);
+
+
+#endif /* _SYS_MMAN_H_ */
@@ -0,0 +1,387 @@
+/*
+ * Added for PetrelOS
+ */
+
+/*
+ * mmaptest.c
+ *
+ * 	Tests mmap and munmap. Maps a file shared, checks what it reads,
+ * 	writes through the mapping, unmaps the middle page on its own, and
+ * 	then checks with read() that the writes reached the file and that
+ * 	the file did not grow. Also checks that a private mapping's writes
+ * 	stay private, that anonymous memory starts zeroed, that mprotect
+ * 	takes write access away from part of a mapping and gives it back,
+ * 	and a few argument errors.
+ *
+ * Needs a file system that can be mapped (SFS); run it from a directory
+ * on one.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGESIZE  4096
+#define NPAGES    3
+#define FILESIZE  (2*PAGESIZE + PAGESIZE/2)	/* last page half past EOF */
+#define FILENAME  "mmaptest.dat"
+
+static char buf[NPAGES*PAGESIZE];
+
+/* The byte originally at offset POS in the file */
+static
+char
+pattern(off_t pos)
+{
+	return 'a' + (pos * 7 + pos / PAGESIZE) % 26;
+}
+
+/* Bytes written through the mapping, one spot in each page */
+static const off_t pokes[NPAGES] = {
+	17,
+	PAGESIZE + 1000,
+	2*PAGESIZE + 100,
+};
+#define POKE      '#'
+#define PASTEOF   (2*PAGESIZE + 3000)	/* in the last page, past EOF */
+
+static
+void
+makefile(void)
+{
+	off_t pos;
+	int fd;
+
+	for (pos=0; pos<FILESIZE; pos++) {
+		buf[pos] = pattern(pos);
+	}
+	fd = open(FILENAME, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd<0) {
+		err(1, "%s: create", FILENAME);
+	}
+	if (write(fd, buf, FILESIZE) != FILESIZE) {
+		err(1, "%s: write", FILENAME);
+	}
+	close(fd);
+}
+
+static
+void
+checkpage(const char *p, int page, int poked)
+{
+	off_t pos, off;
+	char want;
+
+	for (off=0; off<PAGESIZE; off++) {
+		pos = page*PAGESIZE + off;
+		if (pos >= FILESIZE) {
+			want = pos == PASTEOF && poked ? POKE : 0;
+		}
+		else {
+			want = pos == pokes[page] && poked ? POKE : pattern(pos);
+		}
+		if (p[off] != want) {
+			errx(1, "mapping: byte %ld is %d, expected %d",
+			     (long) pos, p[off], want);
+		}
+	}
+}
+
+/*
+ * Read the whole file back and check it, with the pokes if POKED.
+ */
+static
+void
+checkfile(int poked)
+{
+	struct stat st;
+	off_t pos;
+	int fd, i, n;
+	char want;
+
+	fd = open(FILENAME, O_RDONLY);
+	if (fd<0) {
+		err(1, "%s: open for read", FILENAME);
+	}
+	if (fstat(fd, &st)) {
+		err(1, "%s: fstat", FILENAME);
+	}
+	if (st.st_size != FILESIZE) {
+		errx(1, "%s: size %ld, expected %d", FILENAME,
+		     (long) st.st_size, FILESIZE);
+	}
+	n = read(fd, buf, sizeof(buf));
+	if (n != FILESIZE) {
+		err(1, "%s: read returned %d", FILENAME, n);
+	}
+	close(fd);
+
+	for (pos=0; pos<FILESIZE; pos++) {
+		want = pattern(pos);
+		for (i=0; poked && i<NPAGES; i++) {
+			if (pos == pokes[i]) {
+				want = POKE;
+			}
+		}
+		if (buf[pos] != want) {
+			errx(1, "%s: byte %ld is %d, expected %d", FILENAME,
+			     (long) pos, buf[pos], want);
+		}
+	}
+}
+
+/*
+ * A private mapping of the file: writes must not reach it.
+ */
+static
+void
+privatetest(void)
+{
+	char *p;
+	int fd, i;
+
+	fd = open(FILENAME, O_RDONLY);
+	if (fd<0) {
+		err(1, "%s: open for read", FILENAME);
+	}
+	p = mmap(NULL, NPAGES*PAGESIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+		 fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap private");
+	}
+	close(fd);
+
+	for (i=0; i<NPAGES; i++) {
+		checkpage(p + i*PAGESIZE, i, 0);
+		p[pokes[i]] = POKE;
+	}
+	if (munmap(p, NPAGES*PAGESIZE)) {
+		err(1, "munmap private");
+	}
+	checkfile(0);
+	printf("mmaptest: private mapping passed\n");
+}
+
+/*
+ * A shared mapping: writes reach the file, unmapped in two steps.
+ */
+static
+void
+sharedtest(void)
+{
+	char *p;
+	int fd, i;
+
+	fd = open(FILENAME, O_RDWR);
+	if (fd<0) {
+		err(1, "%s: open for read/write", FILENAME);
+	}
+	p = mmap(NULL, NPAGES*PAGESIZE, PROT_READ|PROT_WRITE, MAP_SHARED,
+		 fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap shared");
+	}
+	/* The mapping holds its own reference to the file */
+	close(fd);
+
+	for (i=0; i<NPAGES; i++) {
+		checkpage(p + i*PAGESIZE, i, 0);
+		p[pokes[i]] = POKE;
+	}
+	p[PASTEOF] = POKE;
+
+	/* Take out the middle page only; the others must stay */
+	if (munmap(p + PAGESIZE, PAGESIZE)) {
+		err(1, "munmap middle page");
+	}
+	checkpage(p, 0, 1);
+	checkpage(p + 2*PAGESIZE, 2, 1);
+
+	/* Unmapping what is left, and the hole, is fine too */
+	if (munmap(p, NPAGES*PAGESIZE)) {
+		err(1, "munmap rest");
+	}
+	checkfile(1);
+	printf("mmaptest: shared mapping passed\n");
+}
+
+/*
+ * Anonymous memory, and some things that must fail.
+ */
+static
+void
+anontest(void)
+{
+	char *p;
+	int i, fd;
+
+	p = mmap(NULL, NPAGES*PAGESIZE, PROT_READ|PROT_WRITE,
+		 MAP_ANON|MAP_PRIVATE, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap anonymous");
+	}
+	for (i=0; i<NPAGES*PAGESIZE; i++) {
+		if (p[i] != 0) {
+			errx(1, "anonymous: byte %d is %d, expected 0", i,
+			     p[i]);
+		}
+		p[i] = i;
+	}
+	for (i=0; i<NPAGES*PAGESIZE; i++) {
+		if (p[i] != (char) i) {
+			errx(1, "anonymous: byte %d did not stick", i);
+		}
+	}
+
+	if (munmap(p + 1, PAGESIZE) == 0 || errno != EINVAL) {
+		errx(1, "munmap of an unaligned address did not fail "
+		     "with EINVAL");
+	}
+	if (munmap(p, 0) == 0 || errno != EINVAL) {
+		errx(1, "munmap of nothing did not fail with EINVAL");
+	}
+	if (munmap(p, NPAGES*PAGESIZE)) {
+		err(1, "munmap anonymous");
+	}
+
+	if (mmap(NULL, PAGESIZE, PROT_READ, MAP_ANON|MAP_SHARED, -1, 0)
+	    != MAP_FAILED || errno != EINVAL) {
+		errx(1, "shared anonymous mmap did not fail with EINVAL");
+	}
+	fd = open(FILENAME, O_RDONLY);
+	if (fd<0) {
+		err(1, "%s: open for read", FILENAME);
+	}
+	if (mmap(NULL, PAGESIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)
+	    != MAP_FAILED || errno != EACCES) {
+		errx(1, "writable shared mmap of a read-only file did not "
+		     "fail with EACCES");
+	}
+	if (mmap(NULL, PAGESIZE, PROT_READ, MAP_PRIVATE, fd, 1)
+	    != MAP_FAILED || errno != EINVAL) {
+		errx(1, "mmap at an unaligned offset did not fail with "
+		     "EINVAL");
+	}
+	close(fd);
+	printf("mmaptest: anonymous memory and errors passed\n");
+}
+
+/*
+ * mprotect on the middle page of an anonymous mapping, and its errors.
+ */
+static
+void
+protecttest(void)
+{
+	char *p;
+	pid_t pid;
+	int i, fd, status;
+
+	p = mmap(NULL, NPAGES*PAGESIZE, PROT_READ|PROT_WRITE,
+		 MAP_ANON|MAP_PRIVATE, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap anonymous");
+	}
+	for (i=0; i<NPAGES*PAGESIZE; i++) {
+		p[i] = i;
+	}
+
+	if (mprotect(p + PAGESIZE, PAGESIZE, PROT_READ)) {
+		err(1, "mprotect middle page read-only");
+	}
+	for (i=0; i<NPAGES*PAGESIZE; i++) {
+		if (p[i] != (char) i) {
+			errx(1, "read-only: byte %d is %d, expected %d", i,
+			     p[i], (char) i);
+		}
+	}
+	/* The pages either side are still writable */
+	p[0] = POKE;
+	p[2*PAGESIZE] = POKE;
+
+	/* Writing to the middle one must kill whoever tries */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		p[PAGESIZE] = POKE;
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (status == 0) {
+		errx(1, "write to a read-only page went through");
+	}
+	if (p[PAGESIZE] != (char) PAGESIZE) {
+		errx(1, "read-only page changed");
+	}
+
+	if (mprotect(p, NPAGES*PAGESIZE, PROT_READ|PROT_WRITE)) {
+		err(1, "mprotect read/write");
+	}
+	p[PAGESIZE] = POKE;
+	if (p[0] != POKE || p[PAGESIZE] != POKE || p[2*PAGESIZE] != POKE) {
+		errx(1, "writes after mprotect did not stick");
+	}
+
+	if (mprotect(p + 1, PAGESIZE, PROT_READ) == 0 || errno != EINVAL) {
+		errx(1, "mprotect of an unaligned address did not fail "
+		     "with EINVAL");
+	}
+	if (mprotect(p, PAGESIZE, 8) == 0 || errno != EINVAL) {
+		errx(1, "mprotect with a bad protection did not fail with "
+		     "EINVAL");
+	}
+	if (munmap(p + PAGESIZE, PAGESIZE)) {
+		err(1, "munmap middle page");
+	}
+	if (mprotect(p, NPAGES*PAGESIZE, PROT_READ) == 0 || errno != ENOMEM) {
+		errx(1, "mprotect across a hole did not fail with ENOMEM");
+	}
+	if (munmap(p, NPAGES*PAGESIZE)) {
+		err(1, "munmap anonymous");
+	}
+
+	fd = open(FILENAME, O_RDONLY);
+	if (fd<0) {
+		err(1, "%s: open for read", FILENAME);
+	}
+	p = mmap(NULL, PAGESIZE, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap shared read-only");
+	}
+	close(fd);
+	if (mprotect(p, PAGESIZE, PROT_READ|PROT_WRITE) == 0 ||
+	    errno != EACCES) {
+		errx(1, "mprotect of a shared mapping of a read-only file to "
+		     "writable did not fail with EACCES");
+	}
+	if (munmap(p, PAGESIZE)) {
+		err(1, "munmap shared read-only");
+	}
+	printf("mmaptest: mprotect passed\n");
+}
+
+int
+main(void)
+{
+	makefile();
+	privatetest();
+	sharedtest();
+	anontest();
+	protecttest();
+
+	if (remove(FILENAME)) {
+		err(1, "%s: remove", FILENAME);
+	}
+	printf("mmaptest: all passed\n");
+	return 0;
+}
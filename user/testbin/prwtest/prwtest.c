@@ -0,0 +1,285 @@
+/*
+ * Added for PetrelOS
+ */
+
+/*
+ * prwtest.c
+ *
+ * 	Tests pread, pwrite, readv and writev: I/O at given offsets,
+ * 	leaving the seek position alone in pread and pwrite, transfers
+ * 	split over several iovecs (including empty ones), short reads at
+ * 	EOF, and the usual argument errors.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define FILENAME  "prwtest.dat"
+#define SIZE      1000		/* what write() puts in first */
+#define HOLEPOS   1500		/* pwrite past EOF, leaving a hole */
+#define HOLELEN   10
+
+static char buf[4096];
+static char data[4096];		/* what the file should hold */
+
+static
+char
+pattern(int pos)
+{
+	return 'A' + pos % 23;
+}
+
+static
+void
+checkpos(int fd, off_t want, const char *after)
+{
+	off_t pos;
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos != want) {
+		errx(1, "after %s: position %ld, expected %ld", after,
+		     (long) pos, (long) want);
+	}
+}
+
+static
+void
+checkdata(const char *got, off_t pos, size_t len, const char *what)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		if (got[i] != data[pos+i]) {
+			errx(1, "%s: byte %ld is %d, expected %d", what,
+			     (long) (pos+i), got[i], data[pos+i]);
+		}
+	}
+}
+
+static
+void
+checksize(int fd, off_t want)
+{
+	struct stat st;
+
+	if (fstat(fd, &st)) {
+		err(1, "fstat");
+	}
+	if (st.st_size != want) {
+		errx(1, "size %ld, expected %ld", (long) st.st_size,
+		     (long) want);
+	}
+}
+
+/*
+ * pread and pwrite at offsets; the seek position must not move.
+ */
+static
+void
+preadtest(int fd)
+{
+	int i, n;
+
+	for (i=0; i<SIZE; i++) {
+		data[i] = pattern(i);
+	}
+	if (write(fd, data, SIZE) != SIZE) {
+		err(1, "write");
+	}
+	checkpos(fd, SIZE, "write");
+
+	memset(data+200, 'x', 50);
+	n = pwrite(fd, data+200, 50, 200);
+	if (n != 50) {
+		errx(1, "pwrite at 200 returned %d", n);
+	}
+	checkpos(fd, SIZE, "pwrite");
+	checksize(fd, SIZE);
+
+	n = pread(fd, buf, 100, 180);
+	if (n != 100) {
+		errx(1, "pread at 180 returned %d", n);
+	}
+	checkdata(buf, 180, 100, "pread");
+	checkpos(fd, SIZE, "pread");
+
+	/* Short at EOF, and nothing past it */
+	n = pread(fd, buf, 100, SIZE - 10);
+	if (n != 10) {
+		errx(1, "pread across EOF returned %d, expected 10", n);
+	}
+	checkdata(buf, SIZE - 10, 10, "pread across EOF");
+	n = pread(fd, buf, 100, SIZE + 100);
+	if (n != 0) {
+		errx(1, "pread past EOF returned %d, expected 0", n);
+	}
+
+	/* Past EOF: the file grows, and the hole reads as zeros */
+	memset(data+HOLEPOS, 'h', HOLELEN);
+	n = pwrite(fd, data+HOLEPOS, HOLELEN, HOLEPOS);
+	if (n != HOLELEN) {
+		errx(1, "pwrite past EOF returned %d", n);
+	}
+	checksize(fd, HOLEPOS + HOLELEN);
+	n = pread(fd, buf, sizeof(buf), 0);
+	if (n != HOLEPOS + HOLELEN) {
+		errx(1, "pread of everything returned %d", n);
+	}
+	checkdata(buf, 0, n, "pread of everything");
+	checkpos(fd, SIZE, "pread and pwrite");
+
+	printf("prwtest: pread/pwrite passed\n");
+}
+
+/*
+ * writev and readv, at the seek position, split differently.
+ */
+static
+void
+readvtest(int fd)
+{
+	struct iovec iov[4];
+	char a[7], b[300], c[50];
+	off_t start = 100;
+	int i, n;
+
+	for (i=0; i<(int)sizeof(a); i++) {
+		a[i] = 'a' + i;
+	}
+	memset(b, 'b', sizeof(b));
+	memset(c, 'c', sizeof(c));
+	memcpy(data+start, a, sizeof(a));
+	memcpy(data+start+sizeof(a), b, sizeof(b));
+	memcpy(data+start+sizeof(a)+sizeof(b), c, sizeof(c));
+
+	iov[0].iov_base = a;
+	iov[0].iov_len = sizeof(a);
+	iov[1].iov_base = b;
+	iov[1].iov_len = 0;		/* empty ones are skipped */
+	iov[2].iov_base = b;
+	iov[2].iov_len = sizeof(b);
+	iov[3].iov_base = c;
+	iov[3].iov_len = sizeof(c);
+	if (lseek(fd, start, SEEK_SET) != start) {
+		err(1, "lseek");
+	}
+	n = writev(fd, iov, 4);
+	if (n != (int)(sizeof(a) + sizeof(b) + sizeof(c))) {
+		errx(1, "writev returned %d", n);
+	}
+	checkpos(fd, start + n, "writev");
+
+	/* Read it back from a little earlier, split somewhere else */
+	memset(buf, 0, sizeof(buf));
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 3;
+	iov[1].iov_base = buf + 3;
+	iov[1].iov_len = 200;
+	iov[2].iov_base = buf + 203;
+	iov[2].iov_len = 0;
+	iov[3].iov_base = buf + 203;
+	iov[3].iov_len = 160;
+	if (lseek(fd, start - 3, SEEK_SET) != start - 3) {
+		err(1, "lseek");
+	}
+	n = readv(fd, iov, 4);
+	if (n != 363) {
+		errx(1, "readv returned %d, expected 363", n);
+	}
+	checkdata(buf, start - 3, 363, "readv");
+	checkpos(fd, start + 360, "readv");
+
+	/* Short at EOF: the second iovec is filled only in part */
+	memset(buf, 0, sizeof(buf));
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 15;
+	iov[1].iov_base = buf + 15;
+	iov[1].iov_len = 15;
+	if (lseek(fd, -20, SEEK_END) != HOLEPOS + HOLELEN - 20) {
+		err(1, "lseek from end");
+	}
+	n = readv(fd, iov, 2);
+	if (n != 20) {
+		errx(1, "readv across EOF returned %d, expected 20", n);
+	}
+	checkdata(buf, HOLEPOS + HOLELEN - 20, 20, "readv across EOF");
+	if (buf[20] != 0) {
+		errx(1, "readv across EOF wrote past what it read");
+	}
+	checkpos(fd, HOLEPOS + HOLELEN, "readv across EOF");
+	n = readv(fd, iov, 2);
+	if (n != 0) {
+		errx(1, "readv at EOF returned %d, expected 0", n);
+	}
+
+	printf("prwtest: readv/writev passed\n");
+}
+
+/*
+ * Things that must fail.
+ */
+static
+void
+errortest(int fd)
+{
+	struct iovec iov;
+	int rfd, cfd;
+
+	if (pread(fd, buf, 10, -1) != -1 || errno != EINVAL) {
+		errx(1, "pread at a negative offset did not fail with EINVAL");
+	}
+	iov.iov_base = buf;
+	iov.iov_len = 10;
+	if (readv(fd, &iov, 0) != -1 || errno != EINVAL) {
+		errx(1, "readv of no iovecs did not fail with EINVAL");
+	}
+
+	rfd = open(FILENAME, O_RDONLY);
+	if (rfd<0) {
+		err(1, "%s: open for read", FILENAME);
+	}
+	if (pwrite(rfd, buf, 10, 0) != -1 || errno != EBADF) {
+		errx(1, "pwrite to a read-only file did not fail with EBADF");
+	}
+	if (writev(rfd, &iov, 1) != -1 || errno != EBADF) {
+		errx(1, "writev to a read-only file did not fail with EBADF");
+	}
+	close(rfd);
+
+	cfd = open("con:", O_RDONLY);
+	if (cfd<0) {
+		err(1, "con:: open");
+	}
+	if (pread(cfd, buf, 10, 0) != -1 || errno != ESPIPE) {
+		errx(1, "pread on the console did not fail with ESPIPE");
+	}
+	close(cfd);
+
+	printf("prwtest: errors passed\n");
+}
+
+int
+main(void)
+{
+	int fd;
+
+	fd = open(FILENAME, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd<0) {
+		err(1, "%s: create", FILENAME);
+	}
+	preadtest(fd);
+	readvtest(fd);
+	errortest(fd);
+	close(fd);
+
+	if (remove(FILENAME)) {
+		err(1, "%s: remove", FILENAME);
+	}
+	printf("prwtest: all passed\n");
+	return 0;
+}